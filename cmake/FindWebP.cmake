@@ -0,0 +1,9 @@
+# Look for the header file.
+find_path(WEBP_INCLUDE_DIR NAMES webp/encode.h)
+find_library(WEBP_LIBRARY NAMES webp libwebp)
+
+set(WEBP_LIBRARIES ${WEBP_LIBRARY})
+set(WEBP_INCLUDE_DIRS ${WEBP_INCLUDE_DIR})
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(WEBP DEFAULT_MSG WEBP_LIBRARY WEBP_INCLUDE_DIR)
+mark_as_advanced(WEBP_INCLUDE_DIR WEBP_LIBRARY)
@@ -27,57 +27,299 @@
  *****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
+#include "mapsimd.h"
 #include <float.h>
 #ifdef USE_GDAL
 
+#ifdef MS_HAVE_X86_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
 #include "gdal.h"
 #include "cpl_string.h"
 
-void gaussian_blur(float *values, int width, int height, int radius) {
+/*
+ * The blur passes are split into jobs covering a range of rows (horizontal
+ * passes) or a range of columns (vertical passes) so they can be run by
+ * msThreadRunJobs(). Vertical passes sweep the rows of their column strip
+ * so that memory is accessed sequentially.
+ */
+typedef struct kdBlurJob kdBlurJob;
+
+struct kdBlurJob {
+  void (*pass)(kdBlurJob *job);
+  const float *src;
+  float *dst;
+  int width, height;
+  int start, end;
+  const float *kernel; /* exact gaussian kernel */
+  int radius; /* gaussian or box radius */
+};
+
+#define KD_STRIP_WIDTH 256
+
+static void gaussian_blur_rows(kdBlurJob *job) {
+  int i,x,y;
+  int length = job->radius*2+1;
+  for(y=job->start; y<job->end; y++) {
+    const float* src_row=job->src + job->width*y;
+    float* dst_row=job->dst + job->width*y;
+
+    for(x=job->radius; x<job->width-job->radius; x++) {
+      float accum=0;
+      for(i=0; i<length; i++) {
+        accum+=src_row[x+i-job->radius] * job->kernel[i];
+      }
+      dst_row[x]=accum;
+    }
+  }
+}
+
+static void gaussian_blur_columns(kdBlurJob *job) {
+  int i,x,y;
+  int length = job->radius*2+1;
+  for(y=job->radius; y<job->height-job->radius; y++) {
+    float* dst_row=job->dst + job->width*y;
+    for(x=job->start; x<job->end; x++) {
+      const float* src_col=job->src + x;
+      float accum=0;
+      for (i=0; i<length; i++) {
+        accum+=src_col[job->width*(y+i-job->radius)] * job->kernel[i];
+      }
+      dst_row[x]=accum;
+    }
+  }
+}
+
+/*
+ * running sums of the box passes may leave a tiny residue where the exact
+ * result is 0, which would confuse the automatic normalization
+ */
+#define KD_BOX_EPSILON 1e-9
+
+static void box_blur_rows(kdBlurJob *job) {
+  int x,y,r=job->radius;
+  double inv = 1.0 / (2*r+1);
+  for(y=job->start; y<job->end; y++) {
+    const float* src_row=job->src + job->width*y;
+    float* dst_row=job->dst + job->width*y;
+    double accum=0;
+    for(x=0; x<r && x<job->width; x++)
+      accum += src_row[x];
+    for(x=0; x<job->width; x++) {
+      double v;
+      if(x+r < job->width) accum += src_row[x+r];
+      v = accum * inv;
+      dst_row[x] = (fabs(v) < KD_BOX_EPSILON) ? 0 : v;
+      if(x-r >= 0) accum -= src_row[x-r];
+    }
+  }
+}
+
+#ifdef MS_HAVE_X86_SIMD
+MS_SIMD_TARGET_SSE2
+static void box_accumulate_sse2(double *acc, const float *row, int n, double sign) {
+  __m128d vsign = _mm_set1_pd(sign);
+  int i=0;
+  for(; i+2<=n; i+=2) {
+    __m128d v = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double*)(row+i))));
+    _mm_storeu_pd(acc+i, _mm_add_pd(_mm_loadu_pd(acc+i), _mm_mul_pd(vsign, v)));
+  }
+  for(; i<n; i++)
+    acc[i] += sign * row[i];
+}
+
+MS_SIMD_TARGET_SSE2
+static void box_store_sse2(float *row, const double *acc, int n, double inv) {
+  __m128d vinv = _mm_set1_pd(inv);
+  __m128d veps = _mm_set1_pd(KD_BOX_EPSILON);
+  __m128d vabs = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+  int i=0;
+  for(; i+2<=n; i+=2) {
+    __m128d v = _mm_mul_pd(_mm_loadu_pd(acc+i), vinv);
+    __m128d tiny = _mm_cmplt_pd(_mm_and_pd(v, vabs), veps);
+    _mm_storel_pi((__m64*)(row+i), _mm_cvtpd_ps(_mm_andnot_pd(tiny, v)));
+  }
+  for(; i<n; i++) {
+    double v = acc[i] * inv;
+    row[i] = (fabs(v) < KD_BOX_EPSILON) ? 0 : v;
+  }
+}
+
+MS_SIMD_TARGET_AVX2
+static void box_accumulate_avx2(double *acc, const float *row, int n, double sign) {
+  __m256d vsign = _mm256_set1_pd(sign);
+  int i=0;
+  for(; i+4<=n; i+=4) {
+    __m256d v = _mm256_cvtps_pd(_mm_loadu_ps(row+i));
+    _mm256_storeu_pd(acc+i, _mm256_add_pd(_mm256_loadu_pd(acc+i), _mm256_mul_pd(vsign, v)));
+  }
+  for(; i<n; i++)
+    acc[i] += sign * row[i];
+}
+
+MS_SIMD_TARGET_AVX2
+static void box_store_avx2(float *row, const double *acc, int n, double inv) {
+  __m256d vinv = _mm256_set1_pd(inv);
+  __m256d veps = _mm256_set1_pd(KD_BOX_EPSILON);
+  __m256d vabs = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+  int i=0;
+  for(; i+4<=n; i+=4) {
+    __m256d v = _mm256_mul_pd(_mm256_loadu_pd(acc+i), vinv);
+    __m256d tiny = _mm256_cmp_pd(_mm256_and_pd(v, vabs), veps, _CMP_LT_OQ);
+    _mm_storeu_ps(row+i, _mm256_cvtpd_ps(_mm256_andnot_pd(tiny, v)));
+  }
+  for(; i<n; i++) {
+    double v = acc[i] * inv;
+    row[i] = (fabs(v) < KD_BOX_EPSILON) ? 0 : v;
+  }
+}
+#endif
+
+/* acc[i] += sign * row[i] */
+static void box_accumulate(double *acc, const float *row, int n, double sign) {
+  int i=0;
+#ifdef MS_HAVE_X86_SIMD
+  if(msSIMDGetLevel() >= MS_SIMD_AVX2) {
+    box_accumulate_avx2(acc, row, n, sign);
+    return;
+  }
+  if(msSIMDGetLevel() >= MS_SIMD_SSE2) {
+    box_accumulate_sse2(acc, row, n, sign);
+    return;
+  }
+#endif
+  for(; i<n; i++)
+    acc[i] += sign * row[i];
+}
+
+/* row[i] = acc[i] * inv, flushing residues to 0 */
+static void box_store(float *row, const double *acc, int n, double inv) {
+  int i=0;
+#ifdef MS_HAVE_X86_SIMD
+  if(msSIMDGetLevel() >= MS_SIMD_AVX2) {
+    box_store_avx2(row, acc, n, inv);
+    return;
+  }
+  if(msSIMDGetLevel() >= MS_SIMD_SSE2) {
+    box_store_sse2(row, acc, n, inv);
+    return;
+  }
+#endif
+  for(; i<n; i++) {
+    double v = acc[i] * inv;
+    row[i] = (fabs(v) < KD_BOX_EPSILON) ? 0 : v;
+  }
+}
+
+static void box_blur_columns(kdBlurJob *job) {
+  int k,y,r=job->radius;
+  int n = job->end - job->start;
+  double inv = 1.0 / (2*r+1);
+  double *acc = (double*)msSmallCalloc(n, sizeof(double));
+  for(k=0; k<r && k<job->height; k++)
+    box_accumulate(acc, job->src + job->width*k + job->start, n, 1.0);
+  for(y=0; y<job->height; y++) {
+    if(y+r < job->height)
+      box_accumulate(acc, job->src + job->width*(y+r) + job->start, n, 1.0);
+    box_store(job->dst + job->width*y + job->start, acc, n, inv);
+    if(y-r >= 0)
+      box_accumulate(acc, job->src + job->width*(y-r) + job->start, n, -1.0);
+  }
+  free(acc);
+}
+
+static void run_blur_job(void *data) {
+  kdBlurJob *job = (kdBlurJob*)data;
+  job->pass(job);
+}
+
+/*
+ * run one blur pass from src to dst, split over rows (horizontal passes) or
+ * column strips (vertical passes)
+ */
+static void run_blur_pass(void (*pass)(kdBlurJob*), int by_rows,
+                          const float *src, float *dst, int width, int height,
+                          const float *kernel, int radius, int nthreads) {
+  int i, njobs, chunk, extent = by_rows ? height : width;
+  kdBlurJob *jobs;
+  void **job_ptrs;
+
+  if(by_rows)
+    njobs = MS_MIN(extent, nthreads * 4);
+  else
+    njobs = (extent + KD_STRIP_WIDTH - 1) / KD_STRIP_WIDTH;
+  njobs = MS_MAX(njobs, 1);
+  chunk = (extent + njobs - 1) / njobs;
+
+  jobs = (kdBlurJob*)msSmallCalloc(njobs, sizeof(kdBlurJob));
+  job_ptrs = (void**)msSmallMalloc(njobs * sizeof(void*));
+  for(i=0; i<njobs; i++) {
+    jobs[i].pass = pass;
+    jobs[i].src = src;
+    jobs[i].dst = dst;
+    jobs[i].width = width;
+    jobs[i].height = height;
+    jobs[i].start = MS_MIN(i * chunk, extent);
+    jobs[i].end = MS_MIN((i+1) * chunk, extent);
+    jobs[i].kernel = kernel;
+    jobs[i].radius = radius;
+    job_ptrs[i] = jobs + i;
+  }
+  msThreadRunJobs(run_blur_job, job_ptrs, njobs, nthreads);
+  free(job_ptrs);
+  free(jobs);
+}
+
+void gaussian_blur(float *values, int width, int height, int radius, int nthreads) {
   float *tmp = (float*)msSmallMalloc(width*height*sizeof(float));
   int length = radius*2+1;
   float *kernel = (float*)msSmallMalloc(length*sizeof(float));
   float sigma=radius/3.0;
-	float a=1.0/ sqrt(2.0*M_PI*sigma*sigma);
-	float den=2.0*sigma*sigma;
-	int i,x,y;
-
-	for (i=0; i<length; i++) {
-	  float x=i - radius;
-	  float v=a * exp(-(x*x) / den);
-	  kernel[i]=v;
-	}
-	memset(tmp,0,width*height*sizeof(float));
-
-	for(y=0; y<height; y++) {
-		float* src_row=values + width*y;
-		float* dst_row=tmp + width*y;
-
-		for(x=radius; x<width-radius; x++) {
-			float accum=0;
-			for(i=0; i<length; i++) {
-				accum+=src_row[x+i-radius] * kernel[i];
-			}
-			dst_row[x]=accum;
-		}
-	}
-
-	for(x=0; x<width; x++) {
-		float* src_col=tmp+x;
-		float* dst_col=values+x;
-
-		for(y=radius; y<height-radius; y++) {
-			float accum=0;
-			for (i=0; i<length; i++) {
-				accum+=src_col[width*(y+i-radius)] * kernel[i];
-			}
-			dst_col[y*width]=accum;
-		}
-	}
+  float a=1.0/ sqrt(2.0*M_PI*sigma*sigma);
+  float den=2.0*sigma*sigma;
+  int i;
+
+  for (i=0; i<length; i++) {
+    float x=i - radius;
+    float v=a * exp(-(x*x) / den);
+    kernel[i]=v;
+  }
+  memset(tmp,0,width*height*sizeof(float));
+
+  run_blur_pass(gaussian_blur_rows, 1, values, tmp, width, height, kernel, radius, nthreads);
+  run_blur_pass(gaussian_blur_columns, 0, tmp, values, width, height, kernel, radius, nthreads);
+
   free(tmp);
   free(kernel);
 }
 
+/*
+ * Approximation of gaussian_blur() by three successive box blurs, each
+ * costing O(1) per pixel whatever the radius. The box sizes are chosen so
+ * that the variance of the three passes matches the one of the gaussian.
+ */
+static void box_blur(float *values, int width, int height, int radius, int nthreads) {
+  float *tmp = (float*)msSmallMalloc(width*height*sizeof(float));
+  double sigma = radius/3.0;
+  int n = 3, pass, wl, m;
+  double wideal = sqrt(12*sigma*sigma/n + 1);
+
+  wl = (int)floor(wideal);
+  if(wl%2 == 0) wl--;
+  m = (int)floor((12*sigma*sigma - n*wl*wl - 4*n*wl - 3*n)/(-4.0*wl - 4) + 0.5);
+
+  for(pass=0; pass<n; pass++) {
+    int box_radius = ((pass < m) ? wl : wl+2) / 2;
+    if(box_radius < 1) continue;
+    run_blur_pass(box_blur_rows, 1, values, tmp, width, height, NULL, box_radius, nthreads);
+    run_blur_pass(box_blur_columns, 0, tmp, values, width, height, NULL, box_radius, nthreads);
+  }
+  free(tmp);
+}
+
 
 int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kerneldensity_layer, void **hDSvoid, void **cleanup_ptr) {
 
@@ -95,6 +337,7 @@ int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kernel
   GDALDatasetH hDS;
   const char *pszProcessing;
   int *classgroup = NULL;
+  int fast_blur = 0, nthreads;
   
   assert(kerneldensity_layer->connectiontype == MS_KERNELDENSITY);
   *cleanup_ptr = NULL;
@@ -127,6 +370,16 @@ int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kernel
     }
   }
 
+  pszProcessing = msLayerGetProcessingKey( kerneldensity_layer, "KERNELDENSITY_METHOD" );
+  if(pszProcessing && !strcasecmp(pszProcessing,"FAST")) {
+    fast_blur = 1;
+  } else if(pszProcessing && strcasecmp(pszProcessing,"EXACT")) {
+    msSetError(MS_MISCERR, "Unsupported KERNELDENSITY_METHOD \"%s\", expecting EXACT or FAST", "msComputeKernelDensityDataset()", pszProcessing);
+    return MS_FAILURE;
+  }
+
+  nthreads = msThreadParseCount(msLayerGetProcessingKey( kerneldensity_layer, "KERNELDENSITY_THREADS" ), 1);
+
   layer_idx = msGetLayerIndex(map,kerneldensity_layer->connection);
   if(layer_idx == -1) {
     int nLayers, *aLayers;
@@ -256,7 +509,10 @@ int msComputeKernelDensityDataset(mapObj *map, imageObj *image, layerObj *kernel
 
 
   if(have_sample) { /* no use applying the filtering kernel if we have no samples */
-    gaussian_blur(values,im_width, im_height, radius);
+    if(fast_blur)
+      box_blur(values, im_width, im_height, radius, nthreads);
+    else
+      gaussian_blur(values, im_width, im_height, radius, nthreads);
 
     if(normalization_scale == 0.0) {   /* auto normalization */
       for (j=radius; j<im_height-radius; j++) {
@@ -30,6 +30,7 @@
 #include "mapserver.h"
 #include "fontcache.h"
 #include "mapagg.h"
+#include "mapthread.h"
 #include <assert.h>
 #include "renderers/agg/include/agg_color_rgba.h"
 #include "renderers/agg/include/agg_pixfmt_rgba.h"
@@ -748,8 +749,10 @@ int aggInitializeRasterBuffer(rasterBufferObj *rb, int width, int height, int mo
   rb->data.rgba.row_step = rb->data.rgba.pixel_step * width;
   rb->width = width;
   rb->height = height;
-  int nBytes = rb->data.rgba.row_step * height;
-  rb->data.rgba.pixels = (band_type*)msSmallCalloc(nBytes,sizeof(band_type));
+  size_t nBytes = (size_t)rb->data.rgba.row_step * height * sizeof(band_type);
+  rb->data.rgba.pixels = (band_type*)msRasterBufferPoolAcquire(nBytes);
+  MS_CHECK_ALLOC(rb->data.rgba.pixels, nBytes, MS_FAILURE);
+  memset(rb->data.rgba.pixels, 0, nBytes);
   rb->data.rgba.r = &(rb->data.rgba.pixels[band_order::R]);
   rb->data.rgba.g = &(rb->data.rgba.pixels[band_order::G]);
   rb->data.rgba.b = &(rb->data.rgba.pixels[band_order::B]);
@@ -827,7 +830,7 @@ imageObj *agg2CreateImage(int width, int height, outputFormatObj *format, colorO
     return NULL;
   }
 
-  r->buffer = (band_type*)malloc(bufSize);
+  r->buffer = (band_type*)msRasterBufferPoolAcquire(bufSize);
   if (r->buffer == NULL) {
     msSetError(MS_MEMERR, "%s: %d: Out of memory allocating " AGG_INT64U_FRMT " bytes.\n", "agg2CreateImage()",
                __FILE__, __LINE__, bufSize64);
@@ -884,18 +887,29 @@ int agg2StartNewLayer(imageObj *img, mapObj*map, layerObj *layer)
     r->gamma_function.end(gamma);
     r->m_rasterizer_aa_gamma.gamma(r->gamma_function);
   }
+  if(MS_IMAGE_RENDERER(img)->pixel_clipping) {
+    /* shapes are not clipped beforehand, see msDrawShape() */
+    r->m_rasterizer_aa.clip_box(0, 0, img->width, img->height);
+    r->m_rasterizer_aa_gamma.clip_box(0, 0, img->width, img->height);
+  } else {
+    r->m_rasterizer_aa.reset_clipping();
+    r->m_rasterizer_aa_gamma.reset_clipping();
+  }
   return MS_SUCCESS;
 }
 
 int agg2CloseNewLayer(imageObj *img, mapObj *map, layerObj *layer)
 {
+  AGG2Renderer *r = AGG_RENDERER(img);
+  r->m_rasterizer_aa.reset_clipping();
+  r->m_rasterizer_aa_gamma.reset_clipping();
   return MS_SUCCESS;
 }
 
 int agg2FreeImage(imageObj * image)
 {
   AGG2Renderer *r = AGG_RENDERER(image);
-  free(r->buffer);
+  msRasterBufferPoolRelease(r->buffer, (size_t)r->m_rendering_buffer.stride() * r->m_rendering_buffer.height() * sizeof(band_type));
   delete r;
   image->img.plugin = NULL;
   return MS_SUCCESS;
@@ -1318,25 +1332,74 @@ int aggCompositeRasterBuffer(imageObj *dest, rasterBufferObj *overlay, Compositi
   }
   return MS_SUCCESS;
 #else
+  unsigned int cover = unsigned(opacity * 2.55);
+  /* the common operators have SIMD versions, giving the same results */
+  if(msCompositeRGBA(r->buffer, r->m_rendering_buffer.stride(),
+                     overlay->data.rgba.pixels, overlay->data.rgba.row_step,
+                     MS_MIN((int)overlay->width, dest->width), MS_MIN((int)overlay->height, dest->height),
+                     comp, cover))
+    return MS_SUCCESS;
   rendering_buffer b(overlay->data.rgba.pixels, overlay->width, overlay->height, overlay->data.rgba.row_step);
   pixel_format pf(b);
   mapserver::comp_op_e comp_op = ms2agg_compop(comp);
   if(comp_op == mapserver::comp_op_src_over) {
-    r->m_renderer_base.blend_from(pf,0,0,0,unsigned(opacity * 2.55));
+    r->m_renderer_base.blend_from(pf,0,0,0,cover);
   } else {
     compop_pixel_format pixf(r->m_rendering_buffer);
     compop_renderer_base ren(pixf);
     pixf.comp_op(comp_op);
-    ren.blend_from(pf,0,0,0,unsigned(opacity * 2.55));
+    ren.blend_from(pf,0,0,0,cover);
   }
   return MS_SUCCESS;
 #endif
 }
 
-void msApplyBlurringCompositingFilter(rasterBufferObj *rb, unsigned int radius) {
-  rendering_buffer b(rb->data.rgba.pixels, rb->width, rb->height, rb->data.rgba.row_step);
+typedef struct {
+  rasterBufferObj *rb;
+  int x0, y0, width, height;
+  unsigned int rx, ry;
+} aggBlurJob;
+
+static void aggRunBlurJob(void *data) {
+  aggBlurJob *job = (aggBlurJob*)data;
+  rendering_buffer b(job->rb->data.rgba.pixels + job->y0 * job->rb->data.rgba.row_step + job->x0 * 4,
+                     job->width, job->height, job->rb->data.rgba.row_step);
   pixel_format pf(b);
-  mapserver::stack_blur_rgba32(pf,radius,radius);
+  mapserver::stack_blur_rgba32(pf,job->rx,job->ry);
+}
+
+void msApplyBlurringCompositingFilter(rasterBufferObj *rb, unsigned int radius, int threads) {
+  if(threads <= 1 || radius == 0) {
+    rendering_buffer b(rb->data.rgba.pixels, rb->width, rb->height, rb->data.rgba.row_step);
+    pixel_format pf(b);
+    mapserver::stack_blur_rgba32(pf,radius,radius);
+    return;
+  }
+
+  /* rows are blurred independently by the horizontal pass, and columns by
+     the vertical one, so both passes can be split over bands of the image */
+  int njobs = MS_MAX(1, MS_MIN(MS_MAX(rb->width, rb->height), threads * 4));
+  aggBlurJob *jobs = (aggBlurJob*)msSmallCalloc(njobs, sizeof(aggBlurJob));
+  void **job_ptrs = (void**)msSmallMalloc(njobs * sizeof(void*));
+  int pass, i, n;
+  for(pass = 0; pass < 2; pass++) {
+    int extent = pass ? rb->width : rb->height;
+    int chunk = (extent + njobs - 1) / njobs;
+    for(i = 0, n = 0; i < njobs && i * chunk < extent; i++, n++) {
+      aggBlurJob *job = jobs + i;
+      job->rb = rb;
+      job->x0 = pass ? i * chunk : 0;
+      job->y0 = pass ? 0 : i * chunk;
+      job->width = pass ? MS_MIN(chunk, extent - i * chunk) : rb->width;
+      job->height = pass ? rb->height : MS_MIN(chunk, extent - i * chunk);
+      job->rx = pass ? 0 : radius;
+      job->ry = pass ? radius : 0;
+      job_ptrs[i] = job;
+    }
+    msThreadRunJobs(aggRunBlurJob, job_ptrs, n, threads);
+  }
+  free(job_ptrs);
+  free(jobs);
 }
 
 int msPopulateRendererVTableAGG(rendererVTableObj * renderer)
@@ -1347,6 +1410,8 @@ int msPopulateRendererVTableAGG(rendererVTableObj * renderer)
   renderer->supports_clipping = 0;
   renderer->supports_svg = 0;
   renderer->default_transform_mode = MS_TRANSFORM_SIMPLIFY;
+  /* the rasterizer works on 24.8 fixed point integers, keep room for stroke widths */
+  renderer->pixel_clipping_limit = 4194304;
   agg2InitCache(&(MS_RENDERER_CACHE(renderer)));
   renderer->cleanup = agg2Cleanup;
   renderer->renderLine = &agg2RenderLine;
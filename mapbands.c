@@ -0,0 +1,687 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Banded rendering of large map images.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapserver.h"
+#include "maptime.h"
+
+/*
+** Banded rendering: when the output format sets BAND_HEIGHT, the map is
+** drawn as a series of horizontal bands of that many rows, each of which is
+** encoded (see msCreateBandWriter()) and freed before the next one is drawn,
+** so that memory use is bounded by the band size rather than by the size of
+** the whole image.
+**
+** Each band is drawn with BAND_BUFFER extra rows above and below it, so that
+** features crossing the band edges are rendered identically on both sides.
+** Labels can't be placed band by band without seams, so they are placed once
+** for the whole map: the label cache is filled and drawn into a "recording"
+** image whose renderer stores the drawing operations instead of executing
+** them, and the recorded operations are replayed, shifted, into each band.
+*/
+
+typedef enum {
+  BAND_OP_LINE,
+  BAND_OP_POLYGON,
+  BAND_OP_POLYGON_TILED,
+  BAND_OP_LINE_TILED,
+  BAND_OP_GLYPHS,
+  BAND_OP_VECTOR_SYMBOL,
+  BAND_OP_PIXMAP_SYMBOL,
+  BAND_OP_ELLIPSE_SYMBOL,
+  BAND_OP_TILE
+} bandOpType;
+
+typedef struct {
+  bandOpType type;
+  double miny, maxy; /* vertical extent of the operation, in map pixels */
+
+  shapeObj *shape;
+  textPathObj *textpath;
+  imageObj *tile;
+  symbolObj *symbol;
+  double x, y;
+
+  strokeStyleObj stroke;
+  symbolStyleObj symbolstyle;
+  colorObj color, outlinecolor, backgroundcolor;
+  int has_color, has_outlinecolor, has_backgroundcolor;
+  int outlinewidth;
+} bandOpObj;
+
+typedef struct {
+  rendererVTableObj vtable;   /* the recording renderer */
+  rendererVTableObj *renderer; /* the renderer of the map's output format */
+  outputFormatObj format;     /* copy of the map's output format using vtable */
+  imageObj *image;            /* the recording image */
+  int recording;
+
+  bandOpObj *ops;
+  int numops, maxops;
+} bandRecorderObj;
+
+#define BAND_RECORDER(img) ((bandRecorderObj*)MS_IMAGE_RENDERER_CACHE(img))
+
+/*
+** Returns the band height to use for drawing the map, or 0 if the map
+** should be drawn in a single image.
+*/
+int msMapGetBandHeight(mapObj *map)
+{
+  int i, j, bandheight;
+  outputFormatObj *format = map->outputformat;
+
+  if(!format || !MS_RENDERER_PLUGIN(format))
+    return 0;
+  bandheight = atoi(msGetOutputFormatOption(format, "BAND_HEIGHT", "0"));
+  if(bandheight <= 0 || bandheight >= map->height)
+    return 0;
+
+  if(format->renderer != MS_RENDER_WITH_AGG || !msBandWriterSupported(format)) {
+    if(map->debug)
+      msDebug("msMapGetBandHeight(): output format %s can't be written in bands, ignoring BAND_HEIGHT.\n", format->name);
+    return 0;
+  }
+
+  if(map->gt.rotation_angle != 0.0 || msTestConfigOption(map, "MS_NONSQUARE", MS_FALSE) ||
+      map->scalebar.status == MS_EMBED || map->legend.status == MS_EMBED) {
+    if(map->debug)
+      msDebug("msMapGetBandHeight(): map is rotated or has embedded annotations, ignoring BAND_HEIGHT.\n");
+    return 0;
+  }
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp = GET_LAYER(map, i);
+    int haslabels = MS_FALSE;
+
+    if(lp->status != MS_ON && lp->status != MS_DEFAULT)
+      continue;
+    for(j=0; j<lp->numclasses; j++)
+      if(lp->class[j]->numlabels > 0)
+        haslabels = MS_TRUE;
+
+    /* these need a view of the whole image, or draw labels outside of the label cache */
+    if(lp->mask || (lp->compositer && lp->compositer->filter) || lp->type == MS_LAYER_CHART ||
+        msLayerGetProcessingKey(lp, "FORCE_DRAW_LABEL_CACHE") ||
+        (haslabels && !lp->labelcache)) {
+      if(map->debug)
+        msDebug("msMapGetBandHeight(): layer %s can't be drawn in bands, ignoring BAND_HEIGHT.\n", lp->name?lp->name:"(null)");
+      return 0;
+    }
+  }
+
+  return bandheight;
+}
+
+/*
+** Recording renderer.  The operations drawn on the recording image are
+** stored with deep copies of their arguments, anything drawn on other
+** images (e.g. symbol tiles) is passed on to the real renderer.
+*/
+
+static bandOpObj *bandRecorderAddOp(bandRecorderObj *rec, bandOpType type)
+{
+  bandOpObj *op;
+
+  if(rec->numops == rec->maxops) {
+    rec->maxops = rec->maxops ? rec->maxops * 2 : 64;
+    rec->ops = (bandOpObj*)msSmallRealloc(rec->ops, rec->maxops * sizeof(bandOpObj));
+  }
+  op = &rec->ops[rec->numops++];
+  memset(op, 0, sizeof(bandOpObj));
+  op->type = type;
+  return op;
+}
+
+static void bandOpSetColors(bandOpObj *op, colorObj *color, colorObj *outlinecolor, colorObj *backgroundcolor)
+{
+  if(color) {
+    op->color = *color;
+    op->has_color = MS_TRUE;
+  }
+  if(outlinecolor) {
+    op->outlinecolor = *outlinecolor;
+    op->has_outlinecolor = MS_TRUE;
+  }
+  if(backgroundcolor) {
+    op->backgroundcolor = *backgroundcolor;
+    op->has_backgroundcolor = MS_TRUE;
+  }
+}
+
+static void bandOpCopyShape(bandOpObj *op, shapeObj *p, double pad)
+{
+  int i;
+
+  /* only the geometry: shapes drawn by the label cache are often built on
+     the stack, with their other members left uninitialized */
+  op->shape = (shapeObj*)msSmallMalloc(sizeof(shapeObj));
+  msInitShape(op->shape);
+  op->shape->type = p->type;
+  for(i=0; i<p->numlines; i++)
+    msAddLine(op->shape, &(p->line[i]));
+  msComputeBounds(op->shape);
+  op->miny = op->shape->bounds.miny - pad;
+  op->maxy = op->shape->bounds.maxy + pad;
+}
+
+static void bandOpSetMarker(bandOpObj *op, double x, double y, symbolObj *symbol, symbolStyleObj *style)
+{
+  double size = MS_MAX(symbol->sizex, symbol->sizey);
+
+  if(symbol->pixmap_buffer)
+    size = MS_MAX(size, MS_MAX(symbol->pixmap_buffer->width, symbol->pixmap_buffer->height));
+  /* generous: covers any rotation and anchor point */
+  size = 2 * size * style->scale + style->outlinewidth + 2;
+
+  op->x = x;
+  op->y = y;
+  op->symbol = symbol;
+  op->symbolstyle = *style;
+  op->symbolstyle.style = NULL;
+  bandOpSetColors(op, style->color, style->outlinecolor, style->backgroundcolor);
+  op->miny = y - size;
+  op->maxy = y + size;
+}
+
+static int bandRecordLine(imageObj *img, shapeObj *p, strokeStyleObj *style)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+  bandOpObj *op;
+
+  if(img != rec->image)
+    return rec->renderer->renderLine(img, p, style);
+  if(!rec->recording)
+    return MS_SUCCESS;
+  op = bandRecorderAddOp(rec, BAND_OP_LINE);
+  bandOpCopyShape(op, p, style->width + style->linejoinmaxsize + 2);
+  op->stroke = *style;
+  bandOpSetColors(op, style->color, NULL, NULL);
+  return MS_SUCCESS;
+}
+
+static int bandRecordPolygon(imageObj *img, shapeObj *p, colorObj *color)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+  bandOpObj *op;
+
+  if(img != rec->image)
+    return rec->renderer->renderPolygon(img, p, color);
+  if(!rec->recording)
+    return MS_SUCCESS;
+  op = bandRecorderAddOp(rec, BAND_OP_POLYGON);
+  bandOpCopyShape(op, p, 2);
+  bandOpSetColors(op, color, NULL, NULL);
+  return MS_SUCCESS;
+}
+
+static int bandRecordPolygonTiled(imageObj *img, shapeObj *p, imageObj *tile)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+  bandOpObj *op;
+
+  if(img != rec->image)
+    return rec->renderer->renderPolygonTiled(img, p, tile);
+  if(!rec->recording)
+    return MS_SUCCESS;
+  op = bandRecorderAddOp(rec, BAND_OP_POLYGON_TILED);
+  bandOpCopyShape(op, p, 2);
+  op->tile = tile;
+  /* the tile belongs to the image's tile cache, keep it from being recycled */
+  img->ntiles = 0;
+  return MS_SUCCESS;
+}
+
+static int bandRecordLineTiled(imageObj *img, shapeObj *p, imageObj *tile)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+  bandOpObj *op;
+
+  if(img != rec->image)
+    return rec->renderer->renderLineTiled(img, p, tile);
+  if(!rec->recording)
+    return MS_SUCCESS;
+  op = bandRecorderAddOp(rec, BAND_OP_LINE_TILED);
+  bandOpCopyShape(op, p, MS_MAX(tile->width, tile->height) + 2);
+  op->tile = tile;
+  img->ntiles = 0;
+  return MS_SUCCESS;
+}
+
+static int bandRecordGlyphs(imageObj *img, textPathObj *tp, colorObj *clr, colorObj *olcolor, int olwidth)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+  bandOpObj *op;
+  double pad;
+  int i;
+
+  if(img != rec->image)
+    return rec->renderer->renderGlyphs(img, tp, clr, olcolor, olwidth);
+  if(!rec->recording)
+    return MS_SUCCESS;
+  op = bandRecorderAddOp(rec, BAND_OP_GLYPHS);
+  op->textpath = (textPathObj*)msSmallMalloc(sizeof(textPathObj));
+  *op->textpath = *tp;
+  op->textpath->bounds.poly = NULL; /* not used for rendering */
+  op->textpath->glyphs = NULL;
+  if(tp->numglyphs > 0) {
+    op->textpath->glyphs = (glyphObj*)msSmallMalloc(tp->numglyphs * sizeof(glyphObj));
+    memcpy(op->textpath->glyphs, tp->glyphs, tp->numglyphs * sizeof(glyphObj));
+  }
+  bandOpSetColors(op, clr, olcolor, NULL);
+  op->outlinewidth = olwidth;
+
+  pad = 2 * tp->glyph_size + olwidth + 2;
+  op->miny = op->maxy = 0;
+  for(i=0; i<tp->numglyphs; i++) {
+    if(i == 0 || tp->glyphs[i].pnt.y - pad < op->miny)
+      op->miny = tp->glyphs[i].pnt.y - pad;
+    if(i == 0 || tp->glyphs[i].pnt.y + pad > op->maxy)
+      op->maxy = tp->glyphs[i].pnt.y + pad;
+  }
+  return MS_SUCCESS;
+}
+
+static int bandRecordVectorSymbol(imageObj *img, double x, double y, symbolObj *symbol, symbolStyleObj *style)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+
+  if(img != rec->image)
+    return rec->renderer->renderVectorSymbol(img, x, y, symbol, style);
+  if(rec->recording)
+    bandOpSetMarker(bandRecorderAddOp(rec, BAND_OP_VECTOR_SYMBOL), x, y, symbol, style);
+  return MS_SUCCESS;
+}
+
+static int bandRecordPixmapSymbol(imageObj *img, double x, double y, symbolObj *symbol, symbolStyleObj *style)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+
+  if(img != rec->image)
+    return rec->renderer->renderPixmapSymbol(img, x, y, symbol, style);
+  if(rec->recording)
+    bandOpSetMarker(bandRecorderAddOp(rec, BAND_OP_PIXMAP_SYMBOL), x, y, symbol, style);
+  return MS_SUCCESS;
+}
+
+static int bandRecordEllipseSymbol(imageObj *img, double x, double y, symbolObj *symbol, symbolStyleObj *style)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+
+  if(img != rec->image)
+    return rec->renderer->renderEllipseSymbol(img, x, y, symbol, style);
+  if(rec->recording)
+    bandOpSetMarker(bandRecorderAddOp(rec, BAND_OP_ELLIPSE_SYMBOL), x, y, symbol, style);
+  return MS_SUCCESS;
+}
+
+static int bandRecordTile(imageObj *img, imageObj *tile, double x, double y)
+{
+  bandRecorderObj *rec = BAND_RECORDER(img);
+  bandOpObj *op;
+
+  if(img != rec->image)
+    return rec->renderer->renderTile(img, tile, x, y);
+  if(!rec->recording)
+    return MS_SUCCESS;
+  op = bandRecorderAddOp(rec, BAND_OP_TILE);
+  op->tile = tile;
+  op->x = x;
+  op->y = y;
+  op->miny = y - MS_MAX(tile->width, tile->height);
+  op->maxy = y + MS_MAX(tile->width, tile->height);
+  img->ntiles = 0;
+  return MS_SUCCESS;
+}
+
+static void bandOpTranslate(bandOpObj *op, double dy)
+{
+  int i, j;
+
+  if(op->shape) {
+    for(i=0; i<op->shape->numlines; i++)
+      for(j=0; j<op->shape->line[i].numpoints; j++)
+        op->shape->line[i].point[j].y += dy;
+  }
+  if(op->textpath) {
+    for(i=0; i<op->textpath->numglyphs; i++)
+      op->textpath->glyphs[i].pnt.y += dy;
+  }
+  op->y += dy;
+}
+
+/*
+** Replay the recorded operations that intersect rows [firstrow,lastrow] of
+** the map into image, whose first row is map row firstrow.
+*/
+static int bandRecorderReplay(bandRecorderObj *rec, imageObj *image, int firstrow, int lastrow)
+{
+  rendererVTableObj *renderer = rec->renderer;
+  int i, status = MS_SUCCESS;
+
+  for(i=0; i<rec->numops && status == MS_SUCCESS; i++) {
+    bandOpObj *op = &rec->ops[i];
+    colorObj *color = op->has_color ? &op->color : NULL;
+    colorObj *outlinecolor = op->has_outlinecolor ? &op->outlinecolor : NULL;
+    colorObj *backgroundcolor = op->has_backgroundcolor ? &op->backgroundcolor : NULL;
+
+    if(op->maxy < firstrow || op->miny > lastrow)
+      continue;
+
+    bandOpTranslate(op, -firstrow);
+    switch(op->type) {
+      case BAND_OP_LINE:
+        op->stroke.color = color;
+        status = renderer->renderLine(image, op->shape, &op->stroke);
+        break;
+      case BAND_OP_POLYGON:
+        status = renderer->renderPolygon(image, op->shape, color);
+        break;
+      case BAND_OP_POLYGON_TILED:
+        status = renderer->renderPolygonTiled(image, op->shape, op->tile);
+        break;
+      case BAND_OP_LINE_TILED:
+        status = renderer->renderLineTiled(image, op->shape, op->tile);
+        break;
+      case BAND_OP_GLYPHS:
+        status = renderer->renderGlyphs(image, op->textpath, color, outlinecolor, op->outlinewidth);
+        break;
+      case BAND_OP_VECTOR_SYMBOL:
+      case BAND_OP_PIXMAP_SYMBOL:
+      case BAND_OP_ELLIPSE_SYMBOL:
+        op->symbolstyle.color = color;
+        op->symbolstyle.outlinecolor = outlinecolor;
+        op->symbolstyle.backgroundcolor = backgroundcolor;
+        if(op->type == BAND_OP_VECTOR_SYMBOL)
+          status = renderer->renderVectorSymbol(image, op->x, op->y, op->symbol, &op->symbolstyle);
+        else if(op->type == BAND_OP_PIXMAP_SYMBOL)
+          status = renderer->renderPixmapSymbol(image, op->x, op->y, op->symbol, &op->symbolstyle);
+        else
+          status = renderer->renderEllipseSymbol(image, op->x, op->y, op->symbol, &op->symbolstyle);
+        break;
+      case BAND_OP_TILE:
+        status = renderer->renderTile(image, op->tile, op->x, op->y);
+        break;
+    }
+    bandOpTranslate(op, firstrow);
+  }
+  return status;
+}
+
+static bandRecorderObj *bandRecorderCreate(mapObj *map)
+{
+  bandRecorderObj *rec = (bandRecorderObj*)msSmallCalloc(1, sizeof(bandRecorderObj));
+
+  rec->renderer = map->outputformat->vtable;
+  rec->vtable = *rec->renderer;
+  rec->vtable.renderer_data = rec;
+  rec->vtable.renderLine = bandRecordLine;
+  rec->vtable.renderPolygon = bandRecordPolygon;
+  rec->vtable.renderPolygonTiled = bandRecordPolygonTiled;
+  rec->vtable.renderLineTiled = bandRecordLineTiled;
+  rec->vtable.renderGlyphs = bandRecordGlyphs;
+  rec->vtable.renderVectorSymbol = bandRecordVectorSymbol;
+  rec->vtable.renderPixmapSymbol = bandRecordPixmapSymbol;
+  rec->vtable.renderEllipseSymbol = bandRecordEllipseSymbol;
+  rec->vtable.renderTile = bandRecordTile;
+
+  /* shallow copy, never freed through msFreeOutputFormat() as we hold a reference */
+  rec->format = *map->outputformat;
+  rec->format.vtable = &rec->vtable;
+  rec->format.refcount = 1;
+
+  /*
+  ** The recording image is backed by a minimal image of the real renderer, so
+  ** that code accessing the renderer directly (e.g. hatches) remains safe.
+  */
+  rec->image = msImageCreate(1, 1, &rec->format, NULL, NULL, map->resolution, map->defresolution, NULL);
+  if(!rec->image) {
+    free(rec);
+    return NULL;
+  }
+  rec->image->width = map->width;
+  rec->image->height = map->height;
+  rec->image->map = map;
+  return rec;
+}
+
+static void bandRecorderFree(mapObj *map, bandRecorderObj *rec)
+{
+  int i;
+
+  for(i=0; i<rec->numops; i++) {
+    if(rec->ops[i].shape) {
+      msFreeShape(rec->ops[i].shape);
+      free(rec->ops[i].shape);
+    }
+    if(rec->ops[i].textpath) {
+      free(rec->ops[i].textpath->glyphs);
+      free(rec->ops[i].textpath);
+    }
+  }
+  free(rec->ops);
+
+  /* also frees the symbol tiles */
+  msFreeImage(rec->image);
+
+  /* symbols drawn on the recording image refer to its vtable */
+  for(i=0; i<map->symbolset.numsymbols; i++) {
+    symbolObj *s = map->symbolset.symbol[i];
+    if(s && s->renderer == &rec->vtable)
+      s->renderer = rec->renderer;
+  }
+  free(rec);
+}
+
+/*
+** Fill the label cache for the whole map and record it being drawn.
+*/
+static int bandRecordLabels(mapObj *map, bandRecorderObj *rec)
+{
+  int i, j, status;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp;
+    int haslabels = MS_FALSE;
+
+    if(map->layerorder[i] == -1)
+      continue;
+    lp = GET_LAYER(map, map->layerorder[i]);
+    if(lp->postlabelcache || !lp->labelcache || lp->connectiontype == MS_WMS ||
+        lp->type == MS_LAYER_RASTER || lp->type == MS_LAYER_CHART)
+      continue;
+    for(j=0; j<lp->numclasses; j++)
+      if(lp->class[j]->numlabels > 0)
+        haslabels = MS_TRUE;
+    if(!haslabels || !msLayerIsVisible(map, lp))
+      continue;
+
+    lp->project = MS_TRUE;
+    status = msDrawVectorLayer(map, lp, rec->image);
+    if(status != MS_SUCCESS) {
+      msSetError(MS_IMGERR, "Failed to collect labels of layer named '%s'.", "msDrawMapInBands()", lp->name);
+      return MS_FAILURE;
+    }
+  }
+
+  rec->recording = MS_TRUE;
+  status = msDrawLabelCache(map, rec->image);
+  rec->recording = MS_FALSE;
+  return status;
+}
+
+static int bandDrawLayers(mapObj *map, imageObj *image, int postlabelcache)
+{
+  int i;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *lp;
+
+    if(map->layerorder[i] == -1)
+      continue;
+    lp = GET_LAYER(map, map->layerorder[i]);
+    if(lp->postlabelcache != postlabelcache)
+      continue;
+    if(msDrawLayer(map, lp, image) != MS_SUCCESS) {
+      msSetError(MS_IMGERR, "Failed to draw layer named '%s'.", "msDrawMapInBands()", lp->name);
+      return MS_FAILURE;
+    }
+  }
+  return MS_SUCCESS;
+}
+
+/*
+** Draw the map a band of rows at a time, and write it to filename, or to
+** stdout if filename is NULL.  msMapGetBandHeight() must have returned a
+** non zero band height for the map.  Nothing is written before the first
+** band has been drawn; start, if not NULL, is called right before that so
+** that e.g. HTTP headers are only sent once drawing is known to work.
+*/
+int msDrawMapInBands(mapObj *map, char *filename, msBandOutputStartFunc start, void *startdata)
+{
+  int bandheight, buffer, y0, width, height, status = MS_SUCCESS;
+  double cellsize;
+  rectObj extent;
+  bandWriterObj *writer = NULL;
+  bandRecorderObj *rec;
+  char szPath[MS_MAXPATHLEN];
+  struct mstimeval mapstarttime, mapendtime;
+  struct mstimeval starttime, endtime;
+
+  if(map->debug >= MS_DEBUGLEVEL_TUNING) msGettimeofday(&mapstarttime, NULL);
+
+  msApplyMapConfigOptions(map);
+  bandheight = msMapGetBandHeight(map);
+  if(bandheight <= 0) {
+    msSetError(MS_MISCERR, "Map can't be drawn in bands.", "msDrawMapInBands()");
+    return MS_FAILURE;
+  }
+  buffer = MS_MAX(0, atoi(msGetOutputFormatOption(map->outputformat, "BAND_BUFFER", "32")));
+
+  if(msValidateContexts(map) != MS_SUCCESS)
+    return MS_FAILURE;
+  if(msPrepareMapGeometry(map, MS_FALSE) != MS_SUCCESS)
+    return MS_FAILURE;
+  width = map->width;
+  height = map->height;
+  extent = map->extent;
+  cellsize = map->cellsize;
+
+  if( map->debug >= MS_DEBUGLEVEL_DEBUG )
+    msDebug( "msDrawMapInBands(): rendering using outputformat named %s (%s), in bands of %d rows.\n",
+             map->outputformat->name, map->outputformat->driver, bandheight );
+
+  /* place the labels for the whole map */
+  if(map->debug >= MS_DEBUGLEVEL_TUNING) msGettimeofday(&starttime, NULL);
+  msFreeLabelCache(&(map->labelcache));
+  msInitLabelCache(&(map->labelcache));
+  rec = bandRecorderCreate(map);
+  if(!rec || bandRecordLabels(map, rec) != MS_SUCCESS)
+    status = MS_FAILURE;
+  msFreeLabelCache(&(map->labelcache));
+  if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+    msGettimeofday(&endtime, NULL);
+    msDebug("msDrawMapInBands(): Label placement, %d operations, %.3fs\n", rec ? rec->numops : 0,
+            (endtime.tv_sec+endtime.tv_usec/1.0e6)-
+            (starttime.tv_sec+starttime.tv_usec/1.0e6) );
+  }
+
+  for(y0=0; y0<height && status == MS_SUCCESS; y0+=bandheight) {
+    int rows = MS_MIN(bandheight, height - y0);
+    int top = MS_MIN(buffer, y0);
+    int bottom = MS_MIN(buffer, height - y0 - rows);
+    imageObj *image;
+    rasterBufferObj rb;
+
+    if(rows + top + bottom < 2) /* msAdjustExtent() needs 2 rows */
+      top = 1;
+
+    if(map->debug >= MS_DEBUGLEVEL_TUNING) msGettimeofday(&starttime, NULL);
+
+    map->height = rows + top + bottom;
+    map->extent.maxy = extent.maxy - (y0 - top) * cellsize;
+    map->extent.miny = map->extent.maxy - (map->height - 1) * cellsize;
+
+    image = msPrepareImage(map, MS_FALSE);
+    if(!image) {
+      status = MS_FAILURE;
+      break;
+    }
+
+    status = bandDrawLayers(map, image, MS_FALSE);
+    if(status == MS_SUCCESS)
+      status = bandRecorderReplay(rec, image, y0 - top, y0 + rows + bottom - 1);
+    msFreeLabelCache(&(map->labelcache));
+    msInitLabelCache(&(map->labelcache));
+    if(status == MS_SUCCESS)
+      status = bandDrawLayers(map, image, MS_TRUE);
+
+    if(status == MS_SUCCESS) {
+      memset(&rb, 0, sizeof(rasterBufferObj));
+      status = MS_IMAGE_RENDERER(image)->getRasterBufferHandle(image, &rb);
+    }
+    if(status == MS_SUCCESS && !writer) {
+      /* start the output once the first band is drawn */
+      if(start)
+        start(startdata);
+      writer = msCreateBandWriter(map, map->outputformat, width, height,
+                                  filename ? msBuildPath(szPath, map->mappath, filename) : NULL);
+      if(!writer)
+        status = MS_FAILURE;
+    }
+    if(status == MS_SUCCESS)
+      status = writer->writeRows(writer, &rb, top, rows);
+    msFreeImage(image);
+
+    if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+      msGettimeofday(&endtime, NULL);
+      msDebug("msDrawMapInBands(): Band of rows %d-%d, %.3fs\n", y0, y0 + rows - 1,
+              (endtime.tv_sec+endtime.tv_usec/1.0e6)-
+              (starttime.tv_sec+starttime.tv_usec/1.0e6) );
+    }
+  }
+
+  map->height = height;
+  map->extent = extent;
+  msPrepareMapGeometry(map, MS_FALSE);
+  msFreeLabelCache(&(map->labelcache));
+  msInitLabelCache(&(map->labelcache));
+  if(rec)
+    bandRecorderFree(map, rec);
+
+  if(writer && writer->close(writer, status == MS_SUCCESS) != MS_SUCCESS)
+    status = MS_FAILURE;
+
+  if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+    msGettimeofday(&mapendtime, NULL);
+    msDebug("msDrawMapInBands() total time: %.3fs\n",
+            (mapendtime.tv_sec+mapendtime.tv_usec/1.0e6)-
+            (mapstarttime.tv_sec+mapstarttime.tv_usec/1.0e6) );
+  }
+
+  return status;
+}
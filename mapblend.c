@@ -0,0 +1,428 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  SIMD compositing of premultiplied RGBA buffers.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapserver.h"
+#include "mapsimd.h"
+
+#ifdef MS_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Layer compositing kernels.                                      */
+/*                                                                      */
+/*      Pixels are 4 bytes of premultiplied color with the alpha in     */
+/*      the last byte, the order of the color bytes does not matter.    */
+/*      The kernels use the same integer arithmetic as the AGG          */
+/*      src-over blender and multiply/screen comp ops, so layers        */
+/*      composited here are bit for bit identical to the AGG ones.      */
+/*      Pixels are processed as 16 bit lanes, the "over" and            */
+/*      "multiply" sums that do not fit in 16 bits being computed       */
+/*      with pmaddwd on (dst,src) lane pairs.                           */
+/* ==================================================================== */
+/************************************************************************/
+
+/************************************************************************/
+/*                          Scalar versions.                            */
+/************************************************************************/
+
+static void msBlendPixelOver( unsigned char *p, const unsigned char *s,
+                              unsigned int cover )
+
+{
+  unsigned int c1 = cover + 1, ia, i;
+
+  if( s[3] == 0 )
+    return;
+
+  /* with a full cover this is the same as (p*ia >> 8) + s */
+  ia = 255 - ((s[3] * c1) >> 8);
+  for( i = 0; i < 3; i++ )
+    p[i] = (unsigned char)((p[i] * ia + s[i] * c1) >> 8);
+  p[3] = (unsigned char)(255 - ((ia * (255 - p[3])) >> 8));
+}
+
+static void msBlendPixelMultiply( unsigned char *p, const unsigned char *src,
+                                  unsigned int cover )
+
+{
+  unsigned int s[4], i, s1a, d1a;
+
+  for( i = 0; i < 4; i++ )
+    s[i] = (cover < 255) ? (src[i] * cover + 255) >> 8 : src[i];
+  if( s[3] == 0 )
+    return;
+
+  s1a = 255 - s[3];
+  d1a = 255 - p[3];
+  for( i = 0; i < 3; i++ )
+    p[i] = (unsigned char)((s[i] * p[i] + s[i] * d1a + p[i] * s1a + 255) >> 8);
+  p[3] = (unsigned char)(s[3] + p[3] - ((s[3] * p[3] + 255) >> 8));
+}
+
+static void msBlendPixelScreen( unsigned char *p, const unsigned char *src,
+                                unsigned int cover )
+
+{
+  unsigned int s, i;
+
+  if( src[3] == 0 || (cover < 255 && ((src[3] * cover + 255) >> 8) == 0) )
+    return;
+
+  for( i = 0; i < 4; i++ ) {
+    s = (cover < 255) ? (src[i] * cover + 255) >> 8 : src[i];
+    p[i] = (unsigned char)(s + p[i] - ((s * p[i] + 255) >> 8));
+  }
+}
+
+typedef void (*msBlendPixelFunc)( unsigned char *p, const unsigned char *s,
+                                  unsigned int cover );
+
+#ifdef MS_HAVE_X86_SIMD
+
+/************************************************************************/
+/*                           SSE2 versions.                             */
+/*                                                                      */
+/*      The helpers blend two pixels held as eight 16 bit lanes.        */
+/************************************************************************/
+
+MS_SIMD_TARGET_SSE2
+static __m128i msBlendOver_SSE2( __m128i d, __m128i s, __m128i c1 )
+
+{
+  const __m128i amask = _mm_set_epi16( 255, 0, 0, 0, 255, 0, 0, 0 );
+  const __m128i cmask = _mm_set_epi16( 0, -1, -1, -1, 0, -1, -1, -1 );
+  __m128i a = _mm_shufflehi_epi16( _mm_shufflelo_epi16( s, 0xFF ), 0xFF );
+  __m128i ia = _mm_sub_epi16( _mm_set1_epi16( 255 ),
+                              _mm_srli_epi16( _mm_mullo_epi16( a, c1 ), 8 ) );
+  /* color lanes: d*ia + s*c1, alpha lane: (255-d)*ia */
+  __m128i x = _mm_xor_si128( d, amask );
+  __m128i y = _mm_and_si128( s, cmask );
+  __m128i w = _mm_and_si128( c1, cmask );
+  __m128i lo = _mm_madd_epi16( _mm_unpacklo_epi16( x, y ), _mm_unpacklo_epi16( ia, w ) );
+  __m128i hi = _mm_madd_epi16( _mm_unpackhi_epi16( x, y ), _mm_unpackhi_epi16( ia, w ) );
+  __m128i t = _mm_packs_epi32( _mm_srai_epi32( lo, 8 ), _mm_srai_epi32( hi, 8 ) );
+  __m128i keep = _mm_cmpeq_epi16( a, _mm_setzero_si128() );
+
+  t = _mm_xor_si128( t, amask );
+  return _mm_or_si128( _mm_and_si128( keep, d ), _mm_andnot_si128( keep, t ) );
+}
+
+MS_SIMD_TARGET_SSE2
+static __m128i msBlendScreenLanes_SSE2( __m128i d, __m128i s )
+
+{
+  __m128i m = _mm_srli_epi16( _mm_add_epi16( _mm_mullo_epi16( s, d ),
+                              _mm_set1_epi16( 255 ) ), 8 );
+  return _mm_sub_epi16( _mm_add_epi16( s, d ), m );
+}
+
+MS_SIMD_TARGET_SSE2
+static __m128i msBlendMultiply_SSE2( __m128i d, __m128i s )
+
+{
+  const __m128i cmask = _mm_set_epi16( 0, -1, -1, -1, 0, -1, -1, -1 );
+  const __m128i v255 = _mm_set1_epi16( 255 );
+  __m128i sa = _mm_shufflehi_epi16( _mm_shufflelo_epi16( s, 0xFF ), 0xFF );
+  __m128i da = _mm_shufflehi_epi16( _mm_shufflelo_epi16( d, 0xFF ), 0xFF );
+  /* color lanes: s*(d + 255-da) + d*(255-sa) + 255 */
+  __m128i w1 = _mm_add_epi16( d, _mm_sub_epi16( v255, da ) );
+  __m128i w2 = _mm_sub_epi16( v255, sa );
+  __m128i lo = _mm_madd_epi16( _mm_unpacklo_epi16( s, d ), _mm_unpacklo_epi16( w1, w2 ) );
+  __m128i hi = _mm_madd_epi16( _mm_unpackhi_epi16( s, d ), _mm_unpackhi_epi16( w1, w2 ) );
+  __m128i r = _mm_packs_epi32( _mm_srai_epi32( _mm_add_epi32( lo, _mm_set1_epi32( 255 ) ), 8 ),
+                               _mm_srai_epi32( _mm_add_epi32( hi, _mm_set1_epi32( 255 ) ), 8 ) );
+  __m128i keep = _mm_cmpeq_epi16( sa, _mm_setzero_si128() );
+
+  /* the alpha lane is the same as for screen */
+  r = _mm_or_si128( _mm_and_si128( cmask, r ),
+                    _mm_andnot_si128( cmask, msBlendScreenLanes_SSE2( d, s ) ) );
+  return _mm_or_si128( _mm_and_si128( keep, d ), _mm_andnot_si128( keep, r ) );
+}
+
+MS_SIMD_TARGET_SSE2
+static __m128i msBlendScreen_SSE2( __m128i d, __m128i s )
+
+{
+  __m128i sa = _mm_shufflehi_epi16( _mm_shufflelo_epi16( s, 0xFF ), 0xFF );
+  __m128i keep = _mm_cmpeq_epi16( sa, _mm_setzero_si128() );
+
+  return _mm_or_si128( _mm_and_si128( keep, d ),
+                       _mm_andnot_si128( keep, msBlendScreenLanes_SSE2( d, s ) ) );
+}
+
+/************************************************************************/
+/*                        msBlendRow_SSE2()                             */
+/*                                                                      */
+/*      Blends four pixels at a time, returns the number of pixels      */
+/*      processed.                                                      */
+/************************************************************************/
+
+MS_SIMD_TARGET_SSE2
+static int msBlendRow_SSE2( unsigned char *dst, const unsigned char *src,
+                            int width, CompositingOperation comp,
+                            unsigned int cover )
+
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi32( (int)0xFF000000 );
+  const __m128i c1 = _mm_set1_epi16( (short)(cover + 1) );
+  const __m128i vcover = _mm_set1_epi16( (short)cover );
+  const __m128i low8 = _mm_set1_epi16( 255 );
+  int i;
+
+  for( i = 0; i + 4 <= width; i += 4 ) {
+    __m128i s = _mm_loadu_si128( (const __m128i*)(src + 4 * i) );
+    __m128i sa = _mm_and_si128( s, alpha );
+    __m128i d, slo, shi, dlo, dhi;
+
+    /* runs of transparent pixels are common in layer buffers */
+    if( _mm_movemask_epi8( _mm_cmpeq_epi32( sa, zero ) ) == 0xFFFF )
+      continue;
+    if( comp == MS_COMPOP_SRC_OVER && cover == 255
+        && _mm_movemask_epi8( _mm_cmpeq_epi32( sa, alpha ) ) == 0xFFFF ) {
+      _mm_storeu_si128( (__m128i*)(dst + 4 * i), s );
+      continue;
+    }
+
+    d = _mm_loadu_si128( (const __m128i*)(dst + 4 * i) );
+    slo = _mm_unpacklo_epi8( s, zero );
+    shi = _mm_unpackhi_epi8( s, zero );
+    dlo = _mm_unpacklo_epi8( d, zero );
+    dhi = _mm_unpackhi_epi8( d, zero );
+
+    if( comp != MS_COMPOP_SRC_OVER && cover < 255 ) {
+      slo = _mm_srli_epi16( _mm_add_epi16( _mm_mullo_epi16( slo, vcover ), low8 ), 8 );
+      shi = _mm_srli_epi16( _mm_add_epi16( _mm_mullo_epi16( shi, vcover ), low8 ), 8 );
+    }
+
+    if( comp == MS_COMPOP_SRC_OVER ) {
+      dlo = msBlendOver_SSE2( dlo, slo, c1 );
+      dhi = msBlendOver_SSE2( dhi, shi, c1 );
+    } else if( comp == MS_COMPOP_MULTIPLY ) {
+      dlo = msBlendMultiply_SSE2( dlo, slo );
+      dhi = msBlendMultiply_SSE2( dhi, shi );
+    } else {
+      dlo = msBlendScreen_SSE2( dlo, slo );
+      dhi = msBlendScreen_SSE2( dhi, shi );
+    }
+
+    /* the scalar code stores the low 8 bits of out of range values */
+    d = _mm_packus_epi16( _mm_and_si128( dlo, low8 ), _mm_and_si128( dhi, low8 ) );
+    _mm_storeu_si128( (__m128i*)(dst + 4 * i), d );
+  }
+
+  return i;
+}
+
+/************************************************************************/
+/*                           AVX2 versions.                             */
+/*                                                                      */
+/*      Same as the SSE2 ones, on four pixels.  Unpacking and packing   */
+/*      both work within 128 bit lanes, so pixel order is preserved.    */
+/************************************************************************/
+
+MS_SIMD_TARGET_AVX2
+static __m256i msBlendOver_AVX2( __m256i d, __m256i s, __m256i c1 )
+
+{
+  const __m256i amask = _mm256_set_epi16( 255, 0, 0, 0, 255, 0, 0, 0,
+                                          255, 0, 0, 0, 255, 0, 0, 0 );
+  const __m256i cmask = _mm256_set_epi16( 0, -1, -1, -1, 0, -1, -1, -1,
+                                          0, -1, -1, -1, 0, -1, -1, -1 );
+  __m256i a = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( s, 0xFF ), 0xFF );
+  __m256i ia = _mm256_sub_epi16( _mm256_set1_epi16( 255 ),
+                                 _mm256_srli_epi16( _mm256_mullo_epi16( a, c1 ), 8 ) );
+  __m256i x = _mm256_xor_si256( d, amask );
+  __m256i y = _mm256_and_si256( s, cmask );
+  __m256i w = _mm256_and_si256( c1, cmask );
+  __m256i lo = _mm256_madd_epi16( _mm256_unpacklo_epi16( x, y ), _mm256_unpacklo_epi16( ia, w ) );
+  __m256i hi = _mm256_madd_epi16( _mm256_unpackhi_epi16( x, y ), _mm256_unpackhi_epi16( ia, w ) );
+  __m256i t = _mm256_packs_epi32( _mm256_srai_epi32( lo, 8 ), _mm256_srai_epi32( hi, 8 ) );
+  __m256i keep = _mm256_cmpeq_epi16( a, _mm256_setzero_si256() );
+
+  t = _mm256_xor_si256( t, amask );
+  return _mm256_blendv_epi8( t, d, keep );
+}
+
+MS_SIMD_TARGET_AVX2
+static __m256i msBlendScreenLanes_AVX2( __m256i d, __m256i s )
+
+{
+  __m256i m = _mm256_srli_epi16( _mm256_add_epi16( _mm256_mullo_epi16( s, d ),
+                                 _mm256_set1_epi16( 255 ) ), 8 );
+  return _mm256_sub_epi16( _mm256_add_epi16( s, d ), m );
+}
+
+MS_SIMD_TARGET_AVX2
+static __m256i msBlendMultiply_AVX2( __m256i d, __m256i s )
+
+{
+  const __m256i cmask = _mm256_set_epi16( 0, -1, -1, -1, 0, -1, -1, -1,
+                                          0, -1, -1, -1, 0, -1, -1, -1 );
+  const __m256i v255 = _mm256_set1_epi16( 255 );
+  const __m256i r255 = _mm256_set1_epi32( 255 );
+  __m256i sa = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( s, 0xFF ), 0xFF );
+  __m256i da = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( d, 0xFF ), 0xFF );
+  __m256i w1 = _mm256_add_epi16( d, _mm256_sub_epi16( v255, da ) );
+  __m256i w2 = _mm256_sub_epi16( v255, sa );
+  __m256i lo = _mm256_madd_epi16( _mm256_unpacklo_epi16( s, d ), _mm256_unpacklo_epi16( w1, w2 ) );
+  __m256i hi = _mm256_madd_epi16( _mm256_unpackhi_epi16( s, d ), _mm256_unpackhi_epi16( w1, w2 ) );
+  __m256i r = _mm256_packs_epi32( _mm256_srai_epi32( _mm256_add_epi32( lo, r255 ), 8 ),
+                                  _mm256_srai_epi32( _mm256_add_epi32( hi, r255 ), 8 ) );
+  __m256i keep = _mm256_cmpeq_epi16( sa, _mm256_setzero_si256() );
+
+  r = _mm256_blendv_epi8( msBlendScreenLanes_AVX2( d, s ), r, cmask );
+  return _mm256_blendv_epi8( r, d, keep );
+}
+
+MS_SIMD_TARGET_AVX2
+static __m256i msBlendScreen_AVX2( __m256i d, __m256i s )
+
+{
+  __m256i sa = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( s, 0xFF ), 0xFF );
+  __m256i keep = _mm256_cmpeq_epi16( sa, _mm256_setzero_si256() );
+
+  return _mm256_blendv_epi8( msBlendScreenLanes_AVX2( d, s ), d, keep );
+}
+
+/************************************************************************/
+/*                        msBlendRow_AVX2()                             */
+/************************************************************************/
+
+MS_SIMD_TARGET_AVX2
+static int msBlendRow_AVX2( unsigned char *dst, const unsigned char *src,
+                            int width, CompositingOperation comp,
+                            unsigned int cover )
+
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha = _mm256_set1_epi32( (int)0xFF000000 );
+  const __m256i c1 = _mm256_set1_epi16( (short)(cover + 1) );
+  const __m256i vcover = _mm256_set1_epi16( (short)cover );
+  const __m256i low8 = _mm256_set1_epi16( 255 );
+  int i;
+
+  for( i = 0; i + 8 <= width; i += 8 ) {
+    __m256i s = _mm256_loadu_si256( (const __m256i*)(src + 4 * i) );
+    __m256i sa = _mm256_and_si256( s, alpha );
+    __m256i d, slo, shi, dlo, dhi;
+
+    if( _mm256_testz_si256( s, alpha ) )
+      continue;
+    if( comp == MS_COMPOP_SRC_OVER && cover == 255
+        && _mm256_movemask_epi8( _mm256_cmpeq_epi32( sa, alpha ) ) == -1 ) {
+      _mm256_storeu_si256( (__m256i*)(dst + 4 * i), s );
+      continue;
+    }
+
+    d = _mm256_loadu_si256( (const __m256i*)(dst + 4 * i) );
+    slo = _mm256_unpacklo_epi8( s, zero );
+    shi = _mm256_unpackhi_epi8( s, zero );
+    dlo = _mm256_unpacklo_epi8( d, zero );
+    dhi = _mm256_unpackhi_epi8( d, zero );
+
+    if( comp != MS_COMPOP_SRC_OVER && cover < 255 ) {
+      slo = _mm256_srli_epi16( _mm256_add_epi16( _mm256_mullo_epi16( slo, vcover ), low8 ), 8 );
+      shi = _mm256_srli_epi16( _mm256_add_epi16( _mm256_mullo_epi16( shi, vcover ), low8 ), 8 );
+    }
+
+    if( comp == MS_COMPOP_SRC_OVER ) {
+      dlo = msBlendOver_AVX2( dlo, slo, c1 );
+      dhi = msBlendOver_AVX2( dhi, shi, c1 );
+    } else if( comp == MS_COMPOP_MULTIPLY ) {
+      dlo = msBlendMultiply_AVX2( dlo, slo );
+      dhi = msBlendMultiply_AVX2( dhi, shi );
+    } else {
+      dlo = msBlendScreen_AVX2( dlo, slo );
+      dhi = msBlendScreen_AVX2( dhi, shi );
+    }
+
+    d = _mm256_packus_epi16( _mm256_and_si256( dlo, low8 ), _mm256_and_si256( dhi, low8 ) );
+    _mm256_storeu_si256( (__m256i*)(dst + 4 * i), d );
+  }
+
+  return i;
+}
+
+#endif /* def MS_HAVE_X86_SIMD */
+
+/************************************************************************/
+/*                          msCompositeRGBA()                           */
+/*                                                                      */
+/*      Composites the width x height src pixels over dst with the      */
+/*      comp operator, src being first scaled by cover (0-255).         */
+/*      Returns MS_FALSE without touching dst if the operator is not    */
+/*      one handled here or no SIMD instruction set is available, in    */
+/*      which case the caller should use its generic code path.         */
+/************************************************************************/
+
+int msCompositeRGBA( unsigned char *dst, int dst_row_step,
+                     const unsigned char *src, int src_row_step,
+                     int width, int height,
+                     CompositingOperation comp, unsigned int cover )
+
+{
+  msBlendPixelFunc pfnBlendPixel;
+  int level = msSIMDGetLevel();
+  int row, i;
+
+  if( level == MS_SIMD_NONE || cover > 255 )
+    return MS_FALSE;
+
+  switch( comp ) {
+    case MS_COMPOP_SRC_OVER:
+      pfnBlendPixel = msBlendPixelOver;
+      break;
+    case MS_COMPOP_MULTIPLY:
+      pfnBlendPixel = msBlendPixelMultiply;
+      break;
+    case MS_COMPOP_SCREEN:
+      pfnBlendPixel = msBlendPixelScreen;
+      break;
+    default:
+      return MS_FALSE;
+  }
+
+  for( row = 0; row < height; row++ ) {
+    unsigned char *pd = dst + (size_t)row * dst_row_step;
+    const unsigned char *ps = src + (size_t)row * src_row_step;
+
+    i = 0;
+#ifdef MS_HAVE_X86_SIMD
+    if( level >= MS_SIMD_AVX2 )
+      i = msBlendRow_AVX2( pd, ps, width, comp, cover );
+    i += msBlendRow_SSE2( pd + 4 * i, ps + 4 * i, width - i, comp, cover );
+#endif
+    for( ; i < width; i++ )
+      pfnBlendPixel( pd + 4 * i, ps + 4 * i, cover );
+  }
+
+  return MS_TRUE;
+}
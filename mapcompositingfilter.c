@@ -26,143 +26,45 @@
  * DEALINGS IN THE SOFTWARE.
  *****************************************************************************/
 #include "mapserver.h"
+#include "mapthread.h"
+#include "mapsimd.h"
 #include <regex.h>
-#define pixmove(rb,srcx,srcy,dstx,dsty) \
-  memcpy(rb->data.rgba.pixels+dsty*rb->data.rgba.row_step+dstx*4,\
-          rb->data.rgba.pixels+srcy*rb->data.rgba.row_step+srcx*4,\
-          4)
-#define pixerase(rb,x,y) memset(rb->data.rgba.pixels+y*rb->data.rgba.row_step+x*4,0,4)
-
-void msApplyTranslationCompositingFilter(rasterBufferObj *rb, int xtrans, int ytrans) {
-  int src_sx,src_sy,dst_sx,dst_sy,x,y,dst_x,dst_y;
-  if(abs(xtrans)>=rb->width || abs(ytrans)>=rb->height) {
-    for(y = 0; y<rb->height; y++)
-      for(x = 0; x<rb->width; x++)
-        pixerase(rb,x,y);
-  }
-  if(xtrans == 0 && ytrans == 0)
-    return;
-  if(xtrans>=0) {
-    if(ytrans>=0) {
-      src_sx = rb->width - xtrans - 1;
-      src_sy = rb->height - ytrans - 1;
-      dst_sx = rb->width - 1;
-      dst_sy = rb->height -1;
-      for(y = src_sy,dst_y= dst_sy;y>=0;y--,dst_y--) {
-        for(x = src_sx,dst_x= dst_sx;x>=0;x--,dst_x--) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
-      }
-      for(y=0;y<ytrans;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);  
-      for(y=ytrans;y<rb->height;y++)
-        for(x=0;x<xtrans;x++)
-          pixerase(rb,x,y);
-    } else {
-      src_sx = rb->width - xtrans - 1;
-      src_sy = - ytrans;
-      dst_sx = rb->width - 1;
-      dst_sy = 0;
-      for(y = src_sy,dst_y= dst_sy;y<rb->height;y++,dst_y++) {
-        for(x = src_sx,dst_x= dst_sx;x>=0;x--,dst_x--) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
-      }
-      for(y=0;y<rb->height+ytrans;y++)
-        for(x=0;x<xtrans;x++)
-          pixerase(rb,x,y);  
-      for(y=rb->height+ytrans;y<rb->height;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);
-    }
-  } else {
-    if(ytrans>=0) {
-      src_sx = - xtrans;
-      src_sy = rb->height - ytrans - 1;
-      dst_sx = 0;
-      dst_sy = rb->height -1;
-      for(y = src_sy,dst_y= dst_sy;y>=0;y--,dst_y--) {
-        for(x = src_sx,dst_x= dst_sx;x<rb->width;x++,dst_x++) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
-      }
-      for(y=0;y<ytrans;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);
-      for(y=ytrans;y<rb->height;y++)
-        for(x=rb->width+xtrans;x<rb->width;x++)
-          pixerase(rb,x,y);
-    } else {
-      src_sx = - xtrans;
-      src_sy = - ytrans;
-      dst_sx = 0;
-      dst_sy = 0;
-      for(y = src_sy,dst_y= dst_sy;y<rb->height;y++,dst_y++) {
-        for(x = src_sx,dst_x= dst_sx;x<rb->width;x++,dst_x++) {
-          pixmove(rb,x,y,dst_x,dst_y);
-        }
-      }
-      for(y=0;y<rb->height+ytrans;y++)
-        for(x=rb->width+xtrans;x<rb->width;x++)
-          pixerase(rb,x,y);
-      for(y=rb->height+ytrans;y<rb->height;y++)
-        for(x=0;x<rb->width;x++)
-          pixerase(rb,x,y);
-    }
-  }
-}
 
-void msApplyBlackeningCompositingFilter(rasterBufferObj *rb) {
-  int row,col;
-  unsigned char *r,*g,*b;
-  for(row=0;row<rb->height;row++) {
-    r = rb->data.rgba.r + row*rb->data.rgba.row_step;
-    g = rb->data.rgba.g + row*rb->data.rgba.row_step;
-    b = rb->data.rgba.b + row*rb->data.rgba.row_step;
-    for(col=0;col<rb->width;col++) {
-      *r = *g = *b = 0;
-      r+=4;g+=4;b+=4;
-    }    
-  }
-}
+#ifdef MS_HAVE_X86_SIMD
+#include <emmintrin.h>
+#endif
 
-void msApplyWhiteningCompositingFilter(rasterBufferObj *rb) {
-  int row,col;
-  unsigned char *r,*g,*b,*a;
-  for(row=0;row<rb->height;row++) {
-    r = rb->data.rgba.r + row*rb->data.rgba.row_step;
-    g = rb->data.rgba.g + row*rb->data.rgba.row_step;
-    b = rb->data.rgba.b + row*rb->data.rgba.row_step;
-    a = rb->data.rgba.a + row*rb->data.rgba.row_step;
-    for(col=0;col<rb->width;col++) {
-      *r = *g = *b = *a;
-      r+=4;g+=4;b+=4;a+=4;
-    }    
-  }
-}
+/*
+ * The filters of a chain are grouped into passes over the raster buffer:
+ * a translation and any number of point-wise filters (grayscale, blacken,
+ * whiten) are fused into a single pass applying them row by row, and a
+ * blur is a pass of its own. As blacken and whiten replace the color
+ * channels by a value that does not depend on them, and the blur treats
+ * channels independently, they give the same result when applied before
+ * a blur, so they are moved into the pass preceding it. A drop shadow
+ * (translate, blur, blacken) thus costs two passes instead of three.
+ */
+#define MS_COMPFILTER_BLUR      0
+#define MS_COMPFILTER_TRANSLATE 1
+#define MS_COMPFILTER_GRAYSCALE 2
+#define MS_COMPFILTER_BLACKEN   3
+#define MS_COMPFILTER_WHITEN    4
 
-void msApplyGrayscaleCompositingFilter(rasterBufferObj *rb) {
-  int row,col;
-  unsigned char *r,*g,*b;
-  for(row=0;row<rb->height;row++) {
-    r = rb->data.rgba.r + row*rb->data.rgba.row_step;
-    g = rb->data.rgba.g + row*rb->data.rgba.row_step;
-    b = rb->data.rgba.b + row*rb->data.rgba.row_step;
-    for(col=0;col<rb->width;col++) {
-      unsigned int mix = (unsigned int)*r + (unsigned int)*g + (unsigned int)*b;
-      mix /=3;
-      *r = *g = *b = (unsigned char)mix;
-      r+=4;g+=4;b+=4;
-    }    
-  }
-}
+#define MS_COMPFILTER_MAX_OPS 16
+
+typedef struct {
+  int is_blur;
+  unsigned int radius;
+  int xtrans, ytrans;
+  int numops;
+  int ops[MS_COMPFILTER_MAX_OPS];
+} compositingPassObj;
 
-int msApplyCompositingFilter(mapObj *map, rasterBufferObj *rb, CompositingFilter *filter) {
+static int msParseCompositingFilter(mapObj *map, CompositingFilter *filter, int *type, int *arg1, int *arg2) {
   int rstatus;
   regex_t regex;
   regmatch_t pmatch[3];
-  
+
   /* test for blurring filter */
   regcomp(&regex, "blur\\(([0-9]+)\\)", REG_EXTENDED);
   rstatus = regexec(&regex, filter->filter, 2, pmatch, 0);
@@ -175,8 +77,8 @@ int msApplyCompositingFilter(mapObj *map, rasterBufferObj *rb, CompositingFilter
     //msDebug("got blur filter with radius %s\n",rad);
     irad = atoi(rad);
     free(rad);
-    irad = MS_NINT(irad*map->resolution/map->defresolution);
-    msApplyBlurringCompositingFilter(rb,irad);
+    *type = MS_COMPFILTER_BLUR;
+    *arg1 = MS_NINT(irad*map->resolution/map->defresolution);
     return MS_SUCCESS;
   }
   
@@ -198,26 +100,213 @@ int msApplyCompositingFilter(mapObj *map, rasterBufferObj *rb, CompositingFilter
     ytrans = atoi(num);
     free(num);
     //msDebug("got translation filter of radius %d,%d\n",xtrans,ytrans);
-    xtrans = MS_NINT(xtrans*map->resolution/map->defresolution);
-    ytrans = MS_NINT(ytrans*map->resolution/map->defresolution);
-    msApplyTranslationCompositingFilter(rb,xtrans,ytrans);
+    *type = MS_COMPFILTER_TRANSLATE;
+    *arg1 = MS_NINT(xtrans*map->resolution/map->defresolution);
+    *arg2 = MS_NINT(ytrans*map->resolution/map->defresolution);
     return MS_SUCCESS;
   }
   
   /* test for grayscale filter */
   if(!strncmp(filter->filter,"grayscale()",strlen("grayscale()"))) {
-    msApplyGrayscaleCompositingFilter(rb);
+    *type = MS_COMPFILTER_GRAYSCALE;
     return MS_SUCCESS;
   }
   if(!strncmp(filter->filter,"blacken()",strlen("blacken()"))) {
-    msApplyBlackeningCompositingFilter(rb);
+    *type = MS_COMPFILTER_BLACKEN;
     return MS_SUCCESS;
   }
   if(!strncmp(filter->filter,"whiten()",strlen("whiten()"))) {
-    msApplyWhiteningCompositingFilter(rb);
+    *type = MS_COMPFILTER_WHITEN;
     return MS_SUCCESS;
   }
   
-  msSetError(MS_MISCERR,"unknown compositing filter (%s)", "msApplyCompositingFilter()", filter->filter);
+  msSetError(MS_MISCERR,"unknown compositing filter (%s)", "msApplyCompositingFilters()", filter->filter);
   return MS_FAILURE;
 }
+
+#ifdef MS_HAVE_X86_SIMD
+/* four pixels at a time, for buffers with the alpha in the last byte */
+MS_SIMD_TARGET_SSE2
+static int msApplyPointFiltersSSE2(unsigned char *pixels, int width, const int *ops, int numops) {
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  const __m128i low8 = _mm_set1_epi32(0xFF);
+  const __m128i third = _mm_set1_epi32(43691);
+  int x, i;
+
+  for(x=0; x+4<=width; x+=4) {
+    __m128i p = _mm_loadu_si128((__m128i*)(pixels + 4*x));
+    for(i=0; i<numops; i++) {
+      __m128i v;
+      switch(ops[i]) {
+        case MS_COMPFILTER_GRAYSCALE:
+          v = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(p, low8),
+                                          _mm_and_si128(_mm_srli_epi32(p, 8), low8)),
+                            _mm_and_si128(_mm_srli_epi32(p, 16), low8));
+          /* (v * 43691) >> 17 == v / 3 for the possible sums */
+          v = _mm_srli_epi32(_mm_mulhi_epu16(v, third), 1);
+          v = _mm_or_si128(v, _mm_slli_epi32(v, 8));
+          v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+          p = _mm_or_si128(_mm_and_si128(p, alpha), _mm_andnot_si128(alpha, v));
+          break;
+        case MS_COMPFILTER_BLACKEN:
+          p = _mm_and_si128(p, alpha);
+          break;
+        case MS_COMPFILTER_WHITEN:
+          v = _mm_srli_epi32(p, 24);
+          v = _mm_or_si128(v, _mm_slli_epi32(v, 8));
+          p = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+          break;
+      }
+    }
+    _mm_storeu_si128((__m128i*)(pixels + 4*x), p);
+  }
+  return x;
+}
+#endif
+
+/* apply the point-wise filters to width pixels starting at column x of row */
+static void msApplyPointFilters(rasterBufferObj *rb, int row, int x, int width, const int *ops, int numops) {
+  int col, i;
+  size_t off = (size_t)row*rb->data.rgba.row_step + (size_t)x*rb->data.rgba.pixel_step;
+  unsigned char *r = rb->data.rgba.r + off, *g = rb->data.rgba.g + off, *b = rb->data.rgba.b + off;
+  unsigned char *a = rb->data.rgba.a ? rb->data.rgba.a + off : NULL;
+
+  if(numops == 0)
+    return;
+#ifdef MS_HAVE_X86_SIMD
+  if(a && rb->data.rgba.pixel_step == 4 && a == rb->data.rgba.pixels + off + 3 && msSIMDGetLevel() >= MS_SIMD_SSE2) {
+    col = msApplyPointFiltersSSE2(rb->data.rgba.pixels + off, width, ops, numops);
+    r += 4*col; g += 4*col; b += 4*col; a += 4*col;
+    width -= col;
+  }
+#endif
+  for(col=0; col<width; col++) {
+    for(i=0; i<numops; i++) {
+      switch(ops[i]) {
+        case MS_COMPFILTER_GRAYSCALE: {
+          unsigned int mix = (unsigned int)*r + (unsigned int)*g + (unsigned int)*b;
+          mix /=3;
+          *r = *g = *b = (unsigned char)mix;
+          break;
+        }
+        case MS_COMPFILTER_BLACKEN:
+          *r = *g = *b = 0;
+          break;
+        case MS_COMPFILTER_WHITEN:
+          *r = *g = *b = a ? *a : 255;
+          break;
+      }
+    }
+    r+=rb->data.rgba.pixel_step;g+=rb->data.rgba.pixel_step;b+=rb->data.rgba.pixel_step;
+    if(a) a+=rb->data.rgba.pixel_step;
+  }
+}
+
+/*
+ * Translation and point-wise filters in one pass. Rows are processed in
+ * the direction of the vertical translation so that source rows are read
+ * before being overwritten. The point-wise filters leave transparent black
+ * pixels unchanged, so they only need to be applied to the moved pixels.
+ */
+static void msApplyFusedCompositingPass(rasterBufferObj *rb, compositingPassObj *pass) {
+  int xtrans = pass->xtrans, ytrans = pass->ytrans;
+  int row_step = rb->data.rgba.row_step;
+  int rowbytes = rb->width * 4;
+  int n = rb->width - abs(xtrans);
+  int x0 = MS_MAX(0, xtrans);
+  int i, y;
+
+  if(xtrans == 0 && ytrans == 0) {
+    for(y=0; y<rb->height; y++)
+      msApplyPointFilters(rb, y, 0, rb->width, pass->ops, pass->numops);
+    return;
+  }
+
+  for(i=0; i<rb->height; i++) {
+    int sy;
+    unsigned char *dst;
+    y = (ytrans > 0) ? rb->height - 1 - i : i;
+    sy = y - ytrans;
+    dst = rb->data.rgba.pixels + (size_t)y*row_step;
+    if(sy < 0 || sy >= rb->height || n <= 0) {
+      memset(dst, 0, rowbytes);
+      continue;
+    }
+    memmove(dst + x0*4, rb->data.rgba.pixels + (size_t)sy*row_step + (x0 - xtrans)*4, n*4);
+    if(xtrans > 0)
+      memset(dst, 0, xtrans*4);
+    else if(xtrans < 0)
+      memset(dst + n*4, 0, -xtrans*4);
+    msApplyPointFilters(rb, y, x0, n, pass->ops, pass->numops);
+  }
+}
+
+/*
+ * Split the filter chain into passes, see above. Returns the number of
+ * passes, or -1 on error.
+ */
+static int msPlanCompositingFilters(mapObj *map, CompositingFilter *filter, compositingPassObj **passes) {
+  int numpasses = 0;
+  *passes = NULL;
+
+  for(; filter; filter = filter->next) {
+    int type, arg1 = 0, arg2 = 0;
+    compositingPassObj *last, *target = NULL;
+
+    if(msParseCompositingFilter(map, filter, &type, &arg1, &arg2) != MS_SUCCESS) {
+      free(*passes);
+      *passes = NULL;
+      return -1;
+    }
+    last = numpasses ? *passes + numpasses - 1 : NULL;
+
+    if(type == MS_COMPFILTER_TRANSLATE) {
+      /* translations cannot be merged, pixels moved out of the image are lost */
+      if(last && !last->is_blur && last->xtrans == 0 && last->ytrans == 0)
+        target = last;
+    } else if(type != MS_COMPFILTER_BLUR) {
+      if(last && !last->is_blur)
+        target = last;
+      else if(last && numpasses > 1 && type != MS_COMPFILTER_GRAYSCALE && !last[-1].is_blur)
+        target = last - 1;
+      if(target && target->numops == MS_COMPFILTER_MAX_OPS)
+        target = NULL;
+    }
+
+    if(!target) {
+      *passes = msSmallRealloc(*passes, (numpasses + 1) * sizeof(compositingPassObj));
+      target = *passes + numpasses++;
+      memset(target, 0, sizeof(compositingPassObj));
+      target->is_blur = (type == MS_COMPFILTER_BLUR);
+    }
+
+    if(type == MS_COMPFILTER_BLUR) {
+      target->radius = arg1;
+    } else if(type == MS_COMPFILTER_TRANSLATE) {
+      target->xtrans = arg1;
+      target->ytrans = arg2;
+    } else {
+      target->ops[target->numops++] = type;
+    }
+  }
+  return numpasses;
+}
+
+int msApplyCompositingFilters(mapObj *map, layerObj *layer, rasterBufferObj *rb, CompositingFilter *filter) {
+  compositingPassObj *passes;
+  int i, numpasses, threads;
+
+  numpasses = msPlanCompositingFilters(map, filter, &passes);
+  if(numpasses < 0)
+    return MS_FAILURE;
+
+  threads = msThreadParseCount(msLayerGetProcessingKey(layer, "COMPOSITING_THREADS"), 1);
+  for(i=0; i<numpasses; i++) {
+    if(passes[i].is_blur)
+      msApplyBlurringCompositingFilter(rb, passes[i].radius, threads);
+    else
+      msApplyFusedCompositingPass(rb, passes + i);
+  }
+  free(passes);
+  return MS_SUCCESS;
+}
@@ -1292,7 +1292,8 @@ int msCopyRasterBuffer(rasterBufferObj *dst, const rasterBufferObj *src) {
   *dst = *src;
   if(src->type == MS_BUFFER_BYTE_RGBA) {
     dst->data.rgba = src->data.rgba;
-    dst->data.rgba.pixels = msSmallMalloc(src->height * src->data.rgba.row_step);
+    dst->data.rgba.pixels = msRasterBufferPoolAcquire((size_t)src->height * src->data.rgba.row_step);
+    MS_CHECK_ALLOC(dst->data.rgba.pixels, (size_t)src->height * src->data.rgba.row_step, MS_FAILURE);
     memcpy(dst->data.rgba.pixels, src->data.rgba.pixels, src->data.rgba.row_step*src->height);
     dst->data.rgba.r = dst->data.rgba.pixels + (src->data.rgba.r - src->data.rgba.pixels);
     dst->data.rgba.g = dst->data.rgba.pixels + (src->data.rgba.g - src->data.rgba.pixels);
@@ -36,6 +36,78 @@
 #include "mapows.h"
 
 
+/*
+ * Compute the cellsize, scale, geotransform and layer scale factors of the
+ * map for its current extent and image dimensions.  Called by
+ * msPrepareImage(), and on its own by renderers that don't allocate a
+ * single image for the whole map (see mapbands.c).
+ */
+int msPrepareMapGeometry(mapObj *map, int allow_nonsquare)
+{
+  int i, status;
+  double geo_cellsize;
+
+  /*
+   * If we want to support nonsquare pixels, note that now, otherwise
+   * adjust the extent size to have square pixels.
+   *
+   * If allow_nonsquare is set to MS_TRUE then the caller should call
+   * msMapRestoreRealExtent() once they are done with the image.
+   * This should be set to MS_TRUE only when called from msDrawMap(), see bug 945.
+   */
+  if( allow_nonsquare && msTestConfigOption( map, "MS_NONSQUARE", MS_FALSE ) ) {
+    double cellsize_x = (map->extent.maxx - map->extent.minx)/map->width;
+    double cellsize_y = (map->extent.maxy - map->extent.miny)/map->height;
+
+    if( cellsize_y != 0.0
+        && (fabs(cellsize_x/cellsize_y) > 1.00001
+            || fabs(cellsize_x/cellsize_y) < 0.99999) ) {
+      map->gt.need_geotransform = MS_TRUE;
+      if (map->debug)
+        msDebug( "msDrawMap(): kicking into non-square pixel preserving mode.\n" );
+    }
+    map->cellsize = (cellsize_x*0.5 + cellsize_y*0.5);
+  } else
+    map->cellsize = msAdjustExtent(&(map->extent),map->width,map->height);
+
+  status = msCalculateScale(map->extent,map->units,map->width,map->height, map->resolution, &map->scaledenom);
+  if(status != MS_SUCCESS)
+    return(MS_FAILURE);
+
+  /* update geotransform based on adjusted extent. */
+  msMapComputeGeotransform( map );
+
+  /* Do we need to fake out stuff for rotated support? */
+  if( map->gt.need_geotransform )
+    msMapSetFakedExtent( map );
+
+  /* We will need a cellsize that represents a real georeferenced */
+  /* coordinate cellsize here, so compute it from saved extents.   */
+
+  geo_cellsize = map->cellsize;
+  if( map->gt.need_geotransform == MS_TRUE ) {
+    double cellsize_x = (map->saved_extent.maxx - map->saved_extent.minx)
+                        / map->width;
+    double cellsize_y = (map->saved_extent.maxy - map->saved_extent.miny)
+                        / map->height;
+
+    geo_cellsize = sqrt(cellsize_x*cellsize_x + cellsize_y*cellsize_y)
+                   / sqrt(2.0);
+  }
+
+  /* compute layer scale factors now */
+  for(i=0; i<map->numlayers; i++) {
+    if(GET_LAYER(map, i)->sizeunits != MS_PIXELS)
+      GET_LAYER(map, i)->scalefactor = (msInchesPerUnit(GET_LAYER(map, i)->sizeunits,0)/msInchesPerUnit(map->units,0)) / geo_cellsize;
+    else if(GET_LAYER(map, i)->symbolscaledenom > 0 && map->scaledenom > 0)
+      GET_LAYER(map, i)->scalefactor = GET_LAYER(map, i)->symbolscaledenom/map->scaledenom*map->resolution/map->defresolution;
+    else
+      GET_LAYER(map, i)->scalefactor = map->resolution/map->defresolution;
+  }
+
+  return(MS_SUCCESS);
+}
+
 /* msPrepareImage()
  *
  * Returns a new imageObj ready for rendering the current map.
@@ -48,7 +120,6 @@ imageObj *msPrepareImage(mapObj *map, int allow_nonsquare)
 {
   int i, status;
   imageObj *image=NULL;
-  double geo_cellsize;
 
   if(map->width == -1 || map->height == -1) {
     msSetError(MS_MISCERR, "Image dimensions not specified.", "msPrepareImage()");
@@ -112,66 +183,11 @@ imageObj *msPrepareImage(mapObj *map, int allow_nonsquare)
   
   image->map = map;
 
-  /*
-   * If we want to support nonsquare pixels, note that now, otherwise
-   * adjust the extent size to have square pixels.
-   *
-   * If allow_nonsquare is set to MS_TRUE then the caller should call
-   * msMapRestoreRealExtent() once they are done with the image.
-   * This should be set to MS_TRUE only when called from msDrawMap(), see bug 945.
-   */
-  if( allow_nonsquare && msTestConfigOption( map, "MS_NONSQUARE", MS_FALSE ) ) {
-    double cellsize_x = (map->extent.maxx - map->extent.minx)/map->width;
-    double cellsize_y = (map->extent.maxy - map->extent.miny)/map->height;
-
-    if( cellsize_y != 0.0
-        && (fabs(cellsize_x/cellsize_y) > 1.00001
-            || fabs(cellsize_x/cellsize_y) < 0.99999) ) {
-      map->gt.need_geotransform = MS_TRUE;
-      if (map->debug)
-        msDebug( "msDrawMap(): kicking into non-square pixel preserving mode.\n" );
-    }
-    map->cellsize = (cellsize_x*0.5 + cellsize_y*0.5);
-  } else
-    map->cellsize = msAdjustExtent(&(map->extent),map->width,map->height);
-
-  status = msCalculateScale(map->extent,map->units,map->width,map->height, map->resolution, &map->scaledenom);
-  if(status != MS_SUCCESS) {
+  if(msPrepareMapGeometry(map, allow_nonsquare) != MS_SUCCESS) {
     msFreeImage(image);
     return(NULL);
   }
 
-  /* update geotransform based on adjusted extent. */
-  msMapComputeGeotransform( map );
-
-  /* Do we need to fake out stuff for rotated support? */
-  if( map->gt.need_geotransform )
-    msMapSetFakedExtent( map );
-
-  /* We will need a cellsize that represents a real georeferenced */
-  /* coordinate cellsize here, so compute it from saved extents.   */
-
-  geo_cellsize = map->cellsize;
-  if( map->gt.need_geotransform == MS_TRUE ) {
-    double cellsize_x = (map->saved_extent.maxx - map->saved_extent.minx)
-                        / map->width;
-    double cellsize_y = (map->saved_extent.maxy - map->saved_extent.miny)
-                        / map->height;
-
-    geo_cellsize = sqrt(cellsize_x*cellsize_x + cellsize_y*cellsize_y)
-                   / sqrt(2.0);
-  }
-
-  /* compute layer scale factors now */
-  for(i=0; i<map->numlayers; i++) {
-    if(GET_LAYER(map, i)->sizeunits != MS_PIXELS)
-      GET_LAYER(map, i)->scalefactor = (msInchesPerUnit(GET_LAYER(map, i)->sizeunits,0)/msInchesPerUnit(map->units,0)) / geo_cellsize;
-    else if(GET_LAYER(map, i)->symbolscaledenom > 0 && map->scaledenom > 0)
-      GET_LAYER(map, i)->scalefactor = GET_LAYER(map, i)->symbolscaledenom/map->scaledenom*map->resolution/map->defresolution;
-    else
-      GET_LAYER(map, i)->scalefactor = map->resolution/map->defresolution;
-  }
-
   image->refpt.x = MS_MAP2IMAGE_X_IC_DBL(0, map->extent.minx, 1.0/map->cellsize);
   image->refpt.y = MS_MAP2IMAGE_Y_IC_DBL(0, map->extent.maxy, 1.0/map->cellsize);
 
@@ -179,7 +195,7 @@ imageObj *msPrepareImage(mapObj *map, int allow_nonsquare)
   
 }
 
-static int msCompositeRasterBuffer(mapObj *map, imageObj *img, rasterBufferObj *rb, LayerCompositer *comp) {
+static int msCompositeRasterBuffer(mapObj *map, layerObj *layer, imageObj *img, rasterBufferObj *rb, LayerCompositer *comp) {
   int ret = MS_SUCCESS;
   if(MS_IMAGE_RENDERER(img)->compositeRasterBuffer) {
     while(comp && ret == MS_SUCCESS) {
@@ -191,10 +207,8 @@ static int msCompositeRasterBuffer(mapObj *map, imageObj *img, rasterBufferObj *
 	rb_ptr = (rasterBufferObj*)msSmallCalloc(sizeof(rasterBufferObj),1);
 	msCopyRasterBuffer(rb_ptr,rb);
       }
-      while(filter && ret == MS_SUCCESS) {
-        ret = msApplyCompositingFilter(map,rb_ptr,filter);
-        filter = filter->next;
-      }
+      if(filter)
+        ret = msApplyCompositingFilters(map,layer,rb_ptr,filter);
       if(ret == MS_SUCCESS)
       	ret = MS_IMAGE_RENDERER(img)->compositeRasterBuffer(img,rb_ptr,comp->comp_op, comp->opacity);
       if(rb_ptr != rb) {
@@ -566,10 +580,14 @@ imageObj *msDrawMap(mapObj *map, int querymap)
 #endif
 
   if(map->debug >= MS_DEBUGLEVEL_TUNING) {
+    rasterBufferPoolStatsObj poolstats;
     msGettimeofday(&mapendtime, NULL);
     msDebug("msDrawMap() total time: %.3fs\n",
             (mapendtime.tv_sec+mapendtime.tv_usec/1.0e6)-
             (mapstarttime.tv_sec+mapstarttime.tv_usec/1.0e6) );
+    msRasterBufferPoolGetStats(&poolstats);
+    msDebug("msDrawMap(): raster buffer pool %ld hits, %ld misses, %d buffers (%ld KB) pooled\n",
+            poolstats.hits, poolstats.misses, poolstats.pooled_buffers, (long)(poolstats.pooled_bytes / 1024));
   }
 
   return(image);
@@ -879,7 +897,7 @@ altformat_cleanup:
       /*we have a mask layer with no composition configured, do a nomral blend */
       retcode = renderer->mergeRasterBuffer(image,&rb,1.0,0,0,0,0,rb.width,rb.height);
     } else {
-      retcode = msCompositeRasterBuffer(map,image,&rb,layer->compositer);
+      retcode = msCompositeRasterBuffer(map,layer,image,&rb,layer->compositer);
     }
     if(UNLIKELY(retcode == MS_FAILURE)) {
       goto imagedraw_cleanup;
@@ -908,6 +926,8 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
   double minfeaturesize = -1;
   int maxfeatures=-1;
   int featuresdrawn=0;
+  shapeBatchObj batch;
+  const char *shape_arena;
 
   if (image)
     maxfeatures=msLayerGetMaxFeaturesToDraw(layer, image->format);
@@ -958,8 +978,15 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
     return MS_FAILURE;
   }
 
-  /* step through the target shapes */
+  /* step through the target shapes, read in batches. Feature geometries are
+     read into arenas recycled by msFreeShape(), for the providers that support
+     it (see mapshapearena.c) */
   msInitShape(&shape);
+  shape_arena = msLayerGetProcessingKey(layer, "SHAPE_ARENA");
+  msInitShapeBatch(&batch, msLayerGetShapeBatchSize(layer), !shape_arena || strcasecmp(shape_arena, "OFF") != 0);
+  /* optionally read the batches in a background thread while drawing */
+  if(msShapeBatchStartPipeline(layer, &batch) && layer->debug >= MS_DEBUGLEVEL_TUNING)
+    msDebug("msDrawVectorLayer(%s): reading shapes in a background thread\n", layer->name ? layer->name : "(null)");
 
   nclasses = 0;
   classgroup = NULL;
@@ -969,7 +996,7 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
   if(layer->minfeaturesize > 0)
     minfeaturesize = Pix2LayerGeoref(map, layer, layer->minfeaturesize);
 
-  while((status = msLayerNextShape(layer, &shape)) == MS_SUCCESS) {
+  while((status = msShapeBatchNext(layer, &batch, &shape)) == MS_SUCCESS) {
 
     /* Check if the shape size is ok to be drawn */
     if((shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) && (msShapeCheckSize(&shape, minfeaturesize) == MS_FALSE)) {
@@ -1090,6 +1117,14 @@ int msDrawVectorLayer(mapObj *map, layerObj *layer, imageObj *image)
   if (classgroup)
     msFree(classgroup);
 
+  if(batch.shapes[0].arena && (layer->debug >= MS_DEBUGLEVEL_TUNING || map->debug >= MS_DEBUGLEVEL_TUNING)) {
+    long allocations, resets;
+    msShapeBatchGetArenaStats(&batch, &allocations, &resets);
+    msDebug("msDrawVectorLayer(%s): %ld shape arena allocations over %ld features\n",
+            layer->name ? layer->name : "(null)", allocations, resets);
+  }
+  msFreeShapeBatch(&batch);
+
   if(status != MS_DONE || retcode == MS_FAILURE) {
     msLayerClose(layer);
     if(shpcache) {
@@ -1791,6 +1826,32 @@ int polygonLayerDrawShape(mapObj *map, imageObj *image, layerObj *layer,
   return MS_SUCCESS;
 }
 
+/*
+** Check whether the renderer may clip a shape of class c itself, in pixel
+** space, instead of having it clipped by msClipPolygonRect() or
+** msClipPolylineRect() first.  Only done for plain fills and strokes: label
+** points, offsets, dashes and symbols along lines are computed on the
+** geometry, they need the clipped shape.  So do symbol fills, hatches are
+** generated over the whole extent of the polygon.
+*/
+static int msRendererCanClipShape(layerObj *layer, int c, imageObj *image, int drawmode)
+{
+  int s;
+
+  if(!MS_RENDERER_PLUGIN(image->format) || !MS_IMAGE_RENDERER(image)->pixel_clipping)
+    return MS_FALSE;
+  if(MS_DRAW_LABELS(drawmode))
+    return MS_FALSE;
+  for(s=0; s<layer->class[c]->numstyles; s++) {
+    styleObj *style = layer->class[c]->styles[s];
+    if(style->patternlength > 0 || style->gap != 0 || style->offsetx != 0 || style->offsety != 0)
+      return MS_FALSE;
+    if(style->symbol != 0)
+      return MS_FALSE;
+  }
+  return MS_TRUE;
+}
+
 /*
 ** Function to render an individual shape, the style variable enables/disables the drawing of a single style
 ** versus a single style. This is necessary when drawing entire layers as proper overlay can only be achived
@@ -1914,8 +1975,30 @@ int msDrawShape(mapObj *map, layerObj *layer, shapeObj *shape, imageObj *image,
     }
 
 
-    /* if we need a copy of the unclipped shape, transform first, then clip to avoid transforming twice */
-    if(bNeedUnclippedShape) {
+    if(!bNeedUnclippedShape && msRendererCanClipShape(layer, c, image, drawmode)) {
+      /* the rasterizer clips in pixel space, only shapes beyond the range
+         of its coordinates still need to be clipped here */
+      double limit = MS_IMAGE_RENDERER(image)->pixel_clipping_limit;
+      msTransformShape(shape, map->extent, map->cellsize, image);
+      msComputeBounds(shape);
+      if(shape->numlines > 0 &&
+          (shape->bounds.minx < -limit || shape->bounds.miny < -limit ||
+           shape->bounds.maxx > limit || shape->bounds.maxy > limit)) {
+        if(shape->type == MS_SHAPE_POLYGON)
+          clip_buf += 2; /* #179 */
+        cliprect.minx = cliprect.miny = -clip_buf;
+        cliprect.maxx = image->width + clip_buf;
+        cliprect.maxy = image->height + clip_buf;
+        if(shape->type == MS_SHAPE_POLYGON) {
+          msClipPolygonRect(shape, cliprect);
+        } else {
+          assert(shape->type == MS_SHAPE_LINE);
+          msClipPolylineRect(shape, cliprect);
+        }
+      }
+      anno_shape = shape;
+    } else if(bNeedUnclippedShape) {
+      /* if we need a copy of the unclipped shape, transform first, then clip to avoid transforming twice */
       msTransformShape(shape, map->extent, map->cellsize, image);
       if(shape->numlines == 0) return MS_SUCCESS;
       msComputeBounds(shape);
@@ -2548,17 +2631,10 @@ offset_cleanup:
 
 void fastComputeBounds(lineObj *line, rectObj *bounds)
 {
-  int j;
   bounds->minx = bounds->maxx = line->point[0].x;
   bounds->miny = bounds->maxy = line->point[0].y;
 
-
-  for( j=0; j<line->numpoints; j++ ) {
-    bounds->minx = MS_MIN(bounds->minx, line->point[j].x);
-    bounds->maxx = MS_MAX(bounds->maxx, line->point[j].x);
-    bounds->miny = MS_MIN(bounds->miny, line->point[j].y);
-    bounds->maxy = MS_MAX(bounds->maxy, line->point[j].y);
-  }
+  msPointArrayExtendBounds(line->point + 1, line->numpoints - 1, bounds);
 }
 
 int computeMarkerBounds(mapObj *map, pointObj *annopoint, textSymbolObj *ts, label_bounds *poly)
@@ -3158,6 +3234,7 @@ void msImageStartLayer(mapObj *map, layerObj *layer, imageObj *image)
   if (image) {
     if( MS_RENDERER_PLUGIN(image->format) ) {
       char *approximation_scale = msLayerGetProcessingKey( layer, "APPROXIMATION_SCALE" );
+      const char *generalization_tolerance, *renderer_clipping;
       if(approximation_scale) {
         if(!strncasecmp(approximation_scale,"ROUND",5)) {
           MS_IMAGE_RENDERER(image)->transform_mode = MS_TRANSFORM_ROUND;
@@ -3173,6 +3250,17 @@ void msImageStartLayer(mapObj *map, layerObj *layer, imageObj *image)
         MS_IMAGE_RENDERER(image)->transform_mode = MS_IMAGE_RENDERER(image)->default_transform_mode;
         MS_IMAGE_RENDERER(image)->approximation_scale = MS_IMAGE_RENDERER(image)->default_approximation_scale;
       }
+      /* pixel tolerance for generalizing transformed lines and polygons, layer setting first */
+      generalization_tolerance = msLayerGetProcessingKey( layer, "GENERALIZATION_TOLERANCE" );
+      if(!generalization_tolerance)
+        generalization_tolerance = msGetOutputFormatOption( image->format, "GENERALIZATION_TOLERANCE", NULL );
+      MS_IMAGE_RENDERER(image)->generalization_tolerance = generalization_tolerance ? MS_MAX(0, atof(generalization_tolerance)) : 0;
+      MS_IMAGE_RENDERER(image)->generalization_vertices_in = 0;
+      MS_IMAGE_RENDERER(image)->generalization_vertices_out = 0;
+      /* opt-in, the rasterizer clipping at the image edges may change antialiasing there slightly */
+      renderer_clipping = msLayerGetProcessingKey( layer, "RENDERER_CLIPPING" );
+      MS_IMAGE_RENDERER(image)->pixel_clipping = MS_IMAGE_RENDERER(image)->pixel_clipping_limit > 0 &&
+          renderer_clipping && !strcasecmp(renderer_clipping, "ON");
       MS_IMAGE_RENDERER(image)->startLayer(image, map, layer);
     } else if( MS_RENDERER_IMAGEMAP(image->format) )
       msImageStartLayerIM(map, layer, image);
@@ -3190,7 +3278,13 @@ void msImageEndLayer(mapObj *map, layerObj *layer, imageObj *image)
 {
   if(image) {
     if( MS_RENDERER_PLUGIN(image->format) ) {
-      MS_IMAGE_RENDERER(image)->endLayer(image,map,layer);
+      rendererVTableObj *renderer = MS_IMAGE_RENDERER(image);
+      if(renderer->generalization_vertices_in > 0 && (layer->debug >= MS_DEBUGLEVEL_V || map->debug >= MS_DEBUGLEVEL_V))
+        msDebug("msImageEndLayer(%s): generalization at %g pixels kept %ld of %ld vertices\n",
+                layer->name ? layer->name : "(null)", renderer->generalization_tolerance,
+                renderer->generalization_vertices_out, renderer->generalization_vertices_in);
+      renderer->endLayer(image,map,layer);
+      renderer->pixel_clipping = MS_FALSE;
     }
   }
 }
@@ -509,9 +509,10 @@ int msDrawRasterLayerGDAL(mapObj *map, layerObj *layer, imageObj *image,
    * color table.
    */
   if( classified ) {
-    int c, color_count;
+    int c, color_count, bStoreLUT = MS_FALSE;
     const char* pszRangeColorspace = msLayerGetProcessingKey( layer, "RANGE_COLORSPACE" );
     colorspace iRangeColorspace;
+    char szLUTPrefix[64], *pszLUTKey, *pszClassKey;
 
 #ifndef NDEBUG
     cmap_set = TRUE;
@@ -537,6 +538,32 @@ int msDrawRasterLayerGDAL(mapObj *map, layerObj *layer, imageObj *image,
     }
 
     color_count = MIN(256,GDALGetColorEntryCount(hColorMap));
+
+    /*
+     * The classification only depends on the classes and on the color
+     * table, so it can be reused from a previous request.
+     */
+    snprintf( szLUTPrefix, sizeof(szLUTPrefix), "PCT:%d:%d,%d,%d:",
+              (int) iRangeColorspace, layer->offsite.red,
+              layer->offsite.green, layer->offsite.blue );
+    pszLUTKey = msStrdup( szLUTPrefix );
+    for(i=0; i < color_count; i++) {
+      GDALColorEntry sEntry;
+
+      GDALGetColorEntryAsRGB( hColorMap, i, &sEntry );
+      snprintf( szLUTPrefix, sizeof(szLUTPrefix), "%02x%02x%02x",
+                sEntry.c1 & 0xff, sEntry.c2 & 0xff, sEntry.c3 & 0xff );
+      pszLUTKey = msStringConcatenate( pszLUTKey, szLUTPrefix );
+    }
+    pszLUTKey = msStringConcatenate( pszLUTKey, "|" );
+    pszClassKey = msGetRasterClassKey( layer, pszLUTKey );
+    msFree( pszLUTKey );
+
+    if( msRasterClassLUTFetch( pszClassKey, &(rb_cmap[0][0]), MAXCOLORS ) )
+      color_count = 0;
+    else
+      bStoreLUT = MS_TRUE;
+
     for(i=0; i < color_count; i++) {
       colorObj pixel;
       int colormap_index;
@@ -595,6 +622,10 @@ int msDrawRasterLayerGDAL(mapObj *map, layerObj *layer, imageObj *image,
         }
       }
     }
+
+    if( bStoreLUT )
+      msRasterClassLUTStore( pszClassKey, &(rb_cmap[0][0]), MAXCOLORS );
+    msFree( pszClassKey );
   } else if( hBand2 == NULL && hColorMap != NULL && rb->type == MS_BUFFER_BYTE_RGBA ) {
     int color_count;
 #ifndef NDEBUG
@@ -1889,16 +1920,166 @@ msDrawRasterLayerGDAL_RawMode(
   return 0;
 }
 
+/************************************************************************/
+/*                           ClassifyValue()                            */
+/*                                                                      */
+/*      Classify one raw pixel value and record the resulting color     */
+/*      at index iEntry of the rb_cmap planes.  Unclassified values     */
+/*      are left untouched (transparent).                               */
+/************************************************************************/
+
+static void ClassifyValue( layerObj *layer, double dfValue,
+                           unsigned char *rb_cmap[4], int iEntry )
+{
+  int c, s;
+
+  c = msGetClass_FloatRGB(layer, (float) dfValue, -1, -1, -1);
+  if( c == -1 )
+    return;
+
+  /* change colour based on colour range? */
+  for(s=0; s<layer->class[c]->numstyles; s++) {
+    if( MS_VALID_COLOR(layer->class[c]->styles[s]->mincolor)
+        && MS_VALID_COLOR(layer->class[c]->styles[s]->maxcolor) )
+      msValueToRange(layer->class[c]->styles[s],dfValue, MS_COLORSPACE_RGB);
+  }
+  if( MS_TRANSPARENT_COLOR(layer->class[c]->styles[0]->color) ) {
+    /* leave it transparent */
+  } else if( MS_VALID_COLOR(layer->class[c]->styles[0]->color)) {
+    /* use class color */
+    rb_cmap[0][iEntry] = layer->class[c]->styles[0]->color.red;
+    rb_cmap[1][iEntry] = layer->class[c]->styles[0]->color.green;
+    rb_cmap[2][iEntry] = layer->class[c]->styles[0]->color.blue;
+    rb_cmap[3][iEntry] = (255*layer->class[c]->styles[0]->opacity / 100);
+  }
+}
+
+/************************************************************************/
+/*                   msDrawRasterLayerGDAL_16BitLUT()                   */
+/*                                                                      */
+/*      Classification of Int16 and UInt16 rasters without any          */
+/*      SCALE or SCALE_BUCKETS processing option.  In that case         */
+/*      every bucket is exactly one pixel value, so we classify the     */
+/*      whole 65536 value domain once, cache the table across           */
+/*      requests, and index it directly with the raw pixels.            */
+/************************************************************************/
+
+#define LUT16_SIZE 65536
+
+static int
+msDrawRasterLayerGDAL_16BitLUT(
+  layerObj *layer, rasterBufferObj *rb, rasterBufferObj *mask_rb,
+  GDALRasterBandH hBand, GDALDataType eDataType,
+  int src_xoff, int src_yoff, int src_xsize, int src_ysize,
+  int dst_xoff, int dst_yoff, int dst_xsize, int dst_ysize )
+
+{
+  GUInt16 *panRawData;
+  unsigned char *pabyLUT, *rb_cmap[4];
+  int i, j, k, nXor, nNoDataIndex = -1, bGotNoData = FALSE, bCached;
+  float fNoDataValue;
+  char *pszKey;
+  CPLErr eErr;
+
+  /* -------------------------------------------------------------------- */
+  /*      Read the requested data with its native type.  Int16 values     */
+  /*      are turned into table indexes by flipping the sign bit.         */
+  /* -------------------------------------------------------------------- */
+  panRawData = (GUInt16 *) malloc(sizeof(GUInt16) * dst_xsize * dst_ysize );
+  pabyLUT = (unsigned char *) calloc(4, LUT16_SIZE);
+  if( panRawData == NULL || pabyLUT == NULL ) {
+    free( panRawData );
+    free( pabyLUT );
+    msSetError( MS_MEMERR, "Out of memory allocating working buffer.",
+                "msDrawRasterLayerGDAL_16BitLUT()" );
+    return -1;
+  }
+
+  eErr = GDALRasterIO( hBand, GF_Read,
+                       src_xoff, src_yoff, src_xsize, src_ysize,
+                       panRawData, dst_xsize, dst_ysize, eDataType, 0, 0 );
+
+  if( eErr != CE_None ) {
+    free( panRawData );
+    free( pabyLUT );
+    msSetError( MS_IOERR, "GDALRasterIO() failed: %s",
+                "msDrawRasterLayerGDAL_16BitLUT()",
+                CPLGetLastErrorMsg() );
+    return -1;
+  }
+
+  nXor = (eDataType == GDT_Int16) ? 0x8000 : 0;
+
+  fNoDataValue = (float) msGetGDALNoDataValue( layer, hBand, &bGotNoData );
+  if( bGotNoData && fNoDataValue == floor(fNoDataValue) ) {
+    double dfIndex = fNoDataValue + ((eDataType == GDT_Int16) ? 32768 : 0);
+    if( dfIndex >= 0 && dfIndex < LUT16_SIZE )
+      nNoDataIndex = (int) dfIndex;
+  }
+
+  for( i = 0; i < 4; i++ )
+    rb_cmap[i] = pabyLUT + i * LUT16_SIZE;
+
+  /* ==================================================================== */
+  /*      Fetch or compute the classification lookup table.               */
+  /* ==================================================================== */
+  pszKey = msGetRasterClassKey( layer, GDALGetDataTypeName(eDataType) );
+  bCached = msRasterClassLUTFetch( pszKey, pabyLUT, LUT16_SIZE );
+  if( !bCached ) {
+    int nOffset = (eDataType == GDT_Int16) ? -32768 : 0;
+
+    for( i = 0; i < LUT16_SIZE; i++ )
+      ClassifyValue( layer, (double) (i + nOffset), rb_cmap, i );
+
+    msRasterClassLUTStore( pszKey, pabyLUT, LUT16_SIZE );
+  }
+  msFree( pszKey );
+
+  if( layer->debug > 0 )
+    msDebug( "msDrawRasterLayerGDAL_16BitLUT(%s): %s %s lookup table.\n",
+             layer->name, bCached ? "reusing cached" : "computed",
+             GDALGetDataTypeName(eDataType) );
+
+  /* ==================================================================== */
+  /*      Apply it to the working imageObj.                               */
+  /* ==================================================================== */
+  k = 0;
+
+  for( i = dst_yoff; i < dst_yoff + dst_ysize; i++ ) {
+    for( j = dst_xoff; j < dst_xoff + dst_xsize; j++ ) {
+      int iIndex = panRawData[k++] ^ nXor;
+
+      /* currently we never have partial alpha so keep simple */
+      if( iIndex == nNoDataIndex || rb_cmap[3][iIndex] == 0 )
+        continue;
+
+      if(SKIP_MASK(j,i))
+        continue;
+
+      RB_SET_PIXEL( rb, j, i,
+                    rb_cmap[0][iIndex],
+                    rb_cmap[1][iIndex],
+                    rb_cmap[2][iIndex],
+                    rb_cmap[3][iIndex] );
+    }
+  }
+
+  free( panRawData );
+  free( pabyLUT );
+
+  return 0;
+}
+
 /************************************************************************/
 /*              msDrawRasterLayerGDAL_16BitClassifcation()              */
 /*                                                                      */
 /*      Handle the rendering of rasters going through a 16bit           */
 /*      classification lookup instead of the more common 8bit one.      */
 /*                                                                      */
-/*      Currently we are using one data path where we load the          */
+/*      Unscaled Int16 and UInt16 rasters are handed to                 */
+/*      msDrawRasterLayerGDAL_16BitLUT().  Otherwise we load the        */
 /*      raster into a floating point buffer, and then scale to          */
-/*      16bit.  Eventually we could add optimizations for some of       */
-/*      the 16bit cases at the cost of some complication.               */
+/*      16bit.                                                          */
 /************************************************************************/
 
 static int
@@ -1916,7 +2097,7 @@ msDrawRasterLayerGDAL_16BitClassification(
   float fDataMin=0.0, fDataMax=255.0, fNoDataValue;
   const char *pszScaleInfo;
   const char *pszBuckets;
-  int  *cmap, c, j, k, bGotNoData = FALSE, bGotFirstValue;
+  int  j, k, bGotNoData = FALSE, bGotFirstValue;
   unsigned char *rb_cmap[4];
   CPLErr eErr;
   rasterBufferObj *mask_rb = NULL;
@@ -1933,6 +2114,17 @@ msDrawRasterLayerGDAL_16BitClassification(
 
   assert( rb->type == MS_BUFFER_BYTE_RGBA );
 
+  eDataType = GDALGetRasterDataType( hBand );
+  pszBuckets = CSLFetchNameValue( layer->processing, "SCALE_BUCKETS" );
+  pszScaleInfo = CSLFetchNameValue( layer->processing, "SCALE" );
+
+  if( (eDataType == GDT_Int16 || eDataType == GDT_UInt16)
+      && pszBuckets == NULL && pszScaleInfo == NULL )
+    return msDrawRasterLayerGDAL_16BitLUT(
+             layer, rb, mask_rb, hBand, eDataType,
+             src_xoff, src_yoff, src_xsize, src_ysize,
+             dst_xoff, dst_yoff, dst_xsize, dst_ysize );
+
   /* ==================================================================== */
   /*      Read the requested data in one gulp into a floating point       */
   /*      buffer.                                                         */
@@ -1961,7 +2153,6 @@ msDrawRasterLayerGDAL_16BitClassification(
   /* ==================================================================== */
   /*      Determine scaling.                                              */
   /* ==================================================================== */
-  eDataType = GDALGetRasterDataType( hBand );
 
   /* -------------------------------------------------------------------- */
   /*      Scan for absolute min/max of this block.                        */
@@ -1982,11 +2173,8 @@ msDrawRasterLayerGDAL_16BitClassification(
   }
 
   /* -------------------------------------------------------------------- */
-  /*      Fetch the scale processing option.                              */
+  /*      Parse the scale processing option.                              */
   /* -------------------------------------------------------------------- */
-  pszBuckets = CSLFetchNameValue( layer->processing, "SCALE_BUCKETS" );
-  pszScaleInfo = CSLFetchNameValue( layer->processing, "SCALE" );
-
   if( pszScaleInfo != NULL ) {
     char **papszTokens;
 
@@ -2072,7 +2260,6 @@ msDrawRasterLayerGDAL_16BitClassification(
   /*      Compute classification lookup table.                            */
   /* ==================================================================== */
 
-  cmap = (int *) msSmallCalloc(sizeof(int),nBucketCount);
   rb_cmap[0] = (unsigned char *) msSmallCalloc(1,nBucketCount);
   rb_cmap[1] = (unsigned char *) msSmallCalloc(1,nBucketCount);
   rb_cmap[2] = (unsigned char *) msSmallCalloc(1,nBucketCount);
@@ -2081,30 +2268,9 @@ msDrawRasterLayerGDAL_16BitClassification(
   for(i=0; i < nBucketCount; i++) {
     double dfOriginalValue;
 
-    cmap[i] = -1;
-
     dfOriginalValue = (i+0.5) / dfScaleRatio + dfScaleMin;
 
-    c = msGetClass_FloatRGB(layer, (float) dfOriginalValue, -1, -1, -1);
-    if( c != -1 ) {
-      int s;
-
-      /* change colour based on colour range? */
-      for(s=0; s<layer->class[c]->numstyles; s++) {
-        if( MS_VALID_COLOR(layer->class[c]->styles[s]->mincolor)
-            && MS_VALID_COLOR(layer->class[c]->styles[s]->maxcolor) )
-          msValueToRange(layer->class[c]->styles[s],dfOriginalValue, MS_COLORSPACE_RGB);
-      }
-      if( MS_TRANSPARENT_COLOR(layer->class[c]->styles[0]->color) ) {
-        /* leave it transparent */
-      } else if( MS_VALID_COLOR(layer->class[c]->styles[0]->color)) {
-        /* use class color */
-        rb_cmap[0][i] = layer->class[c]->styles[0]->color.red;
-        rb_cmap[1][i] = layer->class[c]->styles[0]->color.green;
-        rb_cmap[2][i] = layer->class[c]->styles[0]->color.blue;
-        rb_cmap[3][i] = (255*layer->class[c]->styles[0]->opacity / 100);
-      }
-    }
+    ClassifyValue( layer, dfOriginalValue, rb_cmap, i );
   }
 
   /* ==================================================================== */
@@ -2150,7 +2316,6 @@ msDrawRasterLayerGDAL_16BitClassification(
   /*      Cleanup                                                         */
   /* -------------------------------------------------------------------- */
   free( pafRawData );
-  free( cmap );
   free( rb_cmap[0] );
   free( rb_cmap[1] );
   free( rb_cmap[2] );
@@ -0,0 +1,1018 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  In-process columnar feature store layer (CONNECTIONTYPE FEATURESTORE).
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mapserver.h"
+#include "mapthread.h"
+
+/*
+** A FEATURESTORE layer serves the features of the shapefile named by DATA
+** from memory.  The shapefile is read once per process into coordinate
+** arrays, typed attribute columns and a packed R-tree, which are shared by
+** all layers (and threads) using the same file.
+**
+** The store is reloaded when the .shp or .dbf file changes (modification
+** time or size).  The new store replaces the old one in the cache, layers
+** still reading the old store keep it until they are closed.  Files should
+** be replaced with rename() rather than rewritten in place.
+*/
+
+#define MS_FEATURE_STORE_CACHE_SIZE 8  /* distinct files kept loaded */
+#define MS_FEATURE_STORE_NODE_SIZE 16  /* R-tree fan out */
+
+typedef struct {
+  char *name;
+  char type;        /* DBF field type */
+  int decimals;
+  double *numbers;  /* numeric columns, when every value reads back as "%.*f" */
+  int *offsets;     /* otherwise numfeatures+1 offsets of the values in text */
+  char *text;
+} featureStoreColumnObj;
+
+typedef struct {
+  rectObj bounds;
+  int index;        /* feature for leaves, first child otherwise */
+  int count;        /* number of children, 0 for leaves */
+} featureStoreNodeObj;
+
+typedef struct featureStoreObj {
+  char *path;       /* shapefile basename, the cache key */
+  time_t shpmtime, dbfmtime;
+  off_t shpsize, dbfsize;
+  int refcount;
+  struct featureStoreObj *next;
+
+  int numfeatures;
+  int shapetype;    /* MS_SHAPE_* of the non NULL features */
+  rectObj bounds;
+
+  /* geometries, partoffsets and pointoffsets are NULL when every feature is a single point */
+  int *partoffsets;     /* numfeatures+1 offsets into pointoffsets, no parts is a NULL shape */
+  int *pointoffsets;    /* numparts+1 offsets into x and y */
+  double *x, *y;
+  double *z, *m;        /* NULL unless the shapefile has Z or M values */
+  rectObj *featurebounds; /* NULL for single points */
+
+  int numcolumns;
+  featureStoreColumnObj *columns;
+
+  int numnodes, numlevels;
+  featureStoreNodeObj *nodes; /* leaves first, the root is the last node */
+} featureStoreObj;
+
+typedef struct {
+  featureStoreObj *store;
+  ms_bitarray status;
+  int lastshape;
+} featureStoreLayerInfo;
+
+static featureStoreObj *featureStoreCache = NULL; /* protected by TLOCK_FEATURESTORE */
+
+static void msFeatureStoreFree(featureStoreObj *store)
+{
+  int i;
+
+  if(!store) return;
+  msFree(store->path);
+  msFree(store->partoffsets);
+  msFree(store->pointoffsets);
+  msFree(store->x);
+  msFree(store->y);
+  msFree(store->z);
+  msFree(store->m);
+  msFree(store->featurebounds);
+  for(i=0; i<store->numcolumns; i++) {
+    msFree(store->columns[i].name);
+    msFree(store->columns[i].numbers);
+    msFree(store->columns[i].offsets);
+    msFree(store->columns[i].text);
+  }
+  msFree(store->columns);
+  msFree(store->nodes);
+  free(store);
+}
+
+/*
+** Packed R-tree.  Leaves are sorted along a Hilbert curve through the
+** centers of the feature bounds, and every level groups runs of
+** MS_FEATURE_STORE_NODE_SIZE consecutive nodes of the level below.
+*/
+typedef struct {
+  unsigned int hilbert;
+  int index;
+} featureStoreSortObj;
+
+static int msFeatureStoreCompareSort(const void *a, const void *b)
+{
+  const featureStoreSortObj *sa = (const featureStoreSortObj*)a, *sb = (const featureStoreSortObj*)b;
+  if(sa->hilbert != sb->hilbert)
+    return sa->hilbert < sb->hilbert ? -1 : 1;
+  return sa->index - sb->index;
+}
+
+/* distance of (x,y) along a Hilbert curve through a 65536x65536 grid */
+static unsigned int msFeatureStoreHilbert(unsigned int x, unsigned int y)
+{
+  unsigned int s, rx, ry, t, d = 0;
+
+  for(s=1<<15; s>0; s>>=1) {
+    rx = (x & s) > 0;
+    ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    if(ry == 0) {
+      if(rx == 1) {
+        x = 65535 - x;
+        y = 65535 - y;
+      }
+      t = x;
+      x = y;
+      y = t;
+    }
+  }
+  return d;
+}
+
+static void msFeatureStoreGetBounds(featureStoreObj *store, int i, rectObj *bounds)
+{
+  if(store->featurebounds) {
+    *bounds = store->featurebounds[i];
+  } else {
+    bounds->minx = bounds->maxx = store->x[i];
+    bounds->miny = bounds->maxy = store->y[i];
+  }
+}
+
+static int msFeatureStoreIsNull(featureStoreObj *store, int i)
+{
+  return store->partoffsets && store->partoffsets[i] == store->partoffsets[i+1];
+}
+
+static void msFeatureStoreBuildTree(featureStoreObj *store)
+{
+  featureStoreSortObj *sort;
+  double width, height;
+  int i, n = 0, m, start, end, pos;
+
+  sort = (featureStoreSortObj*)msSmallMalloc(sizeof(featureStoreSortObj) * MS_MAX(1, store->numfeatures));
+  width = store->bounds.maxx - store->bounds.minx;
+  height = store->bounds.maxy - store->bounds.miny;
+  for(i=0; i<store->numfeatures; i++) {
+    rectObj bounds;
+    double cx, cy;
+    if(msFeatureStoreIsNull(store, i))
+      continue;
+    msFeatureStoreGetBounds(store, i, &bounds);
+    cx = width > 0 ? ((bounds.minx + bounds.maxx) / 2 - store->bounds.minx) / width : 0;
+    cy = height > 0 ? ((bounds.miny + bounds.maxy) / 2 - store->bounds.miny) / height : 0;
+    sort[n].hilbert = msFeatureStoreHilbert((unsigned int)(MS_MAX(0, MS_MIN(1, cx)) * 65535),
+                                            (unsigned int)(MS_MAX(0, MS_MIN(1, cy)) * 65535));
+    sort[n].index = i;
+    n++;
+  }
+  qsort(sort, n, sizeof(featureStoreSortObj), msFeatureStoreCompareSort);
+
+  store->numnodes = n;
+  for(m=n; m>1; m=(m + MS_FEATURE_STORE_NODE_SIZE - 1) / MS_FEATURE_STORE_NODE_SIZE)
+    store->numnodes += (m + MS_FEATURE_STORE_NODE_SIZE - 1) / MS_FEATURE_STORE_NODE_SIZE;
+  store->numlevels = 0;
+  if(n == 0) {
+    free(sort);
+    return;
+  }
+
+  store->nodes = (featureStoreNodeObj*)msSmallMalloc(sizeof(featureStoreNodeObj) * store->numnodes);
+  for(i=0; i<n; i++) {
+    msFeatureStoreGetBounds(store, sort[i].index, &store->nodes[i].bounds);
+    store->nodes[i].index = sort[i].index;
+    store->nodes[i].count = 0;
+  }
+  free(sort);
+
+  start = 0;
+  end = pos = n;
+  store->numlevels = 1;
+  while(end - start > 1) {
+    for(i=start; i<end; i+=MS_FEATURE_STORE_NODE_SIZE) {
+      featureStoreNodeObj *node = &store->nodes[pos++];
+      int j;
+      node->index = i;
+      node->count = MS_MIN(MS_FEATURE_STORE_NODE_SIZE, end - i);
+      node->bounds = store->nodes[i].bounds;
+      for(j=i+1; j<i+node->count; j++)
+        msMergeRect(&node->bounds, &store->nodes[j].bounds);
+    }
+    start = end;
+    end = pos;
+    store->numlevels++;
+  }
+}
+
+/* set the bits of the features whose bounds overlap rect */
+static void msFeatureStoreSearchTree(featureStoreObj *store, rectObj *rect, ms_bitarray status)
+{
+  int *stack, sp = 0;
+
+  if(store->numnodes == 0)
+    return;
+
+  stack = (int*)msSmallMalloc(sizeof(int) * (store->numlevels + 1) * MS_FEATURE_STORE_NODE_SIZE);
+  stack[sp++] = store->numnodes - 1;
+  while(sp > 0) {
+    featureStoreNodeObj *node = &store->nodes[stack[--sp]];
+    int i;
+    if(msRectOverlap(&node->bounds, rect) != MS_TRUE)
+      continue;
+    if(node->count == 0) {
+      msSetBit(status, node->index, 1);
+      continue;
+    }
+    for(i=node->index; i<node->index+node->count; i++)
+      stack[sp++] = i;
+  }
+  free(stack);
+}
+
+/*
+** Loading.  Columns are filled row by row, so the .dbf is read sequentially.
+*/
+typedef struct {
+  double *numbers;
+  int isnumber;
+  int *offsets;
+  char *text;
+  size_t textsize, textallocated;
+} featureStoreColumnBuilder;
+
+static void msFeatureStoreAppendValue(featureStoreColumnObj *column, featureStoreColumnBuilder *builder,
+                                      int i, const char *value)
+{
+  size_t length = strlen(value) + 1;
+
+  if(builder->isnumber) {
+    char buffer[256];
+    double number = strtod(value, NULL);
+    int n = snprintf(buffer, sizeof(buffer), "%.*f", column->decimals, number);
+    if(n > 0 && n < (int)sizeof(buffer) && strcmp(buffer, value) == 0)
+      builder->numbers[i] = number;
+    else
+      builder->isnumber = MS_FALSE;
+  }
+
+  /* the text is kept until the whole column is known to be numeric */
+  if(builder->textsize + length > builder->textallocated) {
+    builder->textallocated = MS_MAX(builder->textallocated * 2, builder->textsize + length + 1024);
+    builder->text = (char*)msSmallRealloc(builder->text, builder->textallocated);
+  }
+  builder->offsets[i] = (int)builder->textsize;
+  memcpy(builder->text + builder->textsize, value, length);
+  builder->textsize += length;
+}
+
+static featureStoreObj *msFeatureStoreLoad(const char *path)
+{
+  shapefileObj shpfile;
+  featureStoreObj *store;
+  featureStoreColumnBuilder *builders = NULL;
+  shapeObj shape;
+  int i, j, k, numparts = 0, numpoints = 0, partsallocated = 0, pointsallocated = 0;
+  int singlepoints = MS_TRUE, hasz = MS_FALSE;
+
+  if(msShapefileOpen(&shpfile, "rb", path, MS_TRUE) == -1)
+    return NULL;
+
+  store = (featureStoreObj*)msSmallCalloc(1, sizeof(featureStoreObj));
+  store->numfeatures = shpfile.numshapes;
+  store->bounds = shpfile.bounds;
+  store->shapetype = MS_SHAPE_NULL;
+
+#ifdef USE_POINT_Z_M
+  hasz = (shpfile.type == SHP_POINTZ || shpfile.type == SHP_ARCZ || shpfile.type == SHP_POLYGONZ ||
+          shpfile.type == SHP_MULTIPOINTZ || shpfile.type == SHP_POINTM || shpfile.type == SHP_ARCM ||
+          shpfile.type == SHP_POLYGONM || shpfile.type == SHP_MULTIPOINTM);
+#endif
+
+  /* geometries */
+  store->partoffsets = (int*)msSmallMalloc(sizeof(int) * (store->numfeatures + 1));
+  store->featurebounds = (rectObj*)msSmallMalloc(sizeof(rectObj) * MS_MAX(1, store->numfeatures));
+  store->pointoffsets = (int*)msSmallMalloc(sizeof(int));
+  store->pointoffsets[0] = 0;
+  for(i=0; i<store->numfeatures; i++) {
+    msSHPReadShape(shpfile.hSHP, i, &shape);
+    store->partoffsets[i] = numparts;
+    store->featurebounds[i] = shape.bounds;
+    if(shape.type == MS_SHAPE_NULL) {
+      singlepoints = MS_FALSE;
+      msFreeShape(&shape);
+      continue;
+    }
+    store->shapetype = shape.type;
+    if(shape.numlines != 1 || shape.line[0].numpoints != 1)
+      singlepoints = MS_FALSE;
+
+    if(numparts + shape.numlines >= partsallocated) {
+      partsallocated = MS_MAX(partsallocated * 2, numparts + shape.numlines + 1024);
+      store->pointoffsets = (int*)msSmallRealloc(store->pointoffsets, sizeof(int) * (partsallocated + 1));
+    }
+    for(j=0; j<shape.numlines; j++) {
+      lineObj *line = &shape.line[j];
+      if(numpoints + line->numpoints > pointsallocated) {
+        pointsallocated = MS_MAX(pointsallocated * 2, numpoints + line->numpoints + 4096);
+        store->x = (double*)msSmallRealloc(store->x, sizeof(double) * pointsallocated);
+        store->y = (double*)msSmallRealloc(store->y, sizeof(double) * pointsallocated);
+        if(hasz) {
+          store->z = (double*)msSmallRealloc(store->z, sizeof(double) * pointsallocated);
+          store->m = (double*)msSmallRealloc(store->m, sizeof(double) * pointsallocated);
+        }
+      }
+      for(k=0; k<line->numpoints; k++) {
+        store->x[numpoints + k] = line->point[k].x;
+        store->y[numpoints + k] = line->point[k].y;
+#ifdef USE_POINT_Z_M
+        if(hasz) {
+          store->z[numpoints + k] = line->point[k].z;
+          store->m[numpoints + k] = line->point[k].m;
+        }
+#endif
+      }
+      numpoints += line->numpoints;
+      store->pointoffsets[++numparts] = numpoints;
+    }
+    msFreeShape(&shape);
+  }
+  store->partoffsets[store->numfeatures] = numparts;
+
+  if(singlepoints) {
+    msFree(store->partoffsets);
+    msFree(store->pointoffsets);
+    msFree(store->featurebounds);
+    store->partoffsets = store->pointoffsets = NULL;
+    store->featurebounds = NULL;
+  }
+
+  /* attributes */
+  store->numcolumns = msDBFGetFieldCount(shpfile.hDBF);
+  if(store->numcolumns > 0) {
+    store->columns = (featureStoreColumnObj*)msSmallCalloc(store->numcolumns, sizeof(featureStoreColumnObj));
+    builders = (featureStoreColumnBuilder*)msSmallCalloc(store->numcolumns, sizeof(featureStoreColumnBuilder));
+  }
+  for(j=0; j<store->numcolumns; j++) {
+    char name[32];
+    int width;
+    msDBFGetFieldInfo(shpfile.hDBF, j, name, &width, &store->columns[j].decimals);
+    store->columns[j].name = msStrdup(name);
+    store->columns[j].type = shpfile.hDBF->pachFieldType[j];
+    builders[j].isnumber = (store->columns[j].type == 'N' || store->columns[j].type == 'F');
+    if(builders[j].isnumber)
+      builders[j].numbers = (double*)msSmallMalloc(sizeof(double) * MS_MAX(1, store->numfeatures));
+    builders[j].offsets = (int*)msSmallMalloc(sizeof(int) * (store->numfeatures + 1));
+  }
+  for(i=0; i<store->numfeatures; i++) {
+    for(j=0; j<store->numcolumns; j++) {
+      const char *value = msDBFReadStringAttribute(shpfile.hDBF, i, j);
+      if(!value) {
+        for(j=0; j<store->numcolumns; j++) {
+          msFree(builders[j].numbers);
+          msFree(builders[j].offsets);
+          msFree(builders[j].text);
+        }
+        free(builders);
+        msShapefileClose(&shpfile);
+        msFeatureStoreFree(store);
+        return NULL;
+      }
+      msFeatureStoreAppendValue(&store->columns[j], &builders[j], i, value);
+    }
+  }
+  for(j=0; j<store->numcolumns; j++) {
+    if(builders[j].isnumber) {
+      store->columns[j].numbers = builders[j].numbers;
+      free(builders[j].offsets);
+      msFree(builders[j].text);
+    } else {
+      msFree(builders[j].numbers);
+      builders[j].offsets[store->numfeatures] = (int)builders[j].textsize;
+      store->columns[j].offsets = builders[j].offsets;
+      store->columns[j].text = builders[j].text;
+    }
+  }
+  msFree(builders);
+  msShapefileClose(&shpfile);
+
+  msFeatureStoreBuildTree(store);
+
+  return store;
+}
+
+/* stat() the .shp and .dbf files of the shapefile basename path */
+static int msFeatureStoreStat(const char *path, struct stat *shpstat, struct stat *dbfstat)
+{
+  char filename[MS_MAXPATHLEN];
+
+  snprintf(filename, sizeof(filename), "%s.shp", path);
+  if(stat(filename, shpstat) != 0) {
+    snprintf(filename, sizeof(filename), "%s.SHP", path);
+    if(stat(filename, shpstat) != 0)
+      return MS_FAILURE;
+  }
+  snprintf(filename, sizeof(filename), "%s.dbf", path);
+  if(stat(filename, dbfstat) != 0) {
+    snprintf(filename, sizeof(filename), "%s.DBF", path);
+    if(stat(filename, dbfstat) != 0)
+      return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+/*
+** Returns a reference to the store of the shapefile basename path, loading it
+** if needed.  The reference must be given back with msFeatureStoreRelease().
+*/
+static featureStoreObj *msFeatureStoreAcquire(const char *path, int debug)
+{
+  struct stat shpstat, dbfstat;
+  featureStoreObj *store, *previous, *newstore;
+  int count;
+
+  if(msFeatureStoreStat(path, &shpstat, &dbfstat) != MS_SUCCESS) {
+    msSetError(MS_IOERR, "(%s)", "msFeatureStoreAcquire()", path);
+    return NULL;
+  }
+
+  msAcquireLock(TLOCK_FEATURESTORE);
+  for(store=featureStoreCache, previous=NULL; store!=NULL; previous=store, store=store->next) {
+    if(strcmp(store->path, path) == 0) break;
+  }
+
+  if(store && (store->shpmtime != shpstat.st_mtime || store->shpsize != shpstat.st_size ||
+               store->dbfmtime != dbfstat.st_mtime || store->dbfsize != dbfstat.st_size)) { /* stale */
+    if(previous) previous->next = store->next;
+    else featureStoreCache = store->next;
+    if(--store->refcount == 0) msFeatureStoreFree(store);
+    store = NULL;
+  }
+
+  if(store) { /* move to the front of the list */
+    if(previous) {
+      previous->next = store->next;
+      store->next = featureStoreCache;
+      featureStoreCache = store;
+    }
+    store->refcount++;
+    msReleaseLock(TLOCK_FEATURESTORE);
+    return store;
+  }
+  msReleaseLock(TLOCK_FEATURESTORE);
+
+  /* load outside of the lock, concurrent loads of the same file are harmless */
+  if(debug)
+    msDebug("msFeatureStoreAcquire(): loading %s\n", path);
+  newstore = msFeatureStoreLoad(path);
+  if(!newstore) return NULL;
+
+  newstore->path = msStrdup(path);
+  newstore->shpmtime = shpstat.st_mtime;
+  newstore->shpsize = shpstat.st_size;
+  newstore->dbfmtime = dbfstat.st_mtime;
+  newstore->dbfsize = dbfstat.st_size;
+  newstore->refcount = 2; /* one for the cache, one for the caller */
+
+  msAcquireLock(TLOCK_FEATURESTORE);
+  newstore->next = featureStoreCache;
+  featureStoreCache = newstore;
+
+  /* drop older copies of this file and the least recently used stores */
+  count = 1;
+  previous = newstore;
+  for(store=newstore->next; store!=NULL; store=previous->next) {
+    if(count >= MS_FEATURE_STORE_CACHE_SIZE || strcmp(store->path, path) == 0) {
+      previous->next = store->next;
+      if(--store->refcount == 0) msFeatureStoreFree(store);
+    } else {
+      previous = store;
+      count++;
+    }
+  }
+  msReleaseLock(TLOCK_FEATURESTORE);
+
+  return newstore;
+}
+
+static void msFeatureStoreRelease(featureStoreObj *store)
+{
+  if(!store) return;
+
+  msAcquireLock(TLOCK_FEATURESTORE);
+  if(--store->refcount == 0) msFeatureStoreFree(store);
+  msReleaseLock(TLOCK_FEATURESTORE);
+}
+
+/* free the cached stores, called from msCleanup() */
+void msFeatureStoreCleanup(void)
+{
+  featureStoreObj *store;
+
+  msAcquireLock(TLOCK_FEATURESTORE);
+  while(featureStoreCache) {
+    store = featureStoreCache;
+    featureStoreCache = store->next;
+    if(--store->refcount == 0) msFeatureStoreFree(store);
+  }
+  msReleaseLock(TLOCK_FEATURESTORE);
+}
+
+/*
+** Reading features.
+*/
+static char *msFeatureStoreGetValue(featureStoreColumnObj *column, int i)
+{
+  char buffer[256];
+
+  if(column->numbers) {
+    snprintf(buffer, sizeof(buffer), "%.*f", column->decimals, column->numbers[i]);
+    return msStrdup(buffer);
+  }
+  return msStrdup(column->text + column->offsets[i]);
+}
+
+static int msFeatureStoreReadShape(layerObj *layer, featureStoreObj *store, int i, shapeObj *shape)
+{
+  shapeArenaObj *arena = shape->arena;
+  int *iteminfo = (int*)layer->iteminfo;
+  int j, k, firstpart, numparts;
+
+  msInitShape(shape);
+  shape->arena = arena; /* vertices are read into it */
+
+  if(store->partoffsets) {
+    firstpart = store->partoffsets[i];
+    numparts = store->partoffsets[i+1] - firstpart;
+  } else {
+    firstpart = i;
+    numparts = 1;
+  }
+  if(numparts == 0) /* NULL shape */
+    return MS_SUCCESS;
+
+  shape->line = (lineObj*)msShapeAllocStorage(shape, sizeof(lineObj) * numparts);
+  MS_CHECK_ALLOC(shape->line, sizeof(lineObj) * numparts, MS_FAILURE);
+  for(j=0; j<numparts; j++) {
+    int first = store->pointoffsets ? store->pointoffsets[firstpart + j] : i;
+    int numpoints = store->pointoffsets ? store->pointoffsets[firstpart + j + 1] - first : 1;
+    lineObj *line = &shape->line[j];
+
+    line->numpoints = numpoints;
+    line->point = (pointObj*)msShapeAllocStorage(shape, sizeof(pointObj) * numpoints);
+    if(!line->point) {
+      shape->numlines = j;
+      msFreeShape(shape);
+      msSetError(MS_MEMERR, "Out of memory", "msFeatureStoreReadShape()");
+      return MS_FAILURE;
+    }
+    for(k=0; k<numpoints; k++) {
+      line->point[k].x = store->x[first + k];
+      line->point[k].y = store->y[first + k];
+#ifdef USE_POINT_Z_M
+      line->point[k].z = store->z ? store->z[first + k] : 0;
+      line->point[k].m = store->m ? store->m[first + k] : 0;
+#endif
+    }
+    shape->numlines++;
+  }
+  shape->type = store->shapetype;
+  msFeatureStoreGetBounds(store, i, &shape->bounds);
+  shape->index = i;
+
+  if(layer->numitems > 0 && iteminfo) {
+    shape->values = (char**)msSmallMalloc(sizeof(char*) * layer->numitems);
+    for(j=0; j<layer->numitems; j++)
+      shape->values[j] = msFeatureStoreGetValue(&store->columns[iteminfo[j]], i);
+    shape->numvalues = layer->numitems;
+  }
+
+  return MS_SUCCESS;
+}
+
+/*
+** Evaluate the layer FILTER on the attribute columns when it is a conjunction
+** of comparisons between an attribute and a literal, clearing the status bits
+** of the features failing it.  Other filters are left to msLayerNextShape(),
+** which evaluates this one again too: this only saves building shapes.
+*/
+#define MS_FEATURE_STORE_MAX_TERMS 16
+
+typedef struct {
+  featureStoreColumnObj *column;
+  int comparison;
+  int isnumber;
+  double number;
+  const char *string;
+} featureStoreTermObj;
+
+static int msFeatureStoreParseFilter(layerObj *layer, featureStoreObj *store, featureStoreTermObj *terms)
+{
+  tokenListNodeObjPtr node;
+  int numterms = 0, *iteminfo = (int*)layer->iteminfo;
+
+  if(layer->filter.type != MS_EXPRESSION || !layer->filter.tokens || !iteminfo)
+    return 0;
+
+  node = layer->filter.tokens;
+  while(node) {
+    featureStoreTermObj *term;
+    tokenListNodeObjPtr binding, comparison, literal;
+
+    while(node && node->token == '(')
+      node = node->next;
+    if(!node || !node->next || !node->next->next || numterms == MS_FEATURE_STORE_MAX_TERMS)
+      return 0;
+    binding = node;
+    comparison = node->next;
+    literal = node->next->next;
+    if(comparison->token < MS_TOKEN_COMPARISON_EQ || comparison->token > MS_TOKEN_COMPARISON_GE)
+      return 0;
+
+    term = &terms[numterms++];
+    term->comparison = comparison->token;
+    if((binding->token == MS_TOKEN_BINDING_DOUBLE || binding->token == MS_TOKEN_BINDING_INTEGER) &&
+        literal->token == MS_TOKEN_LITERAL_NUMBER) {
+      term->isnumber = MS_TRUE;
+      term->number = literal->tokenval.dblval;
+    } else if(binding->token == MS_TOKEN_BINDING_STRING && literal->token == MS_TOKEN_LITERAL_STRING &&
+              (comparison->token == MS_TOKEN_COMPARISON_EQ || comparison->token == MS_TOKEN_COMPARISON_NE)) {
+      term->isnumber = MS_FALSE;
+      term->string = literal->tokenval.strval;
+    } else
+      return 0;
+    if(binding->tokenval.bindval.index < 0 || binding->tokenval.bindval.index >= layer->numitems)
+      return 0;
+    term->column = &store->columns[iteminfo[binding->tokenval.bindval.index]];
+    if(!term->isnumber && term->column->numbers)
+      return 0; /* would need formatting every value */
+
+    node = literal->next;
+    while(node && node->token == ')')
+      node = node->next;
+    if(node) {
+      if(node->token != MS_TOKEN_LOGICAL_AND)
+        return 0;
+      node = node->next;
+    }
+  }
+
+  return numterms;
+}
+
+static int msFeatureStoreEvalTerm(featureStoreTermObj *term, int i)
+{
+  if(term->isnumber) {
+    /* same as msEvalExpression(): atof() of the value */
+    double value = term->column->numbers ? term->column->numbers[i] : atof(term->column->text + term->column->offsets[i]);
+    switch(term->comparison) {
+      case MS_TOKEN_COMPARISON_EQ: return value == term->number;
+      case MS_TOKEN_COMPARISON_NE: return value != term->number;
+      case MS_TOKEN_COMPARISON_GT: return value > term->number;
+      case MS_TOKEN_COMPARISON_LT: return value < term->number;
+      case MS_TOKEN_COMPARISON_LE: return value <= term->number;
+      case MS_TOKEN_COMPARISON_GE: return value >= term->number;
+    }
+  } else {
+    int equal = strcmp(term->column->text + term->column->offsets[i], term->string) == 0;
+    return term->comparison == MS_TOKEN_COMPARISON_EQ ? equal : !equal;
+  }
+  return MS_TRUE;
+}
+
+static void msFeatureStoreFilter(layerObj *layer, featureStoreObj *store, ms_bitarray status)
+{
+  featureStoreTermObj terms[MS_FEATURE_STORE_MAX_TERMS];
+  int numterms, i, j;
+
+  if((numterms = msFeatureStoreParseFilter(layer, store, terms)) == 0)
+    return;
+
+  for(i=msGetNextBit(status, 0, store->numfeatures); i!=-1; i=msGetNextBit(status, i+1, store->numfeatures)) {
+    for(j=0; j<numterms; j++) {
+      if(!msFeatureStoreEvalTerm(&terms[j], i)) {
+        msSetBit(status, i, 0);
+        break;
+      }
+    }
+  }
+}
+
+/*
+** FEATURESTORE layer virtual table functions
+*/
+void msFeatureStoreLayerFreeItemInfo(layerObj *layer)
+{
+  if(layer->iteminfo) {
+    free(layer->iteminfo);
+    layer->iteminfo = NULL;
+  }
+}
+
+int msFeatureStoreLayerInitItemInfo(layerObj *layer)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+  int i, j, *iteminfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerInitItemInfo()");
+    return MS_FAILURE;
+  }
+
+  msFeatureStoreLayerFreeItemInfo(layer);
+  if(layer->numitems == 0)
+    return MS_SUCCESS;
+
+  iteminfo = (int*)msSmallMalloc(sizeof(int) * layer->numitems);
+  for(i=0; i<layer->numitems; i++) {
+    for(j=0; j<layerinfo->store->numcolumns; j++) {
+      if(strcasecmp(layer->items[i], layerinfo->store->columns[j].name) == 0)
+        break;
+    }
+    if(j == layerinfo->store->numcolumns) {
+      msSetError(MS_MISCERR, "Item '%s' not found.", "msFeatureStoreLayerInitItemInfo()", layer->items[i]);
+      free(iteminfo);
+      return MS_FAILURE;
+    }
+    iteminfo[i] = j;
+  }
+  layer->iteminfo = iteminfo;
+
+  return MS_SUCCESS;
+}
+
+int msFeatureStoreLayerOpen(layerObj *layer)
+{
+  char szPath[MS_MAXPATHLEN];
+  featureStoreLayerInfo *layerinfo;
+  featureStoreObj *store;
+  struct stat shpstat, dbfstat;
+  size_t length;
+
+  if(layer->layerinfo) return MS_SUCCESS; /* layer already open */
+
+  if(msCheckParentPointer(layer->map, "map") == MS_FAILURE)
+    return MS_FAILURE;
+
+  if(!layer->data) {
+    msSetError(MS_MISCERR, "DATA must name a shapefile.", "msFeatureStoreLayerOpen()");
+    return MS_FAILURE;
+  }
+
+  /* the cache is keyed on the shapefile basename */
+  msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, layer->data);
+  length = strlen(szPath);
+  if(length > 4 && strcasecmp(szPath + length - 4, ".shp") == 0)
+    szPath[length - 4] = '\0';
+  if(msFeatureStoreStat(szPath, &shpstat, &dbfstat) != MS_SUCCESS) {
+    msBuildPath(szPath, layer->map->mappath, layer->data);
+    length = strlen(szPath);
+    if(length > 4 && strcasecmp(szPath + length - 4, ".shp") == 0)
+      szPath[length - 4] = '\0';
+  }
+
+  store = msFeatureStoreAcquire(szPath, layer->debug);
+  if(!store)
+    return MS_FAILURE;
+
+  layerinfo = (featureStoreLayerInfo*)msSmallCalloc(1, sizeof(featureStoreLayerInfo));
+  layerinfo->store = store;
+  layerinfo->lastshape = -1;
+  layer->layerinfo = layerinfo;
+
+  return MS_SUCCESS;
+}
+
+int msFeatureStoreLayerIsOpen(layerObj *layer)
+{
+  if(layer->layerinfo)
+    return MS_TRUE;
+  else
+    return MS_FALSE;
+}
+
+int msFeatureStoreLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+  featureStoreObj *store;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerWhichShapes()");
+    return MS_FAILURE;
+  }
+  store = layerinfo->store;
+
+  free(layerinfo->status);
+  layerinfo->status = NULL;
+  layerinfo->lastshape = -1;
+
+  if(msRectOverlap(&store->bounds, &rect) != MS_TRUE)
+    return MS_DONE;
+
+  layerinfo->status = msAllocBitArray(MS_MAX(1, store->numfeatures));
+  if(!layerinfo->status) {
+    msSetError(MS_MEMERR, NULL, "msFeatureStoreLayerWhichShapes()");
+    return MS_FAILURE;
+  }
+  if(msRectContained(&store->bounds, &rect) == MS_TRUE)
+    msSetAllBits(layerinfo->status, store->numfeatures, 1);
+  else
+    msFeatureStoreSearchTree(store, &rect, layerinfo->status);
+
+  msFeatureStoreFilter(layer, store, layerinfo->status);
+
+  return MS_SUCCESS;
+}
+
+int msFeatureStoreLayerNextShape(layerObj *layer, shapeObj *shape)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+  featureStoreObj *store;
+  int i;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerNextShape()");
+    return MS_FAILURE;
+  }
+  store = layerinfo->store;
+  if(!layerinfo->status)
+    return MS_DONE;
+
+  do {
+    i = msGetNextBit(layerinfo->status, layerinfo->lastshape + 1, store->numfeatures);
+    layerinfo->lastshape = i;
+    if(i == -1) return MS_DONE; /* nothing else to read */
+  } while(msFeatureStoreIsNull(store, i)); /* skip NULL shapes */
+
+  return msFeatureStoreReadShape(layer, store, i, shape);
+}
+
+int msFeatureStoreLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+  featureStoreObj *store;
+  int i;
+
+  *numshapes = 0;
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerNextShapes()");
+    return MS_FAILURE;
+  }
+  store = layerinfo->store;
+  if(!layerinfo->status)
+    return MS_DONE;
+
+  while(*numshapes < maxshapes) {
+    i = msGetNextBit(layerinfo->status, layerinfo->lastshape + 1, store->numfeatures);
+    layerinfo->lastshape = i;
+    if(i == -1)
+      return MS_DONE;
+    if(msFeatureStoreIsNull(store, i))
+      continue;
+    if(msFeatureStoreReadShape(layer, store, i, &shapes[*numshapes]) != MS_SUCCESS) {
+      for(i=0; i<*numshapes; i++)
+        msFreeShape(&shapes[i]);
+      *numshapes = 0;
+      return MS_FAILURE;
+    }
+    (*numshapes)++;
+  }
+
+  return MS_SUCCESS;
+}
+
+int msFeatureStoreLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+  long shapeindex = record->shapeindex;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerGetShape()");
+    return MS_FAILURE;
+  }
+
+  if(shapeindex < 0 || shapeindex >= layerinfo->store->numfeatures) {
+    msSetError(MS_MISCERR, "Invalid feature id.", "msFeatureStoreLayerGetShape()");
+    return MS_FAILURE;
+  }
+
+  return msFeatureStoreReadShape(layer, layerinfo->store, shapeindex, shape);
+}
+
+int msFeatureStoreLayerClose(layerObj *layer)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) return MS_SUCCESS; /* nothing to do */
+
+  msFeatureStoreRelease(layerinfo->store);
+  free(layerinfo->status);
+  free(layerinfo);
+  layer->layerinfo = NULL;
+
+  return MS_SUCCESS;
+}
+
+int msFeatureStoreLayerGetItems(layerObj *layer)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+  int i;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerGetItems()");
+    return MS_FAILURE;
+  }
+
+  layer->numitems = layerinfo->store->numcolumns;
+  if(layer->numitems == 0) return MS_SUCCESS;
+  layer->items = (char**)msSmallMalloc(sizeof(char*) * layer->numitems);
+  for(i=0; i<layer->numitems; i++)
+    layer->items[i] = msStrdup(layerinfo->store->columns[i].name);
+
+  return msLayerInitItemInfo(layer);
+}
+
+int msFeatureStoreLayerGetExtent(layerObj *layer, rectObj *extent)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerGetExtent()");
+    return MS_FAILURE;
+  }
+  *extent = layerinfo->store->bounds;
+  return MS_SUCCESS;
+}
+
+int msFeatureStoreLayerGetNumFeatures(layerObj *layer)
+{
+  featureStoreLayerInfo *layerinfo = (featureStoreLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "Feature store layer has not been opened.", "msFeatureStoreLayerGetNumFeatures()");
+    return -1;
+  }
+  return layerinfo->store->numfeatures;
+}
+
+int msFeatureStoreLayerSupportsCommonFilters(layerObj *layer)
+{
+  return MS_TRUE;
+}
+
+int msFeatureStoreLayerInitializeVirtualTable(layerObj *layer)
+{
+  assert(layer != NULL);
+  assert(layer->vtable != NULL);
+
+  layer->vtable->LayerSupportsCommonFilters = msFeatureStoreLayerSupportsCommonFilters;
+  layer->vtable->LayerInitItemInfo = msFeatureStoreLayerInitItemInfo;
+  layer->vtable->LayerFreeItemInfo = msFeatureStoreLayerFreeItemInfo;
+  layer->vtable->LayerOpen = msFeatureStoreLayerOpen;
+  layer->vtable->LayerIsOpen = msFeatureStoreLayerIsOpen;
+  layer->vtable->LayerWhichShapes = msFeatureStoreLayerWhichShapes;
+  layer->vtable->LayerNextShape = msFeatureStoreLayerNextShape;
+  layer->vtable->LayerNextShapes = msFeatureStoreLayerNextShapes;
+  layer->vtable->LayerGetShape = msFeatureStoreLayerGetShape;
+  layer->vtable->LayerClose = msFeatureStoreLayerClose;
+  layer->vtable->LayerGetItems = msFeatureStoreLayerGetItems;
+  layer->vtable->LayerGetExtent = msFeatureStoreLayerGetExtent;
+  /* layer->vtable->LayerGetAutoStyle, use default */
+  /* layer->vtable->LayerCloseConnection, use default */
+  layer->vtable->LayerSetTimeFilter = msLayerMakeBackticsTimeFilter;
+  /* layer->vtable->LayerTranslateFilter, use default */
+  /* layer->vtable->LayerApplyFilterToLayer, use default */
+  /* layer->vtable->LayerCreateItems, use default */
+  layer->vtable->LayerGetNumFeatures = msFeatureStoreLayerGetNumFeatures;
+
+  return MS_SUCCESS;
+}
@@ -0,0 +1,1068 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Native FlatGeobuf layer (CONNECTIONTYPE FLATGEOBUF).
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "mapserver.h"
+
+/*
+** A FLATGEOBUF layer reads the FlatGeobuf (version 3) file named by DATA
+** without going through OGR.  The file is memory mapped, WhichShapes()
+** walks the packed Hilbert R-tree stored after the header, and features
+** are decoded from their FlatBuffer tables straight into shapeObjs.
+**
+** A file is laid out as:
+**
+**   magic "fgb\3fgb\0"
+**   uint32 header size, Header table
+**   packed R-tree, 40 byte nodes (4 doubles + uint64 offset), root first
+**   features, each an uint32 size followed by a Feature table
+**
+** All values are little endian.  Files written without an index are read
+** sequentially, the feature bounds are then checked after decoding.
+*/
+
+/* Header table fields */
+#define FGB_HEADER_ENVELOPE 1
+#define FGB_HEADER_GEOMETRY_TYPE 2
+#define FGB_HEADER_HAS_Z 3
+#define FGB_HEADER_HAS_M 4
+#define FGB_HEADER_COLUMNS 7
+#define FGB_HEADER_FEATURES_COUNT 8
+#define FGB_HEADER_INDEX_NODE_SIZE 9
+
+/* Column table fields */
+#define FGB_COLUMN_NAME 0
+#define FGB_COLUMN_TYPE 1
+
+/* Feature table fields */
+#define FGB_FEATURE_GEOMETRY 0
+#define FGB_FEATURE_PROPERTIES 1
+
+/* Geometry table fields */
+#define FGB_GEOMETRY_ENDS 0
+#define FGB_GEOMETRY_XY 1
+#define FGB_GEOMETRY_Z 2
+#define FGB_GEOMETRY_M 3
+#define FGB_GEOMETRY_TYPE 6
+#define FGB_GEOMETRY_PARTS 7
+
+enum FGB_GEOMETRY_TYPES {FGB_UNKNOWN, FGB_POINT, FGB_LINESTRING, FGB_POLYGON, FGB_MULTIPOINT, FGB_MULTILINESTRING, FGB_MULTIPOLYGON};
+enum FGB_COLUMN_TYPES {FGB_BYTE, FGB_UBYTE, FGB_BOOL, FGB_SHORT, FGB_USHORT, FGB_INT, FGB_UINT, FGB_LONG, FGB_ULONG, FGB_FLOAT, FGB_DOUBLE, FGB_STRING, FGB_JSON, FGB_DATETIME, FGB_BINARY};
+
+#define FGB_NODE_SIZE 40
+#define FGB_MAX_LEVELS 64
+
+typedef struct {
+  char *name;
+  int type;
+} flatGeobufColumnObj;
+
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  int mapped;
+
+  int geometrytype;
+  int hasz, hasm;
+  int numfeatures;
+  rectObj bounds;
+  int hasbounds;
+
+  int numcolumns;
+  flatGeobufColumnObj *columns;
+
+  int nodesize, numlevels;
+  size_t levelstart[FGB_MAX_LEVELS], levelend[FGB_MAX_LEVELS]; /* node ranges, level 0 holds the leaves */
+  const unsigned char *index;    /* NULL for files without index */
+  const unsigned char *features;
+  size_t featuressize;
+  size_t *offsets;               /* feature offsets of files without index */
+
+  ms_bitarray status;
+  int lastshape;
+  rectObj rect;                  /* checked on the features of files without index */
+} flatGeobufLayerInfo;
+
+/*
+** Little endian scalars.
+*/
+static unsigned int msFGBUInt16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static ms_uint32 msFGBUInt32(const unsigned char *p)
+{
+  return (ms_uint32)p[0] | ((ms_uint32)p[1] << 8) | ((ms_uint32)p[2] << 16) | ((ms_uint32)p[3] << 24);
+}
+
+static uint64_t msFGBUInt64(const unsigned char *p)
+{
+  return (uint64_t)msFGBUInt32(p) | ((uint64_t)msFGBUInt32(p + 4) << 32);
+}
+
+static double msFGBDouble(const unsigned char *p)
+{
+  uint64_t bits = msFGBUInt64(p);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static float msFGBFloat(const unsigned char *p)
+{
+  ms_uint32 bits = msFGBUInt32(p);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/*
+** FlatBuffer access.  Offsets are relative to buf, everything is checked
+** against size so that a corrupted file cannot make us read outside it.
+*/
+static int msFGBRoot(const unsigned char *buf, size_t size, size_t *table)
+{
+  if(size < 4) return MS_FALSE;
+  *table = msFGBUInt32(buf);
+  return *table <= size - 4;
+}
+
+/* position of field of table, MS_FALSE if the field is absent */
+static int msFGBField(const unsigned char *buf, size_t size, size_t table, int field, size_t *pos)
+{
+  ms_int32 soffset;
+  size_t vtable;
+  unsigned int vtsize, offset;
+
+  if(table > size - 4) return MS_FALSE;
+  soffset = (ms_int32)msFGBUInt32(buf + table);
+  if((soffset > 0 && (size_t)soffset > table) || (soffset < 0 && (size_t)-(long long)soffset > size - table))
+    return MS_FALSE;
+  vtable = table - soffset;
+  if(vtable > size - 4) return MS_FALSE;
+  vtsize = msFGBUInt16(buf + vtable);
+  if(4 + 2*field + 2 > vtsize || vtable + 4 + 2*field + 2 > size) return MS_FALSE;
+  offset = msFGBUInt16(buf + vtable + 4 + 2*field);
+  if(offset == 0 || table + offset >= size) return MS_FALSE;
+  *pos = table + offset;
+  return MS_TRUE;
+}
+
+static unsigned int msFGBFieldUInt8(const unsigned char *buf, size_t size, size_t table, int field, unsigned int dflt)
+{
+  size_t pos;
+  return msFGBField(buf, size, table, field, &pos) ? buf[pos] : dflt;
+}
+
+static unsigned int msFGBFieldUInt16(const unsigned char *buf, size_t size, size_t table, int field, unsigned int dflt)
+{
+  size_t pos;
+  return msFGBField(buf, size, table, field, &pos) && pos <= size - 2 ? msFGBUInt16(buf + pos) : dflt;
+}
+
+static uint64_t msFGBFieldUInt64(const unsigned char *buf, size_t size, size_t table, int field, uint64_t dflt)
+{
+  size_t pos;
+  return msFGBField(buf, size, table, field, &pos) && pos <= size - 8 ? msFGBUInt64(buf + pos) : dflt;
+}
+
+/* target of the offset (table, vector or string) stored in field */
+static int msFGBFieldOffset(const unsigned char *buf, size_t size, size_t table, int field, size_t *target)
+{
+  size_t pos;
+  ms_uint32 offset;
+
+  if(!msFGBField(buf, size, table, field, &pos) || pos > size - 4) return MS_FALSE;
+  offset = msFGBUInt32(buf + pos);
+  if(offset > size - pos) return MS_FALSE;
+  *target = pos + offset;
+  return *target <= size - 4;
+}
+
+/* vector stored in field, elements of elemsize bytes from *start */
+static int msFGBFieldVector(const unsigned char *buf, size_t size, size_t table, int field, size_t elemsize, size_t *start, size_t *count)
+{
+  size_t vector;
+
+  if(!msFGBFieldOffset(buf, size, table, field, &vector)) return MS_FALSE;
+  *count = msFGBUInt32(buf + vector);
+  *start = vector + 4;
+  return *count <= (size - *start) / elemsize;
+}
+
+/* table at element i of a vector of tables */
+static int msFGBVectorTable(const unsigned char *buf, size_t size, size_t start, size_t i, size_t *table)
+{
+  size_t pos = start + 4*i;
+  ms_uint32 offset = msFGBUInt32(buf + pos);
+  if(offset > size - pos) return MS_FALSE;
+  *table = pos + offset;
+  return *table <= size - 4;
+}
+
+/*
+** Packed R-tree, stored as in the reference implementation: the node
+** counts of the levels from the leaves up, laid out root first.
+*/
+static int msFGBInitIndex(flatGeobufLayerInfo *info, size_t *indexsize)
+{
+  size_t numnodes[FGB_MAX_LEVELS], n = info->numfeatures, total = n, offset;
+  int i;
+
+  info->numlevels = 1;
+  numnodes[0] = n;
+  do {
+    n = (n + info->nodesize - 1) / info->nodesize;
+    if(info->numlevels == FGB_MAX_LEVELS) return MS_FAILURE;
+    numnodes[info->numlevels++] = n;
+    total += n;
+  } while(n != 1);
+
+  offset = total;
+  for(i=0; i<info->numlevels; i++) {
+    offset -= numnodes[i];
+    info->levelstart[i] = offset;
+    info->levelend[i] = offset + numnodes[i];
+  }
+  *indexsize = total * FGB_NODE_SIZE;
+  return MS_SUCCESS;
+}
+
+static void msFGBReadNodeBounds(const unsigned char *node, rectObj *bounds)
+{
+  bounds->minx = msFGBDouble(node);
+  bounds->miny = msFGBDouble(node + 8);
+  bounds->maxx = msFGBDouble(node + 16);
+  bounds->maxy = msFGBDouble(node + 24);
+}
+
+static int msFGBSearchIndex(flatGeobufLayerInfo *info, rectObj *rect, ms_bitarray status)
+{
+  typedef struct {
+    size_t node;
+    int level;
+  } flatGeobufStackObj;
+  flatGeobufStackObj *stack;
+  int numstack = 0;
+
+  /* a level pushes at most nodesize children */
+  stack = (flatGeobufStackObj*)malloc(sizeof(flatGeobufStackObj) * (info->numlevels * info->nodesize + 1));
+  MS_CHECK_ALLOC(stack, sizeof(flatGeobufStackObj) * (info->numlevels * info->nodesize + 1), MS_FAILURE);
+  stack[numstack].node = 0;
+  stack[numstack++].level = info->numlevels - 1;
+
+  while(numstack > 0) {
+    size_t first = stack[numstack - 1].node, i, end;
+    int level = stack[--numstack].level;
+
+    end = MS_MIN(first + info->nodesize, info->levelend[level]);
+    for(i=first; i<end; i++) {
+      const unsigned char *node = info->index + i * FGB_NODE_SIZE;
+      rectObj bounds;
+
+      msFGBReadNodeBounds(node, &bounds);
+      if(msRectOverlap(&bounds, rect) != MS_TRUE)
+        continue;
+      if(level == 0)
+        msSetBit(status, (int)(i - info->levelstart[0]), 1);
+      else {
+        uint64_t child = msFGBUInt64(node + 32);
+        if(child < info->levelstart[level - 1] || child >= info->levelend[level - 1])
+          continue; /* corrupted index */
+        stack[numstack].node = (size_t)child;
+        stack[numstack++].level = level - 1;
+      }
+    }
+  }
+
+  free(stack);
+  return MS_SUCCESS;
+}
+
+/* locate feature i, returning its FlatBuffer */
+static int msFGBGetFeature(flatGeobufLayerInfo *info, int i, const unsigned char **buf, size_t *size)
+{
+  size_t offset;
+
+  if(info->index)
+    offset = (size_t)msFGBUInt64(info->index + (info->levelstart[0] + i) * FGB_NODE_SIZE + 32);
+  else
+    offset = info->offsets[i];
+
+  if(offset > info->featuressize - 4 || msFGBUInt32(info->features + offset) > info->featuressize - offset - 4) {
+    msSetError(MS_MISCERR, "Corrupted feature %d.", "msFGBGetFeature()", i);
+    return MS_FAILURE;
+  }
+  *buf = info->features + offset + 4;
+  *size = msFGBUInt32(info->features + offset);
+  return MS_SUCCESS;
+}
+
+/*
+** Geometries.  Both passes walk the same Geometry tables, the first only
+** counts the lines to allocate.  MultiPolygons keep their polygons in parts,
+** every other type has its coordinates in xy, split into lines by ends.
+*/
+static int msFGBShapeType(int type)
+{
+  switch(type) {
+    case FGB_POINT:
+    case FGB_MULTIPOINT:
+      return MS_SHAPE_POINT;
+    case FGB_LINESTRING:
+    case FGB_MULTILINESTRING:
+      return MS_SHAPE_LINE;
+    case FGB_POLYGON:
+    case FGB_MULTIPOLYGON:
+      return MS_SHAPE_POLYGON;
+  }
+  return MS_SHAPE_NULL;
+}
+
+static int msFGBReadGeometry(flatGeobufLayerInfo *info, const unsigned char *buf, size_t size, size_t geometry,
+                             int type, shapeObj *shape, int count)
+{
+  size_t xy, numxy, ends, numends, z, numz, m, numm, j;
+  int k, first = 0;
+
+  if(type == FGB_MULTIPOLYGON) {
+    size_t parts, numparts, part;
+    int numlines = 0;
+
+    if(!msFGBFieldVector(buf, size, geometry, FGB_GEOMETRY_PARTS, 4, &parts, &numparts))
+      return 0;
+    for(j=0; j<numparts; j++) {
+      int n;
+      if(!msFGBVectorTable(buf, size, parts, j, &part))
+        return -1;
+      if((n = msFGBReadGeometry(info, buf, size, part, FGB_POLYGON, shape, count)) < 0)
+        return -1;
+      numlines += n;
+    }
+    return numlines;
+  }
+
+  if(!msFGBFieldVector(buf, size, geometry, FGB_GEOMETRY_XY, 8, &xy, &numxy) || numxy < 2)
+    return 0;
+  numxy /= 2; /* x,y pairs */
+  if(numxy > INT_MAX) return -1;
+  if(type != FGB_MULTILINESTRING && type != FGB_POLYGON)
+    numends = 0;
+  else if(!msFGBFieldVector(buf, size, geometry, FGB_GEOMETRY_ENDS, 4, &ends, &numends))
+    numends = 0;
+  if(count) /* first pass */
+    return numends > 0 ? (int)numends : 1;
+
+  if(!info->hasz || !msFGBFieldVector(buf, size, geometry, FGB_GEOMETRY_Z, 8, &z, &numz) || numz != numxy)
+    numz = 0;
+  if(!info->hasm || !msFGBFieldVector(buf, size, geometry, FGB_GEOMETRY_M, 8, &m, &numm) || numm != numxy)
+    numm = 0;
+
+  for(j=0; j<MS_MAX(numends, 1); j++) {
+    lineObj *line = &shape->line[shape->numlines];
+    int last = numends > 0 ? (int)msFGBUInt32(buf + ends + 4*j) : (int)numxy;
+
+    if(last < first || last > (int)numxy)
+      return -1;
+    if(last == first)
+      continue; /* empty part */
+    line->numpoints = last - first;
+    line->point = (pointObj*)msShapeAllocStorage(shape, sizeof(pointObj) * line->numpoints);
+    if(!line->point) {
+      msSetError(MS_MEMERR, "Out of memory", "msFGBReadGeometry()");
+      return -1;
+    }
+    for(k=0; k<line->numpoints; k++) {
+      const unsigned char *p = buf + xy + 16*(first + k);
+      pointObj *point = &line->point[k];
+      point->x = msFGBDouble(p);
+      point->y = msFGBDouble(p + 8);
+#ifdef USE_POINT_Z_M
+      point->z = numz ? msFGBDouble(buf + z + 8*(first + k)) : 0;
+      point->m = numm ? msFGBDouble(buf + m + 8*(first + k)) : 0;
+#endif
+      if(shape->numlines == 0 && k == 0) {
+        shape->bounds.minx = shape->bounds.maxx = point->x;
+        shape->bounds.miny = shape->bounds.maxy = point->y;
+      } else {
+        shape->bounds.minx = MS_MIN(shape->bounds.minx, point->x);
+        shape->bounds.maxx = MS_MAX(shape->bounds.maxx, point->x);
+        shape->bounds.miny = MS_MIN(shape->bounds.miny, point->y);
+        shape->bounds.maxy = MS_MAX(shape->bounds.maxy, point->y);
+      }
+    }
+    shape->numlines++;
+    first = last;
+  }
+  return (int)MS_MAX(numends, 1);
+}
+
+/*
+** Attributes are a sequence of (uint16 column, value) pairs, values are
+** formatted the way OGR would return them.
+*/
+static char *msFGBReadValue(int type, const unsigned char *p, size_t size, size_t *length)
+{
+  char buffer[64];
+  size_t n = 0, j;
+
+  switch(type) {
+    case FGB_BYTE:
+    case FGB_UBYTE:
+    case FGB_BOOL:
+      *length = 1;
+      break;
+    case FGB_SHORT:
+    case FGB_USHORT:
+      *length = 2;
+      break;
+    case FGB_INT:
+    case FGB_UINT:
+    case FGB_FLOAT:
+      *length = 4;
+      break;
+    case FGB_LONG:
+    case FGB_ULONG:
+    case FGB_DOUBLE:
+      *length = 8;
+      break;
+    case FGB_STRING:
+    case FGB_JSON:
+    case FGB_DATETIME:
+    case FGB_BINARY:
+      if(size < 4) return NULL;
+      n = msFGBUInt32(p);
+      if(n > size - 4) return NULL;
+      *length = 4 + n;
+      break;
+    default:
+      return NULL;
+  }
+  if(*length > size) return NULL;
+
+  switch(type) {
+    case FGB_BYTE: snprintf(buffer, sizeof(buffer), "%d", (signed char)p[0]); break;
+    case FGB_UBYTE: snprintf(buffer, sizeof(buffer), "%u", p[0]); break;
+    case FGB_BOOL: snprintf(buffer, sizeof(buffer), "%d", p[0] ? 1 : 0); break;
+    case FGB_SHORT: snprintf(buffer, sizeof(buffer), "%d", (short)msFGBUInt16(p)); break;
+    case FGB_USHORT: snprintf(buffer, sizeof(buffer), "%u", msFGBUInt16(p)); break;
+    case FGB_INT: snprintf(buffer, sizeof(buffer), "%d", (int)(ms_int32)msFGBUInt32(p)); break;
+    case FGB_UINT: snprintf(buffer, sizeof(buffer), "%u", (unsigned int)msFGBUInt32(p)); break;
+    case FGB_LONG: snprintf(buffer, sizeof(buffer), "%lld", (long long)(int64_t)msFGBUInt64(p)); break;
+    case FGB_ULONG: snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)msFGBUInt64(p)); break;
+    case FGB_FLOAT: snprintf(buffer, sizeof(buffer), "%.15g", (double)msFGBFloat(p)); break;
+    case FGB_DOUBLE: snprintf(buffer, sizeof(buffer), "%.15g", msFGBDouble(p)); break;
+    case FGB_BINARY: {
+      char *value = (char*)msSmallMalloc(2*n + 1);
+      for(j=0; j<n; j++)
+        snprintf(value + 2*j, 3, "%02X", p[4 + j]);
+      value[2*n] = '\0';
+      return value;
+    }
+    default: { /* strings */
+      char *value = (char*)msSmallMalloc(n + 1);
+      memcpy(value, p + 4, n);
+      value[n] = '\0';
+      return value;
+    }
+  }
+  return msStrdup(buffer);
+}
+
+static int msFGBReadValues(layerObj *layer, flatGeobufLayerInfo *info, const unsigned char *buf, size_t size,
+                           size_t feature, shapeObj *shape)
+{
+  int *iteminfo = (int*)layer->iteminfo;
+  size_t properties, length, pos = 0;
+  int i;
+
+  shape->values = (char**)msSmallCalloc(layer->numitems, sizeof(char*));
+  shape->numvalues = layer->numitems;
+
+  if(msFGBFieldVector(buf, size, feature, FGB_FEATURE_PROPERTIES, 1, &properties, &length)) {
+    const unsigned char *p = buf + properties;
+    while(pos + 2 <= length) {
+      unsigned int column = msFGBUInt16(p + pos);
+      size_t valuelength;
+      char *value;
+
+      if((int)column >= info->numcolumns)
+        break;
+      pos += 2;
+      value = msFGBReadValue(info->columns[column].type, p + pos, length - pos, &valuelength);
+      if(!value)
+        break;
+      pos += valuelength;
+      for(i=0; i<layer->numitems; i++) {
+        if(iteminfo[i] == (int)column && !shape->values[i]) {
+          shape->values[i] = value;
+          value = NULL;
+        }
+      }
+      msFree(value);
+    }
+  }
+
+  for(i=0; i<layer->numitems; i++) { /* missing values are NULL fields */
+    if(!shape->values[i])
+      shape->values[i] = msStrdup("");
+  }
+  return MS_SUCCESS;
+}
+
+static int msFGBReadShape(layerObj *layer, flatGeobufLayerInfo *info, int i, shapeObj *shape)
+{
+  shapeArenaObj *arena = shape->arena;
+  const unsigned char *buf;
+  size_t size, feature, geometry;
+  int type, numlines;
+
+  msInitShape(shape);
+  shape->arena = arena; /* vertices are read into it */
+
+  if(msFGBGetFeature(info, i, &buf, &size) != MS_SUCCESS)
+    return MS_FAILURE;
+  if(!msFGBRoot(buf, size, &feature))
+    goto corrupted;
+  shape->index = i;
+
+  if(msFGBFieldOffset(buf, size, feature, FGB_FEATURE_GEOMETRY, &geometry)) {
+    type = info->geometrytype;
+    if(type == FGB_UNKNOWN)
+      type = msFGBFieldUInt8(buf, size, geometry, FGB_GEOMETRY_TYPE, FGB_UNKNOWN);
+    if(msFGBShapeType(type) != MS_SHAPE_NULL) {
+      if((numlines = msFGBReadGeometry(info, buf, size, geometry, type, shape, MS_TRUE)) < 0)
+        goto corrupted;
+      if(numlines > 0) {
+        shape->line = (lineObj*)msShapeAllocStorage(shape, sizeof(lineObj) * numlines);
+        MS_CHECK_ALLOC(shape->line, sizeof(lineObj) * numlines, MS_FAILURE);
+        if(msFGBReadGeometry(info, buf, size, geometry, type, shape, MS_FALSE) < 0) {
+          msFreeShape(shape);
+          goto corrupted;
+        }
+      }
+      if(shape->numlines > 0)
+        shape->type = msFGBShapeType(type);
+    }
+  }
+
+  if(layer->numitems > 0 && layer->iteminfo)
+    return msFGBReadValues(layer, info, buf, size, feature, shape);
+
+  return MS_SUCCESS;
+
+corrupted:
+  msSetError(MS_MISCERR, "Corrupted feature %d.", "msFGBReadShape()", i);
+  return MS_FAILURE;
+}
+
+/*
+** Opening files.
+*/
+static void msFGBFree(flatGeobufLayerInfo *info)
+{
+  int i;
+
+  if(!info) return;
+#ifndef _WIN32
+  if(info->mapped)
+    munmap(info->data, info->size);
+  else
+#endif
+    msFree(info->data);
+  for(i=0; i<info->numcolumns; i++)
+    msFree(info->columns[i].name);
+  msFree(info->columns);
+  msFree(info->offsets);
+  msFree(info->status);
+  free(info);
+}
+
+static int msFGBMapFile(flatGeobufLayerInfo *info, const char *path)
+{
+#ifndef _WIN32
+  struct stat stat_buf;
+  int fd = open(path, O_RDONLY);
+
+  if(fd < 0)
+    return MS_FAILURE;
+  if(fstat(fd, &stat_buf) != 0 || stat_buf.st_size <= 0) {
+    close(fd);
+    return MS_FAILURE;
+  }
+  info->size = (size_t)stat_buf.st_size;
+  info->data = (unsigned char*)mmap(NULL, info->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(info->data == MAP_FAILED) {
+    info->data = NULL;
+    return MS_FAILURE;
+  }
+  info->mapped = MS_TRUE;
+  return MS_SUCCESS;
+#else
+  FILE *fp = fopen(path, "rb");
+  long size;
+
+  if(!fp)
+    return MS_FAILURE;
+  if(fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) != 0) {
+    fclose(fp);
+    return MS_FAILURE;
+  }
+  info->size = (size_t)size;
+  info->data = (unsigned char*)malloc(info->size);
+  if(!info->data || fread(info->data, 1, info->size, fp) != info->size) {
+    msFree(info->data);
+    info->data = NULL;
+    fclose(fp);
+    return MS_FAILURE;
+  }
+  fclose(fp);
+  return MS_SUCCESS;
+#endif
+}
+
+static int msFGBReadHeader(flatGeobufLayerInfo *info)
+{
+  static const unsigned char magic[] = {'f', 'g', 'b', 3, 'f', 'g', 'b'};
+  const unsigned char *buf;
+  size_t size, header, start, count, j, indexsize = 0, pos;
+  uint64_t numfeatures;
+
+  if(info->size < 12 || memcmp(info->data, magic, sizeof(magic)) != 0) {
+    msSetError(MS_MISCERR, "Not a FlatGeobuf version 3 file.", "msFGBReadHeader()");
+    return MS_FAILURE;
+  }
+  size = msFGBUInt32(info->data + 8);
+  if(size > info->size - 12)
+    goto corrupted;
+  buf = info->data + 12;
+  if(!msFGBRoot(buf, size, &header))
+    goto corrupted;
+
+  info->geometrytype = msFGBFieldUInt8(buf, size, header, FGB_HEADER_GEOMETRY_TYPE, FGB_UNKNOWN);
+  info->hasz = msFGBFieldUInt8(buf, size, header, FGB_HEADER_HAS_Z, 0);
+  info->hasm = msFGBFieldUInt8(buf, size, header, FGB_HEADER_HAS_M, 0);
+  info->nodesize = msFGBFieldUInt16(buf, size, header, FGB_HEADER_INDEX_NODE_SIZE, 16);
+  numfeatures = msFGBFieldUInt64(buf, size, header, FGB_HEADER_FEATURES_COUNT, 0);
+  if(numfeatures > INT_MAX) {
+    msSetError(MS_MISCERR, "Too many features.", "msFGBReadHeader()");
+    return MS_FAILURE;
+  }
+  info->numfeatures = (int)numfeatures;
+
+  if(msFGBFieldVector(buf, size, header, FGB_HEADER_ENVELOPE, 8, &start, &count) && count >= 4) {
+    info->bounds.minx = msFGBDouble(buf + start);
+    info->bounds.miny = msFGBDouble(buf + start + 8);
+    info->bounds.maxx = msFGBDouble(buf + start + 16);
+    info->bounds.maxy = msFGBDouble(buf + start + 24);
+    info->hasbounds = MS_TRUE;
+  }
+
+  if(msFGBFieldVector(buf, size, header, FGB_HEADER_COLUMNS, 4, &start, &count) && count > 0) {
+    info->columns = (flatGeobufColumnObj*)msSmallCalloc(count, sizeof(flatGeobufColumnObj));
+    for(j=0; j<count; j++) {
+      size_t column, name, length;
+      if(!msFGBVectorTable(buf, size, start, j, &column) ||
+          !msFGBFieldVector(buf, size, column, FGB_COLUMN_NAME, 1, &name, &length))
+        goto corrupted;
+      info->columns[j].name = (char*)msSmallMalloc(length + 1);
+      memcpy(info->columns[j].name, buf + name, length);
+      info->columns[j].name[length] = '\0';
+      info->columns[j].type = msFGBFieldUInt8(buf, size, column, FGB_COLUMN_TYPE, FGB_BYTE);
+      info->numcolumns++;
+    }
+  }
+
+  pos = 12 + size;
+  if(info->nodesize == 1)
+    goto corrupted;
+  if(info->nodesize > 0 && info->numfeatures > 0) {
+    if(msFGBInitIndex(info, &indexsize) != MS_SUCCESS || indexsize > info->size - pos)
+      goto corrupted;
+    info->index = info->data + pos;
+    if(!info->hasbounds) {
+      msFGBReadNodeBounds(info->index, &info->bounds);
+      info->hasbounds = MS_TRUE;
+    }
+  }
+  info->features = info->data + pos + indexsize;
+  info->featuressize = info->size - pos - indexsize;
+
+  if(!info->index) { /* no index, find the features */
+    int maxfeatures = MS_MAX(info->numfeatures, 1024);
+    info->numfeatures = 0;
+    info->offsets = (size_t*)msSmallMalloc(sizeof(size_t) * maxfeatures);
+    pos = 0;
+    while(pos + 4 <= info->featuressize) {
+      size_t length = msFGBUInt32(info->features + pos);
+      if(length > info->featuressize - pos - 4)
+        goto corrupted;
+      if(info->numfeatures == maxfeatures) {
+        if(maxfeatures > INT_MAX / 2) goto corrupted;
+        maxfeatures *= 2;
+        info->offsets = (size_t*)msSmallRealloc(info->offsets, sizeof(size_t) * maxfeatures);
+      }
+      info->offsets[info->numfeatures++] = pos;
+      pos += 4 + length;
+    }
+  }
+
+  return MS_SUCCESS;
+
+corrupted:
+  msSetError(MS_MISCERR, "Corrupted FlatGeobuf header.", "msFGBReadHeader()");
+  return MS_FAILURE;
+}
+
+/*
+** FLATGEOBUF layer virtual table functions
+*/
+void msFlatGeobufLayerFreeItemInfo(layerObj *layer)
+{
+  if(layer->iteminfo) {
+    free(layer->iteminfo);
+    layer->iteminfo = NULL;
+  }
+}
+
+int msFlatGeobufLayerInitItemInfo(layerObj *layer)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+  int i, j, *iteminfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerInitItemInfo()");
+    return MS_FAILURE;
+  }
+
+  msFlatGeobufLayerFreeItemInfo(layer);
+  if(layer->numitems == 0)
+    return MS_SUCCESS;
+
+  iteminfo = (int*)msSmallMalloc(sizeof(int) * layer->numitems);
+  for(i=0; i<layer->numitems; i++) {
+    for(j=0; j<layerinfo->numcolumns; j++) {
+      if(strcasecmp(layer->items[i], layerinfo->columns[j].name) == 0)
+        break;
+    }
+    if(j == layerinfo->numcolumns) {
+      msSetError(MS_MISCERR, "Item '%s' not found.", "msFlatGeobufLayerInitItemInfo()", layer->items[i]);
+      free(iteminfo);
+      return MS_FAILURE;
+    }
+    iteminfo[i] = j;
+  }
+  layer->iteminfo = iteminfo;
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerOpen(layerObj *layer)
+{
+  char szPath[MS_MAXPATHLEN];
+  flatGeobufLayerInfo *layerinfo;
+
+  if(layer->layerinfo) return MS_SUCCESS; /* layer already open */
+
+  if(msCheckParentPointer(layer->map, "map") == MS_FAILURE)
+    return MS_FAILURE;
+
+  if(!layer->data) {
+    msSetError(MS_MISCERR, "DATA must name a FlatGeobuf file.", "msFlatGeobufLayerOpen()");
+    return MS_FAILURE;
+  }
+
+  layerinfo = (flatGeobufLayerInfo*)msSmallCalloc(1, sizeof(flatGeobufLayerInfo));
+  if(msFGBMapFile(layerinfo, msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, layer->data)) != MS_SUCCESS &&
+      msFGBMapFile(layerinfo, msBuildPath(szPath, layer->map->mappath, layer->data)) != MS_SUCCESS) {
+    msSetError(MS_IOERR, "(%s)", "msFlatGeobufLayerOpen()", layer->data);
+    msFGBFree(layerinfo);
+    return MS_FAILURE;
+  }
+  if(msFGBReadHeader(layerinfo) != MS_SUCCESS) {
+    msFGBFree(layerinfo);
+    return MS_FAILURE;
+  }
+  if(layer->debug)
+    msDebug("msFlatGeobufLayerOpen(): %s, %d features, %s.\n", szPath, layerinfo->numfeatures,
+            layerinfo->index ? "indexed" : "no index");
+
+  layerinfo->lastshape = -1;
+  layer->layerinfo = layerinfo;
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerIsOpen(layerObj *layer)
+{
+  if(layer->layerinfo)
+    return MS_TRUE;
+  else
+    return MS_FALSE;
+}
+
+int msFlatGeobufLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerWhichShapes()");
+    return MS_FAILURE;
+  }
+
+  free(layerinfo->status);
+  layerinfo->status = NULL;
+  layerinfo->lastshape = -1;
+  layerinfo->rect = rect;
+
+  if(layerinfo->numfeatures == 0 || (layerinfo->hasbounds && msRectOverlap(&layerinfo->bounds, &rect) != MS_TRUE))
+    return MS_DONE;
+
+  layerinfo->status = msAllocBitArray(layerinfo->numfeatures);
+  if(!layerinfo->status) {
+    msSetError(MS_MEMERR, NULL, "msFlatGeobufLayerWhichShapes()");
+    return MS_FAILURE;
+  }
+  if(!layerinfo->index || (layerinfo->hasbounds && msRectContained(&layerinfo->bounds, &rect) == MS_TRUE)) {
+    msSetAllBits(layerinfo->status, layerinfo->numfeatures, 1);
+    return MS_SUCCESS;
+  }
+  return msFGBSearchIndex(layerinfo, &rect, layerinfo->status);
+}
+
+/* read the next feature selected by WhichShapes(), MS_DONE after the last one */
+static int msFGBNextShape(layerObj *layer, flatGeobufLayerInfo *layerinfo, shapeObj *shape)
+{
+  int i;
+
+  while(1) {
+    i = msGetNextBit(layerinfo->status, layerinfo->lastshape + 1, layerinfo->numfeatures);
+    layerinfo->lastshape = i;
+    if(i == -1) return MS_DONE; /* nothing else to read */
+
+    if(msFGBReadShape(layer, layerinfo, i, shape) != MS_SUCCESS)
+      return MS_FAILURE;
+    if(shape->type == MS_SHAPE_NULL || (!layerinfo->index && msRectOverlap(&shape->bounds, &layerinfo->rect) != MS_TRUE)) {
+      msFreeShape(shape); /* skip NULL shapes */
+      continue;
+    }
+    return MS_SUCCESS;
+  }
+}
+
+int msFlatGeobufLayerNextShape(layerObj *layer, shapeObj *shape)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerNextShape()");
+    return MS_FAILURE;
+  }
+  if(!layerinfo->status)
+    return MS_DONE;
+
+  return msFGBNextShape(layer, layerinfo, shape);
+}
+
+int msFlatGeobufLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+  int i, status;
+
+  *numshapes = 0;
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerNextShapes()");
+    return MS_FAILURE;
+  }
+  if(!layerinfo->status)
+    return MS_DONE;
+
+  while(*numshapes < maxshapes) {
+    status = msFGBNextShape(layer, layerinfo, &shapes[*numshapes]);
+    if(status == MS_DONE)
+      return MS_DONE;
+    if(status != MS_SUCCESS) {
+      for(i=0; i<*numshapes; i++)
+        msFreeShape(&shapes[i]);
+      *numshapes = 0;
+      return MS_FAILURE;
+    }
+    (*numshapes)++;
+  }
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+  long shapeindex = record->shapeindex;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetShape()");
+    return MS_FAILURE;
+  }
+
+  if(shapeindex < 0 || shapeindex >= layerinfo->numfeatures) {
+    msSetError(MS_MISCERR, "Invalid feature id.", "msFlatGeobufLayerGetShape()");
+    return MS_FAILURE;
+  }
+
+  return msFGBReadShape(layer, layerinfo, shapeindex, shape);
+}
+
+int msFlatGeobufLayerClose(layerObj *layer)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) return MS_SUCCESS; /* nothing to do */
+
+  msFGBFree(layerinfo);
+  layer->layerinfo = NULL;
+
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerGetItems(layerObj *layer)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+  int i;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetItems()");
+    return MS_FAILURE;
+  }
+
+  layer->numitems = layerinfo->numcolumns;
+  if(layer->numitems == 0) return MS_SUCCESS;
+  layer->items = (char**)msSmallMalloc(sizeof(char*) * layer->numitems);
+  for(i=0; i<layer->numitems; i++)
+    layer->items[i] = msStrdup(layerinfo->columns[i].name);
+
+  return msLayerInitItemInfo(layer);
+}
+
+int msFlatGeobufLayerGetExtent(layerObj *layer, rectObj *extent)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+  int i, found = MS_FALSE;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetExtent()");
+    return MS_FAILURE;
+  }
+
+  if(layerinfo->hasbounds) {
+    *extent = layerinfo->bounds;
+    return MS_SUCCESS;
+  }
+
+  /* neither envelope nor index, scan the features */
+  for(i=0; i<layerinfo->numfeatures; i++) {
+    shapeObj shape;
+    int numitems = layer->numitems;
+
+    msInitShape(&shape);
+    layer->numitems = 0; /* geometry only */
+    if(msFGBReadShape(layer, layerinfo, i, &shape) != MS_SUCCESS) {
+      layer->numitems = numitems;
+      return MS_FAILURE;
+    }
+    layer->numitems = numitems;
+    if(shape.type != MS_SHAPE_NULL) {
+      if(found)
+        msMergeRect(extent, &shape.bounds);
+      else
+        *extent = shape.bounds;
+      found = MS_TRUE;
+    }
+    msFreeShape(&shape);
+  }
+  if(!found) {
+    msSetError(MS_MISCERR, "No features.", "msFlatGeobufLayerGetExtent()");
+    return MS_FAILURE;
+  }
+  layerinfo->bounds = *extent;
+  layerinfo->hasbounds = MS_TRUE;
+  return MS_SUCCESS;
+}
+
+int msFlatGeobufLayerGetNumFeatures(layerObj *layer)
+{
+  flatGeobufLayerInfo *layerinfo = (flatGeobufLayerInfo*)layer->layerinfo;
+
+  if(!layerinfo) {
+    msSetError(MS_MISCERR, "FlatGeobuf layer has not been opened.", "msFlatGeobufLayerGetNumFeatures()");
+    return -1;
+  }
+  return layerinfo->numfeatures;
+}
+
+int msFlatGeobufLayerSupportsCommonFilters(layerObj *layer)
+{
+  return MS_TRUE;
+}
+
+int msFlatGeobufLayerInitializeVirtualTable(layerObj *layer)
+{
+  assert(layer != NULL);
+  assert(layer->vtable != NULL);
+
+  layer->vtable->LayerSupportsCommonFilters = msFlatGeobufLayerSupportsCommonFilters;
+  layer->vtable->LayerInitItemInfo = msFlatGeobufLayerInitItemInfo;
+  layer->vtable->LayerFreeItemInfo = msFlatGeobufLayerFreeItemInfo;
+  layer->vtable->LayerOpen = msFlatGeobufLayerOpen;
+  layer->vtable->LayerIsOpen = msFlatGeobufLayerIsOpen;
+  layer->vtable->LayerWhichShapes = msFlatGeobufLayerWhichShapes;
+  layer->vtable->LayerNextShape = msFlatGeobufLayerNextShape;
+  layer->vtable->LayerNextShapes = msFlatGeobufLayerNextShapes;
+  layer->vtable->LayerGetShape = msFlatGeobufLayerGetShape;
+  layer->vtable->LayerClose = msFlatGeobufLayerClose;
+  layer->vtable->LayerGetItems = msFlatGeobufLayerGetItems;
+  layer->vtable->LayerGetExtent = msFlatGeobufLayerGetExtent;
+  /* layer->vtable->LayerGetAutoStyle, use default */
+  /* layer->vtable->LayerCloseConnection, use default */
+  layer->vtable->LayerSetTimeFilter = msLayerMakeBackticsTimeFilter;
+  /* layer->vtable->LayerTranslateFilter, use default */
+  /* layer->vtable->LayerApplyFilterToLayer, use default */
+  /* layer->vtable->LayerCreateItems, use default */
+  layer->vtable->LayerGetNumFeatures = msFlatGeobufLayerGetNumFeatures;
+
+  return MS_SUCCESS;
+}
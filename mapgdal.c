@@ -63,6 +63,123 @@ void msGDALInitialize( void )
   }
 }
 
+/************************************************************************/
+/*                       GDAL dataset handle cache.                     */
+/*                                                                      */
+/*      Datasets handed out by msGDALAcquireCachedDataset() are used    */
+/*      exclusively by one caller until released, so unlike the         */
+/*      GDALOpenShared() handles they can be read from concurrently     */
+/*      (each from its own handle) without holding TLOCK_GDAL.          */
+/*      Released handles stay open, up to a caller provided limit,      */
+/*      and the least recently used ones are closed first.              */
+/************************************************************************/
+
+typedef struct msGDALCachedDataset_t {
+  char *pszPath;
+  GDALDatasetH hDS;
+  int bInUse;
+  unsigned int nLastUse;
+  struct msGDALCachedDataset_t *psNext;
+} msGDALCachedDataset;
+
+static msGDALCachedDataset *psGDALDatasetCache = NULL;
+static unsigned int nGDALDatasetCacheClock = 0;
+
+/************************************************************************/
+/*                     msGDALAcquireCachedDataset()                     */
+/*                                                                      */
+/*      Returns an idle cached handle on pszPath, or opens a new one.   */
+/*      Returns NULL if the dataset cannot be opened.                   */
+/************************************************************************/
+
+void *msGDALAcquireCachedDataset( const char *pszPath )
+
+{
+  msGDALCachedDataset *psEntry;
+  GDALDatasetH hDS = NULL;
+
+  msAcquireLock( TLOCK_GDALCACHE );
+  for( psEntry = psGDALDatasetCache; psEntry != NULL; psEntry = psEntry->psNext ) {
+    if( !psEntry->bInUse && strcmp(psEntry->pszPath, pszPath) == 0 ) {
+      psEntry->bInUse = MS_TRUE;
+      hDS = psEntry->hDS;
+      break;
+    }
+  }
+  msReleaseLock( TLOCK_GDALCACHE );
+
+  if( hDS == NULL ) {
+    hDS = GDALOpen( pszPath, GA_ReadOnly );
+    if( hDS == NULL )
+      return NULL;
+
+    psEntry = (msGDALCachedDataset *) msSmallMalloc( sizeof(msGDALCachedDataset) );
+    psEntry->pszPath = msStrdup( pszPath );
+    psEntry->hDS = hDS;
+    psEntry->bInUse = MS_TRUE;
+
+    msAcquireLock( TLOCK_GDALCACHE );
+    psEntry->nLastUse = nGDALDatasetCacheClock;
+    psEntry->psNext = psGDALDatasetCache;
+    psGDALDatasetCache = psEntry;
+    msReleaseLock( TLOCK_GDALCACHE );
+  }
+
+  return hDS;
+}
+
+/************************************************************************/
+/*                     msGDALReleaseCachedDataset()                     */
+/*                                                                      */
+/*      Gives back a handle obtained with msGDALAcquireCachedDataset(). */
+/*      At most nMaxIdle released handles are kept open.                */
+/************************************************************************/
+
+void msGDALReleaseCachedDataset( void *hDSIn, int nMaxIdle )
+
+{
+  msGDALCachedDataset *psEntry, **ppsLink, *psToClose = NULL;
+  int nIdle = 0;
+
+  msAcquireLock( TLOCK_GDALCACHE );
+
+  for( psEntry = psGDALDatasetCache; psEntry != NULL; psEntry = psEntry->psNext ) {
+    if( psEntry->hDS == (GDALDatasetH) hDSIn ) {
+      psEntry->bInUse = MS_FALSE;
+      psEntry->nLastUse = ++nGDALDatasetCacheClock;
+    }
+    if( !psEntry->bInUse )
+      nIdle++;
+  }
+
+  /* unlink the least recently used idle handles beyond the limit */
+  while( nIdle > MS_MAX(nMaxIdle, 0) ) {
+    msGDALCachedDataset **ppsOldest = NULL;
+
+    for( ppsLink = &psGDALDatasetCache; *ppsLink != NULL; ppsLink = &((*ppsLink)->psNext) ) {
+      if( !(*ppsLink)->bInUse
+          && (ppsOldest == NULL || (*ppsLink)->nLastUse < (*ppsOldest)->nLastUse) )
+        ppsOldest = ppsLink;
+    }
+
+    psEntry = *ppsOldest;
+    *ppsOldest = psEntry->psNext;
+    psEntry->psNext = psToClose;
+    psToClose = psEntry;
+    nIdle--;
+  }
+
+  msReleaseLock( TLOCK_GDALCACHE );
+
+  while( psToClose != NULL ) {
+    psEntry = psToClose->psNext;
+    GDALClose( psToClose->hDS );
+    free( psToClose->pszPath );
+    free( psToClose );
+    psToClose = psEntry;
+  }
+}
+
 /************************************************************************/
 /*                           msGDALCleanup()                            */
 /************************************************************************/
@@ -72,6 +189,9 @@ void msGDALCleanup( void )
 {
   if( bGDALInitialized ) {
     int iRepeat = 5;
+
+    msGDALReleaseCachedDataset( NULL, 0 );
+
     msAcquireLock( TLOCK_GDAL );
 
 #if GDAL_RELEASE_DATE > 20101207
@@ -139,6 +259,107 @@ void CleanVSIDir( const char *pszDir )
   CSLDestroy( papszFiles );
 }
 
+/************************************************************************/
+/*                         msGDALStdoutWrite()                          */
+/*                                                                      */
+/*      Redirection of /vsistdout/ to the msIO standard output, so      */
+/*      that drivers writing their files sequentially can stream        */
+/*      them without a temporary copy.                                  */
+/************************************************************************/
+
+#if GDAL_VERSION_NUM >= 2000000
+static size_t msGDALStdoutWrite( const void *ptr, size_t size, size_t nmemb,
+                                 FILE *fp )
+
+{
+  (void) fp;
+  return msIO_fwrite( ptr, size, nmemb, stdout );
+}
+
+static int msGDALDriverIsStreamable( const char *pszDriver )
+
+{
+  return EQUAL(pszDriver,"PNG") || EQUAL(pszDriver,"JPEG")
+         || EQUAL(pszDriver,"GIF");
+}
+#endif
+
+/************************************************************************/
+/*                        msGDALSetOutputInfo()                         */
+/*                                                                      */
+/*      Set the color interpretation, georeferencing, nodata value      */
+/*      and resolution of an output dataset.                            */
+/************************************************************************/
+
+static void msGDALSetOutputInfo( GDALDatasetH hDS, mapObj *map,
+                                 outputFormatObj *format, double resolution )
+
+{
+  /* -------------------------------------------------------------------- */
+  /*      Set the color interpretation of RGB(A) output.                  */
+  /* -------------------------------------------------------------------- */
+  if( format->imagemode == MS_IMAGEMODE_RGB ) {
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 1 ), GCI_RedBand );
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 2 ), GCI_GreenBand );
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 3 ), GCI_BlueBand );
+  } else if( format->imagemode == MS_IMAGEMODE_RGBA ) {
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 1 ), GCI_RedBand );
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 2 ), GCI_GreenBand );
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 3 ), GCI_BlueBand );
+    GDALSetRasterColorInterpretation(
+      GDALGetRasterBand( hDS, 4 ), GCI_AlphaBand );
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      Assign the projection and coordinate system to the dataset.     */
+  /* -------------------------------------------------------------------- */
+
+  if( map != NULL ) {
+    char *pszWKT;
+
+    GDALSetGeoTransform( hDS, map->gt.geotransform );
+
+    pszWKT = msProjectionObj2OGCWKT( &(map->projection) );
+    if( pszWKT != NULL ) {
+      GDALSetProjection( hDS, pszWKT );
+      msFree( pszWKT );
+    }
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      Possibly assign a nodata value.                                 */
+  /* -------------------------------------------------------------------- */
+  if( msGetOutputFormatOption(format,"NULLVALUE",NULL) != NULL ) {
+    int iBand;
+    int nBands = GDALGetRasterCount( hDS );
+    const char *nullvalue = msGetOutputFormatOption(format,
+                            "NULLVALUE",NULL);
+
+    for( iBand = 0; iBand < nBands; iBand++ ) {
+      GDALRasterBandH hBand = GDALGetRasterBand( hDS, iBand+1 );
+      GDALSetRasterNoDataValue( hBand, atof(nullvalue) );
+    }
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*  Try to save resolution in the output file.                          */
+  /* -------------------------------------------------------------------- */
+  if( resolution > 0 ) {
+    char res[30];
+
+    sprintf( res, "%lf", resolution );
+    GDALSetMetadataItem( hDS, "TIFFTAG_XRESOLUTION", res, NULL );
+    GDALSetMetadataItem( hDS, "TIFFTAG_YRESOLUTION", res, NULL );
+    GDALSetMetadataItem( hDS, "TIFFTAG_RESOLUTIONUNIT", "2", NULL );
+  }
+}
+
 /************************************************************************/
 /*                          msSaveImageGDAL()                           */
 /************************************************************************/
@@ -147,6 +368,8 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
 
 {
   int  bFileIsTemporary = MS_FALSE;
+  int  bStreamToStdout = MS_FALSE;
+  char szStdoutName[] = "/vsistdout/";
   GDALDatasetH hMemDS, hOutputDS;
   GDALDriverH  hMemDriver, hOutputDriver;
   int          nBands = 1;
@@ -185,13 +408,24 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   /*      then stream to stdout if no filename is passed.  If the         */
   /*      driver supports virtualio then we hold the temporary file in    */
   /*      memory, otherwise we try to put it in a reasonable temporary    */
-  /*      file location.                                                  */
+  /*      file location.  Drivers writing their output sequentially       */
+  /*      write straight to stdout instead.                               */
   /* -------------------------------------------------------------------- */
   if( filename == NULL ) {
     const char *pszExtension = format->extension;
     if( pszExtension == NULL )
       pszExtension = "img.tmp";
 
+#if GDAL_VERSION_NUM >= 2000000
+    if( bUseXmp == MS_FALSE && msGDALDriverIsStreamable(format->driver+5) ) {
+      if( msIO_needBinaryStdout() == MS_FAILURE ) {
+        msReleaseLock( TLOCK_GDAL );
+        return MS_FAILURE;
+      }
+      filename = szStdoutName;
+      bStreamToStdout = MS_TRUE;
+    } else
+#endif
     if( bUseXmp == MS_FALSE && GDALGetMetadataItem( hOutputDriver, GDAL_DCAP_VIRTUALIO, NULL )
         != NULL ) {
       CleanVSIDir( "/vsimem/msout" );
@@ -204,7 +438,8 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
       filename = msTmpFile(map, NULL, NULL, pszExtension );
     }
 
-    bFileIsTemporary = MS_TRUE;
+    if( !bStreamToStdout )
+      bFileIsTemporary = MS_TRUE;
   }
 
   /* -------------------------------------------------------------------- */
@@ -357,69 +592,7 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   if( pabyAlphaLine != NULL )
     free( pabyAlphaLine );
 
-  /* -------------------------------------------------------------------- */
-  /*      Attach the palette if appropriate.                              */
-  /* -------------------------------------------------------------------- */
-    if( format->imagemode == MS_IMAGEMODE_RGB ) {
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 1 ), GCI_RedBand );
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 2 ), GCI_GreenBand );
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 3 ), GCI_BlueBand );
-    } else if( format->imagemode == MS_IMAGEMODE_RGBA ) {
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 1 ), GCI_RedBand );
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 2 ), GCI_GreenBand );
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 3 ), GCI_BlueBand );
-      GDALSetRasterColorInterpretation(
-        GDALGetRasterBand( hMemDS, 4 ), GCI_AlphaBand );
-    }
-
-  /* -------------------------------------------------------------------- */
-  /*      Assign the projection and coordinate system to the memory       */
-  /*      dataset.                                                        */
-  /* -------------------------------------------------------------------- */
-
-  if( map != NULL ) {
-    char *pszWKT;
-
-    GDALSetGeoTransform( hMemDS, map->gt.geotransform );
-
-    pszWKT = msProjectionObj2OGCWKT( &(map->projection) );
-    if( pszWKT != NULL ) {
-      GDALSetProjection( hMemDS, pszWKT );
-      msFree( pszWKT );
-    }
-  }
-
-  /* -------------------------------------------------------------------- */
-  /*      Possibly assign a nodata value.                                 */
-  /* -------------------------------------------------------------------- */
-  if( msGetOutputFormatOption(format,"NULLVALUE",NULL) != NULL ) {
-    int iBand;
-    const char *nullvalue = msGetOutputFormatOption(format,
-                            "NULLVALUE",NULL);
-
-    for( iBand = 0; iBand < nBands; iBand++ ) {
-      GDALRasterBandH hBand = GDALGetRasterBand( hMemDS, iBand+1 );
-      GDALSetRasterNoDataValue( hBand, atof(nullvalue) );
-    }
-  }
-
-  /* -------------------------------------------------------------------- */
-  /*  Try to save resolution in the output file.                          */
-  /* -------------------------------------------------------------------- */
-  if( image->resolution > 0 ) {
-    char res[30];
-
-    sprintf( res, "%lf", image->resolution );
-    GDALSetMetadataItem( hMemDS, "TIFFTAG_XRESOLUTION", res, NULL );
-    GDALSetMetadataItem( hMemDS, "TIFFTAG_YRESOLUTION", res, NULL );
-    GDALSetMetadataItem( hMemDS, "TIFFTAG_RESOLUTIONUNIT", "2", NULL );
-  }
+  msGDALSetOutputInfo( hMemDS, map, format, image->resolution );
 
   /* -------------------------------------------------------------------- */
   /*      Create a disk image in the selected output format from the      */
@@ -436,6 +609,11 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   memcpy( papszOptions, format->formatoptions,
           sizeof(char *) * format->numformatoptions );
 
+#if GDAL_VERSION_NUM >= 2000000
+  if( bStreamToStdout )
+    VSIStdoutSetRedirection( msGDALStdoutWrite, stdout );
+#endif
+
   hOutputDS = GDALCreateCopy( hOutputDriver, filename, hMemDS, FALSE,
                               papszOptions, NULL, NULL );
 
@@ -443,6 +621,10 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
 
   if( hOutputDS == NULL ) {
     GDALClose( hMemDS );
+#if GDAL_VERSION_NUM >= 2000000
+    if( bStreamToStdout )
+      VSIStdoutSetRedirection( fwrite, stdout );
+#endif
     msReleaseLock( TLOCK_GDAL );
     msSetError( MS_MISCERR, "Failed to create output %s file.\n%s",
                 "msSaveImageGDAL()", format->driver+5,
@@ -454,6 +636,10 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   GDALClose( hMemDS );
 
   GDALClose( hOutputDS );
+#if GDAL_VERSION_NUM >= 2000000
+  if( bStreamToStdout )
+    VSIStdoutSetRedirection( fwrite, stdout );
+#endif
   msReleaseLock( TLOCK_GDAL );
 
 
@@ -509,6 +695,210 @@ int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename )
   return MS_SUCCESS;
 }
 
+/************************************************************************/
+/*                          GDAL band writers                           */
+/*                                                                      */
+/*      Used by the banded renderer (mapbands.c) to write RGB(A)        */
+/*      images a band of rows at a time, with drivers that can create   */
+/*      a dataset directly (e.g. GTiff).  Output to stdout goes         */
+/*      through a temporary file on disk, as these images are usually   */
+/*      far too large to be held in /vsimem/.                           */
+/************************************************************************/
+
+typedef struct {
+  GDALDatasetH hDS;
+  char        *pszFilename;
+  int          bFileIsTemporary;
+  int          nNextLine;
+  GByte       *pabyLine;
+} msGDALBandWriter;
+
+int msGDALBandWriterSupported( outputFormatObj *format )
+
+{
+  GDALDriverH hDriver;
+
+  msGDALInitialize();
+  hDriver = GDALGetDriverByName( format->driver+5 );
+  return hDriver != NULL
+         && GDALGetMetadataItem( hDriver, GDAL_DCAP_CREATE, NULL ) != NULL;
+}
+
+static int msGDALBandWriteRows( bandWriterObj *writer, rasterBufferObj *rb,
+                                int firstrow, int numrows )
+
+{
+  msGDALBandWriter *psWriter = (msGDALBandWriter *) writer->data;
+  int nBands, iBand, iLine, i;
+  CPLErr eErr = CE_None;
+
+  msAcquireLock( TLOCK_GDAL );
+  nBands = GDALGetRasterCount( psWriter->hDS );
+  for( iBand = 0; iBand < nBands && eErr == CE_None; iBand++ ) {
+    GDALRasterBandH hBand = GDALGetRasterBand( psWriter->hDS, iBand+1 );
+    unsigned char *pixptr;
+
+    switch(iBand) {
+      case 0:
+        pixptr = rb->data.rgba.r;
+        break;
+      case 1:
+        pixptr = rb->data.rgba.g;
+        break;
+      case 2:
+        pixptr = rb->data.rgba.b;
+        break;
+      default:
+        pixptr = rb->data.rgba.a;
+        break;
+    }
+    pixptr += firstrow * rb->data.rgba.row_step;
+
+    if( rb->data.rgba.a == NULL || iBand == 3 ) {
+      eErr = GDALRasterIO( hBand, GF_Write, 0, psWriter->nNextLine,
+                           rb->width, numrows, pixptr, rb->width, numrows,
+                           GDT_Byte, rb->data.rgba.pixel_step,
+                           rb->data.rgba.row_step );
+      continue;
+    }
+
+    /* We need to un-pre-multiply RGB by alpha. */
+    for( iLine = 0; iLine < numrows && eErr == CE_None; iLine++ ) {
+      GByte *pabyData = (GByte *)(pixptr + iLine*rb->data.rgba.row_step);
+      GByte *pabyAlpha = (GByte *)(rb->data.rgba.a
+                                   + (firstrow+iLine)*rb->data.rgba.row_step);
+
+      for( i = 0; i < rb->width; i++ ) {
+        int alpha = pabyAlpha[i*rb->data.rgba.pixel_step];
+
+        if( alpha == 0 )
+          psWriter->pabyLine[i] = 0;
+        else
+          psWriter->pabyLine[i] =
+            MS_MIN(pabyData[i*rb->data.rgba.pixel_step] * 255 / alpha, 255);
+      }
+
+      eErr = GDALRasterIO( hBand, GF_Write, 0, psWriter->nNextLine + iLine,
+                           rb->width, 1, psWriter->pabyLine, rb->width, 1,
+                           GDT_Byte, 1, 0 );
+    }
+  }
+  msReleaseLock( TLOCK_GDAL );
+
+  if( eErr != CE_None ) {
+    msSetError( MS_MISCERR, "Failed to write rows to %s.\n%s",
+                "msGDALBandWriteRows()", psWriter->pszFilename,
+                CPLGetLastErrorMsg() );
+    return MS_FAILURE;
+  }
+  psWriter->nNextLine += numrows;
+  return MS_SUCCESS;
+}
+
+static int msGDALBandClose( bandWriterObj *writer, int success )
+
+{
+  msGDALBandWriter *psWriter = (msGDALBandWriter *) writer->data;
+
+  msAcquireLock( TLOCK_GDAL );
+  GDALClose( psWriter->hDS );
+  msReleaseLock( TLOCK_GDAL );
+
+  /* -------------------------------------------------------------------- */
+  /*      Stream temporary files to stdout, and delete them.              */
+  /* -------------------------------------------------------------------- */
+  if( psWriter->bFileIsTemporary ) {
+    if( success ) {
+      VSILFILE *fp;
+      unsigned char block[4000];
+      int bytes_read;
+
+      fp = VSIFOpenL( psWriter->pszFilename, "rb" );
+      if( fp == NULL ) {
+        msSetError( MS_MISCERR,
+                    "Failed to open %s for streaming to stdout.",
+                    "msGDALBandClose()", psWriter->pszFilename );
+        success = MS_FALSE;
+      } else {
+        while( (bytes_read = VSIFReadL(block, 1, sizeof(block), fp)) > 0 )
+          msIO_fwrite( block, 1, bytes_read, stdout );
+        VSIFCloseL( fp );
+      }
+    }
+    VSIUnlink( psWriter->pszFilename );
+  }
+
+  free( psWriter->pszFilename );
+  free( psWriter->pabyLine );
+  free( psWriter );
+  free( writer );
+  return success ? MS_SUCCESS : MS_FAILURE;
+}
+
+bandWriterObj *msGDALCreateBandWriter( mapObj *map, outputFormatObj *format,
+                                       int width, int height, char *filename )
+
+{
+  GDALDriverH hDriver;
+  GDALDatasetH hDS;
+  char **papszOptions;
+  msGDALBandWriter *psWriter;
+  bandWriterObj *writer;
+  int bFileIsTemporary = MS_FALSE;
+  int nBands = (format->imagemode == MS_IMAGEMODE_RGBA) ? 4 : 3;
+
+  msGDALInitialize();
+
+  if( filename == NULL ) {
+    const char *pszExtension = format->extension;
+    if( pszExtension == NULL )
+      pszExtension = "img.tmp";
+
+    if( msIO_needBinaryStdout() == MS_FAILURE )
+      return NULL;
+    filename = msTmpFile(map, map ? map->mappath : NULL, NULL, pszExtension);
+    if( filename == NULL )
+      return NULL;
+    bFileIsTemporary = MS_TRUE;
+  } else {
+    filename = msStrdup( filename );
+  }
+
+  papszOptions = (char**)msSmallCalloc(sizeof(char *),(format->numformatoptions+1));
+  memcpy( papszOptions, format->formatoptions,
+          sizeof(char *) * format->numformatoptions );
+
+  msAcquireLock( TLOCK_GDAL );
+  hDriver = GDALGetDriverByName( format->driver+5 );
+  hDS = hDriver ? GDALCreate( hDriver, filename, width, height, nBands,
+                              GDT_Byte, papszOptions ) : NULL;
+  free( papszOptions );
+  if( hDS == NULL ) {
+    msReleaseLock( TLOCK_GDAL );
+    msSetError( MS_MISCERR, "Failed to create output %s file.\n%s",
+                "msGDALCreateBandWriter()", format->driver+5,
+                CPLGetLastErrorMsg() );
+    free( filename );
+    return NULL;
+  }
+  msGDALSetOutputInfo( hDS, map, format, map ? map->resolution : 0 );
+  msReleaseLock( TLOCK_GDAL );
+
+  psWriter = (msGDALBandWriter *) msSmallCalloc(1, sizeof(msGDALBandWriter));
+  psWriter->hDS = hDS;
+  psWriter->pszFilename = filename;
+  psWriter->bFileIsTemporary = bFileIsTemporary;
+  psWriter->pabyLine = (GByte *) msSmallMalloc(width);
+
+  writer = (bandWriterObj *) msSmallCalloc(1, sizeof(bandWriterObj));
+  writer->width = width;
+  writer->height = height;
+  writer->writeRows = msGDALBandWriteRows;
+  writer->close = msGDALBandClose;
+  writer->data = psWriter;
+  return writer;
+}
+
 /************************************************************************/
 /*                       msInitGDALOutputFormat()                       */
 /************************************************************************/
@@ -265,9 +265,9 @@ int msGeomTransformShape(mapObj *map, layerObj *layer, shapeObj *shape)
       tmpshp = p.result.shpval;
 
       for (i= 0; i < shape->numlines; i++)
-        free(shape->line[i].point);
+        msShapeFreeStorage(shape, shape->line[i].point);
       shape->numlines = 0;
-      if (shape->line) free(shape->line);
+      msShapeFreeStorage(shape, shape->line);
       
       for(i=0; i<tmpshp->numlines; i++)
         msAddLine(shape, &(tmpshp->line[i])); /* copy each line */
@@ -28,12 +28,18 @@
  ****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
 #include <png.h>
+#include <zlib.h>
 #include <setjmp.h>
 #include <assert.h>
 #include <jpeglib.h>
 #include <stdlib.h>
 
+#ifdef USE_WEBP
+#include <webp/encode.h>
+#endif
+
 #ifdef USE_GIF
 #include <gif_lib.h>
 #endif
@@ -43,12 +49,68 @@
 typedef struct _streamInfo {
   FILE *fp;
   bufferObj *buffer;
+  msIOContext *context; /* msIO channel of fp, NULL for plain files */
+  unsigned char *chunk; /* bytes not yet written to fp */
+  size_t chunk_len;
 } streamInfo;
 
+/*
+** Encoders write to an output stream directly, without building the whole
+** image in memory first.  The writes are coalesced in chunks of
+** STREAM_CHUNK_SIZE bytes that are handed to the msIO channel of the stream
+** (e.g. FastCGI), resolved only once per image.
+*/
+#define STREAM_CHUNK_SIZE 65536
+
+static void streamInit(streamInfo *info, FILE *fp)
+{
+  info->fp = fp;
+  info->buffer = NULL;
+  info->context = msIO_getHandler(fp);
+  info->chunk = (unsigned char*)msSmallMalloc(STREAM_CHUNK_SIZE);
+  info->chunk_len = 0;
+}
+
+static void streamWriteDirect(streamInfo *info, const void *data, size_t length)
+{
+  if(info->context)
+    msIO_contextWrite(info->context,data,length);
+  else
+    fwrite(data,length,1,info->fp);
+}
+
+static void streamWrite(streamInfo *info, const void *data, size_t length)
+{
+  if(info->buffer) {
+    msBufferAppend(info->buffer,(void*)data,length);
+    return;
+  }
+  if(info->chunk_len + length > STREAM_CHUNK_SIZE) {
+    if(info->chunk_len) {
+      streamWriteDirect(info,info->chunk,info->chunk_len);
+      info->chunk_len = 0;
+    }
+    if(length >= STREAM_CHUNK_SIZE) {
+      streamWriteDirect(info,data,length);
+      return;
+    }
+  }
+  memcpy(info->chunk + info->chunk_len,data,length);
+  info->chunk_len += length;
+}
+
+static void streamClose(streamInfo *info)
+{
+  if(info->chunk_len)
+    streamWriteDirect(info,info->chunk,info->chunk_len);
+  free(info->chunk);
+  info->chunk = NULL;
+  info->chunk_len = 0;
+}
+
 void png_write_data_to_stream(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-  FILE *fp = ((streamInfo*)png_get_io_ptr(png_ptr))->fp;
-  msIO_fwrite(data,length,1,fp);
+  streamWrite((streamInfo*)png_get_io_ptr(png_ptr),data,length);
 }
 
 void png_write_data_to_buffer(png_structp png_ptr, png_bytep data, png_size_t length)
@@ -69,7 +131,7 @@ typedef struct {
 
 typedef struct {
   ms_destination_mgr mgr;
-  FILE *stream;
+  streamInfo *info;
 } ms_stream_destination_mgr;
 
 typedef struct {
@@ -96,7 +158,7 @@ jpeg_init_destination (j_compress_ptr cinfo)
 void jpeg_stream_term_destination (j_compress_ptr cinfo)
 {
   ms_stream_destination_mgr *dest = (ms_stream_destination_mgr*) cinfo->dest;
-  msIO_fwrite(dest->mgr.data, OUTPUT_BUF_SIZE-dest->mgr.pub.free_in_buffer, 1, dest->stream);
+  streamWrite(dest->info, dest->mgr.data, OUTPUT_BUF_SIZE-dest->mgr.pub.free_in_buffer);
   dest->mgr.pub.next_output_byte = dest->mgr.data;
   dest->mgr.pub.free_in_buffer = OUTPUT_BUF_SIZE;
 }
@@ -112,7 +174,7 @@ void jpeg_buffer_term_destination (j_compress_ptr cinfo)
 int jpeg_stream_empty_output_buffer (j_compress_ptr cinfo)
 {
   ms_stream_destination_mgr *dest = (ms_stream_destination_mgr*) cinfo->dest;
-  msIO_fwrite(dest->mgr.data, OUTPUT_BUF_SIZE, 1, dest->stream);
+  streamWrite(dest->info, dest->mgr.data, OUTPUT_BUF_SIZE);
   dest->mgr.pub.next_output_byte = dest->mgr.data;
   dest->mgr.pub.free_in_buffer = OUTPUT_BUF_SIZE;
   return TRUE;
@@ -141,6 +203,50 @@ static void msJPEGErrorExit(j_common_ptr cinfo)
     longjmp(*pJmpBuffer, 1);
 }
 
+static void jpegSetDestination(j_compress_ptr cinfo, streamInfo *info)
+{
+  ms_destination_mgr *dest;
+
+  if (cinfo->dest == NULL) {
+    if(info->fp) {
+      cinfo->dest = (struct jpeg_destination_mgr *)
+                    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                                sizeof (ms_stream_destination_mgr));
+      ((ms_stream_destination_mgr*)cinfo->dest)->mgr.pub.empty_output_buffer = jpeg_stream_empty_output_buffer;
+      ((ms_stream_destination_mgr*)cinfo->dest)->mgr.pub.term_destination = jpeg_stream_term_destination;
+      ((ms_stream_destination_mgr*)cinfo->dest)->info = info;
+    } else {
+
+      cinfo->dest = (struct jpeg_destination_mgr *)
+                    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                                sizeof (ms_buffer_destination_mgr));
+      ((ms_buffer_destination_mgr*)cinfo->dest)->mgr.pub.empty_output_buffer = jpeg_buffer_empty_output_buffer;
+      ((ms_buffer_destination_mgr*)cinfo->dest)->mgr.pub.term_destination = jpeg_buffer_term_destination;
+      ((ms_buffer_destination_mgr*)cinfo->dest)->buffer = info->buffer;
+    }
+  }
+  dest = (ms_destination_mgr*) cinfo->dest;
+  dest->pub.init_destination = jpeg_init_destination;
+}
+
+/* convert a row of a RGBA buffer to RGB samples */
+static void packRGBRowForJPEG(rasterBufferObj *rb, int row, JSAMPLE *pixptr)
+{
+  int col;
+  unsigned char *r,*g,*b;
+  r=rb->data.rgba.r+row*rb->data.rgba.row_step;
+  g=rb->data.rgba.g+row*rb->data.rgba.row_step;
+  b=rb->data.rgba.b+row*rb->data.rgba.row_step;
+  for(col=0; col<rb->width; col++) {
+    *(pixptr++) = *r;
+    *(pixptr++) = *g;
+    *(pixptr++) = *b;
+    r+=rb->data.rgba.pixel_step;
+    g+=rb->data.rgba.pixel_step;
+    b+=rb->data.rgba.pixel_step;
+  }
+}
+
 int saveAsJPEG(mapObj *map, rasterBufferObj *rb, streamInfo *info,
                outputFormatObj *format)
 {
@@ -150,7 +256,6 @@ int saveAsJPEG(mapObj *map, rasterBufferObj *rb, streamInfo *info,
   const char* pszOptimized;
   int optimized;
   int arithmetic;
-  ms_destination_mgr *dest;
   JSAMPLE *rowdata = NULL;
   unsigned int row;
   jmp_buf setjmp_buffer;
@@ -172,27 +277,7 @@ int saveAsJPEG(mapObj *map, rasterBufferObj *rb, streamInfo *info,
   jerr.error_exit = msJPEGErrorExit;
   cinfo.client_data = (void *) &(setjmp_buffer);
   jpeg_create_compress(&cinfo);
-
-  if (cinfo.dest == NULL) {
-    if(info->fp) {
-      cinfo.dest = (struct jpeg_destination_mgr *)
-                   (*cinfo.mem->alloc_small) ((j_common_ptr) &cinfo, JPOOL_PERMANENT,
-                                              sizeof (ms_stream_destination_mgr));
-      ((ms_stream_destination_mgr*)cinfo.dest)->mgr.pub.empty_output_buffer = jpeg_stream_empty_output_buffer;
-      ((ms_stream_destination_mgr*)cinfo.dest)->mgr.pub.term_destination = jpeg_stream_term_destination;
-      ((ms_stream_destination_mgr*)cinfo.dest)->stream = info->fp;
-    } else {
-
-      cinfo.dest = (struct jpeg_destination_mgr *)
-                   (*cinfo.mem->alloc_small) ((j_common_ptr) &cinfo, JPOOL_PERMANENT,
-                                              sizeof (ms_buffer_destination_mgr));
-      ((ms_buffer_destination_mgr*)cinfo.dest)->mgr.pub.empty_output_buffer = jpeg_buffer_empty_output_buffer;
-      ((ms_buffer_destination_mgr*)cinfo.dest)->mgr.pub.term_destination = jpeg_buffer_term_destination;
-      ((ms_buffer_destination_mgr*)cinfo.dest)->buffer = info->buffer;
-    }
-  }
-  dest = (ms_destination_mgr*) cinfo.dest;
-  dest->pub.init_destination = jpeg_init_destination;
+  jpegSetDestination(&cinfo, info);
 
   cinfo.image_width = rb->width;
   cinfo.image_height = rb->height;
@@ -218,20 +303,7 @@ int saveAsJPEG(mapObj *map, rasterBufferObj *rb, streamInfo *info,
   rowdata = (JSAMPLE*)malloc(rb->width*cinfo.input_components*sizeof(JSAMPLE));
 
   for(row=0; row<rb->height; row++) {
-    JSAMPLE *pixptr = rowdata;
-    int col;
-    unsigned char *r,*g,*b;
-    r=rb->data.rgba.r+row*rb->data.rgba.row_step;
-    g=rb->data.rgba.g+row*rb->data.rgba.row_step;
-    b=rb->data.rgba.b+row*rb->data.rgba.row_step;
-    for(col=0; col<rb->width; col++) {
-      *(pixptr++) = *r;
-      *(pixptr++) = *g;
-      *(pixptr++) = *b;
-      r+=rb->data.rgba.pixel_step;
-      g+=rb->data.rgba.pixel_step;
-      b+=rb->data.rgba.pixel_step;
-    }
+    packRGBRowForJPEG(rb, row, rowdata);
     (void) jpeg_write_scanlines(&cinfo, &rowdata, 1);
   }
 
@@ -305,7 +377,214 @@ int remapPaletteForPNG(rasterBufferObj *rb, rgbPixel *rgb, unsigned char *a, int
   return MS_SUCCESS;
 }
 
-int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression)
+/* convert a row of a RGBA buffer to straight (non premultiplied) RGBA, or RGB
+   for buffers without alpha */
+static void unpremultiplyRGBARow(rasterBufferObj *rb, int row, unsigned char *pix)
+{
+  int col;
+  unsigned char *a,*r,*g,*b;
+  r=rb->data.rgba.r+row*rb->data.rgba.row_step;
+  g=rb->data.rgba.g+row*rb->data.rgba.row_step;
+  b=rb->data.rgba.b+row*rb->data.rgba.row_step;
+  if(rb->data.rgba.a) {
+    a=rb->data.rgba.a+row*rb->data.rgba.row_step;
+    for(col=0; col<rb->width; col++) {
+      if(*a) {
+        double da = *a/255.0;
+        pix[0] = *r/da;
+        pix[1] = *g/da;
+        pix[2] = *b/da;
+        pix[3] = *a;
+      } else {
+        pix[0] = pix[1] = pix[2] = pix[3] = 0;
+      }
+      pix+=4;
+      a+=rb->data.rgba.pixel_step;
+      r+=rb->data.rgba.pixel_step;
+      g+=rb->data.rgba.pixel_step;
+      b+=rb->data.rgba.pixel_step;
+    }
+  } else {
+    for(col=0; col<rb->width; col++) {
+      pix[0] = *r;
+      pix[1] = *g;
+      pix[2] = *b;
+      pix+=3;
+      r+=rb->data.rgba.pixel_step;
+      g+=rb->data.rgba.pixel_step;
+      b+=rb->data.rgba.pixel_step;
+    }
+  }
+}
+
+/* pack a row of palette indexes with sample_depth bits per pixel */
+static void packPaletteRowForPNG(rasterBufferObj *rb, int row, int sample_depth, unsigned char *pix)
+{
+  const unsigned char *src = &(rb->data.palette.pixels[row*rb->width]);
+  int col;
+
+  if(sample_depth == 8) {
+    memcpy(pix, src, rb->width);
+    return;
+  }
+  memset(pix, 0, (rb->width * sample_depth + 7) / 8);
+  for(col=0; col<rb->width; col++) {
+    int bit = col * sample_depth;
+    pix[bit >> 3] |= src[col] << (8 - sample_depth - (bit & 7));
+  }
+}
+
+/*
+** Parallel PNG encoding: the image data is split in bands of rows that are
+** converted and deflated independently, pigz style.  Each band is primed with
+** the last 32KB of the rows preceding it and ends with a sync flush, so that
+** the concatenated bands form a single zlib stream with about the same
+** compression ratio as a serial one.
+*/
+#define PNG_BAND_BYTES (256*1024)
+#define PNG_WINDOW_SIZE 32768
+
+typedef struct {
+  rasterBufferObj *rb;
+  int sample_depth; /* only for palette buffers */
+  size_t rowbytes; /* including the filter type byte */
+  int first_row, num_rows;
+  int compression;
+  int last;
+  unsigned char *out;
+  size_t out_len;
+  uLong adler;
+  int status;
+} pngBandJob;
+
+static void deflatePNGBand(void *data)
+{
+  pngBandJob *job = (pngBandJob*)data;
+  int dict_rows = MS_MIN(job->first_row, (int)((PNG_WINDOW_SIZE + job->rowbytes - 1) / job->rowbytes));
+  size_t out_size, dict_len = job->rowbytes * dict_rows;
+  unsigned char *raw = (unsigned char*)malloc(job->rowbytes * (dict_rows + job->num_rows));
+  int i, zret, flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+  z_stream z;
+
+  job->status = MS_FAILURE;
+  if(!raw)
+    return;
+
+  for(i=0; i<dict_rows + job->num_rows; i++) {
+    unsigned char *rowptr = raw + i * job->rowbytes;
+    int row = job->first_row - dict_rows + i;
+    rowptr[0] = PNG_FILTER_VALUE_NONE;
+    if(job->rb->type == MS_BUFFER_BYTE_PALETTE)
+      packPaletteRowForPNG(job->rb, row, job->sample_depth, rowptr + 1);
+    else
+      unpremultiplyRGBARow(job->rb, row, rowptr + 1);
+  }
+
+  memset(&z, 0, sizeof(z_stream));
+  if(deflateInit2(&z, job->compression, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(raw);
+    return;
+  }
+  if(dict_len > 0) {
+    size_t len = MS_MIN(dict_len, PNG_WINDOW_SIZE);
+    deflateSetDictionary(&z, raw + dict_len - len, len);
+  }
+
+  z.next_in = raw + dict_len;
+  z.avail_in = job->rowbytes * job->num_rows;
+  job->adler = adler32(adler32(0, NULL, 0), z.next_in, z.avail_in);
+
+  out_size = deflateBound(&z, z.avail_in) + 16;
+  job->out = (unsigned char*)malloc(out_size);
+  job->out_len = 0;
+  while(job->out) {
+    z.next_out = job->out + job->out_len;
+    z.avail_out = out_size - job->out_len;
+    zret = deflate(&z, flush);
+    job->out_len = out_size - z.avail_out;
+    if(zret == Z_STREAM_ERROR)
+      break;
+    if(job->last ? zret == Z_STREAM_END : z.avail_out != 0) {
+      job->status = MS_SUCCESS;
+      break;
+    }
+    out_size *= 2;
+    job->out = (unsigned char*)msSmallRealloc(job->out, out_size);
+  }
+
+  deflateEnd(&z);
+  free(raw);
+}
+
+/* write the IDAT and IEND chunks of an image, after png_write_info() */
+static int writePNGDataParallel(png_structp png_ptr, rasterBufferObj *rb, int sample_depth,
+                                size_t rowbytes, int compression, int threads)
+{
+  int i, band_rows, num_bands, level, ret = MS_SUCCESS;
+  pngBandJob *jobs;
+  void **job_ptrs;
+  unsigned char header[2], trailer[4];
+  uLong adler;
+
+  band_rows = MS_MAX(1, (int)(PNG_BAND_BYTES / rowbytes));
+  num_bands = (rb->height + band_rows - 1) / band_rows;
+  jobs = (pngBandJob*)msSmallCalloc(num_bands, sizeof(pngBandJob));
+  job_ptrs = (void**)msSmallMalloc(num_bands * sizeof(void*));
+  for(i=0; i<num_bands; i++) {
+    jobs[i].rb = rb;
+    jobs[i].sample_depth = sample_depth;
+    jobs[i].rowbytes = rowbytes;
+    jobs[i].first_row = i * band_rows;
+    jobs[i].num_rows = MS_MIN(band_rows, rb->height - jobs[i].first_row);
+    jobs[i].compression = compression;
+    jobs[i].last = (i == num_bands - 1);
+    job_ptrs[i] = jobs + i;
+  }
+
+  msThreadRunJobs(deflatePNGBand, job_ptrs, num_bands, threads);
+
+  adler = adler32(0, NULL, 0);
+  for(i=0; i<num_bands; i++) {
+    if(jobs[i].status != MS_SUCCESS) {
+      msSetError(MS_MISCERR,"failed to compress image data","saveAsPNG()");
+      ret = MS_FAILURE;
+      break;
+    }
+    adler = adler32_combine(adler, jobs[i].adler, (z_off_t)(rowbytes * jobs[i].num_rows));
+  }
+
+  if(ret == MS_SUCCESS) {
+    /* zlib header with a 32K window, and the level hint of the compression */
+    level = (compression < 0) ? 6 : compression;
+    header[0] = 0x78;
+    header[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+    header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+    trailer[0] = (adler >> 24) & 0xFF;
+    trailer[1] = (adler >> 16) & 0xFF;
+    trailer[2] = (adler >> 8) & 0xFF;
+    trailer[3] = adler & 0xFF;
+
+    for(i=0; i<num_bands; i++) {
+      size_t len = jobs[i].out_len + (i == 0 ? 2 : 0) + (jobs[i].last ? 4 : 0);
+      png_write_chunk_start(png_ptr, (png_const_bytep)"IDAT", len);
+      if(i == 0)
+        png_write_chunk_data(png_ptr, header, 2);
+      png_write_chunk_data(png_ptr, jobs[i].out, jobs[i].out_len);
+      if(jobs[i].last)
+        png_write_chunk_data(png_ptr, trailer, 4);
+      png_write_chunk_end(png_ptr);
+    }
+    png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+  }
+
+  for(i=0; i<num_bands; i++)
+    free(jobs[i].out);
+  free(jobs);
+  free(job_ptrs);
+  return ret;
+}
+
+int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression, int threads)
 {
   png_infop info_ptr;
   rgbPixel rgb[256];
@@ -361,6 +640,14 @@ int savePalettePNG(rasterBufferObj *rb, streamInfo *info, int compression)
     png_set_tRNS(png_ptr, info_ptr, a,num_a, NULL);
 
   png_write_info(png_ptr, info_ptr);
+
+  if(threads > 1 && rb->height > 1) {
+    int ret = writePNGDataParallel(png_ptr, rb, sample_depth,
+                                   1 + (rb->width * sample_depth + 7) / 8, compression, threads);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return ret;
+  }
+
   png_set_packing(png_ptr);
 
   for(row=0; row<rb->height; row++) {
@@ -429,6 +716,7 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
 
   const char *force_string,*zlib_compression;
   int compression = -1;
+  int threads = msThreadParseCount(msGetOutputFormatOption( format, "COMPRESSION_THREADS", NULL), 1);
 
   zlib_compression = msGetOutputFormatOption( format, "COMPRESSION", NULL);
   if(zlib_compression && *zlib_compression) {
@@ -453,18 +741,46 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
     rasterBufferObj qrb;
     rgbaPixel palette[256], paletteGiven[256];
     unsigned int numPaletteGivenEntries;
+    inverseColormapObj *icm = NULL;
+    char *reuse_key = NULL;
     memset(&qrb,0,sizeof(rasterBufferObj));
     qrb.type = MS_BUFFER_BYTE_PALETTE;
     qrb.width = rb->width;
     qrb.height = rb->height;
-    qrb.data.palette.pixels = (unsigned char*)malloc(qrb.width*qrb.height*sizeof(unsigned char));
+    qrb.data.palette.pixels = (unsigned char*)msRasterBufferPoolAcquire((size_t)qrb.width*qrb.height);
     qrb.data.palette.scaling_maxval = 255;
     if(force_pc256) {
+      const char *method = msGetOutputFormatOption( format, "QUANTIZE_METHOD", "MEDIANCUT");
+      int fast = (strcasecmp(method,"FAST") == 0);
       qrb.data.palette.palette = palette;
       qrb.data.palette.num_entries = atoi(msGetOutputFormatOption( format, "QUANTIZE_COLORS", "256"));
-      ret = msQuantizeRasterBuffer(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette,
-                                   NULL, 0,
-                                   &qrb.data.palette.scaling_maxval);
+
+      /* reuse the palette computed for a previous image of this series */
+      force_string = msGetOutputFormatOption( format, "QUANTIZE_REUSE", NULL );
+      if( force_string && (strcasecmp(force_string,"on") == 0  || strcasecmp(force_string,"yes") == 0 || strcasecmp(force_string,"true") == 0) ) {
+        reuse_key = msStrdup(map && map->mappath ? map->mappath : "");
+        reuse_key = msStringConcatenate(reuse_key, map && map->name ? map->name : "");
+        reuse_key = msStringConcatenate(reuse_key, "|");
+        reuse_key = msStringConcatenate(reuse_key, format->name ? format->name : "");
+        reuse_key = msStringConcatenate(reuse_key, "|");
+        reuse_key = msStringConcatenate(reuse_key, msGetOutputFormatOption( format, "QUANTIZE_COLORS", "256"));
+        reuse_key = msStringConcatenate(reuse_key, "|");
+        reuse_key = msStringConcatenate(reuse_key, method);
+      }
+
+      if(reuse_key && msGetSharedPalette(reuse_key, qrb.data.palette.palette, &(qrb.data.palette.num_entries), &icm)) {
+        ret = MS_SUCCESS;
+      } else if(fast) {
+        ret = msQuantizeRasterBufferFast(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette);
+      } else {
+        ret = msQuantizeRasterBuffer(rb,&(qrb.data.palette.num_entries),qrb.data.palette.palette,
+                                     NULL, 0,
+                                     &qrb.data.palette.scaling_maxval);
+      }
+
+      /* map the pixels through an inverse colormap, unless the image was rescaled */
+      if(ret != MS_FAILURE && !icm && (fast || reuse_key) && qrb.data.palette.scaling_maxval == 255)
+        icm = msCreateInverseColormap(qrb.data.palette.palette, qrb.data.palette.num_entries);
     } else {
       int colorsWanted = atoi(msGetOutputFormatOption( format, "QUANTIZE_COLORS", "0"));
       const char *palettePath = msGetOutputFormatOption( format, "PALETTE", "palette.txt");
@@ -483,6 +799,39 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
         ret = MS_SUCCESS;
 
         /* we have a full palette and don't want an additional quantization step */
+
+        /* map the pixels through a lookup table shared by the process under
+           the palette file name and contents. Its cells are filled as
+           pixels need them, and completely once it is reused. */
+        {
+          rgbaPixel paletteShared[256];
+          unsigned int i, numPaletteSharedEntries, hash = 2166136261U;
+          const unsigned char *bytes = (const unsigned char*)paletteGiven;
+          char szHash[16];
+
+          for(i=0; i<numPaletteGivenEntries*sizeof(rgbaPixel); i++)
+            hash = (hash ^ bytes[i]) * 16777619U;
+          snprintf(szHash, sizeof(szHash), "|%08x", hash);
+          reuse_key = msStrdup("PALETTE_FORCE|");
+          reuse_key = msStringConcatenate(reuse_key, palettePath);
+          reuse_key = msStringConcatenate(reuse_key, szHash);
+
+          if(msGetSharedPalette(reuse_key, paletteShared, &numPaletteSharedEntries, &icm)) {
+            if(numPaletteSharedEntries != numPaletteGivenEntries ||
+                memcmp(paletteShared, paletteGiven, numPaletteGivenEntries*sizeof(rgbaPixel)) != 0) {
+              /* hash collision, don't share */
+              if(icm)
+                msReleaseSharedPalette(reuse_key, icm);
+              icm = NULL;
+              msFree(reuse_key);
+              reuse_key = NULL;
+            } else if(icm) {
+              msFillInverseColormap(icm);
+            }
+          }
+          if(!icm) /* new palette, or the shared table is being used */
+            icm = msCreateInverseColormap(paletteGiven,numPaletteGivenEntries);
+        }
       } else {
         /* quantize the image, and mix our colours in the resulting palette */
         qrb.data.palette.palette = palette;
@@ -493,16 +842,26 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
       }
     }
     if(ret != MS_FAILURE) {
-      ret = msClassifyRasterBuffer(rb,&qrb);
-      ret = savePalettePNG(&qrb,info,compression);
+      if(icm)
+        ret = msClassifyRasterBufferLUT(rb,&qrb,icm);
+      else
+        ret = msClassifyRasterBuffer(rb,&qrb);
+      ret = savePalettePNG(&qrb,info,compression,threads);
     }
-    msFree(qrb.data.palette.pixels);
+    if(icm) {
+      if(reuse_key)
+        msReleaseSharedPalette(reuse_key, icm);
+      else
+        msFreeInverseColormap(icm);
+    }
+    msFree(reuse_key);
+    msRasterBufferPoolRelease(qrb.data.palette.pixels, (size_t)qrb.width*qrb.height);
     return ret;
   } else if(rb->type == MS_BUFFER_BYTE_RGBA) {
     png_infop info_ptr;
     int color_type;
     int row;
-    unsigned int *rowdata;
+    unsigned char *rowdata;
     png_structp png_ptr = png_create_write_struct(
                             PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
 
@@ -539,51 +898,17 @@ int saveAsPNG(mapObj *map,rasterBufferObj *rb, streamInfo *info, outputFormatObj
 
     png_write_info(png_ptr, info_ptr);
 
-    if(!rb->data.rgba.a && rb->data.rgba.pixel_step==4)
-      png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+    if(threads > 1 && rb->height > 1) {
+      ret = writePNGDataParallel(png_ptr, rb, 8, 1 + rb->width * (rb->data.rgba.a ? 4 : 3),
+                                 compression, threads);
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return ret;
+    }
 
-    rowdata = (unsigned int*)malloc(rb->width*sizeof(unsigned int));
+    rowdata = (unsigned char*)malloc(rb->width*4);
     for(row=0; row<rb->height; row++) {
-      unsigned int *pixptr = rowdata;
-      int col;
-      unsigned char *a,*r,*g,*b;
-      r=rb->data.rgba.r+row*rb->data.rgba.row_step;
-      g=rb->data.rgba.g+row*rb->data.rgba.row_step;
-      b=rb->data.rgba.b+row*rb->data.rgba.row_step;
-      if(rb->data.rgba.a) {
-        a=rb->data.rgba.a+row*rb->data.rgba.row_step;
-        for(col=0; col<rb->width; col++) {
-          if(*a) {
-            double da = *a/255.0;
-            unsigned char *pix = (unsigned char*)pixptr;
-            pix[0] = *r/da;
-            pix[1] = *g/da;
-            pix[2] = *b/da;
-            pix[3] = *a;
-          } else {
-            *pixptr=0;
-          }
-          pixptr++;
-          a+=rb->data.rgba.pixel_step;
-          r+=rb->data.rgba.pixel_step;
-          g+=rb->data.rgba.pixel_step;
-          b+=rb->data.rgba.pixel_step;
-        }
-      } else {
-        for(col=0; col<rb->width; col++) {
-          unsigned char *pix = (unsigned char*)pixptr;
-          pix[0] = *r;
-          pix[1] = *g;
-          pix[2] = *b;
-          pixptr++;
-          r+=rb->data.rgba.pixel_step;
-          g+=rb->data.rgba.pixel_step;
-          b+=rb->data.rgba.pixel_step;
-        }
-      }
-
+      unpremultiplyRGBARow(rb, row, rowdata);
       png_write_row(png_ptr,(png_bytep)rowdata);
-
     }
     png_write_end(png_ptr, info_ptr);
     free(rowdata);
@@ -711,25 +1036,97 @@ int readPNG(char *path, rasterBufferObj *rb)
 
 }
 
+#ifdef USE_WEBP
+static int webp_write_data(const uint8_t *data, size_t data_size, const WebPPicture *picture)
+{
+  streamWrite((streamInfo*)picture->custom_ptr,data,data_size);
+  return 1;
+}
+
+int saveAsWEBP(mapObj *map, rasterBufferObj *rb, streamInfo *info,
+               outputFormatObj *format)
+{
+  WebPConfig config;
+  WebPPicture picture;
+  const char *lossless;
+  unsigned char *pixels;
+  int quality, method, row, ok;
+  int stride = rb->width * (rb->data.rgba.a ? 4 : 3);
+
+  if(rb->type != MS_BUFFER_BYTE_RGBA) {
+    msSetError(MS_MISCERR,"WebP output requires a RGBA buffer","saveAsWEBP()");
+    return MS_FAILURE;
+  }
+
+  quality = atoi(msGetOutputFormatOption( format, "QUALITY", "75"));
+  method = atoi(msGetOutputFormatOption( format, "METHOD", "4"));
+  lossless = msGetOutputFormatOption( format, "LOSSLESS", "OFF");
+
+  if(!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, MS_MAX(0,MS_MIN(100,quality))) ||
+      !WebPPictureInit(&picture)) {
+    msSetError(MS_MISCERR,"libwebp version mismatch","saveAsWEBP()");
+    return MS_FAILURE;
+  }
+  config.method = MS_MAX(0,MS_MIN(6,method));
+  config.lossless = EQUAL(lossless,"ON") || EQUAL(lossless,"YES") || EQUAL(lossless,"TRUE");
+  if(!WebPValidateConfig(&config)) {
+    msSetError(MS_MISCERR,"invalid WebP encoding options","saveAsWEBP()");
+    return MS_FAILURE;
+  }
+
+  /* libwebp expects straight alpha */
+  pixels = (unsigned char*)msSmallMalloc(stride * rb->height);
+  for(row=0; row<rb->height; row++)
+    unpremultiplyRGBARow(rb, row, pixels + row * stride);
+
+  picture.use_argb = config.lossless;
+  picture.width = rb->width;
+  picture.height = rb->height;
+  picture.writer = webp_write_data;
+  picture.custom_ptr = info;
+  if(rb->data.rgba.a)
+    ok = WebPPictureImportRGBA(&picture, pixels, stride);
+  else
+    ok = WebPPictureImportRGB(&picture, pixels, stride);
+  free(pixels);
+
+  if(ok)
+    ok = WebPEncode(&config, &picture);
+  if(!ok) {
+    msSetError(MS_MISCERR,"WebP encoding failed (error code %d)","saveAsWEBP()",picture.error_code);
+    WebPPictureFree(&picture);
+    return MS_FAILURE;
+  }
+
+  WebPPictureFree(&picture);
+  return MS_SUCCESS;
+}
+#endif
+
 int msSaveRasterBuffer(mapObj *map, rasterBufferObj *rb, FILE *stream,
                        outputFormatObj *format)
 {
-  if(strcasestr(format->driver,"/png")) {
-    streamInfo info;
-    info.fp = stream;
-    info.buffer = NULL;
+  streamInfo info;
+  int ret;
 
-    return saveAsPNG(map, rb,&info,format);
+  if(strcasestr(format->driver,"/png")) {
+    streamInit(&info,stream);
+    ret = saveAsPNG(map, rb,&info,format);
   } else if(strcasestr(format->driver,"/jpeg")) {
-    streamInfo info;
-    info.fp = stream;
-    info.buffer=NULL;
-    
-    return saveAsJPEG(map, rb,&info,format);
+    streamInit(&info,stream);
+    ret = saveAsJPEG(map, rb,&info,format);
+#ifdef USE_WEBP
+  } else if(strcasestr(format->driver,"/webp")) {
+    streamInit(&info,stream);
+    ret = saveAsWEBP(map, rb,&info,format);
+#endif
   } else {
     msSetError(MS_MISCERR,"unsupported image format\n", "msSaveRasterBuffer()");
     return MS_FAILURE;
   }
+
+  streamClose(&info);
+  return ret;
 }
 
 int msSaveRasterBufferToBuffer(rasterBufferObj *data, bufferObj *buffer,
@@ -745,12 +1142,259 @@ int msSaveRasterBufferToBuffer(rasterBufferObj *data, bufferObj *buffer,
     info.fp = NULL;
     info.buffer=buffer;
     return saveAsJPEG(NULL, data,&info,format);
+#ifdef USE_WEBP
+  } else if(strcasestr(format->driver,"/webp")) {
+    streamInfo info;
+    info.fp = NULL;
+    info.buffer=buffer;
+    return saveAsWEBP(NULL, data,&info,format);
+#endif
   } else {
     msSetError(MS_MISCERR,"unsupported image format\n", "msSaveRasterBuffer()");
     return MS_FAILURE;
   }
 }
 
+/*
+** Band writers: PNG and JPEG images are encoded a band of rows at a time by
+** the banded renderer (mapbands.c), so that the whole image never has to be
+** held in memory.  Only the encodings that are produced row by row are
+** supported, i.e. not the quantized or paletted PNG modes.
+*/
+typedef struct {
+  streamInfo info;
+  FILE *fp; /* file opened by the writer, NULL when writing to stdout */
+  unsigned char *rowdata;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  jmp_buf setjmp_buffer;
+} rasterBandWriter;
+
+int msBandWriterSupported(outputFormatObj *format)
+{
+  const char *force_string;
+
+  if(!format || !MS_RENDERER_PLUGIN(format) || !format->vtable->supports_pixel_buffer)
+    return MS_FALSE;
+  if(format->imagemode != MS_IMAGEMODE_RGB && format->imagemode != MS_IMAGEMODE_RGBA)
+    return MS_FALSE;
+#ifdef USE_GDAL
+  if(MS_DRIVER_GDAL(format))
+    return msGDALBandWriterSupported(format);
+#endif
+  if(strcasestr(format->driver,"/png")) {
+    force_string = msGetOutputFormatOption( format, "QUANTIZE_FORCE", NULL );
+    if( force_string && (strcasecmp(force_string,"on") == 0  || strcasecmp(force_string,"yes") == 0 || strcasecmp(force_string,"true") == 0) )
+      return MS_FALSE;
+    force_string = msGetOutputFormatOption( format, "PALETTE_FORCE", NULL );
+    if( force_string && (strcasecmp(force_string,"on") == 0  || strcasecmp(force_string,"yes") == 0 || strcasecmp(force_string,"true") == 0) )
+      return MS_FALSE;
+    return MS_TRUE;
+  }
+  if(strcasestr(format->driver,"/jpeg"))
+    return MS_TRUE;
+  return MS_FALSE;
+}
+
+static void rasterBandWriterFree(bandWriterObj *writer)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+  streamClose(&bw->info);
+  if(bw->fp)
+    fclose(bw->fp);
+  free(bw->rowdata);
+  free(bw);
+  free(writer);
+}
+
+static int pngBandWriteRows(bandWriterObj *writer, rasterBufferObj *rb, int firstrow, int numrows)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+  int row;
+
+  if (setjmp(png_jmpbuf(bw->png_ptr)))
+    return MS_FAILURE;
+  for(row=firstrow; row<firstrow+numrows; row++) {
+    unpremultiplyRGBARow(rb, row, bw->rowdata);
+    png_write_row(bw->png_ptr,(png_bytep)bw->rowdata);
+  }
+  return MS_SUCCESS;
+}
+
+static int pngBandClose(bandWriterObj *writer, int success)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+
+  if(success) {
+    if (setjmp(png_jmpbuf(bw->png_ptr)))
+      success = MS_FALSE;
+    else
+      png_write_end(bw->png_ptr, bw->info_ptr);
+  }
+  png_destroy_write_struct(&bw->png_ptr, &bw->info_ptr);
+  rasterBandWriterFree(writer);
+  return success ? MS_SUCCESS : MS_FAILURE;
+}
+
+static int pngBandOpen(bandWriterObj *writer, outputFormatObj *format)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+  const char *zlib_compression;
+  int compression = -1;
+  int color_type;
+
+  zlib_compression = msGetOutputFormatOption( format, "COMPRESSION", NULL);
+  if(zlib_compression && *zlib_compression) {
+    char *endptr;
+    compression = strtol(zlib_compression,&endptr,10);
+    if(*endptr || compression<-1 || compression>9) {
+      msSetError(MS_MISCERR,"failed to parse FORMATOPTION \"COMPRESSION=%s\", expecting integer from 0 to 9.","msCreateBandWriter()",zlib_compression);
+      return MS_FAILURE;
+    }
+  }
+
+  bw->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
+  if (!bw->png_ptr)
+    return MS_FAILURE;
+  bw->info_ptr = png_create_info_struct(bw->png_ptr);
+  if (!bw->info_ptr || setjmp(png_jmpbuf(bw->png_ptr))) {
+    png_destroy_write_struct(&bw->png_ptr, &bw->info_ptr);
+    return MS_FAILURE;
+  }
+  png_set_compression_level(bw->png_ptr, compression);
+  png_set_filter (bw->png_ptr,0, PNG_FILTER_NONE);
+  png_set_write_fn(bw->png_ptr,&bw->info, png_write_data_to_stream, png_flush_data);
+
+  if(format->imagemode == MS_IMAGEMODE_RGBA)
+    color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+  else
+    color_type = PNG_COLOR_TYPE_RGB;
+  png_set_IHDR(bw->png_ptr, bw->info_ptr, writer->width, writer->height,
+               8, color_type, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(bw->png_ptr, bw->info_ptr);
+
+  bw->rowdata = (unsigned char*)msSmallMalloc(writer->width*4);
+  writer->writeRows = pngBandWriteRows;
+  writer->close = pngBandClose;
+  return MS_SUCCESS;
+}
+
+static int jpegBandWriteRows(bandWriterObj *writer, rasterBufferObj *rb, int firstrow, int numrows)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+  int row;
+
+  if (setjmp(bw->setjmp_buffer))
+    return MS_FAILURE;
+  for(row=firstrow; row<firstrow+numrows; row++) {
+    JSAMPLE *rowdata = bw->rowdata;
+    packRGBRowForJPEG(rb, row, rowdata);
+    (void) jpeg_write_scanlines(&bw->cinfo, &rowdata, 1);
+  }
+  return MS_SUCCESS;
+}
+
+static int jpegBandClose(bandWriterObj *writer, int success)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+
+  if(success) {
+    if (setjmp(bw->setjmp_buffer))
+      success = MS_FALSE;
+    else
+      jpeg_finish_compress(&bw->cinfo);
+  }
+  jpeg_destroy_compress(&bw->cinfo);
+  rasterBandWriterFree(writer);
+  return success ? MS_SUCCESS : MS_FAILURE;
+}
+
+static int jpegBandOpen(bandWriterObj *writer, outputFormatObj *format)
+{
+  rasterBandWriter *bw = (rasterBandWriter*)writer->data;
+  int quality = atoi(msGetOutputFormatOption( format, "QUALITY", "75"));
+
+  bw->cinfo.err = jpeg_std_error(&bw->jerr);
+  bw->jerr.error_exit = msJPEGErrorExit;
+  bw->cinfo.client_data = (void *) &(bw->setjmp_buffer);
+  jpeg_create_compress(&bw->cinfo);
+  if (setjmp(bw->setjmp_buffer)) {
+    jpeg_destroy_compress(&bw->cinfo);
+    return MS_FAILURE;
+  }
+  jpegSetDestination(&bw->cinfo, &bw->info);
+
+  /* OPTIMIZED is not honoured here: optimized Huffman tables make libjpeg
+     buffer the coefficients of the whole image */
+  bw->cinfo.image_width = writer->width;
+  bw->cinfo.image_height = writer->height;
+  bw->cinfo.input_components = 3;
+  bw->cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&bw->cinfo);
+  jpeg_set_quality(&bw->cinfo, quality, TRUE);
+  jpeg_start_compress(&bw->cinfo, TRUE);
+
+  bw->rowdata = (unsigned char*)msSmallMalloc(writer->width*3*sizeof(JSAMPLE));
+  writer->writeRows = jpegBandWriteRows;
+  writer->close = jpegBandClose;
+  return MS_SUCCESS;
+}
+
+/*
+** Create a band writer for an image of width x height pixels in the given
+** format, written to filename, or to stdout if filename is NULL.
+*/
+bandWriterObj *msCreateBandWriter(mapObj *map, outputFormatObj *format, int width, int height, char *filename)
+{
+  bandWriterObj *writer;
+  rasterBandWriter *bw;
+  FILE *stream;
+  int status;
+
+  if(!msBandWriterSupported(format)) {
+    msSetError(MS_MISCERR,"Output format (%s) can't be written in bands.","msCreateBandWriter()",format->name);
+    return NULL;
+  }
+#ifdef USE_GDAL
+  if(MS_DRIVER_GDAL(format))
+    return msGDALCreateBandWriter(map, format, width, height, filename);
+#endif
+
+  if(filename) {
+    stream = fopen(filename,"wb");
+    if(!stream) {
+      msSetError(MS_IOERR,"Failed to create output file (%s).","msCreateBandWriter()",filename);
+      return NULL;
+    }
+  } else {
+    if(msIO_needBinaryStdout() == MS_FAILURE)
+      return NULL;
+    stream = stdout;
+  }
+
+  writer = (bandWriterObj*)msSmallCalloc(1,sizeof(bandWriterObj));
+  bw = (rasterBandWriter*)msSmallCalloc(1,sizeof(rasterBandWriter));
+  writer->width = width;
+  writer->height = height;
+  writer->data = bw;
+  streamInit(&bw->info,stream);
+  if(stream != stdout)
+    bw->fp = stream;
+
+  if(strcasestr(format->driver,"/png"))
+    status = pngBandOpen(writer,format);
+  else
+    status = jpegBandOpen(writer,format);
+  if(status != MS_SUCCESS) {
+    rasterBandWriterFree(writer);
+    return NULL;
+  }
+  return writer;
+}
+
 #ifdef USE_GIF
 #if defined GIFLIB_MAJOR && GIFLIB_MAJOR >= 5
 static char const *gif_error_msg(int code)
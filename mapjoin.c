@@ -28,6 +28,9 @@
  ****************************************************************************/
 
 #include "mapserver.h"
+#include "mapthread.h"
+
+#include <sys/stat.h>
 
 
 
@@ -154,6 +157,307 @@ int msJoinClose(joinObj *join)
   return MS_FAILURE;
 }
 
+/*  */
+/* Join table index, shared by the XBase and CSV joins */
+/*  */
+
+/*
+** The "to" column of a join table is loaded once into a hash index, so that
+** finding the rows matching a shape is O(1) instead of a scan of the whole
+** table.  Rows sharing a key are chained in table order to support one-to-many
+** joins.  Indexes are cached across requests (e.g. FastCGI or mapscript) and
+** reloaded when the table file changes.  Once built they are read only, so
+** they can be shared by joins running in several threads.
+*/
+#define MS_JOIN_INDEX_CACHE_SIZE 16
+
+typedef struct msJoinIndex_t {
+  char *key; /* join type, path and "to" column */
+  time_t mtime;
+  off_t size;
+  int refcount;
+
+  int numrows;
+  char **keys; /* "to" value of each row */
+  int *next; /* next row with the same hash value, -1 at the end */
+  int *buckets; /* first row of each hash bucket, -1 if empty */
+  unsigned int bucketmask;
+
+  /* CSV tables are kept in memory as a whole */
+  char ***rows;
+  int *rownumitems;
+  int numitems;
+
+  struct msJoinIndex_t *nextindex;
+} msJoinIndex;
+
+static msJoinIndex *joinIndexCache = NULL;
+
+static unsigned int msJoinIndexHash(const char *key)
+{
+  unsigned int hashval;
+
+  for(hashval=0; *key!='\0'; key++)
+    hashval = (unsigned char)(*key) + 31 * hashval;
+
+  return hashval;
+}
+
+/* build the hash chains once all the keys are loaded */
+static void msJoinIndexBuild(msJoinIndex *index)
+{
+  int i;
+  unsigned int numbuckets = 16;
+
+  while(numbuckets < (unsigned int)index->numrows && numbuckets < (1U << 30))
+    numbuckets *= 2;
+
+  index->bucketmask = numbuckets - 1;
+  index->buckets = (int *) msSmallMalloc(sizeof(int)*numbuckets);
+  for(i=0; i<(int)numbuckets; i++)
+    index->buckets[i] = -1;
+  index->next = (int *) msSmallMalloc(sizeof(int)*MS_MAX(1, index->numrows));
+
+  /* insert backwards so that each chain is in table order */
+  for(i=index->numrows-1; i>=0; i--) {
+    unsigned int bucket = msJoinIndexHash(index->keys[i]) & index->bucketmask;
+    index->next[i] = index->buckets[bucket];
+    index->buckets[bucket] = i;
+  }
+}
+
+static void msJoinIndexFree(msJoinIndex *index)
+{
+  int i;
+
+  if(index->rows) {
+    for(i=0; i<index->numrows; i++)
+      msFreeCharArray(index->rows[i], index->rownumitems[i]);
+    free(index->rows);
+    free(index->rownumitems);
+  } else if(index->keys) {
+    for(i=0; i<index->numrows; i++)
+      free(index->keys[i]);
+  }
+  free(index->keys); /* CSV keys point into the rows */
+  free(index->next);
+  free(index->buckets);
+  free(index->key);
+  free(index);
+}
+
+/* first row matching target at or after row start in its chain, -1 if none */
+static int msJoinIndexFind(msJoinIndex *index, const char *target, int start)
+{
+  int i;
+
+  for(i=start; i>=0; i=index->next[i]) {
+    if(strcmp(target, index->keys[i]) == 0) return i;
+  }
+
+  return -1;
+}
+
+static int msJoinIndexFirst(msJoinIndex *index, const char *target)
+{
+  return index->buckets[msJoinIndexHash(target) & index->bucketmask];
+}
+
+/* load the "to" column of an open XBase table */
+static msJoinIndex *msJoinIndexLoadDBF(DBFHandle hDBF, int toindex)
+{
+  int i;
+  msJoinIndex *index = (msJoinIndex *) msSmallCalloc(1, sizeof(msJoinIndex));
+
+  index->numrows = msDBFGetRecordCount(hDBF);
+  index->keys = (char **) msSmallMalloc(sizeof(char *)*MS_MAX(1, index->numrows));
+  for(i=0; i<index->numrows; i++) {
+    const char *value = msDBFReadStringAttribute(hDBF, i, toindex);
+    index->keys[i] = msStrdup(value ? value : "");
+  }
+
+  msJoinIndexBuild(index);
+
+  return index;
+}
+
+/* load a whole CSV file, toindex is checked against the number of columns */
+static msJoinIndex *msJoinIndexLoadCSV(const char *path, int toindex)
+{
+  int i, allocated = 0;
+  FILE *stream;
+  char buffer[MS_BUFFER_LENGTH];
+  msJoinIndex *index;
+
+  if((stream = fopen(path, "r")) == NULL) {
+    msSetError(MS_IOERR, "(%s)", "msCSVJoinConnect()", path);
+    return NULL;
+  }
+
+  index = (msJoinIndex *) msSmallCalloc(1, sizeof(msJoinIndex));
+
+  /* load the rows */
+  while(fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) {
+    if(index->numrows == allocated) {
+      allocated = MS_MAX(ROW_ALLOCATION_SIZE, allocated*2);
+      index->rows = (char ***) msSmallRealloc(index->rows, sizeof(char **)*allocated);
+      index->rownumitems = (int *) msSmallRealloc(index->rownumitems, sizeof(int)*allocated);
+    }
+
+    msStringTrimEOL(buffer);
+    index->rows[index->numrows] = msStringSplitComplex(buffer, ",", &(index->rownumitems[index->numrows]), MS_ALLOWEMPTYTOKENS);
+    index->numitems = index->rownumitems[index->numrows];
+    index->numrows++;
+  }
+  fclose(stream);
+
+  if(index->numrows > 0 && toindex >= index->numitems) {
+    msSetError(MS_JOINERR, "Invalid column index %d.", "msCSVJoinConnect()", toindex+1);
+    msJoinIndexFree(index);
+    return NULL;
+  }
+
+  index->keys = (char **) msSmallMalloc(sizeof(char *)*MS_MAX(1, index->numrows));
+  for(i=0; i<index->numrows; i++)
+    index->keys[i] = (toindex < index->rownumitems[i]) ? index->rows[i][toindex] : "";
+
+  msJoinIndexBuild(index);
+
+  return index;
+}
+
+/*
+** Resolves the name of the .dbf file msDBFOpen() reads for a table given
+** as foo, foo.dbf or foo.shp, trying the lower case extension first.
+*/
+static void msJoinDBFPath(const char *path, char *dbfpath)
+{
+  struct stat stat_buf;
+  int len;
+
+  strlcpy(dbfpath, path, MS_MAXPATHLEN);
+  len = strlen(dbfpath);
+  if(len < 4) return;
+
+  if(strcmp(dbfpath+len-4, ".shp") == 0 || strcmp(dbfpath+len-4, ".shx") == 0)
+    strcpy(dbfpath+len-4, ".dbf");
+  else if(strcmp(dbfpath+len-4, ".SHP") == 0 || strcmp(dbfpath+len-4, ".SHX") == 0)
+    strcpy(dbfpath+len-4, ".DBF");
+
+  if(strcmp(dbfpath+len-4, ".dbf") == 0 && stat(dbfpath, &stat_buf) != 0)
+    strcpy(dbfpath+len-4, ".DBF");
+}
+
+/*
+** Returns a reference to the cached index of a table, loading it if needed.
+** Either hDBF (XBase) or the CSV file path is used to load it, path is the
+** file actually read and keys the cache.  The reference must be given back
+** with msJoinIndexRelease().
+*/
+static msJoinIndex *msJoinIndexAcquire(const char *type, const char *path, DBFHandle hDBF, int toindex)
+{
+  char key[MS_MAXPATHLEN+64];
+  struct stat stat_buf;
+  msJoinIndex *index, *previous, *newindex = NULL;
+  int count, status;
+
+  /* check the open XBase file itself, its name may have been changed */
+  if(hDBF)
+    status = fstat(fileno(hDBF->fp), &stat_buf);
+  else
+    status = stat(path, &stat_buf);
+
+  if(status != 0) { /* can't tell if it changes, don't cache */
+    newindex = hDBF ? msJoinIndexLoadDBF(hDBF, toindex) : msJoinIndexLoadCSV(path, toindex);
+    if(newindex) {
+      newindex->key = msStrdup("");
+      newindex->refcount = 1;
+    }
+    return newindex;
+  }
+
+  snprintf(key, sizeof(key), "%s:%d:%s", type, toindex, path);
+
+  msAcquireLock(TLOCK_JOIN);
+  for(index=joinIndexCache, previous=NULL; index!=NULL; previous=index, index=index->nextindex) {
+    if(strcmp(index->key, key) == 0) break;
+  }
+
+  if(index && (index->mtime != stat_buf.st_mtime || index->size != stat_buf.st_size)) { /* stale */
+    if(previous) previous->nextindex = index->nextindex;
+    else joinIndexCache = index->nextindex;
+    if(--index->refcount == 0) msJoinIndexFree(index);
+    index = NULL;
+  }
+
+  if(index) { /* move to the front of the list */
+    if(previous) {
+      previous->nextindex = index->nextindex;
+      index->nextindex = joinIndexCache;
+      joinIndexCache = index;
+    }
+    index->refcount++;
+    msReleaseLock(TLOCK_JOIN);
+    return index;
+  }
+  msReleaseLock(TLOCK_JOIN);
+
+  /* load outside of the lock, concurrent loads of the same table are harmless */
+  if(hDBF)
+    newindex = msJoinIndexLoadDBF(hDBF, toindex);
+  else
+    newindex = msJoinIndexLoadCSV(path, toindex);
+  if(!newindex) return NULL;
+
+  newindex->key = msStrdup(key);
+  newindex->mtime = stat_buf.st_mtime;
+  newindex->size = stat_buf.st_size;
+  newindex->refcount = 2; /* one for the cache, one for the caller */
+
+  msAcquireLock(TLOCK_JOIN);
+  newindex->nextindex = joinIndexCache;
+  joinIndexCache = newindex;
+
+  /* drop duplicates of this table and the least recently used indexes */
+  count = 1;
+  previous = newindex;
+  for(index=newindex->nextindex; index!=NULL; index=previous->nextindex) {
+    if(count >= MS_JOIN_INDEX_CACHE_SIZE || strcmp(index->key, key) == 0) {
+      previous->nextindex = index->nextindex;
+      if(--index->refcount == 0) msJoinIndexFree(index);
+    } else {
+      previous = index;
+      count++;
+    }
+  }
+  msReleaseLock(TLOCK_JOIN);
+
+  return newindex;
+}
+
+static void msJoinIndexRelease(msJoinIndex *index)
+{
+  if(!index) return;
+
+  msAcquireLock(TLOCK_JOIN);
+  if(--index->refcount == 0) msJoinIndexFree(index);
+  msReleaseLock(TLOCK_JOIN);
+}
+
+/* free the cached join indexes, called from msCleanup() */
+void msJoinCleanup(void)
+{
+  msJoinIndex *index;
+
+  msAcquireLock(TLOCK_JOIN);
+  while(joinIndexCache) {
+    index = joinIndexCache;
+    joinIndexCache = index->nextindex;
+    if(--index->refcount == 0) msJoinIndexFree(index);
+  }
+  msReleaseLock(TLOCK_JOIN);
+}
+
 /*  */
 /* XBASE join functions */
 /*  */
@@ -162,12 +466,13 @@ typedef struct {
   int fromindex, toindex;
   char *target;
   int nextrecord;
+  msJoinIndex *index;
 } msDBFJoinInfo;
 
 int msDBFJoinConnect(layerObj *layer, joinObj *join)
 {
   int i;
-  char szPath[MS_MAXPATHLEN];
+  char szPath[MS_MAXPATHLEN], szDBFPath[MS_MAXPATHLEN];
   msDBFJoinInfo *joininfo;
 
   if(join->joininfo) return(MS_SUCCESS); /* already open */
@@ -185,7 +490,8 @@ int msDBFJoinConnect(layerObj *layer, joinObj *join)
 
   /* initialize any members that won't get set later on in this function */
   joininfo->target = NULL;
-  joininfo->nextrecord = 0;
+  joininfo->nextrecord = -1;
+  joininfo->index = NULL;
 
   join->joininfo = joininfo;
 
@@ -203,6 +509,11 @@ int msDBFJoinConnect(layerObj *layer, joinObj *join)
     return(MS_FAILURE);
   }
 
+  /* index the "to" column */
+  msJoinDBFPath(szPath, szDBFPath);
+  if((joininfo->index = msJoinIndexAcquire("DBF", szDBFPath, joininfo->hDBF, joininfo->toindex)) == NULL)
+    return(MS_FAILURE);
+
   /* get "from" item index   */
   for(i=0; i<layer->numitems; i++) {
     if(strcasecmp(layer->items[i],join->from) == 0) { /* found it */
@@ -243,17 +554,17 @@ int msDBFJoinPrepare(joinObj *join, shapeObj *shape)
     return(MS_FAILURE);
   }
 
-  joininfo->nextrecord = 0; /* starting with the first record */
-
   if(joininfo->target) free(joininfo->target); /* clear last target */
   joininfo->target = msStrdup(shape->values[joininfo->fromindex]);
 
+  joininfo->nextrecord = msJoinIndexFirst(joininfo->index, joininfo->target); /* starting with the first candidate record */
+
   return(MS_SUCCESS);
 }
 
 int msDBFJoinNext(joinObj *join)
 {
-  int i, n;
+  int i;
   msDBFJoinInfo *joininfo = join->joininfo;
 
   if(!joininfo) {
@@ -272,13 +583,9 @@ int msDBFJoinNext(joinObj *join)
     join->values = NULL;
   }
 
-  n = msDBFGetRecordCount(joininfo->hDBF);
+  i = msJoinIndexFind(joininfo->index, joininfo->target, joininfo->nextrecord); /* find a match */
 
-  for(i=joininfo->nextrecord; i<n; i++) { /* find a match */
-    if(strcmp(joininfo->target, msDBFReadStringAttribute(joininfo->hDBF, i, joininfo->toindex)) == 0) break;
-  }
-
-  if(i == n) { /* unable to do the join */
+  if(i == -1) { /* unable to do the join */
     if((join->values = (char **)malloc(sizeof(char *)*join->numitems)) == NULL) {
       msSetError(MS_MEMERR, NULL, "msDBFJoinNext()");
       return(MS_FAILURE);
@@ -286,14 +593,14 @@ int msDBFJoinNext(joinObj *join)
     for(i=0; i<join->numitems; i++)
       join->values[i] = msStrdup("\0"); /* intialize to zero length strings */
 
-    joininfo->nextrecord = n;
+    joininfo->nextrecord = -1;
     return(MS_DONE);
   }
 
   if((join->values = msDBFGetValues(joininfo->hDBF,i)) == NULL)
     return(MS_FAILURE);
 
-  joininfo->nextrecord = i+1; /* so we know where to start looking next time through */
+  joininfo->nextrecord = joininfo->index->next[i]; /* so we know where to start looking next time through */
 
   return(MS_SUCCESS);
 }
@@ -305,9 +612,10 @@ int msDBFJoinClose(joinObj *join)
   if(!joininfo) return(MS_SUCCESS); /* already closed */
 
   if(joininfo->hDBF) msDBFClose(joininfo->hDBF);
+  msJoinIndexRelease(joininfo->index);
   if(joininfo->target) free(joininfo->target);
   free(joininfo);
-  joininfo = NULL;
+  join->joininfo = NULL;
 
   return(MS_SUCCESS);
 }
@@ -318,18 +626,16 @@ int msDBFJoinClose(joinObj *join)
 typedef struct {
   int fromindex, toindex;
   char *target;
-  char ***rows;
-  int numrows;
   int nextrow;
+  msJoinIndex *index; /* holds the rows too */
 } msCSVJoinInfo;
 
 int msCSVJoinConnect(layerObj *layer, joinObj *join)
 {
   int i;
-  FILE *stream;
+  struct stat stat_buf;
   char szPath[MS_MAXPATHLEN];
   msCSVJoinInfo *joininfo;
-  char buffer[MS_BUFFER_LENGTH];
 
   if(join->joininfo) return(MS_SUCCESS); /* already open */
   if ( msCheckParentPointer(layer->map,"map")==MS_FAILURE )
@@ -344,38 +650,19 @@ int msCSVJoinConnect(layerObj *layer, joinObj *join)
 
   /* initialize any members that won't get set later on in this function */
   joininfo->target = NULL;
-  joininfo->nextrow = 0;
+  joininfo->nextrow = -1;
+  joininfo->index = NULL;
 
   join->joininfo = joininfo;
 
-  /* open the CSV file */
-  if((stream = fopen( msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, join->table), "r" )) == NULL) {
-    if((stream = fopen( msBuildPath(szPath, layer->map->mappath, join->table), "r" )) == NULL) {
+  /* locate the CSV file */
+  if(stat(msBuildPath3(szPath, layer->map->mappath, layer->map->shapepath, join->table), &stat_buf) != 0) {
+    if(stat(msBuildPath(szPath, layer->map->mappath, join->table), &stat_buf) != 0) {
       msSetError(MS_IOERR, "(%s)", "msCSVJoinConnect()", join->table);
       return(MS_FAILURE);
     }
   }
 
-  /* once through to get the number of rows */
-  joininfo->numrows = 0;
-  while(fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) joininfo->numrows++;
-  rewind(stream);
-
-  if((joininfo->rows = (char ***) malloc(joininfo->numrows*sizeof(char **))) == NULL) {
-    fclose(stream);
-    msSetError(MS_MEMERR, "Error allocating rows.", "msCSVJoinConnect()");
-    return(MS_FAILURE);
-  }
-
-  /* load the rows */
-  i = 0;
-  while(fgets(buffer, MS_BUFFER_LENGTH, stream) != NULL) {
-    msStringTrimEOL(buffer);
-    joininfo->rows[i] = msStringSplitComplex(buffer, ",", &(join->numitems), MS_ALLOWEMPTYTOKENS);
-    i++;
-  }
-  fclose(stream);
-
   /* get "from" item index   */
   for(i=0; i<layer->numitems; i++) {
     if(strcasecmp(layer->items[i],join->from) == 0) { /* found it */
@@ -391,11 +678,16 @@ int msCSVJoinConnect(layerObj *layer, joinObj *join)
 
   /* get "to" index (for now the user tells us which column, 1..n) */
   joininfo->toindex = atoi(join->to) - 1;
-  if(joininfo->toindex < 0 || joininfo->toindex > join->numitems) {
+  if(joininfo->toindex < 0) {
     msSetError(MS_JOINERR, "Invalid column index %s.", "msCSVJoinConnect()", join->to);
     return(MS_FAILURE);
   }
 
+  /* load the rows and index the "to" column */
+  if((joininfo->index = msJoinIndexAcquire("CSV", szPath, NULL, joininfo->toindex)) == NULL)
+    return(MS_FAILURE);
+  join->numitems = joininfo->index->numitems;
+
   /* store away the column names (1..n) */
   if((join->items = (char **) malloc(sizeof(char *)*join->numitems)) == NULL) {
     msSetError(MS_MEMERR, "Error allocating space for join item names.", "msCSVJoinConnect()");
@@ -428,11 +720,11 @@ int msCSVJoinPrepare(joinObj *join, shapeObj *shape)
     return(MS_FAILURE);
   }
 
-  joininfo->nextrow = 0; /* starting with the first record */
-
   if(joininfo->target) free(joininfo->target); /* clear last target */
   joininfo->target = msStrdup(shape->values[joininfo->fromindex]);
 
+  joininfo->nextrow = msJoinIndexFirst(joininfo->index, joininfo->target); /* starting with the first candidate record */
+
   return(MS_SUCCESS);
 }
 
@@ -452,44 +744,44 @@ int msCSVJoinNext(joinObj *join)
     join->values = NULL;
   }
 
-  for(i=joininfo->nextrow; i<joininfo->numrows; i++) { /* find a match     */
-    if(strcmp(joininfo->target, joininfo->rows[i][joininfo->toindex]) == 0) break;
+  if(!joininfo->target) {
+    msSetError(MS_JOINERR, "No target specified, run msCSVJoinPrepare() first.", "msCSVJoinNext()");
+    return(MS_FAILURE);
   }
 
+  i = msJoinIndexFind(joininfo->index, joininfo->target, joininfo->nextrow); /* find a match */
+
   if((join->values = (char ** )malloc(sizeof(char *)*join->numitems)) == NULL) {
     msSetError(MS_MEMERR, NULL, "msCSVJoinNext()");
     return(MS_FAILURE);
   }
 
-  if(i == joininfo->numrows) { /* unable to do the join     */
+  if(i == -1) { /* unable to do the join     */
     for(j=0; j<join->numitems; j++)
       join->values[j] = msStrdup("\0"); /* intialize to zero length strings */
 
-    joininfo->nextrow = joininfo->numrows;
+    joininfo->nextrow = -1;
     return(MS_DONE);
   }
 
   for(j=0; j<join->numitems; j++)
-    join->values[j] = msStrdup(joininfo->rows[i][j]);
+    join->values[j] = msStrdup(j < joininfo->index->rownumitems[i] ? joininfo->index->rows[i][j] : "");
 
-  joininfo->nextrow = i+1; /* so we know where to start looking next time through */
+  joininfo->nextrow = joininfo->index->next[i]; /* so we know where to start looking next time through */
 
   return(MS_SUCCESS);
 }
 
 int msCSVJoinClose(joinObj *join)
 {
-  int i;
   msCSVJoinInfo *joininfo = join->joininfo;
 
   if(!joininfo) return(MS_SUCCESS); /* already closed */
 
-  for(i=0; i<joininfo->numrows; i++)
-    msFreeCharArray(joininfo->rows[i], join->numitems);
-  free(joininfo->rows);
+  msJoinIndexRelease(joininfo->index);
   if(joininfo->target) free(joininfo->target);
   free(joininfo);
-  joininfo = NULL;
+  join->joininfo = NULL;
 
   return(MS_SUCCESS);
 }
@@ -292,6 +292,42 @@ int msLayerWhichShapes(layerObj *layer, rectObj rect, int isQuery)
   return layer->vtable->LayerWhichShapes(layer, rect, isQuery);
 }
 
+/*
+** Items needed before shapes are read, and processing applied to each shape
+** once it passed the layer filter.  Shared by msLayerNextShape() and
+** msLayerNextShapes().
+*/
+static void msLayerPrepareNextShape(layerObj *layer)
+{
+#ifdef USE_V8_MAPSCRIPT
+  /* we need to force the GetItems for the geomtransform attributes */
+  if(!layer->items &&
+     layer->_geomtransform.type == MS_GEOMTRANSFORM_EXPRESSION &&
+     strstr(layer->_geomtransform.string, "javascript"))
+      msLayerGetItems(layer);
+#endif
+}
+
+static int msLayerFinishNextShape(layerObj *layer, shapeObj *shape)
+{
+  int rv = MS_SUCCESS;
+
+  /* RFC89 Apply Layer GeomTransform */
+  if(layer->_geomtransform.type != MS_GEOMTRANSFORM_NONE) {
+    rv = msGeomTransformShape(layer->map, layer, shape);      
+    if(rv != MS_SUCCESS)
+      return rv;
+  }
+
+  if(layer->encoding) {
+    rv = msLayerEncodeShapeAttributes(layer,shape);
+    if(rv != MS_SUCCESS)
+      return rv;
+  }
+
+  return rv;
+}
+
 /*
 ** Called after msWhichShapes has been called to actually retrieve shapes within a given area
 ** and matching a vendor specific filter (i.e. layer FILTER attribute).
@@ -308,13 +344,7 @@ int msLayerNextShape(layerObj *layer, shapeObj *shape)
       return rv;
   }
 
-#ifdef USE_V8_MAPSCRIPT
-  /* we need to force the GetItems for the geomtransform attributes */
-  if(!layer->items &&
-     layer->_geomtransform.type == MS_GEOMTRANSFORM_EXPRESSION &&
-     strstr(layer->_geomtransform.string, "javascript"))
-      msLayerGetItems(layer);
-#endif
+  msLayerPrepareNextShape(layer);
 
   /* At the end of switch case (default -> break; -> return MS_FAILURE),
    * was following TODO ITEM:
@@ -337,22 +367,372 @@ int msLayerNextShape(layerObj *layer, shapeObj *shape)
     if(!filter_passed) msFreeShape(shape);
   } while(!filter_passed);
 
-  /* RFC89 Apply Layer GeomTransform */
-  if(layer->_geomtransform.type != MS_GEOMTRANSFORM_NONE && rv == MS_SUCCESS) {
-    rv = msGeomTransformShape(layer->map, layer, shape);      
-    if(rv != MS_SUCCESS)
+  return msLayerFinishNextShape(layer, shape);
+}
+
+/*
+** Batched version of msLayerNextShape(): reads up to maxshapes shapes into
+** the shapes array (initialized by the caller) and sets *numshapes to the
+** number of shapes read.  Returns MS_SUCCESS if more shapes may follow,
+** MS_DONE if the layer has no more shapes after the *numshapes (possibly 0)
+** returned ones, MS_FAILURE on error in which case no shapes are returned.
+** Providers implementing LayerNextShapes follow the same convention.
+**
+** Shapes failing the layer filter are freed and the remaining ones moved to
+** the start of the array.  Shapes are swapped rather than overwritten so
+** that each slot keeps its own shape arena.
+*/
+int msLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  int i, n, rv;
+
+  *numshapes = 0;
+  if ( ! layer->vtable) {
+    rv =  msInitializeVirtualTable(layer);
+    if (rv != MS_SUCCESS)
       return rv;
   }
+  if(maxshapes < 1) {
+    msSetError(MS_MISCERR, "Invalid number of shapes: %d", "msLayerNextShapes()", maxshapes);
+    return MS_FAILURE;
+  }
 
-  if(layer->encoding) {
-    rv = msLayerEncodeShapeAttributes(layer,shape);
-    if(rv != MS_SUCCESS)
+  msLayerPrepareNextShape(layer);
+
+  /* RFC 91: MapServer-based filtering is done at a more general level. */
+  do {
+    rv = layer->vtable->LayerNextShapes(layer, shapes, maxshapes, numshapes);
+    if(rv != MS_SUCCESS && rv != MS_DONE) {
+      *numshapes = 0;
       return rv;
+    }
+
+    for(i=0, n=0; i<*numshapes; i++) {
+      if(!msEvalExpression(layer, &shapes[i], &(layer->filter), layer->filteritemindex)) {
+        msFreeShape(&shapes[i]);
+        continue;
+      }
+      if(i != n) {
+        shapeObj tmp = shapes[n];
+        shapes[n] = shapes[i];
+        shapes[i] = tmp;
+      }
+      n++;
+    }
+    *numshapes = n;
+  } while(n == 0 && rv == MS_SUCCESS);
+
+  for(i=0; i<n; i++) {
+    int status = msLayerFinishNextShape(layer, &shapes[i]);
+    if(status != MS_SUCCESS) {
+      for(i=0; i<n; i++)
+        msFreeShape(&shapes[i]);
+      *numshapes = 0;
+      return status;
+    }
   }
-  
+
   return rv;
 }
 
+/*
+** A shape batch hands out the shapes read by msLayerNextShapes() one at a time,
+** for loops written around msLayerNextShape().  When use_arenas is set every
+** slot of the batch gets its own shape arena (see mapshapearena.c), which is
+** handed out with the shape and recycled when the caller frees it.
+*/
+void msInitShapeBatch(shapeBatchObj *batch, int maxshapes, int use_arenas)
+{
+  int i;
+
+  batch->maxshapes = MS_MAX(1, maxshapes);
+  batch->numshapes = batch->current = 0;
+  batch->status = MS_SUCCESS;
+  batch->pipeline = NULL;
+  batch->shapes = (shapeObj*)msSmallMalloc(batch->maxshapes * sizeof(shapeObj));
+  for(i=0; i<batch->maxshapes; i++) {
+    msInitShape(&batch->shapes[i]);
+    if(use_arenas)
+      batch->shapes[i].arena = msShapeArenaCreate(0);
+  }
+}
+
+/*
+** Shape pipeline: a producer thread reads batches ahead into a ring of slots
+** while the caller of msShapeBatchNext() renders the previous ones.  Slots
+** circulate through two bounded queues, so at most numslots+1 batches of
+** shapes exist at any time and they are handed out in the order read.
+*/
+typedef struct {
+  shapeObj *shapes;
+  int numshapes;
+  int status; /* of the msLayerNextShapes() call that filled the slot */
+} shapePipelineSlot;
+
+typedef struct {
+  layerObj *layer;
+  int maxshapes, numslots;
+  shapePipelineSlot *slots;
+  msThreadQueue *filled; /* read by the producer, in order */
+  msThreadQueue *empty; /* handed back by msShapeBatchNext() */
+  msThreadHandle *thread;
+
+  /* debug settings of the calling thread, for the producer */
+  char *errorfile;
+  int debuglevel;
+
+  /* error raised by the producer, reported again by msShapeBatchNext() */
+  int errorcode;
+  char errorroutine[ROUTINELENGTH];
+  char errormessage[MESSAGELENGTH];
+} shapePipelineObj;
+
+static void msShapePipelineProducer(void *data)
+{
+  shapePipelineObj *pipeline = (shapePipelineObj*)data;
+  shapePipelineSlot *slot;
+
+  /* errors and debug output are thread specific */
+  if(pipeline->errorfile)
+    msSetErrorFile(pipeline->errorfile, NULL);
+  msSetGlobalDebugLevel(pipeline->debuglevel);
+
+  while((slot = (shapePipelineSlot*)msThreadQueuePop(pipeline->empty)) != NULL) {
+    slot->status = msLayerNextShapes(pipeline->layer, slot->shapes, pipeline->maxshapes, &slot->numshapes);
+    if(slot->status != MS_SUCCESS && slot->status != MS_DONE) {
+      errorObj *error = msGetErrorObj();
+      pipeline->errorcode = error->code;
+      strlcpy(pipeline->errorroutine, error->routine, sizeof(pipeline->errorroutine));
+      strlcpy(pipeline->errormessage, error->message, sizeof(pipeline->errormessage));
+    }
+    if(!msThreadQueuePush(pipeline->filled, slot) || slot->status != MS_SUCCESS)
+      break;
+  }
+
+  msResetErrorList();
+  msDebugCleanup();
+}
+
+/*
+** Swap the next batch read by the producer with the exhausted one of the
+** batch, which goes back to the producer.
+*/
+static int msShapePipelineNext(shapeBatchObj *batch)
+{
+  shapePipelineObj *pipeline = (shapePipelineObj*)batch->pipeline;
+  shapePipelineSlot *slot;
+  shapeObj *shapes;
+  int status;
+
+  slot = (shapePipelineSlot*)msThreadQueuePop(pipeline->filled);
+  if(!slot) {
+    batch->numshapes = 0;
+    msSetError(MS_MISCERR, "Shape pipeline stopped.", "msShapeBatchNext()");
+    return MS_FAILURE;
+  }
+
+  shapes = slot->shapes;
+  slot->shapes = batch->shapes;
+  batch->shapes = shapes;
+  batch->numshapes = slot->numshapes;
+  status = slot->status;
+  msThreadQueuePush(pipeline->empty, slot);
+
+  if(status != MS_SUCCESS && status != MS_DONE && pipeline->errorcode != MS_NOERR)
+    msSetError(pipeline->errorcode, "%s", pipeline->errorroutine, pipeline->errormessage);
+  return status;
+}
+
+/*
+** Stop the producer, after its current read.
+*/
+static void msShapePipelineStop(shapePipelineObj *pipeline)
+{
+  msThreadQueueClose(pipeline->empty);
+  msThreadQueueClose(pipeline->filled);
+  msThreadJoin(pipeline->thread);
+  pipeline->thread = NULL;
+}
+
+static void msShapePipelineFree(shapePipelineObj *pipeline, int maxshapes)
+{
+  int i, j;
+
+  msShapePipelineStop(pipeline);
+
+  for(j=0; j<pipeline->numslots; j++) {
+    for(i=0; i<maxshapes; i++) {
+      msFreeShape(&pipeline->slots[j].shapes[i]);
+      msShapeArenaDestroy(pipeline->slots[j].shapes[i].arena);
+    }
+    msFree(pipeline->slots[j].shapes);
+  }
+  msFree(pipeline->slots);
+  msThreadQueueDestroy(pipeline->empty);
+  msThreadQueueDestroy(pipeline->filled);
+  msFree(pipeline->errorfile);
+  msFree(pipeline);
+}
+
+/*
+** Read the shapes of the batch in a background thread, PROCESSING
+** "SHAPE_PIPELINE_DEPTH" batches ahead of the caller, which must not use the
+** layer for anything else until msFreeShapeBatch().  Returns MS_TRUE if the
+** thread was started, MS_FALSE if shapes are read by msShapeBatchNext() as
+** usual: the pipeline is off, the build has no thread support, or the layer
+** relies on state not safe to share between threads (STYLEITEM AUTO, which
+** reads the style of the feature read last, and javascript).
+*/
+int msShapeBatchStartPipeline(layerObj *layer, shapeBatchObj *batch)
+{
+  shapePipelineObj *pipeline;
+  const char *depth;
+  int i, j;
+
+  depth = msLayerGetProcessingKey(layer, "SHAPE_PIPELINE_DEPTH");
+  if(!depth || atoi(depth) < 1 || batch->pipeline || batch->numshapes > 0)
+    return MS_FALSE;
+  if(layer->styleitem && (strcasecmp(layer->styleitem, "AUTO") == 0 ||
+                          strncasecmp(layer->styleitem, "javascript://", 13) == 0))
+    return MS_FALSE;
+  if(layer->_geomtransform.type == MS_GEOMTRANSFORM_EXPRESSION &&
+     layer->_geomtransform.string && strstr(layer->_geomtransform.string, "javascript"))
+    return MS_FALSE;
+
+  pipeline = (shapePipelineObj*)msSmallCalloc(1, sizeof(shapePipelineObj));
+  pipeline->layer = layer;
+  pipeline->maxshapes = batch->maxshapes;
+  pipeline->numslots = atoi(depth);
+  pipeline->slots = (shapePipelineSlot*)msSmallMalloc(pipeline->numslots * sizeof(shapePipelineSlot));
+  pipeline->filled = msThreadQueueCreate(pipeline->numslots);
+  pipeline->empty = msThreadQueueCreate(pipeline->numslots);
+  for(j=0; j<pipeline->numslots; j++) {
+    pipeline->slots[j].shapes = (shapeObj*)msSmallMalloc(batch->maxshapes * sizeof(shapeObj));
+    for(i=0; i<batch->maxshapes; i++) {
+      msInitShape(&pipeline->slots[j].shapes[i]);
+      if(batch->shapes[0].arena)
+        pipeline->slots[j].shapes[i].arena = msShapeArenaCreate(0);
+    }
+    pipeline->slots[j].numshapes = 0;
+    pipeline->slots[j].status = MS_SUCCESS;
+    msThreadQueuePush(pipeline->empty, &pipeline->slots[j]);
+  }
+  if(msGetErrorFile())
+    pipeline->errorfile = msStrdup(msGetErrorFile());
+  pipeline->debuglevel = msGetGlobalDebugLevel();
+  pipeline->errorcode = MS_NOERR;
+
+  pipeline->thread = msThreadCreate(msShapePipelineProducer, pipeline);
+  if(!pipeline->thread) {
+    msShapePipelineFree(pipeline, batch->maxshapes);
+    return MS_FALSE;
+  }
+  batch->pipeline = pipeline;
+  return MS_TRUE;
+}
+
+/*
+** Replacement for msLayerNextShape(layer, shape).  The caller takes ownership
+** of the returned shape and must free it with msFreeShape() before asking for
+** the next one.  Whatever shape was held by shape is overwritten.
+*/
+int msShapeBatchNext(layerObj *layer, shapeBatchObj *batch, shapeObj *shape)
+{
+  shapeArenaObj *arena;
+
+  if(batch->current == batch->numshapes) {
+    if(batch->status != MS_SUCCESS)
+      return batch->status;
+    batch->current = 0;
+    if(batch->pipeline)
+      batch->status = msShapePipelineNext(batch);
+    else
+      batch->status = msLayerNextShapes(layer, batch->shapes, batch->maxshapes, &batch->numshapes);
+    if(batch->numshapes == 0)
+      return batch->status;
+  }
+
+  arena = batch->shapes[batch->current].arena;
+  *shape = batch->shapes[batch->current];
+  msInitShape(&batch->shapes[batch->current]);
+  batch->shapes[batch->current].arena = arena;
+  batch->current++;
+  return MS_SUCCESS;
+}
+
+/*
+** Free the shapes not handed out yet and the batch storage.  Shapes handed out
+** by msShapeBatchNext() must have been freed before, as their arenas are
+** destroyed here.
+*/
+void msFreeShapeBatch(shapeBatchObj *batch)
+{
+  int i;
+
+  if(!batch->shapes)
+    return;
+  if(batch->pipeline) {
+    msShapePipelineFree((shapePipelineObj*)batch->pipeline, batch->maxshapes);
+    batch->pipeline = NULL;
+  }
+  for(i=0; i<batch->maxshapes; i++) {
+    msFreeShape(&batch->shapes[i]);
+    msShapeArenaDestroy(batch->shapes[i].arena);
+  }
+  msFree(batch->shapes);
+  batch->shapes = NULL;
+  batch->numshapes = batch->current = 0;
+}
+
+/*
+** Number of shapes to read per msLayerNextShapes() call, PROCESSING
+** "SHAPE_BATCH_SIZE" or MS_SHAPE_BATCH_DEFAULT_SIZE.  Always 1 with STYLEITEM
+** AUTO, as providers then take the style from the feature read last.
+*/
+int msLayerGetShapeBatchSize(layerObj *layer)
+{
+  const char *batch_size;
+
+  if(layer->styleitem && strcasecmp(layer->styleitem, "AUTO") == 0)
+    return 1;
+  batch_size = msLayerGetProcessingKey(layer, "SHAPE_BATCH_SIZE");
+  if(batch_size)
+    return MS_MAX(1, atoi(batch_size));
+  return MS_SHAPE_BATCH_DEFAULT_SIZE;
+}
+
+/*
+** Sum of the shape arena statistics of a batch, for debug output.  Stops the
+** producer of a pipelined batch, which must not be read from anymore.
+*/
+void msShapeBatchGetArenaStats(shapeBatchObj *batch, long *allocations, long *resets)
+{
+  int i;
+
+  if(batch->pipeline)
+    msShapePipelineStop((shapePipelineObj*)batch->pipeline);
+
+  *allocations = *resets = 0;
+  for(i=0; i<batch->maxshapes; i++) {
+    if(batch->shapes[i].arena) {
+      *allocations += batch->shapes[i].arena->allocations;
+      *resets += batch->shapes[i].arena->resets;
+    }
+  }
+  if(batch->pipeline) {
+    shapePipelineObj *pipeline = (shapePipelineObj*)batch->pipeline;
+    int j;
+    for(j=0; j<pipeline->numslots; j++) {
+      for(i=0; i<batch->maxshapes; i++) {
+        if(pipeline->slots[j].shapes[i].arena) {
+          *allocations += pipeline->slots[j].shapes[i].arena->allocations;
+          *resets += pipeline->slots[j].shapes[i].arena->resets;
+        }
+      }
+    }
+  }
+}
+
 /*
 ** Used to retrieve a shape from a result set by index. Result sets are created by the various
 ** msQueryBy...() functions. The index is assigned by the data source.
@@ -1499,6 +1879,32 @@ int LayerDefaultNextShape(layerObj *layer, shapeObj *shape)
   return MS_FAILURE;
 }
 
+/*
+** Default batched read for providers without a native one, loops over
+** LayerNextShape.  LayerNextShape must not be called again once it returned
+** MS_DONE (some providers restart from the first shape), hence MS_DONE is
+** returned along with the last shapes.
+*/
+int LayerDefaultNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes)
+{
+  int rv = MS_SUCCESS, i;
+
+  *numshapes = 0;
+  while(*numshapes < maxshapes) {
+    rv = layer->vtable->LayerNextShape(layer, &shapes[*numshapes]);
+    if(rv != MS_SUCCESS)
+      break;
+    (*numshapes)++;
+  }
+
+  if(rv == MS_SUCCESS || rv == MS_DONE)
+    return rv;
+  for(i=0; i<*numshapes; i++)
+    msFreeShape(&shapes[i]);
+  *numshapes = 0;
+  return rv;
+}
+
 int LayerDefaultGetShape(layerObj *layer, shapeObj *shape, resultObj *record)
 {
   return MS_FAILURE;
@@ -1805,6 +2211,7 @@ static int populateVirtualTable(layerVTableObj *vtable)
   vtable->LayerWhichShapes = LayerDefaultWhichShapes;
 
   vtable->LayerNextShape = LayerDefaultNextShape;
+  vtable->LayerNextShapes = LayerDefaultNextShapes;
   /* vtable->LayerResultsGetShape = LayerDefaultResultsGetShape; */
   vtable->LayerGetShape = LayerDefaultGetShape;
   vtable->LayerClose = LayerDefaultClose;
@@ -1909,6 +2316,12 @@ int msInitializeVirtualTable(layerObj *layer)
     case(MS_CONTOUR):
       return(msContourLayerInitializeVirtualTable(layer));
       break;      
+    case(MS_FEATURESTORE):
+      return(msFeatureStoreLayerInitializeVirtualTable(layer));
+      break;
+    case(MS_FLATGEOBUF):
+      return(msFlatGeobufLayerInitializeVirtualTable(layer));
+      break;
     default:
       msSetError(MS_MISCERR, "Unknown connectiontype, it was %d", "msInitializeVirtualTable()", layer->connectiontype);
       return MS_FAILURE;
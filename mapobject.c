@@ -223,6 +223,8 @@ void msApplyMapConfigOptions( mapObj *map )
       msSetPROJ_LIB( value, map->mappath );
     } else if( strcasecmp(key,"MS_ERRORFILE") == 0 ) {
       msSetErrorFile( value, map->mappath );
+    } else if( strcasecmp(key,"MS_RASTER_BUFFER_POOL_SIZE") == 0 ) {
+      msRasterBufferPoolSetSize( atoi(value) );
     } else {
 
 #if defined(USE_GDAL) && GDAL_RELEASE_DATE > 20030601
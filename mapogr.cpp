@@ -38,6 +38,7 @@
 #  include "gdal_version.h"
 #  include "cpl_conv.h"
 #  include "cpl_string.h"
+#  include "cpl_vsi.h"
 #  include "ogr_srs_api.h"
 #endif
 
@@ -48,11 +49,14 @@
 
 #include "ogr_api.h"
 
+typedef struct ms_ogr_ds_cache_entry_t ms_ogr_ds_cache_entry;
+
 typedef struct ms_ogr_file_info_t {
   char        *pszFname;
   char        *pszLayerDef;
   int         nLayerIndex;
   OGRDataSourceH hDS;
+  ms_ogr_ds_cache_entry *psCacheEntry;  /* NULL if hDS is from the connection pool */
   OGRLayerH   hLayer;
   OGRFeatureH hLastFeature;
 
@@ -1069,6 +1073,234 @@ void msOGRInitialize(void)
 
 #ifdef USE_OGR
 
+/**********************************************************************
+ *                     msOGROpenDataSource()
+ *
+ * OGROpen() a datasource, reporting failures with msSetError().
+ **********************************************************************/
+static OGRDataSourceH msOGROpenDataSource(layerObj *layer, const char *pszName)
+{
+  OGRDataSourceH hDS;
+
+  if( layer->debug )
+    msDebug("OGROPen(%s)\n", pszName);
+
+  CPLErrorReset();
+  ACQUIRE_OGR_LOCK;
+  hDS = OGROpen( pszName, MS_FALSE, NULL );
+  RELEASE_OGR_LOCK;
+
+  if( hDS == NULL ) {
+    if( strlen(CPLGetLastErrorMsg()) == 0 )
+      msSetError(MS_OGRERR,
+                 "Open failed for OGR connection in layer `%s'.  "
+                 "File not found or unsupported format.",
+                 "msOGRFileOpen()",
+                 layer->name?layer->name:"(null)" );
+    else
+      msSetError(MS_OGRERR,
+                 "Open failed for OGR connection in layer `%s'.\n%s\n",
+                 "msOGRFileOpen()",
+                 layer->name?layer->name:"(null)",
+                 CPLGetLastErrorMsg() );
+  }
+
+  return hDS;
+}
+
+/**********************************************************************
+ *                     OGR datasource cache
+ *
+ * Datasources stored in files (GeoPackage, FileGDB, shapefiles...) are
+ * kept open across requests instead of going through the connection
+ * pool, which closes them as soon as the last layer using them is closed
+ * (unless CLOSE_CONNECTION=DEFER is set).
+ *
+ * Like pooled connections, an entry is only shared between layers of
+ * the same thread.  Idle entries beyond the cache size are closed, least
+ * recently used first.  The modification time and size of the file are
+ * checked on every request: a changed file is reopened, the old handle is
+ * closed once its last user releases it.
+ *
+ * The cache size defaults to MS_OGR_DS_CACHE_SIZE and is set with the
+ * MS_OGR_DATASOURCE_CACHE_SIZE config option, 0 disables the cache.
+ **********************************************************************/
+#define MS_OGR_DS_CACHE_SIZE 16
+
+struct ms_ogr_ds_cache_entry_t {
+  char        *pszName;     /* name the datasource was opened with */
+  OGRDataSourceH hDS;
+  time_t      nMTime;
+  vsi_l_offset nSize;
+  int         nRefCount;    /* open layers using hDS */
+  void        *pThreadId;   /* thread using hDS, when nRefCount > 0 */
+  int         bStale;       /* file changed, close when released */
+  struct ms_ogr_ds_cache_entry_t *psNext; /* most recently used first */
+};
+
+static ms_ogr_ds_cache_entry *psOGRDSCache = NULL; /* protected by TLOCK_OGR_DSCACHE */
+
+static void msOGRDataSourceCacheClose( ms_ogr_ds_cache_entry *psEntry )
+{
+  while( psEntry != NULL ) {
+    ms_ogr_ds_cache_entry *psNext = psEntry->psNext;
+
+    ACQUIRE_OGR_LOCK;
+    OGR_DS_Destroy( psEntry->hDS );
+    RELEASE_OGR_LOCK;
+    msFree( psEntry->pszName );
+    free( psEntry );
+    psEntry = psNext;
+  }
+}
+
+/**********************************************************************
+ *                     msOGRDataSourceCacheAcquire()
+ *
+ * Returns MS_SUCCESS with *ppsEntry set to a cached (possibly just
+ * opened) datasource, MS_DONE if pszName should not be cached (cache
+ * disabled, or not a file) or MS_FAILURE if opening failed.
+ **********************************************************************/
+static int msOGRDataSourceCacheAcquire( layerObj *layer, const char *pszName,
+                                        ms_ogr_ds_cache_entry **ppsEntry )
+{
+  const char *pszValue;
+  int nCacheSize = MS_OGR_DS_CACHE_SIZE, nCount = 0;
+  VSIStatBufL sStat;
+  ms_ogr_ds_cache_entry *psEntry, *psPrev, *psNext, *psClose = NULL;
+  void *pThreadId = msGetThreadId();
+  OGRDataSourceH hDS;
+
+  *ppsEntry = NULL;
+
+  pszValue = msLayerGetProcessingKey( layer, "CLOSE_CONNECTION" );
+  if( pszValue && strcasecmp(pszValue, "ALWAYS") == 0 )
+    return MS_DONE;
+  pszValue = msGetConfigOption( layer->map, "MS_OGR_DATASOURCE_CACHE_SIZE" );
+  if( pszValue != NULL )
+    nCacheSize = atoi(pszValue);
+  if( nCacheSize <= 0 || VSIStatL( pszName, &sStat ) != 0 )
+    return MS_DONE;
+
+  msAcquireLock( TLOCK_OGR_DSCACHE );
+  for( psEntry = psOGRDSCache, psPrev = NULL; psEntry != NULL; psEntry = psNext ) {
+    psNext = psEntry->psNext;
+    if( psEntry->bStale || strcmp(psEntry->pszName, pszName) != 0 ) {
+      psPrev = psEntry;
+      continue;
+    }
+    if( psEntry->nMTime != sStat.st_mtime || psEntry->nSize != (vsi_l_offset)sStat.st_size ) {
+      if( layer->debug )
+        msDebug("msOGRDataSourceCacheAcquire(%s): file changed, reopening.\n", pszName);
+      psEntry->bStale = MS_TRUE;
+      if( psEntry->nRefCount == 0 ) {
+        if( psPrev ) psPrev->psNext = psNext;
+        else psOGRDSCache = psNext;
+        psEntry->psNext = psClose;
+        psClose = psEntry;
+      } else
+        psPrev = psEntry;
+      continue;
+    }
+    if( psEntry->nRefCount == 0 || psEntry->pThreadId == pThreadId ) {
+      psEntry->nRefCount++;
+      psEntry->pThreadId = pThreadId;
+      if( psPrev ) { /* move to the front */
+        psPrev->psNext = psNext;
+        psEntry->psNext = psOGRDSCache;
+        psOGRDSCache = psEntry;
+      }
+      msReleaseLock( TLOCK_OGR_DSCACHE );
+      msOGRDataSourceCacheClose( psClose );
+      if( layer->debug )
+        msDebug("msOGRDataSourceCacheAcquire(%s) -> got %p\n", pszName, psEntry->hDS);
+      *ppsEntry = psEntry;
+      return MS_SUCCESS;
+    }
+    psPrev = psEntry; /* in use by another thread, open another handle */
+  }
+  msReleaseLock( TLOCK_OGR_DSCACHE );
+  msOGRDataSourceCacheClose( psClose );
+  psClose = NULL;
+
+  /* open outside of the lock, this is the slow part */
+  hDS = msOGROpenDataSource( layer, pszName );
+  if( hDS == NULL )
+    return MS_FAILURE;
+
+  psEntry = (ms_ogr_ds_cache_entry *) msSmallCalloc( 1, sizeof(ms_ogr_ds_cache_entry) );
+  psEntry->pszName = msStrdup( pszName );
+  psEntry->hDS = hDS;
+  psEntry->nMTime = sStat.st_mtime;
+  psEntry->nSize = (vsi_l_offset)sStat.st_size;
+  psEntry->nRefCount = 1;
+  psEntry->pThreadId = pThreadId;
+
+  msAcquireLock( TLOCK_OGR_DSCACHE );
+  psEntry->psNext = psOGRDSCache;
+  psOGRDSCache = psEntry;
+  /* drop idle entries past the cache size */
+  for( psPrev = psEntry, psNext = psEntry->psNext, nCount = 1; psNext != NULL; psNext = psPrev->psNext ) {
+    if( psNext->nRefCount == 0 && ++nCount > nCacheSize ) {
+      psPrev->psNext = psNext->psNext;
+      psNext->psNext = psClose;
+      psClose = psNext;
+    } else
+      psPrev = psNext;
+  }
+  msReleaseLock( TLOCK_OGR_DSCACHE );
+  msOGRDataSourceCacheClose( psClose );
+
+  *ppsEntry = psEntry;
+  return MS_SUCCESS;
+}
+
+/**********************************************************************
+ *                     msOGRDataSourceCacheRelease()
+ **********************************************************************/
+static void msOGRDataSourceCacheRelease( layerObj *layer, ms_ogr_ds_cache_entry *psEntry )
+{
+  ms_ogr_ds_cache_entry *psIter, *psPrev = NULL;
+
+  if( layer->debug )
+    msDebug("msOGRDataSourceCacheRelease(%s,%p)\n", psEntry->pszName, psEntry->hDS);
+
+  msAcquireLock( TLOCK_OGR_DSCACHE );
+  if( --psEntry->nRefCount > 0 || !psEntry->bStale ) {
+    if( psEntry->nRefCount == 0 )
+      psEntry->pThreadId = NULL;
+    msReleaseLock( TLOCK_OGR_DSCACHE );
+    return;
+  }
+  /* last user of a changed file */
+  for( psIter = psOGRDSCache; psIter != NULL && psIter != psEntry; psIter = psIter->psNext )
+    psPrev = psIter;
+  if( psIter != NULL ) {
+    if( psPrev ) psPrev->psNext = psEntry->psNext;
+    else psOGRDSCache = psEntry->psNext;
+  }
+  msReleaseLock( TLOCK_OGR_DSCACHE );
+
+  psEntry->psNext = NULL;
+  msOGRDataSourceCacheClose( psEntry );
+}
+
+/**********************************************************************
+ *                     msOGRDataSourceCacheCleanup()
+ *
+ * Close all cached datasources, called from msOGRCleanup().
+ **********************************************************************/
+static void msOGRDataSourceCacheCleanup(void)
+{
+  ms_ogr_ds_cache_entry *psEntries;
+
+  msAcquireLock( TLOCK_OGR_DSCACHE );
+  psEntries = psOGRDSCache;
+  psOGRDSCache = NULL;
+  msReleaseLock( TLOCK_OGR_DSCACHE );
+  msOGRDataSourceCacheClose( psEntries );
+}
+
 /**********************************************************************
  *                     msOGRFileOpen()
  *
@@ -1133,51 +1365,45 @@ msOGRFileOpen(layerObj *layer, const char *connection )
     pszLayerDef = CPLStrdup("0");
 
   /* -------------------------------------------------------------------- */
-  /*      Can we get an existing connection for this layer?               */
+  /*      File datasources come from the datasource cache.                */
   /* -------------------------------------------------------------------- */
-  OGRDataSourceH hDS;
+  OGRDataSourceH hDS = NULL;
+  ms_ogr_ds_cache_entry *psCacheEntry = NULL;
+  char szPath[MS_MAXPATHLEN] = "";
+  const char *pszDSSelectedName = pszDSName;
+
+  if (msTryBuildPath3(szPath, layer->map->mappath,
+                      layer->map->shapepath, pszDSName) != NULL ||
+      msTryBuildPath(szPath, layer->map->mappath, pszDSName) != NULL) {
+    /* Use relative path */
+    pszDSSelectedName = szPath;
+  }
+
+  int nStatus = msOGRDataSourceCacheAcquire( layer, pszDSSelectedName, &psCacheEntry );
+  if( nStatus == MS_FAILURE ) {
+    CPLFree( pszDSName );
+    CPLFree( pszLayerDef );
+    return NULL;
+  }
+  if( nStatus == MS_SUCCESS )
+    hDS = psCacheEntry->hDS;
 
-  hDS = (OGRDataSourceH) msConnPoolRequest( layer );
+  /* -------------------------------------------------------------------- */
+  /*      Otherwise can we get an existing connection for this layer?     */
+  /* -------------------------------------------------------------------- */
+  if( hDS == NULL )
+    hDS = (OGRDataSourceH) msConnPoolRequest( layer );
 
   /* -------------------------------------------------------------------- */
   /*      If not, open now, and register this connection with the         */
   /*      pool.                                                           */
   /* -------------------------------------------------------------------- */
   if( hDS == NULL ) {
-    char szPath[MS_MAXPATHLEN] = "";
-    const char *pszDSSelectedName = pszDSName;
-
     if( layer->debug )
       msDebug("msOGRFileOpen(%s)...\n", connection);
 
-    CPLErrorReset();
-    if (msTryBuildPath3(szPath, layer->map->mappath,
-                        layer->map->shapepath, pszDSName) != NULL ||
-        msTryBuildPath(szPath, layer->map->mappath, pszDSName) != NULL) {
-      /* Use relative path */
-      pszDSSelectedName = szPath;
-    }
-
-    if( layer->debug )
-      msDebug("OGROPen(%s)\n", pszDSSelectedName);
-
-    ACQUIRE_OGR_LOCK;
-    hDS = OGROpen( pszDSSelectedName, MS_FALSE, NULL );
-    RELEASE_OGR_LOCK;
-
+    hDS = msOGROpenDataSource( layer, pszDSSelectedName );
     if( hDS == NULL ) {
-      if( strlen(CPLGetLastErrorMsg()) == 0 )
-        msSetError(MS_OGRERR,
-                   "Open failed for OGR connection in layer `%s'.  "
-                   "File not found or unsupported format.",
-                   "msOGRFileOpen()",
-                   layer->name?layer->name:"(null)" );
-      else
-        msSetError(MS_OGRERR,
-                   "Open failed for OGR connection in layer `%s'.\n%s\n",
-                   "msOGRFileOpen()",
-                   layer->name?layer->name:"(null)",
-                   CPLGetLastErrorMsg() );
       CPLFree( pszDSName );
       CPLFree( pszLayerDef );
       return NULL;
@@ -1207,7 +1433,10 @@ msOGRFileOpen(layerObj *layer, const char *connection )
                  "msOGRFileOpen()",
                  pszLayerDef, CPLGetLastErrorMsg() );
       RELEASE_OGR_LOCK;
-      msConnPoolRelease( layer, hDS );
+      if( psCacheEntry )
+        msOGRDataSourceCacheRelease( layer, psCacheEntry );
+      else
+        msConnPoolRelease( layer, hDS );
       CPLFree( pszLayerDef );
       return NULL;
     }
@@ -1241,7 +1470,10 @@ msOGRFileOpen(layerObj *layer, const char *connection )
                "msOGRFileOpen()",
                pszLayerDef, connection );
     CPLFree( pszLayerDef );
-    msConnPoolRelease( layer, hDS );
+    if( psCacheEntry )
+      msOGRDataSourceCacheRelease( layer, psCacheEntry );
+    else
+      msConnPoolRelease( layer, hDS );
     return NULL;
   }
 
@@ -1254,6 +1486,7 @@ msOGRFileOpen(layerObj *layer, const char *connection )
   psInfo->pszLayerDef = pszLayerDef;
   psInfo->nLayerIndex = nLayerIndex;
   psInfo->hDS = hDS;
+  psInfo->psCacheEntry = psCacheEntry;
   psInfo->hLayer = hLayer;
 
   psInfo->nTileId = 0;
@@ -1304,11 +1537,24 @@ static int msOGRFileClose(layerObj *layer, msOGRFileInfo *psInfo )
   /* If nLayerIndex == -1 then the layer is an SQL result ... free it */
   if( psInfo->nLayerIndex == -1 )
     OGR_DS_ReleaseResultSet( psInfo->hDS, psInfo->hLayer );
+  else if( psInfo->hLayer ) {
+    /* The datasource may be pooled or cached: leave the layer as the */
+    /* next user expects to find it. */
+    OGR_L_SetSpatialFilter( psInfo->hLayer, NULL );
+    OGR_L_SetAttributeFilter( psInfo->hLayer, NULL );
+#if GDAL_VERSION_NUM >= 1800
+    OGR_L_SetIgnoredFields( psInfo->hLayer, NULL );
+#endif
+    OGR_L_ResetReading( psInfo->hLayer );
+  }
 
   // Release (potentially close) the datasource connection.
   // Make sure we aren't holding the lock when the callback may need it.
   RELEASE_OGR_LOCK;
-  msConnPoolRelease( layer, psInfo->hDS );
+  if( psInfo->psCacheEntry )
+    msOGRDataSourceCacheRelease( layer, psInfo->psCacheEntry );
+  else
+    msConnPoolRelease( layer, psInfo->hDS );
 
   // Free current tile if there is one.
   if( psInfo->poCurTile != NULL )
@@ -2438,6 +2684,60 @@ int msOGRLayerGetItems(layerObj *layer)
 #endif /* USE_OGR */
 }
 
+/**********************************************************************
+ *                     msOGRLayerSetIgnoredFields()
+ *
+ * Tell OGR not to fetch the fields of the source layer that are not in
+ * layer->items, so drivers supporting it skip decoding them.  Must be
+ * called whenever items[] changes: an empty items[] ignores all fields.
+ **********************************************************************/
+#if defined(USE_OGR) && GDAL_VERSION_NUM >= 1800
+static void msOGRLayerSetIgnoredFields(layerObj *layer, OGRLayerH hLayer)
+{
+  OGRFeatureDefnH hDefn;
+  char **papszIgnored = NULL;
+  char *pabyUsed;
+  int i, nFields, bKeepStyle;
+
+  /* a native filter may reference any field */
+  if (msLayerGetProcessingKey(layer, "NATIVE_FILTER") != NULL)
+    return;
+
+  ACQUIRE_OGR_LOCK;
+  if((hDefn = OGR_L_GetLayerDefn( hLayer )) == NULL) {
+    RELEASE_OGR_LOCK;
+    return;
+  }
+
+  nFields = OGR_FD_GetFieldCount( hDefn );
+  pabyUsed = (char *) msSmallCalloc(nFields + 1, 1);
+  bKeepStyle = (layer->styleitem && EQUAL(layer->styleitem, "AUTO"));
+  for(i=0; i<layer->numitems; i++) {
+    int iField = layer->iteminfo ? ((int*)layer->iteminfo)[i] : -1;
+    if (iField >= 0 && iField < nFields)
+      pabyUsed[iField] = MS_TRUE;
+    else if (iField < 0)
+      bKeepStyle = MS_TRUE; /* one of the OGR style string pseudo fields */
+  }
+
+  for(i=0; i<nFields; i++) {
+    if (!pabyUsed[i])
+      papszIgnored = CSLAddString(papszIgnored,
+                                  OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(hDefn, i)));
+  }
+  if (!bKeepStyle)
+    papszIgnored = CSLAddString(papszIgnored, "OGR_STYLE");
+
+  if (OGR_L_SetIgnoredFields( hLayer, (const char **) papszIgnored ) != OGRERR_NONE
+      && layer->debug)
+    msDebug("msOGRLayerSetIgnoredFields(): OGR_L_SetIgnoredFields() failed.\n");
+  RELEASE_OGR_LOCK;
+
+  CSLDestroy(papszIgnored);
+  msFree(pabyUsed);
+}
+#endif /* defined(USE_OGR) && GDAL_VERSION_NUM >= 1800 */
+
 /**********************************************************************
  *                     msOGRLayerInitItemInfo()
  *
@@ -2450,8 +2750,15 @@ static int msOGRLayerInitItemInfo(layerObj *layer)
   int   i;
   OGRFeatureDefnH hDefn;
 
-  if (layer->numitems == 0)
+  if (layer->numitems == 0) {
+#if GDAL_VERSION_NUM >= 1800
+    if( psInfo != NULL && layer->tileindex != NULL )
+      psInfo = psInfo->poCurTile;
+    if( psInfo != NULL && psInfo->hLayer != NULL )
+      msOGRLayerSetIgnoredFields( layer, psInfo->hLayer );
+#endif
     return MS_SUCCESS;
+  }
 
   if( layer->tileindex != NULL ) {
     if( psInfo->poCurTile == NULL
@@ -2551,6 +2858,10 @@ static int msOGRLayerInitItemInfo(layerObj *layer)
     }
   }
 
+#if GDAL_VERSION_NUM >= 1800
+  msOGRLayerSetIgnoredFields( layer, psInfo->hLayer );
+#endif
+
   return(MS_SUCCESS);
 #else
   /* ------------------------------------------------------------------
@@ -3583,6 +3894,8 @@ void msOGRCleanup( void )
 
 {
 #if defined(USE_OGR)
+  msOGRDataSourceCacheCleanup();
+
   ACQUIRE_OGR_LOCK;
   if( bOGRDriversRegistered == MS_TRUE ) {
     CPLPopErrorHandler();
@@ -3657,7 +3970,9 @@ int msOGRLayerInitializeVirtualTable(layerObj *layer)
   /* layer->vtable->LayerGetNumFeatures, use default */
   /* layer->vtable->LayerGetAutoProjection, use defaut*/
 
+#ifdef USE_OGR
   layer->vtable->LayerEscapeSQLParam = msOGREscapeSQLParam;
+#endif
   layer->vtable->LayerEscapePropertyName = msOGREscapePropertyName;
 
   return MS_SUCCESS;
@@ -102,6 +102,7 @@ void msInitShape(shapeObj *shape)
 
   shape->geometry = NULL;
   shape->renderer_cache = NULL;
+  shape->arena = NULL;
 
   /* annotation component */
   shape->text = NULL;
@@ -152,13 +153,14 @@ int msCopyShape(shapeObj *from, shapeObj *to)
 void msFreeShape(shapeObj *shape)
 {
   int c;
+  shapeArenaObj *arena;
 
   if(!shape) return; /* for safety */
 
   for (c= 0; c < shape->numlines; c++)
-    free(shape->line[c].point);
+    msShapeFreeStorage(shape, shape->line[c].point);
 
-  if (shape->line) free(shape->line);
+  msShapeFreeStorage(shape, shape->line);
   if(shape->values) msFreeCharArray(shape->values, shape->numvalues);
   if(shape->text) free(shape->text);
 
@@ -166,7 +168,14 @@ void msFreeShape(shapeObj *shape)
   msGEOSFreeGeometry(shape);
 #endif
 
+  /* the arena only holds this shape's storage, recycle it all at once and
+     keep it attached for the next feature read into this shape */
+  arena = shape->arena;
   msInitShape(shape); /* now reset */
+  if(arena) {
+    msShapeArenaReset(arena);
+    shape->arena = arena;
+  }
 }
 
 void msFreeLabelPathObj(labelPathObj *path)
@@ -184,7 +193,7 @@ void msShapeDeleteLine( shapeObj *shape, int line )
     return;
   }
 
-  free( shape->line[line].point );
+  msShapeFreeStorage( shape, shape->line[line].point );
   if( line < shape->numlines - 1 ) {
     memmove( shape->line + line,
              shape->line + line + 1,
@@ -195,7 +204,7 @@ void msShapeDeleteLine( shapeObj *shape, int line )
 
 void msComputeBounds(shapeObj *shape)
 {
-  int i, j;
+  int i;
   if(shape->numlines <= 0) return;
   for(i=0; i<shape->numlines; i++) {
     if(shape->line[i].numpoints > 0) {
@@ -206,14 +215,8 @@ void msComputeBounds(shapeObj *shape)
   }
   if(i == shape->numlines) return;
 
-  for( i=0; i<shape->numlines; i++ ) {
-    for( j=0; j<shape->line[i].numpoints; j++ ) {
-      shape->bounds.minx = MS_MIN(shape->bounds.minx, shape->line[i].point[j].x);
-      shape->bounds.maxx = MS_MAX(shape->bounds.maxx, shape->line[i].point[j].x);
-      shape->bounds.miny = MS_MIN(shape->bounds.miny, shape->line[i].point[j].y);
-      shape->bounds.maxy = MS_MAX(shape->bounds.maxy, shape->line[i].point[j].y);
-    }
-  }
+  for( ; i<shape->numlines; i++ )
+    msPointArrayExtendBounds(shape->line[i].point, shape->line[i].numpoints, &shape->bounds);
 }
 
 /* checks to see if ring r is an outer ring of shape */
@@ -332,7 +335,7 @@ int msAddLineDirectly(shapeObj *p, lineObj *new_line)
     p->line = (lineObj *) malloc(sizeof(lineObj));
     MS_CHECK_ALLOC(p->line, sizeof(lineObj), MS_FAILURE);
   } else {
-    p->line = (lineObj *) realloc(p->line, (p->numlines+1)*sizeof(lineObj));
+    p->line = (lineObj *) msShapeReallocStorage(p, p->line, p->numlines*sizeof(lineObj), (p->numlines+1)*sizeof(lineObj));
     MS_CHECK_ALLOC(p->line, (p->numlines+1)*sizeof(lineObj), MS_FAILURE);
   }
 
@@ -461,18 +464,65 @@ static int clipLine(double *x1, double *y1, double *x2, double *y2, rectObj rect
   return(MS_TRUE);
 }
 
+#define MS_CLIP_INSIDE 0
+#define MS_CLIP_OUTSIDE 1
+#define MS_CLIP_CROSSES 2
+
+/*
+** Compare the bounds of a single line (or ring) to the clip rectangle, so
+** that lines completely inside or completely outside of it can be kept or
+** dropped without running the clipping algorithm on them.
+*/
+static int msClipLineBoundsTest(lineObj *line, rectObj *rect)
+{
+  rectObj bounds;
+
+  if(line->numpoints < 1)
+    return MS_CLIP_OUTSIDE;
+
+  bounds.minx = bounds.maxx = line->point[0].x;
+  bounds.miny = bounds.maxy = line->point[0].y;
+  msPointArrayExtendBounds(line->point + 1, line->numpoints - 1, &bounds);
+
+  if(bounds.maxx <= rect->maxx && bounds.minx >= rect->minx &&
+      bounds.maxy <= rect->maxy && bounds.miny >= rect->miny)
+    return MS_CLIP_INSIDE;
+  if(bounds.maxx < rect->minx || bounds.minx > rect->maxx ||
+      bounds.maxy < rect->miny || bounds.miny > rect->maxy)
+    return MS_CLIP_OUTSIDE;
+  return MS_CLIP_CROSSES;
+}
+
+/* append a line to the line array being built by msClipPolylineRect() */
+static int msClipAppendLine(shapeObj *shape, lineObj **lines, int *numlines, int *maxlines, pointObj *point, int numpoints)
+{
+  if(*numlines == *maxlines) {
+    lineObj *newlines = (lineObj *)msShapeReallocStorage(shape, *lines, *numlines*sizeof(lineObj), 2 * *maxlines * sizeof(lineObj));
+    MS_CHECK_ALLOC(newlines, 2 * *maxlines * sizeof(lineObj), MS_FAILURE);
+    *lines = newlines;
+    *maxlines *= 2;
+  }
+  (*lines)[*numlines].point = point;
+  (*lines)[*numlines].numpoints = numpoints;
+  (*numlines)++;
+  return MS_SUCCESS;
+}
+
 /*
 ** Routine for clipping a polyline, stored in a shapeObj struct, to a
-** rectangle. Uses clipLine() function to create a new shapeObj.
+** rectangle. Uses clipLine() function to clip each segment.
+**
+** Lines completely inside the rectangle are kept as is and lines completely
+** outside of it are dropped.  The parts of a line crossing the rectangle
+** edges are written to one buffer, which for arena backed shapes is shared
+** by all the parts and trimmed to the points actually used.
 */
 void msClipPolylineRect(shapeObj *shape, rectObj rect)
 {
   int i,j;
-  lineObj line= {0,NULL};
+  lineObj *lines;
+  int numlines=0, maxlines;
   double x1, x2, y1, y2;
-  shapeObj tmp;
-
-  memset( &tmp, 0, sizeof(shapeObj) );
 
   if(shape->numlines == 0) /* nothing to clip */
     return;
@@ -491,71 +541,120 @@ void msClipPolylineRect(shapeObj *shape, rectObj rect)
     return;
   }
 
+  maxlines = shape->numlines;
+  lines = (lineObj *)msShapeAllocStorage(shape, maxlines*sizeof(lineObj));
+  MS_CHECK_ALLOC_NO_RET(lines, maxlines*sizeof(lineObj));
+
   for(i=0; i<shape->numlines; i++) {
+    lineObj *in = &(shape->line[i]);
+    pointObj *buffer;
+    int maxpoints, first=0, numpoints=0, shared, status;
 
-    line.point = (pointObj *)msSmallMalloc(sizeof(pointObj)*shape->line[i].numpoints);
-    line.numpoints = 0;
+    status = msClipLineBoundsTest(in, &rect);
+    if(status == MS_CLIP_INSIDE) {
+      if(msClipAppendLine(shape, &lines, &numlines, &maxlines, in->point, in->numpoints) != MS_SUCCESS)
+        break;
+      in->point = NULL; /* now owned by lines */
+      continue;
+    } else if(status == MS_CLIP_OUTSIDE) {
+      continue;
+    }
 
-    x1 = shape->line[i].point[0].x;
-    y1 = shape->line[i].point[0].y;
-    for(j=1; j<shape->line[i].numpoints; j++) {
-      x2 = shape->line[i].point[j].x;
-      y2 = shape->line[i].point[j].y;
+    /*
+    ** A part has at most in->numpoints points.  All the parts together have
+    ** at most two points per segment.
+    */
+    maxpoints = shape->arena ? 2*(in->numpoints-1) : in->numpoints;
+    buffer = (pointObj *)msShapeAllocStorage(shape, sizeof(pointObj)*maxpoints);
+    if(!buffer) {
+      msSetError(MS_MEMERR, "Out of memory allocating %u bytes.", "msClipPolylineRect()",
+                 (unsigned int)(sizeof(pointObj)*maxpoints));
+      break;
+    }
+    shared = shape->arena && msShapeArenaOwns(shape->arena, buffer);
+
+    x1 = in->point[0].x;
+    y1 = in->point[0].y;
+    for(j=1; j<in->numpoints; j++) {
+      pointObj *line = buffer + first;
+      x2 = in->point[j].x;
+      y2 = in->point[j].y;
 
       if(clipLine(&x1,&y1,&x2,&y2,rect) == MS_TRUE) {
-        if(line.numpoints == 0) { /* first segment, add both points */
-          line.point[0].x = x1;
-          line.point[0].y = y1;
-          line.point[1].x = x2;
-          line.point[1].y = y2;
-          line.numpoints = 2;
+        if(numpoints == 0) { /* first segment, add both points */
+          line[0].x = x1;
+          line[0].y = y1;
+          line[1].x = x2;
+          line[1].y = y2;
+          numpoints = 2;
         } else { /* add just the last point */
-          line.point[line.numpoints].x = x2;
-          line.point[line.numpoints].y = y2;
-          line.numpoints++;
+          line[numpoints].x = x2;
+          line[numpoints].y = y2;
+          numpoints++;
         }
 
-        if((x2 != shape->line[i].point[j].x) || (y2 != shape->line[i].point[j].y)) {
-          msAddLine(&tmp, &line);
-          line.numpoints = 0; /* new line */
+        if((x2 != in->point[j].x) || (y2 != in->point[j].y)) { /* line leaves the rectangle, start a new part */
+          if(shared) {
+            if(msClipAppendLine(shape, &lines, &numlines, &maxlines, line, numpoints) != MS_SUCCESS)
+              break;
+            first += numpoints;
+          } else {
+            pointObj *copy = (pointObj *)msSmallMalloc(sizeof(pointObj)*numpoints);
+            memcpy(copy, line, sizeof(pointObj)*numpoints);
+            if(msClipAppendLine(shape, &lines, &numlines, &maxlines, copy, numpoints) != MS_SUCCESS) {
+              free(copy);
+              break;
+            }
+          }
+          numpoints = 0; /* new line */
         }
       }
 
-      x1 = shape->line[i].point[j].x;
-      y1 = shape->line[i].point[j].y;
+      x1 = in->point[j].x;
+      y1 = in->point[j].y;
     }
 
-    if(line.numpoints > 0) {
-      msAddLineDirectly(&tmp, &line);
-    } else {
-      free(line.point);
-      line.numpoints = 0; /* new line */
+    if(numpoints > 0) {
+      if(msClipAppendLine(shape, &lines, &numlines, &maxlines, buffer + first, numpoints) == MS_SUCCESS) {
+        first += numpoints;
+        if(!shared)
+          buffer = NULL; /* now owned by lines */
+      }
     }
+    if(shared)
+      msShapeShrinkStorage(shape, buffer, sizeof(pointObj)*maxpoints, sizeof(pointObj)*first);
+    else
+      free(buffer);
   }
 
-  for (i=0; i<shape->numlines; i++) free(shape->line[i].point);
-  free(shape->line);
+  for (i=0; i<shape->numlines; i++) msShapeFreeStorage(shape, shape->line[i].point);
+  msShapeFreeStorage(shape, shape->line);
 
-  shape->line = tmp.line;
-  shape->numlines = tmp.numlines;
+  if(numlines == 0) {
+    msShapeFreeStorage(shape, lines);
+    lines = NULL;
+  }
+  shape->line = lines;
+  shape->numlines = numlines;
   msComputeBounds(shape);
 }
 
 /*
 ** Slightly modified version of the Liang-Barsky polygon clipping algorithm
+**
+** Rings completely inside the rectangle are kept as is and rings completely
+** outside of it are dropped (clipping them would only produce a degenerate
+** ring along the rectangle edges).  Each ring yields at most one ring, so
+** the clipped rings replace the original ones in place in shape->line.
 */
 void msClipPolygonRect(shapeObj *shape, rectObj rect)
 {
-  int i, j;
+  int i, j, numlines=0;
   double deltax, deltay, xin,xout,  yin,yout;
   double tinx,tiny,  toutx,touty,  tin1, tin2,  tout;
   double x1,y1, x2,y2;
-
-  shapeObj tmp;
   lineObj line= {0,NULL};
 
-  msInitShape(&tmp);
-
   if(shape->numlines == 0) /* nothing to clip */
     return;
 
@@ -574,16 +673,33 @@ void msClipPolygonRect(shapeObj *shape, rectObj rect)
   }
 
   for(j=0; j<shape->numlines; j++) {
+    lineObj in = shape->line[j];
+    int status = msClipLineBoundsTest(&in, &rect);
+
+    if(status == MS_CLIP_INSIDE) {
+      shape->line[numlines++] = in;
+      continue;
+    } else if(status == MS_CLIP_OUTSIDE) {
+      msShapeFreeStorage(shape, in.point);
+      continue;
+    }
 
-    line.point = (pointObj *)msSmallMalloc(sizeof(pointObj)*2*shape->line[j].numpoints+1); /* worst case scenario, +1 allows us to duplicate the 1st and last point */
+    /* worst case scenario, 3 points per segment plus the closing point */
+    line.point = (pointObj *)msShapeAllocStorage(shape, sizeof(pointObj)*3*in.numpoints);
+    if(!line.point) {
+      msSetError(MS_MEMERR, "Out of memory allocating %u bytes.", "msClipPolygonRect()",
+                 (unsigned int)(sizeof(pointObj)*3*in.numpoints));
+      msShapeFreeStorage(shape, in.point);
+      continue;
+    }
     line.numpoints = 0;
 
-    for (i = 0; i < shape->line[j].numpoints-1; i++) {
+    for (i = 0; i < in.numpoints-1; i++) {
 
-      x1 = shape->line[j].point[i].x;
-      y1 = shape->line[j].point[i].y;
-      x2 = shape->line[j].point[i+1].x;
-      y2 = shape->line[j].point[i+1].y;
+      x1 = in.point[i].x;
+      y1 = in.point[i].y;
+      x2 = in.point[i+1].x;
+      y2 = in.point[i+1].y;
 
       deltax = x2-x1;
       if (deltax == 0) { /* bump off of the vertical */
@@ -676,21 +792,24 @@ void msClipPolygonRect(shapeObj *shape, rectObj rect)
       }
     }
 
+    msShapeFreeStorage(shape, in.point);
     if(line.numpoints > 0) {
       line.point[line.numpoints].x = line.point[0].x; /* force closure */
       line.point[line.numpoints].y = line.point[0].y;
       line.numpoints++;
-      msAddLineDirectly(&tmp, &line);
+      msShapeShrinkStorage(shape, line.point, sizeof(pointObj)*3*in.numpoints, sizeof(pointObj)*line.numpoints);
+      shape->line[numlines++] = line;
     } else {
-      free(line.point);
+      msShapeShrinkStorage(shape, line.point, sizeof(pointObj)*3*in.numpoints, 0);
+      msShapeFreeStorage(shape, line.point);
     }
   } /* next line */
 
-  for (i=0; i<shape->numlines; i++) free(shape->line[i].point);
-  free(shape->line);
-
-  shape->line = tmp.line;
-  shape->numlines = tmp.numlines;
+  shape->numlines = numlines;
+  if(numlines == 0) {
+    msShapeFreeStorage(shape, shape->line);
+    shape->line = NULL;
+  }
   msComputeBounds(shape);
 
   return;
@@ -849,21 +968,18 @@ void msTransformShapeSimplify(shapeObj *shape, rectObj extent, double cellsize)
         continue; /*skip degenerate lines*/
       }
       point=shape->line[i].point;
+      msTransformPointArray(point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 0);
       /*always keep first point*/
-      point[0].x = MS_MAP2IMAGE_X_IC_DBL(point[0].x, extent.minx, inv_cs);
-      point[0].y = MS_MAP2IMAGE_Y_IC_DBL(point[0].y, extent.maxy, inv_cs);
       beforelast=shape->line[i].numpoints-1;
       for(j=1,k=1; j < beforelast; j++ ) { /*loop from second point to first-before-last point*/
-        point[k].x = MS_MAP2IMAGE_X_IC_DBL(point[j].x, extent.minx, inv_cs);
-        point[k].y = MS_MAP2IMAGE_Y_IC_DBL(point[j].y, extent.maxy, inv_cs);
+        point[k] = point[j];
         dx=(point[k].x-point[k-1].x);
         dy=(point[k].y-point[k-1].y);
         if(dx*dx+dy*dy>1)
           k++;
       }
       /* try to keep last point */
-      point[k].x = MS_MAP2IMAGE_X_IC_DBL(point[j].x, extent.minx, inv_cs);
-      point[k].y = MS_MAP2IMAGE_Y_IC_DBL(point[j].y, extent.maxy, inv_cs);
+      point[k] = point[j];
       /* discard last point if equal to the one before it */
       if(point[k].x!=point[k-1].x || point[k].y!=point[k-1].y) {
         shape->line[i].numpoints=k+1;
@@ -892,15 +1008,11 @@ void msTransformShapeSimplify(shapeObj *shape, rectObj extent, double cellsize)
         continue; /*skip degenerate lines*/
       }
       point=shape->line[i].point;
+      msTransformPointArray(point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 0);
       /*always keep first and second point*/
-      point[0].x = MS_MAP2IMAGE_X_IC_DBL(point[0].x, extent.minx, inv_cs);
-      point[0].y = MS_MAP2IMAGE_Y_IC_DBL(point[0].y, extent.maxy, inv_cs);
-      point[1].x = MS_MAP2IMAGE_X_IC_DBL(point[1].x, extent.minx, inv_cs);
-      point[1].y = MS_MAP2IMAGE_Y_IC_DBL(point[1].y, extent.maxy, inv_cs);
       beforelast=shape->line[i].numpoints-2;
       for(j=2,k=2; j < beforelast; j++ ) { /*loop from second point to second-before-last point*/
-        point[k].x = MS_MAP2IMAGE_X_IC_DBL(point[j].x, extent.minx, inv_cs);
-        point[k].y = MS_MAP2IMAGE_Y_IC_DBL(point[j].y, extent.maxy, inv_cs);
+        point[k] = point[j];
         dx=(point[k].x-point[k-1].x);
         dy=(point[k].y-point[k-1].y);
         if(dx*dx+dy*dy>1)
@@ -908,26 +1020,19 @@ void msTransformShapeSimplify(shapeObj *shape, rectObj extent, double cellsize)
       }
       /*always keep last two points (the last point is the repetition of the
        * first one */
-      point[k].x = MS_MAP2IMAGE_X_IC_DBL(point[j].x, extent.minx, inv_cs);
-      point[k].y = MS_MAP2IMAGE_Y_IC_DBL(point[j].y, extent.maxy, inv_cs);
-      point[k+1].x = MS_MAP2IMAGE_X_IC_DBL(point[j+1].x, extent.minx, inv_cs);
-      point[k+1].y = MS_MAP2IMAGE_Y_IC_DBL(point[j+1].y, extent.maxy, inv_cs);
+      point[k] = point[j];
+      point[k+1] = point[j+1];
       shape->line[i].numpoints = k+2;
       ok = 1;
     }
   } else { /* only for untyped shapes, as point layers don't go through this function */
-    for(i=0; i<shape->numlines; i++) {
-      point=shape->line[i].point;
-      for(j=0; j<shape->line[i].numpoints; j++) {
-        point[j].x = MS_MAP2IMAGE_X_IC_DBL(point[j].x, extent.minx, inv_cs);
-        point[j].y = MS_MAP2IMAGE_Y_IC_DBL(point[j].y, extent.maxy, inv_cs);
-      }
-    }
+    for(i=0; i<shape->numlines; i++)
+      msTransformPointArray(shape->line[i].point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 0);
     ok = 1;
   }
   if(!ok) {
     for(i=0; i<shape->numlines; i++) {
-      free(shape->line[i].point);
+      msShapeFreeStorage(shape, shape->line[i].point);
     }
     shape->numlines = 0 ;
   }
@@ -948,16 +1053,152 @@ void  msTransformShape(shapeObj *shape, rectObj extent, double cellsize, imageOb
       msTransformShapeToPixelRound(shape, extent, cellsize);
     } else if(renderer->transform_mode == MS_TRANSFORM_FULLRESOLUTION) {
       msTransformShapeToPixelDoublePrecision(shape,extent,cellsize);
-    } else if(renderer->transform_mode == MS_TRANSFORM_NONE) {
-      /* nothing to do */
+    } else {
+      /* MS_TRANSFORM_NONE or unknown, nothing to do */
       return;
     }
-    /* unknown, do nothing */
+    if(renderer->generalization_tolerance > 0 &&
+        (shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON))
+      msGeneralizeShapePixels(shape, renderer->generalization_tolerance,
+                              &renderer->generalization_vertices_in, &renderer->generalization_vertices_out);
     return;
   }
   msTransformShapeToPixelRound(shape, extent, cellsize);
 }
 
+/*
+** Douglas-Peucker simplification of point[first..last], flagging the vertices
+** to keep in keep[].  The recursion is unrolled on the caller supplied stack
+** (2 entries per point) so long lines cannot overflow the call stack.
+*/
+static void msDouglasPeuckerMark(pointObj *point, int first, int last, double sqtolerance, char *keep, int *stack)
+{
+  int sp = 0;
+
+  keep[first] = keep[last] = 1;
+  stack[sp++] = first;
+  stack[sp++] = last;
+  while(sp > 0) {
+    int b = stack[--sp], a = stack[--sp], i, farthest = -1;
+    double dx = point[b].x - point[a].x, dy = point[b].y - point[a].y;
+    double sqlen = dx*dx + dy*dy, sqmax = sqtolerance;
+
+    for(i=a+1; i<b; i++) {
+      /* squared distance from the vertex to the segment a-b */
+      double px = point[i].x - point[a].x, py = point[i].y - point[a].y, sqd;
+      if(sqlen > 0) {
+        double t = (px*dx + py*dy) / sqlen;
+        if(t > 1) t = 1;
+        else if(t < 0) t = 0;
+        px -= t*dx;
+        py -= t*dy;
+      }
+      sqd = px*px + py*py;
+      if(sqd > sqmax) {
+        sqmax = sqd;
+        farthest = i;
+      }
+    }
+    if(farthest >= 0) {
+      keep[farthest] = 1;
+      stack[sp++] = a;
+      stack[sp++] = farthest;
+      stack[sp++] = farthest;
+      stack[sp++] = b;
+    }
+  }
+}
+
+/*
+** Generalize a shape already transformed to pixel coordinates, dropping the
+** vertices that deviate less than tolerance pixels from the simplified line.
+** Line end points are always kept, and polygon rings keep at least three
+** distinct vertices so that no ring collapses or disappears.  The vertex
+** counts before and after are added to *vertices_in and *vertices_out.
+*/
+void msGeneralizeShapePixels(shapeObj *shape, double tolerance, long *vertices_in, long *vertices_out)
+{
+  int i, j, n, maxpoints = 0;
+  int is_polygon = (shape->type == MS_SHAPE_POLYGON);
+  double sqtolerance = tolerance * tolerance;
+  char *keep;
+  int *stack;
+
+  for(i=0; i<shape->numlines; i++)
+    maxpoints = MS_MAX(maxpoints, shape->line[i].numpoints);
+  if(maxpoints < 3 || tolerance <= 0) {
+    for(i=0; i<shape->numlines; i++) {
+      *vertices_in += shape->line[i].numpoints;
+      *vertices_out += shape->line[i].numpoints;
+    }
+    return;
+  }
+
+  keep = (char*)msSmallMalloc(maxpoints);
+  stack = (int*)msSmallMalloc(2 * maxpoints * sizeof(int));
+
+  for(i=0; i<shape->numlines; i++) {
+    lineObj *line = &(shape->line[i]);
+    pointObj *point = line->point;
+
+    *vertices_in += line->numpoints;
+    /* rings need 4 points (3 distinct + closing) and cannot be reduced below that */
+    if(line->numpoints < (is_polygon ? 5 : 3)) {
+      *vertices_out += line->numpoints;
+      continue;
+    }
+    memset(keep, 0, line->numpoints);
+
+    if(is_polygon) {
+      int last = line->numpoints - 1, split = 1, third = -1;
+      double sqd, sqmax = -1;
+
+      /* a closed ring has no meaningful base segment, split it at the vertex
+         farthest from the start and simplify the two halves */
+      for(j=1; j<last; j++) {
+        sqd = (point[j].x - point[0].x) * (point[j].x - point[0].x) +
+              (point[j].y - point[0].y) * (point[j].y - point[0].y);
+        if(sqd > sqmax) {
+          sqmax = sqd;
+          split = j;
+        }
+      }
+      msDouglasPeuckerMark(point, 0, split, sqtolerance, keep, stack);
+      msDouglasPeuckerMark(point, split, last, sqtolerance, keep, stack);
+      keep[last] = 1;
+
+      /* ring collapse protection: if only the start and the split vertex
+         survived, also keep the vertex farthest from the line between them */
+      for(j=1, n=0; j<last; j++)
+        if(keep[j]) n++;
+      if(n < 2) {
+        double dx = point[split].x - point[0].x, dy = point[split].y - point[0].y, cross;
+        sqmax = -1;
+        for(j=1; j<last; j++) {
+          if(j == split) continue;
+          cross = (point[j].x - point[0].x) * dy - (point[j].y - point[0].y) * dx;
+          if(cross*cross > sqmax) {
+            sqmax = cross*cross;
+            third = j;
+          }
+        }
+        if(third >= 0) keep[third] = 1;
+      }
+    } else {
+      msDouglasPeuckerMark(point, 0, line->numpoints - 1, sqtolerance, keep, stack);
+    }
+
+    for(j=0, n=0; j<line->numpoints; j++) {
+      if(keep[j]) point[n++] = point[j];
+    }
+    line->numpoints = n;
+    *vertices_out += n;
+  }
+
+  free(keep);
+  free(stack);
+}
+
 void msTransformShapeToPixelSnapToGrid(shapeObj *shape, rectObj extent, double cellsize, double grid_resolution)
 {
   int i,j,k; /* loop counters */
@@ -996,11 +1237,9 @@ void msTransformShapeToPixelSnapToGrid(shapeObj *shape, rectObj extent, double c
       else
         snap = 0;
       if(snap) {
-        shape->line[i].point[0].x = x0;
-        shape->line[i].point[0].y = y0;
+        msTransformPointArray(shape->line[i].point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, grid_resolution);
         for(j=1, k=1; j < shape->line[i].numpoints; j++ ) {
-          shape->line[i].point[k].x = MS_MAP2IMAGE_X_IC_SNAP(shape->line[i].point[j].x, extent.minx, inv_cs, grid_resolution);
-          shape->line[i].point[k].y = MS_MAP2IMAGE_Y_IC_SNAP(shape->line[i].point[j].y, extent.maxy, inv_cs, grid_resolution);
+          shape->line[i].point[k] = shape->line[i].point[j];
           if(shape->line[i].point[k].x!=shape->line[i].point[k-1].x || shape->line[i].point[k].y!=shape->line[i].point[k-1].y)
             k++;
         }
@@ -1013,19 +1252,14 @@ void msTransformShapeToPixelSnapToGrid(shapeObj *shape, rectObj extent, double c
           shape->line[i].point[1].y = MS_MAP2IMAGE_Y_IC_DBL(shape->line[i].point[shape->line[i].numpoints-1].y, extent.maxy, inv_cs);
           shape->line[i].numpoints = 2;
         } else {
-          for(j=0; j < shape->line[i].numpoints; j++ ) {
-            shape->line[i].point[j].x = MS_MAP2IMAGE_X_IC_DBL(shape->line[i].point[j].x, extent.minx, inv_cs);
-            shape->line[i].point[j].y = MS_MAP2IMAGE_Y_IC_DBL(shape->line[i].point[j].y, extent.maxy, inv_cs);
-          }
+          msTransformPointArray(shape->line[i].point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 0);
         }
       }
     }
   } else { /* points or untyped shapes */
     for(i=0; i<shape->numlines; i++) { /* for each part */
-      for(j=1; j < shape->line[i].numpoints; j++ ) {
-        shape->line[i].point[j].x = MS_MAP2IMAGE_X_IC_DBL(shape->line[i].point[j].x, extent.minx, inv_cs);
-        shape->line[i].point[j].y = MS_MAP2IMAGE_Y_IC_DBL(shape->line[i].point[j].y, extent.maxy, inv_cs);
-      }
+      if(shape->line[i].numpoints > 1)
+        msTransformPointArray(shape->line[i].point + 1, shape->line[i].numpoints - 1, extent.minx, extent.maxy, inv_cs, 0);
     }
   }
 
@@ -1039,37 +1273,27 @@ void msTransformShapeToPixelRound(shapeObj *shape, rectObj extent, double cellsi
   inv_cs = 1.0 / cellsize; /* invert and multiply much faster */
   if(shape->type == MS_SHAPE_LINE || shape->type == MS_SHAPE_POLYGON) { /* remove duplicate vertices */
     for(i=0; i<shape->numlines; i++) { /* for each part */
-      shape->line[i].point[0].x = MS_MAP2IMAGE_X_IC(shape->line[i].point[0].x, extent.minx, inv_cs);;
-      shape->line[i].point[0].y = MS_MAP2IMAGE_Y_IC(shape->line[i].point[0].y, extent.maxy, inv_cs);
+      msTransformPointArray(shape->line[i].point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 1);
       for(j=1, k=1; j < shape->line[i].numpoints; j++ ) {
-        shape->line[i].point[k].x = MS_MAP2IMAGE_X_IC(shape->line[i].point[j].x, extent.minx, inv_cs);
-        shape->line[i].point[k].y = MS_MAP2IMAGE_Y_IC(shape->line[i].point[j].y, extent.maxy, inv_cs);
+        shape->line[i].point[k] = shape->line[i].point[j];
         if(shape->line[i].point[k].x!=shape->line[i].point[k-1].x || shape->line[i].point[k].y!=shape->line[i].point[k-1].y)
           k++;
       }
       shape->line[i].numpoints=k;
     }
   } else { /* points or untyped shapes */
-    for(i=0; i<shape->numlines; i++) { /* for each part */
-      for(j=0; j < shape->line[i].numpoints; j++ ) {
-        shape->line[i].point[j].x = MS_MAP2IMAGE_X_IC(shape->line[i].point[j].x, extent.minx, inv_cs);
-        shape->line[i].point[j].y = MS_MAP2IMAGE_Y_IC(shape->line[i].point[j].y, extent.maxy, inv_cs);
-      }
-    }
+    for(i=0; i<shape->numlines; i++) /* for each part */
+      msTransformPointArray(shape->line[i].point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 1);
   }
 
 }
 
 void msTransformShapeToPixelDoublePrecision(shapeObj *shape, rectObj extent, double cellsize)
 {
-  int i,j; /* loop counters */
+  int i; /* loop counter */
   double inv_cs = 1.0 / cellsize; /* invert and multiply much faster */
-  for(i=0; i<shape->numlines; i++) {
-    for(j=0; j<shape->line[i].numpoints; j++) {
-      shape->line[i].point[j].x = MS_MAP2IMAGE_X_IC_DBL(shape->line[i].point[j].x, extent.minx, inv_cs);
-      shape->line[i].point[j].y = MS_MAP2IMAGE_Y_IC_DBL(shape->line[i].point[j].y, extent.maxy, inv_cs);
-    }
-  }
+  for(i=0; i<shape->numlines; i++)
+    msTransformPointArray(shape->line[i].point, shape->line[i].numpoints, extent.minx, extent.maxy, inv_cs, 0);
 }
 
 
@@ -75,6 +75,7 @@ typedef struct {
   char **values;
   void *geometry;
   void *renderer_cache;
+  struct shapeArenaObj *arena; /* if set, line storage may come from this arena, see mapshapearena.c */
 #endif
 
 #ifdef SWIG
@@ -303,6 +303,7 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
   pointObj  lastPoint, thisPoint, wrkPoint;
   lineObj *line = shape->line + line_index;
   lineObj *line_out = line;
+  pointObj *points;
   int valid_flag = 0; /* 1=true, -1=false, 0=unknown */
   int numpoints_in = line->numpoints;
   int line_alloc = numpoints_in;
@@ -467,9 +468,12 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
              */
             line_alloc = line_alloc * 2;
 
-            line_out->point = (pointObj *)
-                              realloc(line_out->point,
-                                      sizeof(pointObj) * line_alloc);
+            points = (pointObj *)
+                     msShapeReallocStorage(shape, line_out->point,
+                                           sizeof(pointObj) * line_out->numpoints,
+                                           sizeof(pointObj) * line_alloc);
+            MS_CHECK_ALLOC(points, sizeof(pointObj) * line_alloc, MS_FAILURE);
+            line_out->point = points;
           }
 
           line_out->point[line_out->numpoints++] = startPoint;
@@ -490,9 +494,14 @@ msProjectShapeLine(projectionObj *in, projectionObj *out,
       && line_out->numpoints > 2
       && (line_out->point[0].x != line_out->point[line_out->numpoints-1].x
           || line_out->point[0].y != line_out->point[line_out->numpoints-1].y) ) {
-    /* make a copy because msAddPointToLine can realloc the array */
+    /* make a copy because the array gets realloc'ed */
     pointObj sFirstPoint = line_out->point[0];
-    msAddPointToLine( line_out, &sFirstPoint );
+    points = (pointObj *) msShapeReallocStorage(shape, line_out->point,
+                                              sizeof(pointObj) * line_out->numpoints,
+                                              sizeof(pointObj) * (line_out->numpoints + 1));
+    MS_CHECK_ALLOC(points, sizeof(pointObj) * (line_out->numpoints + 1), MS_FAILURE);
+    line_out->point = points;
+    line_out->point[line_out->numpoints++] = sFirstPoint;
   }
 
   return(MS_SUCCESS);
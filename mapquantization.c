@@ -45,8 +45,14 @@
  */
 
 #include "mapserver.h"
+#include "mapthread.h"
+#include "mapsimd.h"
 #include <stdlib.h>
 
+#if defined(MS_HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+
 #define PAM_GETR(p) ((p).r)
 #define PAM_GETG(p) ((p).g)
 #define PAM_GETB(p) ((p).b)
@@ -264,6 +270,578 @@ int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb)
 }
 
 
+/*
+ ** Inverse colormaps: map a RGBA color to the index of its closest palette
+ ** entry through a lookup table over a reduced color cube.  The red, green
+ ** and blue components are reduced to 5 bits, and the alpha component to 18
+ ** levels that keep fully transparent and fully opaque pixels apart from the
+ ** partially transparent ones.  Cells are filled the first time a color
+ ** falls in them (or all at once by msFillInverseColormap()), with the
+ ** palette entry closest to the center of the cell.
+ **
+ ** Cells containing palette colors are flagged with ICM_EXACT and point to
+ ** the list of those entries, so that pixels drawn with a palette color are
+ ** always mapped to that very entry.
+ */
+#define ICM_ALPHA_LEVELS 18
+#define ICM_NUM_CELLS (32*32*32*ICM_ALPHA_LEVELS)
+#define ICM_UNSET 0xFFFF
+#define ICM_EXACT 0x8000
+
+#define ICM_ALPHA_LEVEL(a) ((a) == 0 ? 0 : (a) == 255 ? ICM_ALPHA_LEVELS - 1 : 1 + (((a) - 1) >> 4))
+#define ICM_CELL(r,g,b,a) \
+    ((((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3)) * ICM_ALPHA_LEVELS) + ICM_ALPHA_LEVEL(a))
+
+typedef struct {
+  int nearest; /* entry closest to the center of the cell */
+  int count;
+  unsigned char entries[256]; /* entries inside the cell */
+} icmExactCell;
+
+struct inverseColormapObj {
+  rgbaPixel palette[256];
+  int num_entries;
+  unsigned short *cells;
+  icmExactCell *exact;
+  int complete; /* all cells are set, read only from now on */
+};
+
+static int msNearestPaletteEntry(const rgbaPixel *palette, int num_entries,
+                                 int r, int g, int b, int a)
+{
+  int i, ind = 0;
+  long dist = 2000000000, newdist;
+
+  for(i=0; i<num_entries; i++) {
+    int dr = r - palette[i].r;
+    int dg = g - palette[i].g;
+    int db = b - palette[i].b;
+    int da = a - palette[i].a;
+    newdist = dr*dr + dg*dg + db*db + da*da;
+    if(newdist < dist) {
+      ind = i;
+      dist = newdist;
+      if(dist == 0) break;
+    }
+  }
+  return ind;
+}
+
+static int msInverseColormapAlpha(int alevel)
+{
+  if(alevel == 0)
+    return 0;
+  if(alevel == ICM_ALPHA_LEVELS - 1)
+    return 255;
+  return 1 + ((alevel - 1) << 4) + 8;
+}
+
+/* center of a cell, premultiplied colors can't exceed their alpha */
+static void msInverseColormapCellCenter(int cell, int *r, int *g, int *b, int *a)
+{
+  int rgb = cell / ICM_ALPHA_LEVELS;
+
+  *a = msInverseColormapAlpha(cell % ICM_ALPHA_LEVELS);
+  *r = MS_MIN(((rgb >> 10) << 3) | 4, *a);
+  *g = MS_MIN((((rgb >> 5) & 31) << 3) | 4, *a);
+  *b = MS_MIN(((rgb & 31) << 3) | 4, *a);
+}
+
+static int msInverseColormapFillCell(inverseColormapObj *icm, int cell)
+{
+  int r, g, b, a;
+
+  msInverseColormapCellCenter(cell, &r, &g, &b, &a);
+  icm->cells[cell] = msNearestPaletteEntry(icm->palette, icm->num_entries, r, g, b, a);
+  return icm->cells[cell];
+}
+
+/* closest entry to a pixel falling in a flagged cell */
+static int msInverseColormapExact(const inverseColormapObj *icm, int value, const rgbaPixel *pP)
+{
+  const icmExactCell *ec = icm->exact + (value & 0xFF);
+  int i;
+
+  for(i=0; i<ec->count; i++) {
+    const rgbaPixel *c = icm->palette + ec->entries[i];
+    if(c->r == pP->r && c->g == pP->g && c->b == pP->b && c->a == pP->a)
+      return ec->entries[i];
+  }
+  return ec->nearest;
+}
+
+/**
+ * Compute all the cells of an inverse colormap, after which it is read only
+ * and can be shared between threads.  The cube is processed in blocks, and
+ * only the palette entries that can be the closest to some point of a block
+ * are considered for its cells.
+ */
+void msFillInverseColormap(inverseColormapObj *icm)
+{
+  int alevel, br, bg, bb, i;
+  int candidates[256], ncandidates;
+
+  if(icm->complete) return;
+
+  for(alevel=0; alevel<ICM_ALPHA_LEVELS; alevel++) {
+    int a = msInverseColormapAlpha(alevel);
+    for(br=0; br<32; br+=4) {
+      for(bg=0; bg<32; bg+=4) {
+        for(bb=0; bb<32; bb+=4) {
+          /* extent of the cell centers of this block */
+          int lo[3], hi[3], r, g, b;
+          long threshold = -1;
+
+          lo[0] = MS_MIN((br << 3) | 4, a);
+          hi[0] = MS_MIN(((br + 3) << 3) | 4, a);
+          lo[1] = MS_MIN((bg << 3) | 4, a);
+          hi[1] = MS_MIN(((bg + 3) << 3) | 4, a);
+          lo[2] = MS_MIN((bb << 3) | 4, a);
+          hi[2] = MS_MIN(((bb + 3) << 3) | 4, a);
+
+          for(i=0; i<icm->num_entries; i++) {
+            int v[3], c;
+            long maxdist = (long)(icm->palette[i].a - a) * (icm->palette[i].a - a);
+            v[0] = icm->palette[i].r;
+            v[1] = icm->palette[i].g;
+            v[2] = icm->palette[i].b;
+            for(c=0; c<3; c++) {
+              long d = MS_MAX(abs(v[c] - lo[c]), abs(v[c] - hi[c]));
+              maxdist += d * d;
+            }
+            if(threshold < 0 || maxdist < threshold)
+              threshold = maxdist;
+          }
+
+          ncandidates = 0;
+          for(i=0; i<icm->num_entries; i++) {
+            int v[3], c;
+            long mindist = (long)(icm->palette[i].a - a) * (icm->palette[i].a - a);
+            v[0] = icm->palette[i].r;
+            v[1] = icm->palette[i].g;
+            v[2] = icm->palette[i].b;
+            for(c=0; c<3; c++) {
+              long d = (v[c] < lo[c]) ? lo[c] - v[c] : (v[c] > hi[c]) ? v[c] - hi[c] : 0;
+              mindist += d * d;
+            }
+            if(mindist <= threshold)
+              candidates[ncandidates++] = i;
+          }
+
+          for(r=br; r<br+4; r++) {
+            for(g=bg; g<bg+4; g++) {
+              for(b=bb; b<bb+4; b++) {
+                int cell = ((r << 10) | (g << 5) | b) * ICM_ALPHA_LEVELS + alevel;
+                int cr, cg, cb, ca, best = 0;
+                long dist = 2000000000;
+
+                if(icm->cells[cell] != ICM_UNSET) continue;
+                msInverseColormapCellCenter(cell, &cr, &cg, &cb, &ca);
+                for(i=0; i<ncandidates; i++) {
+                  const rgbaPixel *p = icm->palette + candidates[i];
+                  long d = (long)(cr - p->r) * (cr - p->r) + (long)(cg - p->g) * (cg - p->g) +
+                           (long)(cb - p->b) * (cb - p->b) + (long)(ca - p->a) * (ca - p->a);
+                  if(d < dist) {
+                    dist = d;
+                    best = candidates[i];
+                  }
+                }
+                icm->cells[cell] = best;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  icm->complete = MS_TRUE;
+}
+
+/**
+ * Create an (empty) inverse colormap for the given palette. The palette is
+ * copied.
+ */
+inverseColormapObj* msCreateInverseColormap(const rgbaPixel *palette, int num_entries)
+{
+  inverseColormapObj *icm = (inverseColormapObj*)msSmallMalloc(sizeof(inverseColormapObj));
+
+  int i, nexact = 0;
+
+  num_entries = MS_MAX(1, MS_MIN(num_entries, 256));
+  memcpy(icm->palette, palette, num_entries * sizeof(rgbaPixel));
+  icm->num_entries = num_entries;
+  icm->complete = MS_FALSE;
+  /* one spare cell so that the SIMD gathers can read 32 bits at the last one */
+  icm->cells = (unsigned short*)msSmallMalloc((ICM_NUM_CELLS + 1) * sizeof(unsigned short));
+  memset(icm->cells, 0xFF, (ICM_NUM_CELLS + 1) * sizeof(unsigned short));
+  icm->exact = (icmExactCell*)msSmallMalloc(num_entries * sizeof(icmExactCell));
+
+  /* flag the cells containing palette colors */
+  for(i=0; i<num_entries; i++) {
+    const rgbaPixel *p = icm->palette + i;
+    int cell = ICM_CELL(p->r, p->g, p->b, p->a);
+    icmExactCell *ec;
+
+    if(icm->cells[cell] == ICM_UNSET) {
+      ec = icm->exact + nexact;
+      ec->nearest = msInverseColormapFillCell(icm, cell);
+      ec->count = 0;
+      icm->cells[cell] = ICM_EXACT | nexact++;
+    } else {
+      ec = icm->exact + (icm->cells[cell] & 0xFF);
+    }
+    ec->entries[ec->count++] = i;
+  }
+
+  return icm;
+}
+
+void msFreeInverseColormap(inverseColormapObj *icm)
+{
+  if(!icm) return;
+  free(icm->cells);
+  free(icm->exact);
+  free(icm);
+}
+
+/**
+ * Same as msClassifyRasterBuffer(), but using an inverse colormap created for
+ * the palette of qrb. Pixels are mapped by a single table lookup, at the cost
+ * of some precision for colors closer than the size of the table cells.
+ */
+#if defined(MS_HAVE_X86_SIMD)
+/* classify 8 pixels at a time with a gather from a complete inverse colormap */
+MS_SIMD_TARGET_AVX2
+static int msClassifyRowAVX2(const inverseColormapObj *icm, const rgbaPixel *pP,
+                             unsigned char *pQ, int width)
+{
+  const __m256i mask5 = _mm256_set1_epi32(31);
+  const __m256i ones = _mm256_set1_epi32(1);
+  const __m256i opaque = _mm256_set1_epi32(255);
+  const __m256i levels = _mm256_set1_epi32(ICM_ALPHA_LEVELS);
+  const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+  const __m256i exact = _mm256_set1_epi32(ICM_EXACT);
+  int col, i;
+
+  for(col=0; col+8<=width; col+=8) {
+    __m256i px = _mm256_loadu_si256((const __m256i*)(pP + col));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 3), mask5);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 11), mask5);
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(px, 19), mask5);
+    __m256i a = _mm256_srli_epi32(px, 24);
+    /* 1 + (a-1)/16, which gives 0 for a == 0, and one more level for a == 255 */
+    __m256i alevel = _mm256_add_epi32(_mm256_srai_epi32(_mm256_sub_epi32(a, ones), 4), ones);
+    __m256i cell, ind;
+    int values[8];
+
+    alevel = _mm256_sub_epi32(alevel, _mm256_cmpeq_epi32(a, opaque));
+    cell = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 10), _mm256_slli_epi32(g, 5)), b);
+    cell = _mm256_add_epi32(_mm256_mullo_epi32(cell, levels), alevel);
+    ind = _mm256_and_si256(_mm256_i32gather_epi32((const int*)icm->cells, cell, 2), low16);
+
+    _mm256_storeu_si256((__m256i*)values, ind);
+    if(_mm256_testz_si256(ind, exact)) {
+      for(i=0; i<8; i++)
+        pQ[col+i] = (unsigned char)values[i];
+    } else {
+      for(i=0; i<8; i++)
+        pQ[col+i] = (unsigned char)((values[i] & ICM_EXACT) ?
+                                    msInverseColormapExact(icm, values[i], pP + col + i) : values[i]);
+    }
+  }
+
+  return col;
+}
+#endif
+
+/**
+ * Same as msClassifyRasterBuffer(), but using an inverse colormap created for
+ * the palette of qrb. Pixels are mapped by a single table lookup, at the cost
+ * of some precision for colors closer than the size of the table cells.
+ */
+int msClassifyRasterBufferLUT(rasterBufferObj *rb, rasterBufferObj *qrb, inverseColormapObj *icm)
+{
+  int row, col, cell, ind = 0;
+  unsigned int last = 0;
+  unsigned short *cells = icm->cells;
+#if defined(MS_HAVE_X86_SIMD)
+  int use_avx2 = icm->complete && msSIMDGetLevel() >= MS_SIMD_AVX2;
+#endif
+
+  assert(rb->type == MS_BUFFER_BYTE_RGBA && rb->data.rgba.pixel_step == 4);
+
+  for(row=0; row<qrb->height; row++) {
+    const rgbaPixel *pP = (const rgbaPixel*)(&(rb->data.rgba.pixels[row * rb->data.rgba.row_step]));
+    unsigned char *pQ = &(qrb->data.palette.pixels[row*qrb->width]);
+
+    col = 0;
+#if defined(MS_HAVE_X86_SIMD)
+    if(use_avx2) {
+      col = msClassifyRowAVX2(icm, pP, pQ, qrb->width);
+      pP += col;
+      pQ += col;
+    }
+#endif
+
+    for(; col<qrb->width; col++, pP++, pQ++) {
+      unsigned int value;
+      memcpy(&value, pP, 4);
+      /* runs of identical pixels are the common case */
+      if(value != last || (row == 0 && col == 0)) {
+        cell = ICM_CELL(pP->r, pP->g, pP->b, pP->a);
+        ind = cells[cell];
+        if(ind == ICM_UNSET)
+          ind = msInverseColormapFillCell(icm, cell);
+        else if(ind & ICM_EXACT)
+          ind = msInverseColormapExact(icm, ind, pP);
+        last = value;
+      }
+      *pQ = (unsigned char)ind;
+    }
+  }
+
+  return MS_SUCCESS;
+}
+
+/*
+ ** Fast quantization: build a histogram of a sample of the pixels, with
+ ** colors binned in the cells of the inverse colormap cube, compute an
+ ** initial palette with the median cut, and refine it with a few k-means
+ ** iterations over the histogram.
+ */
+#define FASTQ_MAX_SAMPLES 65536
+
+typedef struct {
+  int cell; /* -1 if empty */
+  int count;
+  int r, g, b, a; /* sums */
+} fastqBucket;
+
+int msQuantizeRasterBufferFast(rasterBufferObj *rb, unsigned int *reqcolors, rgbaPixel *palette)
+{
+  fastqBucket *buckets;
+  acolorhist_vector achv, acolormap;
+  unsigned int mask, size = 1;
+  int nbuckets = 0, nsamples = 0, npixels, step, row, col, i, it, iterations, newcolors;
+  long long *sums;
+
+  assert(rb->type == MS_BUFFER_BYTE_RGBA && rb->data.rgba.pixel_step == 4);
+
+  /* sample on a regular grid, shifted on each row to avoid aliasing */
+  npixels = rb->width * rb->height;
+  step = 1;
+  while(npixels / (step * step) > FASTQ_MAX_SAMPLES)
+    step++;
+
+  while(size < 2 * (unsigned int)MS_MIN((rb->width / step + 1) * (rb->height / step + 1), ICM_NUM_CELLS))
+    size *= 2;
+  mask = size - 1;
+  buckets = (fastqBucket*)msSmallMalloc(size * sizeof(fastqBucket));
+  for(i=0; i<(int)size; i++)
+    buckets[i].cell = -1;
+
+  for(row=0; row<rb->height; row+=step) {
+    const rgbaPixel *pRow = (const rgbaPixel*)(&(rb->data.rgba.pixels[row * rb->data.rgba.row_step]));
+    for(col=(row/step)%step; col<rb->width; col+=step) {
+      const rgbaPixel *pP = pRow + col;
+      int cell = ICM_CELL(pP->r, pP->g, pP->b, pP->a);
+      unsigned int h = ((unsigned int)cell * 2654435761U) & mask;
+      while(buckets[h].cell != -1 && buckets[h].cell != cell)
+        h = (h + 1) & mask;
+      if(buckets[h].cell == -1) {
+        buckets[h].cell = cell;
+        buckets[h].count = buckets[h].r = buckets[h].g = buckets[h].b = buckets[h].a = 0;
+        nbuckets++;
+      }
+      buckets[h].count++;
+      buckets[h].r += pP->r;
+      buckets[h].g += pP->g;
+      buckets[h].b += pP->b;
+      buckets[h].a += pP->a;
+      nsamples++;
+    }
+  }
+
+  /* the histogram entries are the average colors of the cells */
+  achv = (acolorhist_vector)msSmallMalloc(MS_MAX(1, nbuckets) * sizeof(struct acolorhist_item));
+  for(i=0, nbuckets=0; i<(int)size; i++) {
+    fastqBucket *bk = buckets + i;
+    if(bk->cell == -1) continue;
+    PAM_ASSIGN(achv[nbuckets].acolor,
+               (bk->r + bk->count/2) / bk->count, (bk->g + bk->count/2) / bk->count,
+               (bk->b + bk->count/2) / bk->count, (bk->a + bk->count/2) / bk->count);
+    achv[nbuckets].value = bk->count;
+    nbuckets++;
+  }
+  free(buckets);
+
+  newcolors = MS_MIN(nbuckets, (int)*reqcolors);
+  acolormap = mediancut(achv, nbuckets, nsamples, 255, newcolors);
+
+  /* k-means refinement, bounded to keep this cheap on busy images */
+  if((long)nbuckets * newcolors <= 2000000)
+    iterations = 3;
+  else if((long)nbuckets * newcolors <= 8000000)
+    iterations = 1;
+  else
+    iterations = 0;
+
+  for(i=0; i<newcolors; i++)
+    palette[i] = acolormap[i].acolor;
+  free(acolormap);
+
+  sums = (long long*)msSmallMalloc(MS_MAX(1, newcolors) * 5 * sizeof(long long));
+  for(it=0; it<iterations; it++) {
+    memset(sums, 0, newcolors * 5 * sizeof(long long));
+    for(i=0; i<nbuckets; i++) {
+      int ind = msNearestPaletteEntry(palette, newcolors,
+                                      achv[i].acolor.r, achv[i].acolor.g,
+                                      achv[i].acolor.b, achv[i].acolor.a);
+      long long *s = sums + ind * 5;
+      s[0] += achv[i].value;
+      s[1] += (long long)achv[i].acolor.r * achv[i].value;
+      s[2] += (long long)achv[i].acolor.g * achv[i].value;
+      s[3] += (long long)achv[i].acolor.b * achv[i].value;
+      s[4] += (long long)achv[i].acolor.a * achv[i].value;
+    }
+    for(i=0; i<newcolors; i++) {
+      long long *s = sums + i * 5;
+      if(s[0] == 0) continue; /* keep unused entries as they are */
+      PAM_ASSIGN(palette[i], (s[1] + s[0]/2) / s[0], (s[2] + s[0]/2) / s[0],
+                 (s[3] + s[0]/2) / s[0], (s[4] + s[0]/2) / s[0]);
+    }
+  }
+  free(sums);
+  free(achv);
+
+  *reqcolors = MS_MAX(newcolors, 1);
+  if(newcolors == 0)
+    PAM_ASSIGN(palette[0], 0, 0, 0, 0);
+
+  return MS_SUCCESS;
+}
+
+/*
+ ** Palettes shared across images (FORMATOPTION "QUANTIZE_REUSE"), so that a
+ ** series of tiles gets consistent colors and only the first one pays for
+ ** the quantization.  Each palette comes with its inverse colormap, which is
+ ** handed to one image at a time.
+ */
+#define MS_SHARED_PALETTE_CACHE_SIZE 16
+
+typedef struct sharedPaletteObj {
+  char *key;
+  rgbaPixel palette[256];
+  unsigned int num_entries;
+  inverseColormapObj *icm;
+  int icm_in_use;
+  struct sharedPaletteObj *next;
+} sharedPaletteObj;
+
+static sharedPaletteObj *sharedPalettes = NULL;
+
+/**
+ * Look up the palette shared under key. Returns MS_TRUE and fills palette,
+ * num_entries and icm if there is one. icm is set to NULL if the inverse
+ * colormap is being used by another image, otherwise it must be given back
+ * with msReleaseSharedPalette().
+ */
+int msGetSharedPalette(const char *key, rgbaPixel *palette, unsigned int *num_entries,
+                       inverseColormapObj **icm)
+{
+  sharedPaletteObj *sp, *prev = NULL;
+
+  msAcquireLock(TLOCK_PALETTE);
+  for(sp=sharedPalettes; sp; prev=sp, sp=sp->next) {
+    if(strcmp(sp->key, key) == 0) break;
+  }
+  if(!sp) {
+    msReleaseLock(TLOCK_PALETTE);
+    return MS_FALSE;
+  }
+
+  if(prev) { /* most recently used first */
+    prev->next = sp->next;
+    sp->next = sharedPalettes;
+    sharedPalettes = sp;
+  }
+
+  memcpy(palette, sp->palette, sp->num_entries * sizeof(rgbaPixel));
+  *num_entries = sp->num_entries;
+  if(!sp->icm_in_use) {
+    sp->icm_in_use = MS_TRUE;
+    *icm = sp->icm;
+  } else {
+    *icm = NULL;
+  }
+  msReleaseLock(TLOCK_PALETTE);
+
+  return MS_TRUE;
+}
+
+/**
+ * Give back an inverse colormap obtained with msGetSharedPalette(), or share a
+ * newly computed palette and its inverse colormap under key. Ownership of icm
+ * is transferred in all cases.
+ */
+void msReleaseSharedPalette(const char *key, inverseColormapObj *icm)
+{
+  sharedPaletteObj *sp, *prev;
+  int count = 0;
+
+  msAcquireLock(TLOCK_PALETTE);
+  for(sp=sharedPalettes; sp; sp=sp->next) {
+    if(strcmp(sp->key, key) == 0) break;
+  }
+
+  if(sp) {
+    if(sp->icm == icm) {
+      sp->icm_in_use = MS_FALSE;
+      icm = NULL;
+    }
+  } else {
+    sp = (sharedPaletteObj*)msSmallCalloc(1, sizeof(sharedPaletteObj));
+    sp->key = msStrdup(key);
+    memcpy(sp->palette, icm->palette, icm->num_entries * sizeof(rgbaPixel));
+    sp->num_entries = icm->num_entries;
+    sp->icm = icm;
+    sp->next = sharedPalettes;
+    sharedPalettes = sp;
+    icm = NULL;
+
+    /* forget the least recently used palettes */
+    for(prev=sharedPalettes, sp=prev->next; sp; sp=prev->next) {
+      if(++count >= MS_SHARED_PALETTE_CACHE_SIZE && !sp->icm_in_use) {
+        prev->next = sp->next;
+        msFreeInverseColormap(sp->icm);
+        free(sp->key);
+        free(sp);
+      } else {
+        prev = sp;
+      }
+    }
+  }
+  msReleaseLock(TLOCK_PALETTE);
+
+  msFreeInverseColormap(icm);
+}
+
+void msQuantizeCleanup(void)
+{
+  msAcquireLock(TLOCK_PALETTE);
+  while(sharedPalettes) {
+    sharedPaletteObj *sp = sharedPalettes;
+    sharedPalettes = sp->next;
+    if(!sp->icm_in_use) /* otherwise freed by its user */
+      msFreeInverseColormap(sp->icm);
+    free(sp->key);
+    free(sp);
+  }
+  msReleaseLock(TLOCK_PALETTE);
+}
+
+
 
 /*
  ** Here is the fun part, the median-cut colormap generator.  This is based
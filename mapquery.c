@@ -534,7 +534,7 @@ int msQueryByIndex(mapObj *map)
    * thus useless as the index in the result cache. See #4926 #4076. Only shape
    * files are considered to have consistent row numbers.
    */
-  if ( !(lp->connectiontype == MS_SHAPEFILE || lp->connectiontype == MS_TILED_SHAPEFILE) ) {
+  if ( !(lp->connectiontype == MS_SHAPEFILE || lp->connectiontype == MS_TILED_SHAPEFILE || lp->connectiontype == MS_FEATURESTORE || lp->connectiontype == MS_FLATGEOBUF) ) {
     shape.resultindex = -1;
   }
 
@@ -672,6 +672,7 @@ int msQueryByFilter(mapObj *map)
   rectObj search_rect;
 
   shapeObj shape;
+  shapeBatchObj batch;
 
   int nclasses = 0;
   int *classgroup = NULL;
@@ -785,7 +786,8 @@ int msQueryByFilter(mapObj *map)
     if (lp->minfeaturesize > 0)
       minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes - if necessary the filter is applied in msLayerNextShape(...) */
+    msInitShapeBatch(&batch, map->query.mode == MS_QUERY_SINGLE ? 1 : msLayerGetShapeBatchSize(lp), MS_FALSE);
+    while((status = msShapeBatchNext(lp, &batch, &shape)) == MS_SUCCESS) { /* step through the shapes - if necessary the filter is applied in msLayerNextShapes(...) */
 
        /* Check if the shape size is ok to be drawn */
       if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
@@ -839,6 +841,7 @@ int msQueryByFilter(mapObj *map)
         break;
       }
     } /* next shape */
+    msFreeShapeBatch(&batch);
 
     if(classgroup) msFree(classgroup);
 
@@ -878,6 +881,7 @@ int msQueryByRect(mapObj *map)
 
   char status;
   shapeObj shape, searchshape;
+  shapeBatchObj batch;
   rectObj searchrect, searchrectInMapProj;
   double layer_tolerance = 0, tolerance = 0;
 
@@ -1007,7 +1011,8 @@ int msQueryByRect(mapObj *map)
     if (lp->minfeaturesize > 0)
       minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+    msInitShapeBatch(&batch, msLayerGetShapeBatchSize(lp), MS_FALSE);
+    while((status = msShapeBatchNext(lp, &batch, &shape)) == MS_SUCCESS) { /* step through the shapes */
 
       /* Check if the shape size is ok to be drawn */
       if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
@@ -1077,6 +1082,7 @@ int msQueryByRect(mapObj *map)
       }
       
     } /* next shape */
+    msFreeShapeBatch(&batch);
 
     if (classgroup)
       msFree(classgroup);
@@ -1123,6 +1129,7 @@ int msQueryByFeatures(mapObj *map)
 
   rectObj searchrect;
   shapeObj shape, selectshape;
+  shapeBatchObj batch;
   int nclasses = 0;
   int *classgroup = NULL;
   double minfeaturesize = -1;
@@ -1281,10 +1288,14 @@ int msQueryByFeatures(mapObj *map)
       if (lp->minfeaturesize > 0)
         minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
 
-      while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+      msInitShapeBatch(&batch, msLayerGetShapeBatchSize(lp), MS_FALSE);
+      while((status = msShapeBatchNext(lp, &batch, &shape)) == MS_SUCCESS) { /* step through the shapes */
 
         /* check for dups when there are multiple selection shapes */
-        if(i > 0 && is_duplicate(lp->resultcache, shape.index, shape.tileindex)) continue;
+        if(i > 0 && is_duplicate(lp->resultcache, shape.index, shape.tileindex)) {
+          msFreeShape(&shape);
+          continue;
+        }
 
 
         /* Check if the shape size is ok to be drawn */
@@ -1400,6 +1411,7 @@ int msQueryByFeatures(mapObj *map)
           break;
         }
       } /* next shape */
+      msFreeShapeBatch(&batch);
 
       if (classgroup)
         msFree(classgroup);
@@ -1450,6 +1462,7 @@ int msQueryByPoint(mapObj *map)
   char status;
   rectObj rect, searchrect;
   shapeObj shape;
+  shapeBatchObj batch;
   int nclasses = 0;
   int *classgroup = NULL;
   double minfeaturesize = -1;
@@ -1571,7 +1584,8 @@ int msQueryByPoint(mapObj *map)
     if (lp->minfeaturesize > 0)
       minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+    msInitShapeBatch(&batch, msLayerGetShapeBatchSize(lp), MS_FALSE);
+    while((status = msShapeBatchNext(lp, &batch, &shape)) == MS_SUCCESS) { /* step through the shapes */
 
       /* Check if the shape size is ok to be drawn */
       if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
@@ -1633,6 +1647,7 @@ int msQueryByPoint(mapObj *map)
         break;
       }
     } /* next shape */
+    msFreeShapeBatch(&batch);
 
     if (classgroup)
       msFree(classgroup);
@@ -1659,6 +1674,7 @@ int msQueryByShape(mapObj *map)
 {
   int start, stop=0, l;
   shapeObj shape, *qshape=NULL;
+  shapeBatchObj batch;
   layerObj *lp;
   char status;
   double distance, tolerance, layer_tolerance;
@@ -1793,7 +1809,8 @@ int msQueryByShape(mapObj *map)
     if (lp->minfeaturesize > 0)
       minfeaturesize = Pix2LayerGeoref(map, lp, lp->minfeaturesize);
 
-    while((status = msLayerNextShape(lp, &shape)) == MS_SUCCESS) { /* step through the shapes */
+    msInitShapeBatch(&batch, msLayerGetShapeBatchSize(lp), MS_FALSE);
+    while((status = msShapeBatchNext(lp, &batch, &shape)) == MS_SUCCESS) { /* step through the shapes */
 
       /* Check if the shape size is ok to be drawn */
       if ( (shape.type == MS_SHAPE_LINE || shape.type == MS_SHAPE_POLYGON) && (minfeaturesize > 0) ) {
@@ -1913,6 +1930,7 @@ int msQueryByShape(mapObj *map)
         break;
       }
     } /* next shape */
+    msFreeShapeBatch(&batch);
 
     if(status != MS_DONE) {
       free(classgroup);
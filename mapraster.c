@@ -30,6 +30,7 @@
  ****************************************************************************/
 
 #include <assert.h>
+#include <sys/stat.h>
 #include "mapserver.h"
 #include "mapfile.h"
 #include "mapresample.h"
@@ -39,6 +40,7 @@
 
 extern int msyylex_destroy(void);
 extern int yyparse(parseObj *);
+extern int InvGeoTransform( double *gt_in, double *gt_out );
 
 extern parseResultObj yypresult; /* result of parsing, true/false */
 
@@ -203,6 +205,188 @@ int msGetClass_FloatRGB(layerObj *layer, float fValue, int red, int green, int b
   return msGetClass_String( layer, &color, pixel_value );
 }
 
+/************************************************************************/
+/*                  Raster classification lookup tables.                */
+/*                                                                      */
+/*      Classifying a raster requires evaluating the class              */
+/*      expressions once for every distinct pixel value.  The           */
+/*      resulting value to RGBA tables are kept in a small process      */
+/*      wide most-recently-used list, keyed on a text signature of      */
+/*      everything the classification depends on, so that requests      */
+/*      with unchanged CLASSes can skip the evaluation altogether.      */
+/************************************************************************/
+
+#define MS_RASTER_CLASS_LUT_CACHE_SIZE 16
+
+typedef struct msRasterClassLUT_t {
+  char *pszKey;
+  int nEntries;
+  unsigned char *pabyRGBA; /* 4 planes (red, green, blue, alpha) of nEntries */
+  struct msRasterClassLUT_t *psNext;
+} msRasterClassLUT;
+
+static msRasterClassLUT *psRasterClassLUTCache = NULL;
+
+/************************************************************************/
+/*                         msGetRasterClassKey()                        */
+/*                                                                      */
+/*      Returns a newly allocated signature of the layer classes,       */
+/*      prefixed by pszPrefix which should describe the source          */
+/*      values (data type, color table, ...).                           */
+/************************************************************************/
+
+char *msGetRasterClassKey( layerObj *layer, const char *pszPrefix )
+{
+  char szBuf[512];
+  char *pszKey;
+  int i, s;
+
+  pszKey = msStrdup( pszPrefix );
+
+  snprintf( szBuf, sizeof(szBuf), "|%d|%s|", layer->numclasses,
+            layer->classgroup ? layer->classgroup : "" );
+  pszKey = msStringConcatenate( pszKey, szBuf );
+
+  for( i = 0; i < layer->numclasses; i++ ) {
+    classObj *psClass = layer->class[i];
+    const char *pszExpr = psClass->expression.string;
+
+    snprintf( szBuf, sizeof(szBuf), "C%d:%d:%d:", psClass->expression.type,
+              psClass->numstyles, pszExpr ? (int)strlen(pszExpr) : -1 );
+    pszKey = msStringConcatenate( pszKey, szBuf );
+    if( pszExpr )
+      pszKey = msStringConcatenate( pszKey, pszExpr );
+    pszKey = msStringConcatenate( pszKey, "|" );
+    if( psClass->group )
+      pszKey = msStringConcatenate( pszKey, psClass->group );
+
+    for( s = 0; s < psClass->numstyles; s++ ) {
+      styleObj *style = psClass->styles[s];
+
+      /* the color of range styles is recomputed for every value, and */
+      /* thus must not be part of the key */
+      if( MS_VALID_COLOR(style->mincolor) && MS_VALID_COLOR(style->maxcolor) )
+        snprintf( szBuf, sizeof(szBuf), "|S%d,%d,%d,%d:%d,%d,%d,%d:%.17g:%.17g:%d",
+                  style->mincolor.red, style->mincolor.green,
+                  style->mincolor.blue, style->mincolor.alpha,
+                  style->maxcolor.red, style->maxcolor.green,
+                  style->maxcolor.blue, style->maxcolor.alpha,
+                  style->minvalue, style->maxvalue, style->opacity );
+      else
+        snprintf( szBuf, sizeof(szBuf), "|S%d,%d,%d,%d:%d,%d,%d:%d",
+                  style->color.red, style->color.green,
+                  style->color.blue, style->color.alpha,
+                  style->mincolor.red, style->mincolor.green,
+                  style->mincolor.blue, style->opacity );
+      pszKey = msStringConcatenate( pszKey, szBuf );
+    }
+    pszKey = msStringConcatenate( pszKey, "|" );
+  }
+
+  return pszKey;
+}
+
+/************************************************************************/
+/*                        msRasterClassLUTFetch()                       */
+/*                                                                      */
+/*      Copies the cached table matching pszKey into pabyRGBA (4        */
+/*      planes of nEntries values).  Returns MS_TRUE on a hit.          */
+/************************************************************************/
+
+int msRasterClassLUTFetch( const char *pszKey, unsigned char *pabyRGBA,
+                           int nEntries )
+{
+  msRasterClassLUT *psLUT, *psPrev = NULL;
+  int bFound = MS_FALSE;
+
+  msAcquireLock( TLOCK_RASTERCLASS );
+
+  for( psLUT = psRasterClassLUTCache; psLUT != NULL; psLUT = psLUT->psNext ) {
+    if( psLUT->nEntries == nEntries && strcmp(psLUT->pszKey, pszKey) == 0 ) {
+      memcpy( pabyRGBA, psLUT->pabyRGBA, 4 * nEntries );
+
+      /* move to the head of the list */
+      if( psPrev != NULL ) {
+        psPrev->psNext = psLUT->psNext;
+        psLUT->psNext = psRasterClassLUTCache;
+        psRasterClassLUTCache = psLUT;
+      }
+      bFound = MS_TRUE;
+      break;
+    }
+    psPrev = psLUT;
+  }
+
+  msReleaseLock( TLOCK_RASTERCLASS );
+
+  return bFound;
+}
+
+/************************************************************************/
+/*                        msRasterClassLUTStore()                       */
+/************************************************************************/
+
+void msRasterClassLUTStore( const char *pszKey, const unsigned char *pabyRGBA,
+                            int nEntries )
+{
+  msRasterClassLUT *psLUT, *psPrev = NULL;
+  int nCount = 0;
+
+  psLUT = (msRasterClassLUT *) malloc( sizeof(msRasterClassLUT) );
+  if( psLUT == NULL )
+    return;
+  psLUT->pabyRGBA = (unsigned char *) malloc( 4 * nEntries );
+  if( psLUT->pabyRGBA == NULL ) {
+    free( psLUT );
+    return;
+  }
+  memcpy( psLUT->pabyRGBA, pabyRGBA, 4 * nEntries );
+  psLUT->pszKey = msStrdup( pszKey );
+  psLUT->nEntries = nEntries;
+
+  msAcquireLock( TLOCK_RASTERCLASS );
+
+  psLUT->psNext = psRasterClassLUTCache;
+  psRasterClassLUTCache = psLUT;
+
+  /* drop the least recently used tables beyond the cache size */
+  for( psLUT = psRasterClassLUTCache; psLUT != NULL; psLUT = psLUT->psNext ) {
+    if( ++nCount > MS_RASTER_CLASS_LUT_CACHE_SIZE ) {
+      psPrev->psNext = NULL;
+      while( psLUT != NULL ) {
+        msRasterClassLUT *psNext = psLUT->psNext;
+        free( psLUT->pszKey );
+        free( psLUT->pabyRGBA );
+        free( psLUT );
+        psLUT = psNext;
+      }
+      break;
+    }
+    psPrev = psLUT;
+  }
+
+  msReleaseLock( TLOCK_RASTERCLASS );
+}
+
+/************************************************************************/
+/*                       msRasterClassLUTCleanup()                      */
+/************************************************************************/
+
+void msRasterClassLUTCleanup( void )
+{
+  msAcquireLock( TLOCK_RASTERCLASS );
+
+  while( psRasterClassLUTCache != NULL ) {
+    msRasterClassLUT *psNext = psRasterClassLUTCache->psNext;
+    free( psRasterClassLUTCache->pszKey );
+    free( psRasterClassLUTCache->pabyRGBA );
+    free( psRasterClassLUTCache );
+    psRasterClassLUTCache = psNext;
+  }
+
+  msReleaseLock( TLOCK_RASTERCLASS );
+}
+
 #if defined(USE_GDAL)
 
 /************************************************************************/
@@ -540,6 +724,838 @@ int msDrawRasterLoadProjection(layerObj *layer,
 
     return MS_SUCCESS;
 }
+
+/************************************************************************/
+/*                     In memory tile index cache.                      */
+/*                                                                      */
+/*      For file based (shapefile) tile indexes we keep the tile        */
+/*      bounds, the TILEITEM/TILESRS values and a quadtree of the       */
+/*      bounds in memory across requests, so that a request only has    */
+/*      to search the tree instead of scanning the .shp and .dbf        */
+/*      files.  Entries are invalidated when the .shp or .dbf           */
+/*      modification time changes.  Enabled with PROCESSING             */
+/*      "TILEINDEX_CACHE=ON", loading the whole index only pays off     */
+/*      when the process serves several requests.                       */
+/************************************************************************/
+
+#define MS_TILEINDEX_CACHE_SIZE 8
+
+typedef struct msTileIndexCache_t {
+  char *pszKey;
+  time_t nSHPTime;
+  time_t nDBFTime;
+  int numshapes;
+  rectObj *pasBounds; /* minx > maxx for shapes without bounds */
+  char **papszItems;  /* TILEITEM values */
+  char **papszSRS;    /* TILESRS values, NULL if TILESRS is not set */
+  treeObj *psTree;
+  struct msTileIndexCache_t *psNext;
+} msTileIndexCache;
+
+static msTileIndexCache *psTileIndexCache = NULL;
+
+static void msTileIndexCacheFree( msTileIndexCache *psEntry )
+{
+  int i;
+
+  for( i = 0; i < psEntry->numshapes; i++ ) {
+    msFree( psEntry->papszItems[i] );
+    if( psEntry->papszSRS )
+      msFree( psEntry->papszSRS[i] );
+  }
+  msFree( psEntry->papszItems );
+  msFree( psEntry->papszSRS );
+  msFree( psEntry->pasBounds );
+  if( psEntry->psTree )
+    msDestroyTree( psEntry->psTree );
+  msFree( psEntry->pszKey );
+  free( psEntry );
+}
+
+/************************************************************************/
+/*                         msTileIndexStatFile()                        */
+/*                                                                      */
+/*      Returns the modification time of pszBase with one of the        */
+/*      given extensions, or 0 if no such file exists.                  */
+/************************************************************************/
+
+static time_t msTileIndexStatFile( const char *pszBase, const char *pszLower,
+                                   const char *pszUpper )
+{
+  char szPath[MS_MAXPATHLEN];
+  struct stat sStat;
+
+  snprintf( szPath, sizeof(szPath), "%s%s", pszBase, pszLower );
+  if( stat( szPath, &sStat ) == 0 )
+    return sStat.st_mtime;
+  snprintf( szPath, sizeof(szPath), "%s%s", pszBase, pszUpper );
+  if( stat( szPath, &sStat ) == 0 )
+    return sStat.st_mtime;
+  return 0;
+}
+
+/************************************************************************/
+/*                          msTileIndexStat()                           */
+/*                                                                      */
+/*      Fetch the modification times of the .shp and .dbf parts of     */
+/*      a tile index shapefile.                                         */
+/************************************************************************/
+
+static int msTileIndexStat( const char *pszPath, time_t *pnSHPTime,
+                            time_t *pnDBFTime )
+{
+  char szBase[MS_MAXPATHLEN];
+  size_t nLen;
+
+  strlcpy( szBase, pszPath, sizeof(szBase) );
+  nLen = strlen( szBase );
+  if( nLen > 4 && strcasecmp( szBase + nLen - 4, ".shp" ) == 0 )
+    szBase[nLen - 4] = '\0';
+
+  *pnSHPTime = msTileIndexStatFile( szBase, ".shp", ".SHP" );
+  *pnDBFTime = msTileIndexStatFile( szBase, ".dbf", ".DBF" );
+
+  return (*pnSHPTime != 0 && *pnDBFTime != 0) ? MS_SUCCESS : MS_FAILURE;
+}
+
+/************************************************************************/
+/*                          msTileIndexLoad()                           */
+/************************************************************************/
+
+static msTileIndexCache *msTileIndexLoad( layerObj *layer, const char *pszPath )
+{
+  shapefileObj shpfile;
+  msTileIndexCache *psEntry;
+  int i, iItem, iSRS = -1;
+
+  if( msShapefileOpen( &shpfile, "rb", pszPath, MS_TRUE ) == -1 )
+    return NULL;
+
+  iItem = msDBFGetItemIndex( shpfile.hDBF, layer->tileitem );
+  if( layer->tilesrs != NULL )
+    iSRS = msDBFGetItemIndex( shpfile.hDBF, layer->tilesrs );
+  if( iItem < 0 || (layer->tilesrs != NULL && iSRS < 0) ) {
+    msSetError(MS_MEMERR,
+               "Could not find attribute %s in tileindex.",
+               "msDrawRasterLayerLow()",
+               iItem < 0 ? layer->tileitem : layer->tilesrs);
+    msShapefileClose( &shpfile );
+    return NULL;
+  }
+
+  psEntry = (msTileIndexCache *) msSmallCalloc( 1, sizeof(msTileIndexCache) );
+  psEntry->numshapes = shpfile.numshapes;
+  psEntry->pasBounds = (rectObj *) msSmallMalloc( sizeof(rectObj) * MS_MAX(1, shpfile.numshapes) );
+  psEntry->papszItems = (char **) msSmallCalloc( MS_MAX(1, shpfile.numshapes), sizeof(char *) );
+  if( iSRS >= 0 )
+    psEntry->papszSRS = (char **) msSmallCalloc( MS_MAX(1, shpfile.numshapes), sizeof(char *) );
+
+  for( i = 0; i < shpfile.numshapes; i++ ) {
+    const char *pszValue;
+
+    if( msSHPReadBounds( shpfile.hSHP, i, &(psEntry->pasBounds[i]) ) != MS_SUCCESS ) {
+      psEntry->pasBounds[i].minx = 1;
+      psEntry->pasBounds[i].maxx = -1;
+      continue;
+    }
+
+    pszValue = msDBFReadStringAttribute( shpfile.hDBF, i, iItem );
+    psEntry->papszItems[i] = msStrdup( pszValue ? pszValue : "" );
+    if( iSRS >= 0 ) {
+      pszValue = msDBFReadStringAttribute( shpfile.hDBF, i, iSRS );
+      psEntry->papszSRS[i] = msStrdup( pszValue ? pszValue : "" );
+    }
+  }
+
+  psEntry->psTree = msCreateTree( &shpfile, 0 );
+  msShapefileClose( &shpfile );
+
+  return psEntry;
+}
+
+/************************************************************************/
+/*                    msDrawRasterPushTile()                            */
+/************************************************************************/
+
+static void msDrawRasterPushTile( msRasterTileList *psTiles, layerObj *layer,
+                                  const char *pszItem, const char *pszSRS )
+{
+  char szTileName[MS_MAXPATHLEN];
+
+  if( psTiles->numtiles == psTiles->maxtiles ) {
+    psTiles->maxtiles = MS_MAX(64, psTiles->maxtiles * 2);
+    psTiles->papszNames = (char **) msSmallRealloc( psTiles->papszNames,
+                          sizeof(char *) * psTiles->maxtiles );
+    psTiles->papszSRS = (char **) msSmallRealloc( psTiles->papszSRS,
+                        sizeof(char *) * psTiles->maxtiles );
+  }
+
+  if(layer->data == NULL || strlen(layer->data) == 0 ) /* assume whole filename is in attribute field */
+    strlcpy( szTileName, pszItem, sizeof(szTileName) );
+  else
+    snprintf( szTileName, sizeof(szTileName), "%s/%s", pszItem, layer->data );
+
+  psTiles->papszNames[psTiles->numtiles] = msStrdup( szTileName );
+  psTiles->papszSRS[psTiles->numtiles] = msStrdup( pszSRS ? pszSRS : "" );
+  psTiles->numtiles++;
+}
+
+/************************************************************************/
+/*                   msDrawRasterFreeTileList()                         */
+/************************************************************************/
+
+void msDrawRasterFreeTileList( msRasterTileList *psTiles )
+{
+  int i;
+
+  for( i = 0; i < psTiles->numtiles; i++ ) {
+    msFree( psTiles->papszNames[i] );
+    msFree( psTiles->papszSRS[i] );
+  }
+  msFree( psTiles->papszNames );
+  msFree( psTiles->papszSRS );
+  memset( psTiles, 0, sizeof(msRasterTileList) );
+}
+
+/************************************************************************/
+/*                  msDrawRasterCollectCachedTiles()                    */
+/*                                                                      */
+/*      Fetch the tiles intersecting psearchrect from the in memory     */
+/*      tile index cache.  *pbHandled is set to MS_FALSE when the       */
+/*      tile index cannot be cached (tile index layer, FILTER, ...)     */
+/*      and the regular layer based code should be used.                */
+/************************************************************************/
+
+static int msDrawRasterCollectCachedTiles( mapObj *map, layerObj *layer,
+    rectObj *psearchrect,
+    msRasterTileList *psTiles,
+    int *pbHandled )
+{
+  char szPath[MS_MAXPATHLEN], *pszKey;
+  const char *pszCache;
+  time_t nSHPTime = 0, nDBFTime = 0;
+  msTileIndexCache *psEntry, *psPrev, *psNew = NULL;
+  int i, nCount;
+
+  *pbHandled = MS_FALSE;
+
+  pszCache = msLayerGetProcessingKey( layer, "TILEINDEX_CACHE" );
+  if( pszCache == NULL || !CSLTestBoolean(pszCache)
+      || msGetLayerIndex(map, layer->tileindex) != -1
+      || layer->filter.string != NULL
+      || (layer->projection.numargs > 0 &&
+          EQUAL(layer->projection.args[0], "auto")) )
+    return MS_SUCCESS;
+
+  /* same lookup order as the shapefile driver */
+  if( (msBuildPath3(szPath, map->mappath, map->shapepath, layer->tileindex) == NULL
+       || msTileIndexStat( szPath, &nSHPTime, &nDBFTime ) != MS_SUCCESS)
+      && (msBuildPath(szPath, map->mappath, layer->tileindex) == NULL
+          || msTileIndexStat( szPath, &nSHPTime, &nDBFTime ) != MS_SUCCESS) )
+    return MS_SUCCESS; /* let the shapefile driver report the error */
+
+  *pbHandled = MS_TRUE;
+
+#ifdef USE_PROJ
+  /* if necessary, project the searchrect to source coords */
+  if((map->projection.numargs > 0) && (layer->projection.numargs > 0)) {
+    if( msProjectRect(&map->projection, &layer->projection, psearchrect)
+        != MS_SUCCESS ) {
+      msDebug( "msDrawRasterLayerLow(%s): unable to reproject map request rectangle into layer projection, canceling.\n", layer->name );
+      return MS_FAILURE;
+    }
+  }
+#endif
+
+  pszKey = msStringConcatenate( msStrdup(szPath), "|" );
+  pszKey = msStringConcatenate( pszKey, layer->tileitem );
+  pszKey = msStringConcatenate( pszKey, "|" );
+  if( layer->tilesrs )
+    pszKey = msStringConcatenate( pszKey, layer->tilesrs );
+
+  for( ;; ) {
+    msAcquireLock( TLOCK_TILEINDEX );
+
+    /* insert the entry we just loaded, unless someone else did it */
+    if( psNew != NULL ) {
+      for( psEntry = psTileIndexCache; psEntry != NULL; psEntry = psEntry->psNext ) {
+        if( strcmp(psEntry->pszKey, pszKey) == 0
+            && psEntry->nSHPTime == nSHPTime && psEntry->nDBFTime == nDBFTime )
+          break;
+      }
+      if( psEntry == NULL ) {
+        psNew->psNext = psTileIndexCache;
+        psTileIndexCache = psNew;
+        psNew = NULL;
+      }
+    }
+
+    psPrev = NULL;
+    nCount = 0;
+    for( psEntry = psTileIndexCache; psEntry != NULL; ) {
+      msTileIndexCache *psNext = psEntry->psNext;
+
+      /* drop outdated entries and the least recently used ones */
+      if( (strcmp(psEntry->pszKey, pszKey) == 0
+           && (psEntry->nSHPTime != nSHPTime || psEntry->nDBFTime != nDBFTime))
+          || nCount >= MS_TILEINDEX_CACHE_SIZE ) {
+        if( psPrev )
+          psPrev->psNext = psNext;
+        else
+          psTileIndexCache = psNext;
+        msTileIndexCacheFree( psEntry );
+      } else {
+        psPrev = psEntry;
+        nCount++;
+      }
+      psEntry = psNext;
+    }
+
+    for( psEntry = psTileIndexCache, psPrev = NULL; psEntry != NULL;
+         psPrev = psEntry, psEntry = psEntry->psNext ) {
+      if( strcmp(psEntry->pszKey, pszKey) == 0 )
+        break;
+    }
+
+    if( psEntry != NULL ) {
+      ms_bitarray status;
+
+      /* move to the head of the list */
+      if( psPrev != NULL ) {
+        psPrev->psNext = psEntry->psNext;
+        psEntry->psNext = psTileIndexCache;
+        psTileIndexCache = psEntry;
+      }
+
+      status = msSearchTree( psEntry->psTree, *psearchrect );
+      if( status == NULL ) {
+        msReleaseLock( TLOCK_TILEINDEX );
+        msFree( pszKey );
+        return MS_FAILURE;
+      }
+
+      /* same order and same bounds test as the shapefile driver */
+      for( i = msGetNextBit(status, 0, psEntry->numshapes); i >= 0;
+           i = msGetNextBit(status, i + 1, psEntry->numshapes) ) {
+        if( psEntry->papszItems[i] != NULL
+            && msRectOverlap( &(psEntry->pasBounds[i]), psearchrect ) == MS_TRUE )
+          msDrawRasterPushTile( psTiles, layer, psEntry->papszItems[i],
+                                psEntry->papszSRS ? psEntry->papszSRS[i] : NULL );
+      }
+      free( status );
+
+      msReleaseLock( TLOCK_TILEINDEX );
+      msFree( pszKey );
+      if( psNew )
+        msTileIndexCacheFree( psNew );
+
+      if( layer->debug )
+        msDebug( "msDrawRasterLayerLow(%s): %d tiles selected from cached tile index.\n",
+                 layer->name, psTiles->numtiles );
+      return MS_SUCCESS;
+    }
+
+    msReleaseLock( TLOCK_TILEINDEX );
+
+    /* not cached yet, load it outside of the lock and retry */
+    if( psNew != NULL ) { /* should not happen */
+      msTileIndexCacheFree( psNew );
+      msFree( pszKey );
+      return MS_FAILURE;
+    }
+
+    if( layer->debug )
+      msDebug( "msDrawRasterLayerLow(%s): loading tile index %s in memory.\n",
+               layer->name, szPath );
+
+    psNew = msTileIndexLoad( layer, szPath );
+    if( psNew == NULL ) {
+      msFree( pszKey );
+      return MS_FAILURE;
+    }
+    psNew->pszKey = msStrdup( pszKey );
+    psNew->nSHPTime = nSHPTime;
+    psNew->nDBFTime = nDBFTime;
+  }
+}
+
+/************************************************************************/
+/*                    msDrawRasterCollectTiles()                        */
+/*                                                                      */
+/*      Build the list of tiles of the tile index intersecting          */
+/*      psearchrect, in tile index order.                               */
+/************************************************************************/
+
+int msDrawRasterCollectTiles( mapObj *map, layerObj *layer,
+                              rectObj *psearchrect,
+                              msRasterTileList *psTiles )
+{
+  layerObj *tlp = NULL;
+  int tileitemindex=-1, tilelayerindex=-1, tilesrsindex=-1;
+  int status, bHandled;
+  shapeObj tshp;
+  char tilename[MS_MAXPATHLEN], tilesrsname[1024];
+
+  memset( psTiles, 0, sizeof(msRasterTileList) );
+
+  status = msDrawRasterCollectCachedTiles( map, layer, psearchrect,
+           psTiles, &bHandled );
+  if( bHandled )
+    return status;
+
+  msInitShape(&tshp);
+  status = msDrawRasterSetupTileLayer(map, layer,
+                                      psearchrect,
+                                      MS_FALSE,
+                                      &tilelayerindex,
+                                      &tileitemindex,
+                                      &tilesrsindex,
+                                      &tlp);
+  if( status == MS_SUCCESS ) {
+    while( (status = msDrawRasterIterateTileIndex(layer, tlp, &tshp,
+                     tileitemindex, tilesrsindex,
+                     tilename, sizeof(tilename),
+                     tilesrsname, sizeof(tilesrsname))) == MS_SUCCESS ) {
+      /* the tile name is already built, so bypass layer->data */
+      char *pszSavedData = layer->data;
+      layer->data = NULL;
+      msDrawRasterPushTile( psTiles, layer, tilename, tilesrsname );
+      layer->data = pszSavedData;
+    }
+  }
+
+  if( tlp != NULL )
+    msDrawRasterCleanupTileLayer(tlp, tilelayerindex);
+
+  return (status == MS_DONE) ? MS_SUCCESS : status;
+}
+
+/************************************************************************/
+/*                       msDrawRasterDataset()                          */
+/*                                                                      */
+/*      Draw one opened dataset, resampling it if needed.  Returns      */
+/*      -1 on failure like msDrawRasterLayerGDAL().                     */
+/************************************************************************/
+
+static int msDrawRasterDataset( mapObj *map, layerObj *layer, imageObj *image,
+                                rasterBufferObj *rb, GDALDatasetH hDS )
+{
+  double  adfGeoTransform[6];
+
+  msGetGDALGeoTransform( hDS, map, layer, adfGeoTransform );
+
+  /*
+  ** We want to resample if the source image is rotated, if
+  ** the projections differ or if resampling has been explicitly
+  ** requested, or if the image has north-down instead of north-up.
+  */
+#ifdef USE_PROJ
+  if( ((adfGeoTransform[2] != 0.0 || adfGeoTransform[4] != 0.0
+        || adfGeoTransform[5] > 0.0 || adfGeoTransform[1] < 0.0 )
+       && layer->transform )
+      || msProjectionsDiffer( &(map->projection),
+                              &(layer->projection) )
+      || CSLFetchNameValue( layer->processing, "RESAMPLE" ) != NULL ) {
+    return msResampleGDALToMap( map, layer, image, rb, hDS );
+  }
+#endif
+
+  if( adfGeoTransform[2] != 0.0 || adfGeoTransform[4] != 0.0 ) {
+    if( layer->debug || map->debug )
+      msDebug(
+        "Layer %s has rotational coefficients but we\n"
+        "are unable to use them, projections support\n"
+        "needs to be built in.",
+        layer->name );
+
+  }
+  return msDrawRasterLayerGDAL(map, layer, image, rb, hDS );
+}
+
+/************************************************************************/
+/*                      Parallel tile drawing.                          */
+/*                                                                      */
+/*      With PROCESSING "TILEINDEX_THREADS", the tiles are read and     */
+/*      resampled concurrently, each into a private buffer covering     */
+/*      its footprint in the map image.  The buffers are then           */
+/*      composited into the map image by the calling thread in tile     */
+/*      index order, so the result does not depend on scheduling.       */
+/*      This path is also taken when only one thread is available, so   */
+/*      the output does not depend on the thread count either.          */
+/*                                                                      */
+/*      Layers and projections are modified while drawing (TILESRS,     */
+/*      RAW_WINDOW processing, range colors...), so every running       */
+/*      job works on its own copy of the layer and map projection.      */
+/************************************************************************/
+
+typedef struct {
+  layerObj *psLayer;
+  projectionObj sMapProjection;
+  int bInUse;
+} msTileDrawWorker;
+
+typedef struct {
+  mapObj *map;
+  imageObj *image;
+  msTileDrawWorker *pasWorkers;
+  int nWorkers;
+  int nHandleCache;
+} msTileDrawContext;
+
+typedef struct {
+  msTileDrawContext *psCtx;
+  const char *pszName;
+  const char *pszSRS;
+  char szPath[MS_MAXPATHLEN];
+  char *pszPath;       /* decrypted dataset path */
+  int nXOff, nYOff;    /* position of sRB in the map image */
+  rasterBufferObj sRB;
+  unsigned char *pabyPixels;
+  int nStatus;         /* MS_SUCCESS, MS_FAILURE or MS_DONE if empty */
+  int bMissing;
+  char *pszError;
+} msTileDrawJob;
+
+/************************************************************************/
+/*                       msDrawRasterTileWindow()                       */
+/*                                                                      */
+/*      Compute the window of the map image covered by the dataset,     */
+/*      with a small safety margin.  Returns MS_DONE if it does not     */
+/*      intersect the map.                                              */
+/************************************************************************/
+
+static int msDrawRasterTileWindow( mapObj *map, layerObj *layer,
+                                   GDALDatasetH hDS,
+                                   int *pnXOff, int *pnYOff,
+                                   int *pnXSize, int *pnYSize )
+{
+  double adfGT[6], dfLeft, dfTop;
+  int nXSize = GDALGetRasterXSize( hDS ), nYSize = GDALGetRasterYSize( hDS );
+  int i, nX1, nY1;
+  rectObj sRect;
+
+  msGetGDALGeoTransform( hDS, map, layer, adfGT );
+
+  for( i = 0; i < 4; i++ ) {
+    double dfPixel = (i & 1) ? nXSize : 0;
+    double dfLine = (i & 2) ? nYSize : 0;
+    double dfX = adfGT[0] + dfPixel * adfGT[1] + dfLine * adfGT[2];
+    double dfY = adfGT[3] + dfPixel * adfGT[4] + dfLine * adfGT[5];
+
+    if( i == 0 ) {
+      sRect.minx = sRect.maxx = dfX;
+      sRect.miny = sRect.maxy = dfY;
+    } else {
+      sRect.minx = MS_MIN(sRect.minx, dfX);
+      sRect.maxx = MS_MAX(sRect.maxx, dfX);
+      sRect.miny = MS_MIN(sRect.miny, dfY);
+      sRect.maxy = MS_MAX(sRect.maxy, dfY);
+    }
+  }
+
+#ifdef USE_PROJ
+  if( msProjectionsDiffer( &(layer->projection), &(map->projection) )
+      && msProjectRect( &(layer->projection), &(map->projection), &sRect ) != MS_SUCCESS ) {
+    /* can't tell, use the whole map */
+    sRect = map->extent;
+    sRect.minx -= map->cellsize;
+    sRect.maxx += map->cellsize;
+    sRect.miny -= map->cellsize;
+    sRect.maxy += map->cellsize;
+  }
+#endif
+
+  /* map extents are based on the center of the edge pixels */
+  dfLeft = map->extent.minx - map->cellsize * 0.5;
+  dfTop = map->extent.maxy + map->cellsize * 0.5;
+
+  *pnXOff = MS_MAX(0, (int) floor((sRect.minx - dfLeft) / map->cellsize) - 2);
+  *pnYOff = MS_MAX(0, (int) floor((dfTop - sRect.maxy) / map->cellsize) - 2);
+  nX1 = MS_MIN(map->width, (int) ceil((sRect.maxx - dfLeft) / map->cellsize) + 2);
+  nY1 = MS_MIN(map->height, (int) ceil((dfTop - sRect.miny) / map->cellsize) + 2);
+
+  if( nX1 <= *pnXOff || nY1 <= *pnYOff )
+    return MS_DONE;
+
+  *pnXSize = nX1 - *pnXOff;
+  *pnYSize = nY1 - *pnYOff;
+
+  return MS_SUCCESS;
+}
+
+/************************************************************************/
+/*                        msDrawRasterTileJob()                         */
+/************************************************************************/
+
+static void msDrawRasterTileJob( void *pJobData )
+{
+  msTileDrawJob *psJob = (msTileDrawJob *) pJobData;
+  msTileDrawContext *psCtx = psJob->psCtx;
+  msTileDrawWorker *psWorker = NULL;
+  layerObj *layer;
+  mapObj sTileMap;
+  imageObj sTileImage;
+  GDALDatasetH hDS;
+  int i, nXSize, nYSize, status;
+
+  psJob->nStatus = MS_DONE;
+
+  /* without TILEINDEX_HANDLE_CACHE the handle is only used for this tile */
+  if( psCtx->nHandleCache > 0 )
+    hDS = msGDALAcquireCachedDataset( psJob->pszPath );
+  else
+    hDS = GDALOpen( psJob->pszPath, GA_ReadOnly );
+  if( hDS == NULL ) {
+    psJob->bMissing = MS_TRUE;
+    psJob->pszError = msStrdup( msDrawRasterGetCPLErrorMsg(psJob->pszPath,
+                                psJob->szPath) );
+    return;
+  }
+
+  /* grab an idle layer copy */
+  msAcquireLock( TLOCK_TILEINDEX );
+  for( i = 0; i < psCtx->nWorkers; i++ ) {
+    if( !psCtx->pasWorkers[i].bInUse ) {
+      psWorker = psCtx->pasWorkers + i;
+      psWorker->bInUse = MS_TRUE;
+      break;
+    }
+  }
+  msReleaseLock( TLOCK_TILEINDEX );
+  assert( psWorker != NULL );
+
+  layer = psWorker->psLayer;
+
+  /* the map is only read, except for its projection */
+  memcpy( &sTileMap, psCtx->map, sizeof(mapObj) );
+  sTileMap.projection = psWorker->sMapProjection;
+
+  if( msDrawRasterLoadProjection( layer, hDS, psJob->pszName,
+                                  layer->tilesrs ? 0 : -1,
+                                  psJob->pszSRS ) != MS_SUCCESS ) {
+    psJob->nStatus = MS_FAILURE;
+  } else if( msDrawRasterTileWindow( &sTileMap, layer, hDS,
+                                     &(psJob->nXOff), &(psJob->nYOff),
+                                     &nXSize, &nYSize ) == MS_SUCCESS ) {
+    /* restrict the map to the tile window, on the same pixel grid */
+    sTileMap.width = nXSize;
+    sTileMap.height = nYSize;
+    sTileMap.extent.minx = psCtx->map->extent.minx + psJob->nXOff * psCtx->map->cellsize;
+    sTileMap.extent.maxx = sTileMap.extent.minx + (nXSize - 1) * psCtx->map->cellsize;
+    sTileMap.extent.maxy = psCtx->map->extent.maxy - psJob->nYOff * psCtx->map->cellsize;
+    sTileMap.extent.miny = sTileMap.extent.maxy - (nYSize - 1) * psCtx->map->cellsize;
+    sTileMap.gt.geotransform[0] += psJob->nXOff * sTileMap.gt.geotransform[1];
+    sTileMap.gt.geotransform[3] += psJob->nYOff * sTileMap.gt.geotransform[5];
+    InvGeoTransform( sTileMap.gt.geotransform, sTileMap.gt.invgeotransform );
+
+    memset( &sTileImage, 0, sizeof(imageObj) );
+    sTileImage.width = nXSize;
+    sTileImage.height = nYSize;
+    sTileImage.format = psCtx->image->format;
+    sTileImage.resolution = psCtx->image->resolution;
+    sTileImage.resolutionfactor = psCtx->image->resolutionfactor;
+
+    psJob->pabyPixels = (unsigned char *) calloc( 4, (size_t) nXSize * nYSize );
+    if( psJob->pabyPixels == NULL ) {
+      msSetError(MS_MEMERR, "Allocating work image of size %dx%d failed.",
+                 "msDrawRasterLayerLow()", nXSize, nYSize );
+      psJob->nStatus = MS_FAILURE;
+    } else {
+      psJob->sRB.type = MS_BUFFER_BYTE_RGBA;
+      psJob->sRB.width = nXSize;
+      psJob->sRB.height = nYSize;
+      psJob->sRB.data.rgba.pixels = psJob->pabyPixels;
+      psJob->sRB.data.rgba.pixel_step = 4;
+      psJob->sRB.data.rgba.row_step = 4 * nXSize;
+      psJob->sRB.data.rgba.r = psJob->pabyPixels;
+      psJob->sRB.data.rgba.g = psJob->pabyPixels + 1;
+      psJob->sRB.data.rgba.b = psJob->pabyPixels + 2;
+      psJob->sRB.data.rgba.a = psJob->pabyPixels + 3;
+
+      status = msDrawRasterDataset( &sTileMap, layer, &sTileImage,
+                                    &(psJob->sRB), hDS );
+      psJob->nStatus = (status == -1) ? MS_FAILURE : MS_SUCCESS;
+    }
+  }
+
+  if( psJob->nStatus == MS_FAILURE ) {
+    psJob->pszError = msGetErrorString( "\n" );
+    msResetErrorList();
+  }
+
+  if( psCtx->nHandleCache > 0 )
+    msGDALReleaseCachedDataset( hDS, psCtx->nHandleCache );
+  else
+    GDALClose( hDS );
+
+  msAcquireLock( TLOCK_TILEINDEX );
+  psWorker->bInUse = MS_FALSE;
+  msReleaseLock( TLOCK_TILEINDEX );
+}
+
+/************************************************************************/
+/*                     msDrawRasterCompositeTile()                      */
+/*                                                                      */
+/*      Draw the premultiplied tile buffer over the map image.  Opaque  */
+/*      pixels replace the map pixels as RB_SET_PIXEL() would.          */
+/************************************************************************/
+
+static void msDrawRasterCompositeTile( msTileDrawJob *psJob, rasterBufferObj *rb )
+{
+  unsigned int i, j;
+
+  for( i = 0; i < psJob->sRB.height; i++ ) {
+    unsigned char *pabySrc = psJob->pabyPixels + i * psJob->sRB.data.rgba.row_step;
+    int nDstOff = psJob->nXOff * rb->data.rgba.pixel_step
+                  + (psJob->nYOff + i) * rb->data.rgba.row_step;
+
+    for( j = 0; j < psJob->sRB.width; j++, pabySrc += 4,
+         nDstOff += rb->data.rgba.pixel_step ) {
+      int nWeight = 255 - pabySrc[3];
+
+      if( pabySrc[3] == 0 )
+        continue;
+
+      if( nWeight == 0 ) {
+        rb->data.rgba.r[nDstOff] = pabySrc[0];
+        rb->data.rgba.g[nDstOff] = pabySrc[1];
+        rb->data.rgba.b[nDstOff] = pabySrc[2];
+        if( rb->data.rgba.a )
+          rb->data.rgba.a[nDstOff] = 255;
+        continue;
+      }
+
+      /* without an alpha channel the map image is opaque, so its
+         colors are premultiplied already */
+      rb->data.rgba.r[nDstOff] = pabySrc[0] + (rb->data.rgba.r[nDstOff] * nWeight + 127) / 255;
+      rb->data.rgba.g[nDstOff] = pabySrc[1] + (rb->data.rgba.g[nDstOff] * nWeight + 127) / 255;
+      rb->data.rgba.b[nDstOff] = pabySrc[2] + (rb->data.rgba.b[nDstOff] * nWeight + 127) / 255;
+      if( rb->data.rgba.a )
+        rb->data.rgba.a[nDstOff] = pabySrc[3] + (rb->data.rgba.a[nDstOff] * nWeight + 127) / 255;
+    }
+  }
+}
+
+/************************************************************************/
+/*                     msDrawRasterTilesParallel()                      */
+/************************************************************************/
+
+static int msDrawRasterTilesParallel( mapObj *map, layerObj *layer,
+                                      imageObj *image, rasterBufferObj *rb,
+                                      msRasterTileList *psTiles,
+                                      int nThreads, int nHandleCache )
+{
+  msTileDrawContext sCtx;
+  msTileDrawJob *pasJobs;
+  void **papJobs;
+  int i, iTile, nBatch, final_status = MS_SUCCESS;
+  int ignore_missing = msMapIgnoreMissingData(map);
+
+  memset( &sCtx, 0, sizeof(sCtx) );
+  sCtx.map = map;
+  sCtx.image = image;
+  sCtx.nHandleCache = nHandleCache;
+  sCtx.pasWorkers = (msTileDrawWorker *) msSmallCalloc( nThreads, sizeof(msTileDrawWorker) );
+
+  for( i = 0; i < nThreads; i++ ) {
+    msTileDrawWorker *psWorker = sCtx.pasWorkers + i;
+
+    psWorker->psLayer = (layerObj *) msSmallMalloc( sizeof(layerObj) );
+    if( initLayer( psWorker->psLayer, map ) == -1
+        || msCopyLayer( psWorker->psLayer, layer ) != MS_SUCCESS ) {
+      freeLayer( psWorker->psLayer );
+      free( psWorker->psLayer );
+      break;
+    }
+    msInitProjection( &(psWorker->sMapProjection) );
+    msCopyProjection( &(psWorker->sMapProjection), &(map->projection) );
+    sCtx.nWorkers++;
+  }
+
+  if( sCtx.nWorkers == 0 ) {
+    free( sCtx.pasWorkers );
+    return MS_FAILURE;
+  }
+
+  if( layer->debug )
+    msDebug( "msDrawRasterLayerLow(%s): drawing %d tiles with %d threads.\n",
+             layer->name, psTiles->numtiles, sCtx.nWorkers );
+
+  /* work by batches to bound the memory used by the tile buffers */
+  nBatch = sCtx.nWorkers * 4;
+  pasJobs = (msTileDrawJob *) msSmallMalloc( sizeof(msTileDrawJob) * nBatch );
+  papJobs = (void **) msSmallMalloc( sizeof(void *) * nBatch );
+
+  for( iTile = 0; iTile < psTiles->numtiles && final_status == MS_SUCCESS; ) {
+    int nJobs = 0;
+
+    /* paths are expanded and decrypted here, which touches the map */
+    for( ; iTile < psTiles->numtiles && nJobs < nBatch; iTile++ ) {
+      msTileDrawJob *psJob = pasJobs + nJobs;
+
+      if( strlen(psTiles->papszNames[iTile]) == 0 )
+        continue;
+
+      memset( psJob, 0, sizeof(msTileDrawJob) );
+      psJob->psCtx = &sCtx;
+      psJob->pszName = psTiles->papszNames[iTile];
+      psJob->pszSRS = psTiles->papszSRS[iTile];
+
+      msDrawRasterBuildRasterPath( map, layer, psJob->pszName, psJob->szPath );
+      psJob->pszPath = msDecryptStringTokens( map, psJob->szPath );
+      if( psJob->pszPath == NULL ) {
+        final_status = MS_FAILURE;
+        break;
+      }
+      papJobs[nJobs++] = psJob;
+    }
+
+    if( final_status == MS_SUCCESS )
+      msThreadRunJobs( msDrawRasterTileJob, papJobs, nJobs, sCtx.nWorkers );
+
+    /* composite in tile index order */
+    for( i = 0; i < nJobs; i++ ) {
+      msTileDrawJob *psJob = pasJobs + i;
+
+      if( final_status == MS_SUCCESS ) {
+        if( psJob->bMissing ) {
+          if(ignore_missing == MS_MISSING_DATA_FAIL) {
+            msSetError(MS_IOERR, "Corrupt, empty or missing file '%s' for layer '%s'. %s", "msDrawRasterLayerLow()", psJob->szPath, layer->name, psJob->pszError );
+            final_status = MS_FAILURE;
+          } else if( ignore_missing == MS_MISSING_DATA_LOG ) {
+            if( layer->debug || layer->map->debug ) {
+              msDebug( "Corrupt, empty or missing file '%s' for layer '%s' ... ignoring this missing data.  %s\n", psJob->szPath, layer->name, psJob->pszError );
+            }
+          }
+        } else if( psJob->nStatus == MS_FAILURE ) {
+          msSetError(MS_IMGERR, "Failed to draw tile '%s' of layer '%s': %s",
+                     "msDrawRasterLayerLow()", psJob->pszName, layer->name,
+                     psJob->pszError ? psJob->pszError : "" );
+          final_status = MS_FAILURE;
+        } else if( psJob->nStatus == MS_SUCCESS ) {
+          msDrawRasterCompositeTile( psJob, rb );
+        }
+      }
+
+      msFree( psJob->pabyPixels );
+      msFree( psJob->pszPath );
+      msFree( psJob->pszError );
+    }
+  }
+
+  free( papJobs );
+  free( pasJobs );
+
+  for( i = 0; i < sCtx.nWorkers; i++ ) {
+    freeLayer( sCtx.pasWorkers[i].psLayer );
+    free( sCtx.pasWorkers[i].psLayer );
+    msFreeProjection( &(sCtx.pasWorkers[i].sMapProjection) );
+  }
+  free( sCtx.pasWorkers );
+
+  return final_status;
+}
+
 #endif // defined(USE_GDAL)
 
 /************************************************************************/
@@ -565,11 +1581,11 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
 
 #else /* defined(USE_GDAL) */
   int status, done;
-  char *filename=NULL, tilename[MS_MAXPATHLEN], tilesrsname[1024];
+  char *filename=NULL;
+  const char *tilesrsname = "";
 
-  layerObj *tlp=NULL; /* pointer to the tile layer either real or temporary */
-  int tileitemindex=-1, tilelayerindex=-1, tilesrsindex=-1;
-  shapeObj tshp;
+  msRasterTileList tiles;
+  int itile = 0, tilesrsindex=-1, nthreads, nhandlecache = 0;
 
   char szPath[MS_MAXPATHLEN];
   char *decrypted_path = NULL;
@@ -577,8 +1593,7 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
 
   rectObj searchrect;
   GDALDatasetH  hDS;
-  double  adfGeoTransform[6];
-  const char *close_connection;
+  const char *close_connection, *handle_cache, *tile_threads;
   void *kernel_density_cleanup_ptr = NULL;
 
   msGDALInitialize();
@@ -629,20 +1644,38 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
   }
 
 
+  memset(&tiles, 0, sizeof(tiles));
+
   if(layer->tileindex) { /* we have an index file */
-    msInitShape(&tshp);
     searchrect = map->extent;
 
-    status = msDrawRasterSetupTileLayer(map, layer,
-                           &searchrect,
-                           MS_FALSE,
-                           &tilelayerindex,
-                           &tileitemindex,
-                           &tilesrsindex,
-                           &tlp);
+    status = msDrawRasterCollectTiles(map, layer, &searchrect, &tiles);
     if(status != MS_SUCCESS) {
-      if (status != MS_DONE)
-        final_status = status;
+      final_status = status;
+      goto cleanup;
+    }
+    if(layer->tilesrs != NULL)
+      tilesrsindex = 0;
+
+    /*
+    ** Optionally keep the tile datasets open across requests, and read
+    ** and resample the tiles concurrently.
+    */
+    handle_cache = msLayerGetProcessingKey(layer, "TILEINDEX_HANDLE_CACHE");
+    if(handle_cache != NULL)
+      nhandlecache = atoi(handle_cache);
+    tile_threads = msLayerGetProcessingKey(layer, "TILEINDEX_THREADS");
+    nthreads = msThreadParseCount(tile_threads, 1);
+#if defined(USE_PROJ) && PJ_VERSION < 480
+    nthreads = 1; /* projections are not reentrant */
+#endif
+    /* composite the same way whatever the number of threads */
+    if(tile_threads != NULL && tiles.numtiles > 0 && rb != NULL
+        && rb->type == MS_BUFFER_BYTE_RGBA && layer->mask == NULL
+        && !map->gt.need_geotransform) {
+      final_status = msDrawRasterTilesParallel(map, layer, image, rb, &tiles,
+                     MS_MIN(nthreads, tiles.numtiles),
+                     nhandlecache);
       goto cleanup;
     }
   }
@@ -651,17 +1684,10 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
   while(done != MS_TRUE) {
 
     if(layer->tileindex) {
-      status = msDrawRasterIterateTileIndex(layer, tlp, &tshp,
-                                            tileitemindex, tilesrsindex,
-                                            tilename, sizeof(tilename),
-                                            tilesrsname, sizeof(tilesrsname));
-      if( status == MS_FAILURE) {
-        final_status = MS_FAILURE;
-        break;
-      }
-
-      if(status == MS_DONE) break; /* no more tiles/images */
-      filename = tilename;
+      if(itile >= tiles.numtiles) break; /* no more tiles/images */
+      filename = tiles.papszNames[itile];
+      tilesrsname = tiles.papszSRS[itile];
+      itile++;
     } else {
       filename = layer->data;
       done = MS_TRUE; /* only one image so we're done after this */
@@ -685,11 +1711,16 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
        ** oracle georaster do not use real paths.
        */
       decrypted_path = msDecryptStringTokens( map, szPath );
-      if( decrypted_path == NULL )
-        return MS_FAILURE;
+      if( decrypted_path == NULL ) {
+        final_status = MS_FAILURE;
+        break;
+      }
 
       msAcquireLock( TLOCK_GDAL );
-      hDS = GDALOpenShared( decrypted_path, GA_ReadOnly );
+      if( nhandlecache > 0 )
+        hDS = msGDALAcquireCachedDataset( decrypted_path );
+      else
+        hDS = GDALOpenShared( decrypted_path, GA_ReadOnly );
     } else {
       status = msComputeKernelDensityDataset(map, image, layer, &hDS, &kernel_density_cleanup_ptr);
       if(status != MS_SUCCESS) {
@@ -725,7 +1756,8 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
 
       if(ignore_missing == MS_MISSING_DATA_FAIL) {
         msSetError(MS_IOERR, "Corrupt, empty or missing file '%s' for layer '%s'. %s", "msDrawRasterLayerLow()", szPath, layer->name, cpl_error_msg );
-        return(MS_FAILURE);
+        final_status = MS_FAILURE;
+        break;
       } else if( ignore_missing == MS_MISSING_DATA_LOG ) {
         if( layer->debug || layer->map->debug ) {
           msDebug( "Corrupt, empty or missing file '%s' for layer '%s' ... ignoring this missing data.  %s\n", szPath, layer->name, cpl_error_msg );
@@ -745,43 +1777,22 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
 
     if( msDrawRasterLoadProjection(layer, hDS, filename, tilesrsindex, tilesrsname) != MS_SUCCESS )
     {
+        if( nhandlecache > 0 )
+          msGDALReleaseCachedDataset( hDS, nhandlecache );
+        else
+          GDALClose( hDS );
         msReleaseLock( TLOCK_GDAL );
         final_status = MS_FAILURE;
         break;
     }
 
-    msGetGDALGeoTransform( hDS, map, layer, adfGeoTransform );
-
-    /*
-    ** We want to resample if the source image is rotated, if
-    ** the projections differ or if resampling has been explicitly
-    ** requested, or if the image has north-down instead of north-up.
-    */
-#ifdef USE_PROJ
-    if( ((adfGeoTransform[2] != 0.0 || adfGeoTransform[4] != 0.0
-          || adfGeoTransform[5] > 0.0 || adfGeoTransform[1] < 0.0 )
-         && layer->transform )
-        || msProjectionsDiffer( &(map->projection),
-                                &(layer->projection) )
-        || CSLFetchNameValue( layer->processing, "RESAMPLE" ) != NULL ) {
-      status = msResampleGDALToMap( map, layer, image, rb, hDS );
-    } else
-#endif
-    {
-      if( adfGeoTransform[2] != 0.0 || adfGeoTransform[4] != 0.0 ) {
-        if( layer->debug || map->debug )
-          msDebug(
-            "Layer %s has rotational coefficients but we\n"
-            "are unable to use them, projections support\n"
-            "needs to be built in.",
-            layer->name );
-
-      }
-      status = msDrawRasterLayerGDAL(map, layer, image, rb, hDS );
-    }
+    status = msDrawRasterDataset(map, layer, image, rb, hDS);
 
     if( status == -1 ) {
-      GDALClose( hDS );
+      if( nhandlecache > 0 )
+        msGDALReleaseCachedDataset( hDS, nhandlecache );
+      else
+        GDALClose( hDS );
       msReleaseLock( TLOCK_GDAL );
       final_status = MS_FAILURE;
       break;
@@ -799,7 +1810,9 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
     if( close_connection == NULL && layer->tileindex == NULL )
       close_connection = "DEFER";
 
-    if( close_connection != NULL
+    if( nhandlecache > 0 ) {
+      msGDALReleaseCachedDataset( hDS, nhandlecache );
+    } else if( close_connection != NULL
         && strcasecmp(close_connection,"DEFER") == 0 ) {
       GDALDereferenceDataset( hDS );
     } else {
@@ -809,9 +1822,7 @@ int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image,
   } /* next tile */
 
 cleanup:
-  if(layer->tileindex) { /* tiling clean-up */
-    msDrawRasterCleanupTileLayer(tlp, tilelayerindex);
-  }
+  msDrawRasterFreeTileList(&tiles);
   if(layer->connectiontype == MS_KERNELDENSITY && kernel_density_cleanup_ptr) {
     msCleanupKernelDensityDataset(map, image, layer, kernel_density_cleanup_ptr);
   }
@@ -56,6 +56,20 @@
                                   const char* filename,
                                   char szPath[MS_MAXPATHLEN]);
 
+  /* Tiles of a tile index intersecting a request, in tile index order. */
+  typedef struct {
+    int numtiles;
+    int maxtiles;
+    char **papszNames; /* tile names, including layer->data if set */
+    char **papszSRS;   /* TILESRS values, "" if unset */
+  } msRasterTileList;
+
+  int msDrawRasterCollectTiles(mapObj *map, layerObj *layer,
+                               rectObj *psearchrect,
+                               msRasterTileList *psTiles /* output */ );
+
+  void msDrawRasterFreeTileList(msRasterTileList *psTiles);
+
   const char* msDrawRasterGetCPLErrorMsg(const char* decrypted_path,
                                          const char* szPath);
 
@@ -0,0 +1,170 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Process level pool of reusable pixel buffers.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapserver.h"
+#include "mapthread.h"
+
+/*
+** Image, layer and quantization buffers are released to this pool instead
+** of being freed, and handed out again to the next request for a buffer of
+** the same size (i.e. same dimensions and pixel format).  This saves the
+** malloc/free and page fault churn of servers rendering many small tiles
+** with the same dimensions.
+**
+** The pool holds at most MS_RASTER_BUFFER_POOL_SIZE megabytes (environment
+** variable or map CONFIG option, defaults to 32, 0 disables pooling), the
+** least recently released buffers being freed first.  Buffers are plain
+** malloc() blocks, so a buffer allocated elsewhere can be released to the
+** pool, and a pooled buffer can be free()d.
+*/
+
+#define MS_RASTER_BUFFER_POOL_DEFAULT_SIZE 32 /* megabytes */
+#define MS_RASTER_BUFFER_POOL_MAX_BUFFERS 64
+
+typedef struct {
+  void *buffer;
+  size_t size;
+} pooledBufferObj;
+
+static pooledBufferObj pooledBuffers[MS_RASTER_BUFFER_POOL_MAX_BUFFERS];
+static int numPooledBuffers = 0;
+static size_t poolBudget = 0;
+static int poolBudgetSet = MS_FALSE;
+static rasterBufferPoolStatsObj poolStats;
+
+static void msRasterBufferPoolInitBudget(void)
+{
+  const char *value;
+
+  if(poolBudgetSet)
+    return;
+  value = getenv("MS_RASTER_BUFFER_POOL_SIZE");
+  poolBudget = (size_t)(value ? MS_MAX(0, atoi(value)) : MS_RASTER_BUFFER_POOL_DEFAULT_SIZE) * 1024 * 1024;
+  poolBudgetSet = MS_TRUE;
+}
+
+/* must be called with TLOCK_RASTERPOOL held */
+static void msRasterBufferPoolEvict(size_t budget)
+{
+  while(numPooledBuffers > 0 && poolStats.pooled_bytes > budget) {
+    /* the oldest buffer is at the start of the list */
+    free(pooledBuffers[0].buffer);
+    poolStats.pooled_bytes -= pooledBuffers[0].size;
+    poolStats.evictions++;
+    numPooledBuffers--;
+    memmove(pooledBuffers, pooledBuffers + 1, numPooledBuffers * sizeof(pooledBufferObj));
+  }
+}
+
+/*
+** Set the maximum size of the pool, in megabytes.
+*/
+void msRasterBufferPoolSetSize(int megabytes)
+{
+  msAcquireLock(TLOCK_RASTERPOOL);
+  poolBudget = (size_t)MS_MAX(0, megabytes) * 1024 * 1024;
+  poolBudgetSet = MS_TRUE;
+  msRasterBufferPoolEvict(poolBudget);
+  msReleaseLock(TLOCK_RASTERPOOL);
+}
+
+/*
+** Return an uninitialized buffer of size bytes, or NULL if out of memory.
+*/
+void *msRasterBufferPoolAcquire(size_t size)
+{
+  void *buffer = NULL;
+  int i;
+
+  msAcquireLock(TLOCK_RASTERPOOL);
+  /* most recently released first, it is the most likely to still be cached */
+  for(i=numPooledBuffers-1; i>=0; i--) {
+    if(pooledBuffers[i].size == size) {
+      buffer = pooledBuffers[i].buffer;
+      poolStats.pooled_bytes -= size;
+      numPooledBuffers--;
+      memmove(pooledBuffers + i, pooledBuffers + i + 1, (numPooledBuffers - i) * sizeof(pooledBufferObj));
+      break;
+    }
+  }
+  if(buffer)
+    poolStats.hits++;
+  else
+    poolStats.misses++;
+  msReleaseLock(TLOCK_RASTERPOOL);
+
+  if(!buffer)
+    buffer = malloc(size);
+  return buffer;
+}
+
+/*
+** Give a buffer of size bytes back to the pool.
+*/
+void msRasterBufferPoolRelease(void *buffer, size_t size)
+{
+  if(!buffer)
+    return;
+
+  msAcquireLock(TLOCK_RASTERPOOL);
+  msRasterBufferPoolInitBudget();
+  if(size == 0 || size > poolBudget) {
+    msReleaseLock(TLOCK_RASTERPOOL);
+    free(buffer);
+    return;
+  }
+  msRasterBufferPoolEvict(poolBudget - size);
+  if(numPooledBuffers == MS_RASTER_BUFFER_POOL_MAX_BUFFERS)
+    msRasterBufferPoolEvict(poolStats.pooled_bytes - pooledBuffers[0].size);
+  pooledBuffers[numPooledBuffers].buffer = buffer;
+  pooledBuffers[numPooledBuffers].size = size;
+  numPooledBuffers++;
+  poolStats.pooled_bytes += size;
+  if(poolStats.pooled_bytes > poolStats.peak_bytes)
+    poolStats.peak_bytes = poolStats.pooled_bytes;
+  msReleaseLock(TLOCK_RASTERPOOL);
+}
+
+void msRasterBufferPoolGetStats(rasterBufferPoolStatsObj *stats)
+{
+  msAcquireLock(TLOCK_RASTERPOOL);
+  *stats = poolStats;
+  stats->pooled_buffers = numPooledBuffers;
+  msReleaseLock(TLOCK_RASTERPOOL);
+}
+
+void msRasterBufferPoolCleanup(void)
+{
+  msAcquireLock(TLOCK_RASTERPOOL);
+  if(msGetGlobalDebugLevel() >= MS_DEBUGLEVEL_TUNING && (poolStats.hits || poolStats.misses))
+    msDebug("msRasterBufferPoolCleanup(): %ld hits, %ld misses, %ld evictions, peak %ld KB\n",
+            poolStats.hits, poolStats.misses, poolStats.evictions, (long)(poolStats.peak_bytes / 1024));
+  msRasterBufferPoolEvict(0);
+  memset(&poolStats, 0, sizeof(poolStats));
+  msReleaseLock(TLOCK_RASTERPOOL);
+}
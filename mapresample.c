@@ -30,6 +30,12 @@
 #include <assert.h>
 #include "mapresample.h"
 #include "mapthread.h"
+#include "mapsimd.h"
+
+#ifdef MS_HAVE_X86_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
 
 
 
@@ -79,23 +85,55 @@ int InvGeoTransform( double *gt_in, double *gt_out )
 
 #if defined(USE_PROJ) && defined(USE_GDAL)
 
+/************************************************************************/
+/*                          msResampleBandInfo                          */
+/*                                                                      */
+/*      Describes one horizontal band of destination rows handed to     */
+/*      a resampler.  Each band owns its transformer so that bands      */
+/*      can be processed concurrently.                                  */
+/************************************************************************/
+
+typedef struct msResampleBandInfo_t msResampleBandInfo;
+
+typedef void (*msBandResampler)( msResampleBandInfo *psBand );
+
+struct msResampleBandInfo_t {
+  msBandResampler pfnResampler;
+
+  imageObj *psSrcImage;
+  rasterBufferObj *src_rb;
+  imageObj *psDstImage;
+  rasterBufferObj *dst_rb;
+  SimpleTransformer pfnTransform;
+  void *pCBData;
+  rasterBufferObj *mask_rb;
+
+  int nDstYStart;
+  int nDstYEnd;
+
+  int nFailedPoints;
+  int nSetPoints;
+};
+
 /************************************************************************/
 /*                      msNearestRasterResample()                       */
 /************************************************************************/
 
-static int
-msNearestRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
-                          imageObj *psDstImage, rasterBufferObj *dst_rb,
-                          int *panCMap,
-                          SimpleTransformer pfnTransform, void *pCBData,
-                          int debug, rasterBufferObj *mask_rb )
+static void
+msNearestRasterResampler( msResampleBandInfo *psBand )
 
 {
+  imageObj *psSrcImage = psBand->psSrcImage;
+  rasterBufferObj *src_rb = psBand->src_rb;
+  imageObj *psDstImage = psBand->psDstImage;
+  rasterBufferObj *dst_rb = psBand->dst_rb;
+  SimpleTransformer pfnTransform = psBand->pfnTransform;
+  void *pCBData = psBand->pCBData;
+  rasterBufferObj *mask_rb = psBand->mask_rb;
   double  *x, *y;
   int   nDstX, nDstY;
   int         *panSuccess;
   int   nDstXSize = psDstImage->width;
-  int   nDstYSize = psDstImage->height;
   int   nSrcXSize = psSrcImage->width;
   int   nSrcYSize = psSrcImage->height;
   int   nFailedPoints = 0, nSetPoints = 0;
@@ -106,7 +144,7 @@ msNearestRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   y = (double *) msSmallMalloc( sizeof(double) * nDstXSize );
   panSuccess = (int *) msSmallMalloc( sizeof(int) * nDstXSize );
 
-  for( nDstY = 0; nDstY < nDstYSize; nDstY++ ) {
+  for( nDstY = psBand->nDstYStart; nDstY < psBand->nDstYEnd; nDstY++ ) {
     for( nDstX = 0; nDstX < nDstXSize; nDstX++ ) {
       x[nDstX] = nDstX + 0.5;
       y[nDstX] = nDstY + 0.5;
@@ -218,18 +256,8 @@ msNearestRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   free( panSuccess );
   free( x );
   free( y );
-  msFree(mask_rb);
-
-  /* -------------------------------------------------------------------- */
-  /*      Some debugging output.                                          */
-  /* -------------------------------------------------------------------- */
-  if( nFailedPoints > 0 && debug ) {
-    msDebug( "msNearestRasterResampler: "
-             "%d failed to transform, %d actually set.\n",
-             nFailedPoints, nSetPoints );
-  }
-
-  return 0;
+  psBand->nFailedPoints = nFailedPoints;
+  psBand->nSetPoints = nSetPoints;
 }
 
 /************************************************************************/
@@ -298,28 +326,251 @@ static void msSourceSample( imageObj *psSrcImage, rasterBufferObj *rb,
   }
 }
 
+/************************************************************************/
+/* ==================================================================== */
+/*      SIMD sample accumulation.                                       */
+/*                                                                      */
+/*      These kernels accumulate a run of source pixels along one       */
+/*      source row, and replace msSourceSample() for the two common     */
+/*      cases: RGBA byte buffers and single band float32 rasters.       */
+/*      They perform the same double precision operations in the       */
+/*      same order as the scalar code (one SIMD lane per output         */
+/*      channel), with nodata handling turned into a zero weight, so    */
+/*      the resampled output is bit for bit identical.                  */
+/* ==================================================================== */
+/************************************************************************/
+
+#define MS_RESAMPLE_KERNEL_NONE  0
+#define MS_RESAMPLE_KERNEL_RGBA  1
+#define MS_RESAMPLE_KERNEL_FLOAT 2
+
+/************************************************************************/
+/*                      msResampleKernelType()                          */
+/************************************************************************/
+
+static int msResampleKernelType( imageObj *psSrcImage, rasterBufferObj *rb )
+
+{
+  if( msSIMDGetLevel() == MS_SIMD_NONE )
+    return MS_RESAMPLE_KERNEL_NONE;
+
+  if( MS_RENDERER_PLUGIN(psSrcImage->format) ) {
+    if( rb && rb->type == MS_BUFFER_BYTE_RGBA )
+      return MS_RESAMPLE_KERNEL_RGBA;
+  } else if( MS_RENDERER_RAWDATA(psSrcImage->format) ) {
+    if( psSrcImage->format->imagemode == MS_IMAGEMODE_FLOAT32
+        && psSrcImage->format->bands == 1 )
+      return MS_RESAMPLE_KERNEL_FLOAT;
+  }
+
+  return MS_RESAMPLE_KERNEL_NONE;
+}
+
+#ifdef MS_HAVE_X86_SIMD
+
+/************************************************************************/
+/*                      msAccumulateRGBA_SSE2()                         */
+/*                                                                      */
+/*      padfAcc holds the red, green and blue sums and the alpha        */
+/*      weighted weight sum.                                            */
+/************************************************************************/
+
+MS_SIMD_TARGET_SSE2
+static void msAccumulateRGBA_SSE2( rgbaArrayObj *rgba, int nRowOff,
+                                   int nXStart, int nCount,
+                                   const double *padfColWeight,
+                                   double dfRowWeight,
+                                   double *padfAcc, double *pdfTotal )
+
+{
+  __m128d vAccRG = _mm_loadu_pd( padfAcc );
+  __m128d vAccBA = _mm_loadu_pd( padfAcc + 2 );
+  double dfTotal = *pdfTotal;
+  int i;
+
+  for( i = 0; i < nCount; i++ ) {
+    int off = (nXStart + i) * rgba->pixel_step + nRowOff;
+    double dfWeight = padfColWeight[i] * dfRowWeight;
+    int nAlpha = rgba->a ? rgba->a[off] : 255;
+    __m128d vWeight = _mm_set1_pd( nAlpha > 1 ? dfWeight : 0.0 );
+    __m128d vRG = _mm_set_pd( rgba->g[off], rgba->r[off] );
+    __m128d vBA = _mm_set_pd( nAlpha / 255.0, rgba->b[off] );
+
+    vAccRG = _mm_add_pd( vAccRG, _mm_mul_pd( vRG, vWeight ) );
+    vAccBA = _mm_add_pd( vAccBA, _mm_mul_pd( vBA, vWeight ) );
+    dfTotal += dfWeight;
+  }
+
+  _mm_storeu_pd( padfAcc, vAccRG );
+  _mm_storeu_pd( padfAcc + 2, vAccBA );
+  *pdfTotal = dfTotal;
+}
+
+/************************************************************************/
+/*                      msAccumulateRGBA_AVX2()                         */
+/************************************************************************/
+
+MS_SIMD_TARGET_AVX2
+static void msAccumulateRGBA_AVX2( rgbaArrayObj *rgba, int nRowOff,
+                                   int nXStart, int nCount,
+                                   const double *padfColWeight,
+                                   double dfRowWeight,
+                                   double *padfAcc, double *pdfTotal )
+
+{
+  const __m256d vScale = _mm256_set_pd( 255.0, 1.0, 1.0, 1.0 );
+  __m256d vAcc = _mm256_loadu_pd( padfAcc );
+  double dfTotal = *pdfTotal;
+  int i;
+
+  for( i = 0; i < nCount; i++ ) {
+    int off = (nXStart + i) * rgba->pixel_step + nRowOff;
+    double dfWeight = padfColWeight[i] * dfRowWeight;
+    int nAlpha = rgba->a ? rgba->a[off] : 255;
+    __m256d vWeight = _mm256_set1_pd( nAlpha > 1 ? dfWeight : 0.0 );
+    __m256d vPixel = _mm256_div_pd(
+                       _mm256_cvtepi32_pd( _mm_set_epi32( nAlpha, rgba->b[off],
+                                           rgba->g[off], rgba->r[off] ) ),
+                       vScale );
+
+    vAcc = _mm256_add_pd( vAcc, _mm256_mul_pd( vPixel, vWeight ) );
+    dfTotal += dfWeight;
+  }
+
+  _mm256_storeu_pd( padfAcc, vAcc );
+  *pdfTotal = dfTotal;
+}
+
+/************************************************************************/
+/*                      msAccumulateFloat_SSE2()                        */
+/*                                                                      */
+/*      padfAcc holds the value sum and the weight sum.  There is no    */
+/*      AVX2 variant: with two lanes per sample a wider register        */
+/*      would need to change the summation order.                      */
+/************************************************************************/
+
+MS_SIMD_TARGET_SSE2
+static void msAccumulateFloat_SSE2( imageObj *psSrcImage, int iSrcY,
+                                    int nXStart, int nCount,
+                                    const double *padfColWeight,
+                                    double dfRowWeight,
+                                    double *padfAcc, double *pdfTotal )
+
+{
+  __m128d vAcc = _mm_loadu_pd( padfAcc );
+  double dfTotal = *pdfTotal;
+  int i;
+
+  for( i = 0; i < nCount; i++ ) {
+    int src_off = nXStart + i + iSrcY * psSrcImage->width;
+    double dfWeight = padfColWeight[i] * dfRowWeight;
+    __m128d vWeight = _mm_set1_pd(
+                        MS_GET_BIT(psSrcImage->img_mask,src_off) ? dfWeight : 0.0 );
+    __m128d vValue = _mm_set_pd( 1.0, psSrcImage->img.raw_float[src_off] );
+
+    vAcc = _mm_add_pd( vAcc, _mm_mul_pd( vValue, vWeight ) );
+    dfTotal += dfWeight;
+  }
+
+  _mm_storeu_pd( padfAcc, vAcc );
+  *pdfTotal = dfTotal;
+}
+
+#endif /* def MS_HAVE_X86_SIMD */
+
+/************************************************************************/
+/*                         msSourceSampleRun()                          */
+/*                                                                      */
+/*      Accumulate nCount consecutive source pixels of row iSrcY,       */
+/*      starting at column nXStart, with the weight of each pixel       */
+/*      being padfColWeight[i] * dfRowWeight.  Equivalent to calling    */
+/*      msSourceSample() on each pixel in turn.  *pdfTotal receives     */
+/*      the sum of weights, whether the pixels were valid or not.       */
+/************************************************************************/
+
+static void msSourceSampleRun( imageObj *psSrcImage, rasterBufferObj *rb,
+                               int nKernel,
+                               int iSrcY, int nXStart, int nCount,
+                               const double *padfColWeight,
+                               double dfRowWeight,
+                               double *padfPixelSum, double *pdfWeightSum,
+                               double *pdfTotal )
+
+{
+#ifdef MS_HAVE_X86_SIMD
+  if( nKernel == MS_RESAMPLE_KERNEL_RGBA ) {
+    double adfAcc[4];
+    adfAcc[0] = padfPixelSum[0];
+    adfAcc[1] = padfPixelSum[1];
+    adfAcc[2] = padfPixelSum[2];
+    adfAcc[3] = *pdfWeightSum;
+
+    if( msSIMDGetLevel() >= MS_SIMD_AVX2 )
+      msAccumulateRGBA_AVX2( &(rb->data.rgba), iSrcY * rb->data.rgba.row_step,
+                             nXStart, nCount, padfColWeight, dfRowWeight,
+                             adfAcc, pdfTotal );
+    else
+      msAccumulateRGBA_SSE2( &(rb->data.rgba), iSrcY * rb->data.rgba.row_step,
+                             nXStart, nCount, padfColWeight, dfRowWeight,
+                             adfAcc, pdfTotal );
+
+    padfPixelSum[0] = adfAcc[0];
+    padfPixelSum[1] = adfAcc[1];
+    padfPixelSum[2] = adfAcc[2];
+    *pdfWeightSum = adfAcc[3];
+    return;
+  }
+
+  if( nKernel == MS_RESAMPLE_KERNEL_FLOAT ) {
+    double adfAcc[2];
+    adfAcc[0] = padfPixelSum[0];
+    adfAcc[1] = *pdfWeightSum;
+
+    msAccumulateFloat_SSE2( psSrcImage, iSrcY, nXStart, nCount,
+                            padfColWeight, dfRowWeight, adfAcc, pdfTotal );
+
+    padfPixelSum[0] = adfAcc[0];
+    *pdfWeightSum = adfAcc[1];
+    return;
+  }
+#endif
+
+  {
+    int i;
+    for( i = 0; i < nCount; i++ ) {
+      double dfWeight = padfColWeight[i] * dfRowWeight;
+      msSourceSample( psSrcImage, rb, nXStart + i, iSrcY, padfPixelSum,
+                      dfWeight, pdfWeightSum );
+      *pdfTotal += dfWeight;
+    }
+  }
+}
+
 /************************************************************************/
 /*                      msBilinearRasterResample()                      */
 /************************************************************************/
 
-static int
-msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
-                           imageObj *psDstImage, rasterBufferObj *dst_rb,
-                           int *panCMap,
-                           SimpleTransformer pfnTransform, void *pCBData,
-                           int debug, rasterBufferObj *mask_rb )
+static void
+msBilinearRasterResampler( msResampleBandInfo *psBand )
 
 {
+  imageObj *psSrcImage = psBand->psSrcImage;
+  rasterBufferObj *src_rb = psBand->src_rb;
+  imageObj *psDstImage = psBand->psDstImage;
+  rasterBufferObj *dst_rb = psBand->dst_rb;
+  SimpleTransformer pfnTransform = psBand->pfnTransform;
+  void *pCBData = psBand->pCBData;
+  rasterBufferObj *mask_rb = psBand->mask_rb;
   double  *x, *y;
   int   nDstX, nDstY, i;
   int         *panSuccess;
   int   nDstXSize = psDstImage->width;
-  int   nDstYSize = psDstImage->height;
   int   nSrcXSize = psSrcImage->width;
   int   nSrcYSize = psSrcImage->height;
   int   nFailedPoints = 0, nSetPoints = 0;
   double     *padfPixelSum;
   int         bandCount = MAX(4,psSrcImage->format->bands);
+  int         nKernel = msResampleKernelType( psSrcImage, src_rb );
 
   padfPixelSum = (double *) msSmallMalloc(sizeof(double) * bandCount);
 
@@ -329,7 +580,7 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   y = (double *) msSmallMalloc( sizeof(double) * nDstXSize );
   panSuccess = (int *) msSmallMalloc( sizeof(int) * nDstXSize );
 
-  for( nDstY = 0; nDstY < nDstYSize; nDstY++ ) {
+  for( nDstY = psBand->nDstYStart; nDstY < psBand->nDstYEnd; nDstY++ ) {
     for( nDstX = 0; nDstX < nDstXSize; nDstX++ ) {
       x[nDstX] = nDstX + 0.5;
       y[nDstX] = nDstY + 0.5;
@@ -340,6 +591,7 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
     for( nDstX = 0; nDstX < nDstXSize; nDstX++ ) {
       int   nSrcX, nSrcY, nSrcX2, nSrcY2;
       double      dfRatioX2, dfRatioY2, dfWeightSum = 0.0;
+      double      adfColWeight[2], dfTotalWeight = 0.0;
       if(SKIP_MASK(nDstX,nDstY)) continue;
 
       if( !panSuccess[nDstX] ) {
@@ -376,21 +628,27 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
 
       memset( padfPixelSum, 0, sizeof(double) * bandCount);
 
-      msSourceSample( psSrcImage, src_rb, nSrcX, nSrcY, padfPixelSum,
-                      (1.0 - dfRatioX2) * (1.0 - dfRatioY2),
-                      &dfWeightSum );
-
-      msSourceSample( psSrcImage, src_rb, nSrcX2, nSrcY, padfPixelSum,
-                      (dfRatioX2) * (1.0 - dfRatioY2),
-                      &dfWeightSum );
-
-      msSourceSample( psSrcImage, src_rb, nSrcX, nSrcY2, padfPixelSum,
-                      (1.0 - dfRatioX2) * (dfRatioY2),
-                      &dfWeightSum );
-
-      msSourceSample( psSrcImage, src_rb, nSrcX2, nSrcY2, padfPixelSum,
-                      (dfRatioX2) * (dfRatioY2),
-                      &dfWeightSum );
+      adfColWeight[0] = 1.0 - dfRatioX2;
+      adfColWeight[1] = dfRatioX2;
+
+      for( i = 0; i < 2; i++ ) {
+        int    iSrcY = (i == 0) ? nSrcY : nSrcY2;
+        double dfRowWeight = (i == 0) ? 1.0 - dfRatioY2 : dfRatioY2;
+
+        if( nSrcX2 == nSrcX + 1 ) {
+          msSourceSampleRun( psSrcImage, src_rb, nKernel, iSrcY, nSrcX, 2,
+                             adfColWeight, dfRowWeight,
+                             padfPixelSum, &dfWeightSum, &dfTotalWeight );
+        } else {
+          /* clamped on the left or right edge */
+          msSourceSampleRun( psSrcImage, src_rb, nKernel, iSrcY, nSrcX, 1,
+                             adfColWeight, dfRowWeight,
+                             padfPixelSum, &dfWeightSum, &dfTotalWeight );
+          msSourceSampleRun( psSrcImage, src_rb, nKernel, iSrcY, nSrcX2, 1,
+                             adfColWeight + 1, dfRowWeight,
+                             padfPixelSum, &dfWeightSum, &dfTotalWeight );
+        }
+      }
 
       if( dfWeightSum == 0.0 )
         continue;
@@ -449,27 +707,18 @@ msBilinearRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   free( panSuccess );
   free( x );
   free( y );
-  msFree(mask_rb);
-
-  /* -------------------------------------------------------------------- */
-  /*      Some debugging output.                                          */
-  /* -------------------------------------------------------------------- */
-  if( nFailedPoints > 0 && debug )
-  {
-    msDebug( "msBilinearRasterResampler: "
-             "%d failed to transform, %d actually set.\n",
-             nFailedPoints, nSetPoints );
-  }
-
-  return 0;
+  psBand->nFailedPoints = nFailedPoints;
+  psBand->nSetPoints = nSetPoints;
 }
 
 /************************************************************************/
 /*                          msAverageSample()                           */
 /************************************************************************/
 
+#define AVERAGE_RUN_SIZE 64
+
 static int
-msAverageSample( imageObj *psSrcImage, rasterBufferObj *src_rb,
+msAverageSample( imageObj *psSrcImage, rasterBufferObj *src_rb, int nKernel,
                  double dfXMin, double dfYMin, double dfXMax, double dfYMax,
                  double *padfPixelSum,
                  double *pdfAlpha01 )
@@ -478,6 +727,7 @@ msAverageSample( imageObj *psSrcImage, rasterBufferObj *src_rb,
   int nXMin, nXMax, nYMin, nYMax, iX, iY;
   double dfWeightSum = 0.0;
   double dfMaxWeight = 0.0;
+  double adfColWeight[AVERAGE_RUN_SIZE];
 
   nXMin = (int) dfXMin;
   nYMin = (int) dfYMin;
@@ -488,21 +738,29 @@ msAverageSample( imageObj *psSrcImage, rasterBufferObj *src_rb,
 
   for( iY = nYMin; iY < nYMax; iY++ ) {
     double dfYCellMin, dfYCellMax;
+    int nXRunStart;
 
     dfYCellMin = MAX(iY,dfYMin);
     dfYCellMax = MIN(iY+1,dfYMax);
 
-    for( iX = nXMin; iX < nXMax; iX++ ) {
-      double dfXCellMin, dfXCellMax, dfWeight;
+    /* process the row in runs of columns sharing the same row weight */
+    for( nXRunStart = nXMin; nXRunStart < nXMax;
+         nXRunStart += AVERAGE_RUN_SIZE ) {
+      int nRunSize = MIN(AVERAGE_RUN_SIZE, nXMax - nXRunStart);
+
+      for( iX = nXRunStart; iX < nXRunStart + nRunSize; iX++ ) {
+        double dfXCellMin, dfXCellMax;
 
-      dfXCellMin = MAX(iX,dfXMin);
-      dfXCellMax = MIN(iX+1,dfXMax);
+        dfXCellMin = MAX(iX,dfXMin);
+        dfXCellMax = MIN(iX+1,dfXMax);
 
-      dfWeight = (dfXCellMax-dfXCellMin) * (dfYCellMax-dfYCellMin);
+        adfColWeight[iX - nXRunStart] = dfXCellMax-dfXCellMin;
+      }
 
-      msSourceSample( psSrcImage, src_rb, iX, iY, padfPixelSum,
-                      dfWeight, &dfWeightSum );
-      dfMaxWeight += dfWeight;
+      msSourceSampleRun( psSrcImage, src_rb, nKernel, iY,
+                         nXRunStart, nRunSize,
+                         adfColWeight, dfYCellMax-dfYCellMin,
+                         padfPixelSum, &dfWeightSum, &dfMaxWeight );
     }
   }
 
@@ -521,23 +779,26 @@ msAverageSample( imageObj *psSrcImage, rasterBufferObj *src_rb,
 /*                      msAverageRasterResample()                       */
 /************************************************************************/
 
-static int
-msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
-                          imageObj *psDstImage, rasterBufferObj *dst_rb,
-                          int *panCMap,
-                          SimpleTransformer pfnTransform, void *pCBData,
-                          int debug, rasterBufferObj *mask_rb )
+static void
+msAverageRasterResampler( msResampleBandInfo *psBand )
 
 {
+  imageObj *psSrcImage = psBand->psSrcImage;
+  rasterBufferObj *src_rb = psBand->src_rb;
+  imageObj *psDstImage = psBand->psDstImage;
+  rasterBufferObj *dst_rb = psBand->dst_rb;
+  SimpleTransformer pfnTransform = psBand->pfnTransform;
+  void *pCBData = psBand->pCBData;
+  rasterBufferObj *mask_rb = psBand->mask_rb;
   double  *x1, *y1, *x2, *y2;
   int   nDstX, nDstY;
   int         *panSuccess1, *panSuccess2;
   int   nDstXSize = psDstImage->width;
-  int   nDstYSize = psDstImage->height;
   int   nFailedPoints = 0, nSetPoints = 0;
   double     *padfPixelSum;
 
   int         bandCount = MAX(4,psSrcImage->format->bands);
+  int         nKernel = msResampleKernelType( psSrcImage, src_rb );
 
   padfPixelSum = (double *) msSmallMalloc(sizeof(double) * bandCount);
 
@@ -550,7 +811,7 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   panSuccess1 = (int *) msSmallMalloc( sizeof(int) * (nDstXSize+1) );
   panSuccess2 = (int *) msSmallMalloc( sizeof(int) * (nDstXSize+1) );
 
-  for( nDstY = 0; nDstY < nDstYSize; nDstY++ ) {
+  for( nDstY = psBand->nDstYStart; nDstY < psBand->nDstYEnd; nDstY++ ) {
     for( nDstX = 0; nDstX <= nDstXSize; nDstX++ ) {
       x1[nDstX] = nDstX;
       y1[nDstX] = nDstY;
@@ -589,7 +850,7 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
 
       memset( padfPixelSum, 0, sizeof(double)*bandCount );
 
-      if( !msAverageSample( psSrcImage, src_rb,
+      if( !msAverageSample( psSrcImage, src_rb, nKernel,
                             dfXMin, dfYMin, dfXMax, dfYMax,
                             padfPixelSum, &dfAlpha01 ) )
         continue;
@@ -647,19 +908,8 @@ msAverageRasterResampler( imageObj *psSrcImage, rasterBufferObj *src_rb,
   free( panSuccess2 );
   free( x2 );
   free( y2 );
-  msFree(mask_rb);
-
-  /* -------------------------------------------------------------------- */
-  /*      Some debugging output.                                          */
-  /* -------------------------------------------------------------------- */
-  if( nFailedPoints > 0 && debug )
-  {
-    msDebug( "msAverageRasterResampler: "
-             "%d failed to transform, %d actually set.\n",
-             nFailedPoints, nSetPoints );
-  }
-
-  return 0;
+  psBand->nFailedPoints = nFailedPoints;
+  psBand->nSetPoints = nSetPoints;
 }
 
 /************************************************************************/
@@ -791,10 +1041,14 @@ int msProjTransformer( void *pCBData, int nPoints,
 
     z = (double *) msSmallCalloc(sizeof(double),nPoints);
 
+#if PJ_VERSION < 480
     msAcquireLock( TLOCK_PROJ );
+#endif
     tr_result = pj_transform( psPTInfo->psDstProj, psPTInfo->psSrcProj,
                               nPoints, 1, x, y,  z);
+#if PJ_VERSION < 480
     msReleaseLock( TLOCK_PROJ );
+#endif
 
     if( tr_result != 0 ) {
       free( z );
@@ -1150,6 +1404,191 @@ static int msTransformMapToSource( int nDstXSize, int nDstYSize,
   return MS_TRUE;
 }
 
+/************************************************************************/
+/*                        msRunBandResampler()                          */
+/************************************************************************/
+
+static void msRunBandResampler( void *pData )
+
+{
+  msResampleBandInfo *psBand = (msResampleBandInfo *) pData;
+
+  psBand->pfnResampler( psBand );
+}
+
+/************************************************************************/
+/*                         msResampleBands()                            */
+/*                                                                      */
+/*      Split the destination image into horizontal bands of rows       */
+/*      and run the requested resampler over them, possibly in          */
+/*      parallel.  Every band gets its own transformer (and, with       */
+/*      PROJ.4 >= 4.8, its own copies of the projections and hence      */
+/*      its own PROJ context) since the transformers are not safe       */
+/*      to share between threads.  Each destination pixel is            */
+/*      computed from the same inputs whatever the band layout is, so   */
+/*      the result does not depend on the number of threads.            */
+/************************************************************************/
+
+static int msResampleBands( msBandResampler pfnResampler,
+                            const char *pszResamplerName,
+                            imageObj *psSrcImage, rasterBufferObj *src_rb,
+                            imageObj *psDstImage, rasterBufferObj *dst_rb,
+                            projectionObj *psSrcProj,
+                            double *padfSrcGeoTransform,
+                            projectionObj *psDstProj,
+                            double *padfDstGeoTransform,
+                            int nThreads, int debug,
+                            rasterBufferObj *mask_rb )
+
+{
+  msResampleBandInfo *pasBands;
+  projectionObj *pasProjCopies = NULL;
+  void **papBands;
+  int nBands, iBand, nRowsPerBand;
+  int nFailedPoints = 0, nSetPoints = 0;
+
+  nBands = MAX(1, MIN(nThreads, psDstImage->height));
+
+#if PJ_VERSION < 480
+  /* pj_transform() is serialized by TLOCK_PROJ, so extra bands
+   * would only add overhead. */
+  nBands = 1;
+#endif
+
+  pasBands = (msResampleBandInfo *)
+             msSmallCalloc(nBands, sizeof(msResampleBandInfo));
+  papBands = (void **) msSmallMalloc(nBands * sizeof(void *));
+
+  if( nBands > 1 )
+    pasProjCopies = (projectionObj *)
+                    msSmallCalloc(2 * nBands, sizeof(projectionObj));
+
+  nRowsPerBand = (psDstImage->height + nBands - 1) / nBands;
+
+  for( iBand = 0; iBand < nBands; iBand++ ) {
+    msResampleBandInfo *psBand = pasBands + iBand;
+    projectionObj *psBandSrcProj = psSrcProj;
+    projectionObj *psBandDstProj = psDstProj;
+    void *pTCBData;
+
+    if( iBand > 0 ) {
+      psBandSrcProj = pasProjCopies + 2 * iBand;
+      psBandDstProj = pasProjCopies + 2 * iBand + 1;
+      msInitProjection( psBandSrcProj );
+      msInitProjection( psBandDstProj );
+      if( msCopyProjection( psBandSrcProj, psSrcProj ) != MS_SUCCESS
+          || msCopyProjection( psBandDstProj, psDstProj ) != MS_SUCCESS ) {
+        msFreeProjection( psBandSrcProj );
+        msFreeProjection( psBandDstProj );
+        break;
+      }
+    }
+
+    pTCBData = msInitProjTransformer( psBandSrcProj, padfSrcGeoTransform,
+                                      psBandDstProj, padfDstGeoTransform );
+    if( pTCBData == NULL ) {
+      if( iBand > 0 ) {
+        msFreeProjection( psBandSrcProj );
+        msFreeProjection( psBandDstProj );
+      }
+      break;
+    }
+
+    psBand->psSrcImage = psSrcImage;
+    psBand->src_rb = src_rb;
+    psBand->psDstImage = psDstImage;
+    psBand->dst_rb = dst_rb;
+    psBand->pfnResampler = pfnResampler;
+    psBand->mask_rb = mask_rb;
+
+    /* -------------------------------------------------------------------- */
+    /*      It is cheaper to use linear approximations as long as our       */
+    /*      error is modest (less than 0.333 pixels).                       */
+    /* -------------------------------------------------------------------- */
+    psBand->pfnTransform = msApproxTransformer;
+    psBand->pCBData = msInitApproxTransformer( msProjTransformer, pTCBData,
+                      0.333 );
+
+    psBand->nDstYStart = MIN(iBand * nRowsPerBand, psDstImage->height);
+    psBand->nDstYEnd = MIN(psBand->nDstYStart + nRowsPerBand,
+                           psDstImage->height);
+
+    papBands[iBand] = psBand;
+  }
+
+  /* -------------------------------------------------------------------- */
+  /*      If we could not set up every band, fall back to a single        */
+  /*      band covering the whole image.                                  */
+  /* -------------------------------------------------------------------- */
+  if( iBand < nBands ) {
+    int nReady = iBand;
+
+    if( nReady == 0 ) {
+      free( papBands );
+      free( pasBands );
+      free( pasProjCopies );
+      if( debug )
+        msDebug( "msInitProjTransformer() returned NULL.\n" );
+      return MS_PROJERR;
+    }
+
+    for( iBand = 1; iBand < nReady; iBand++ ) {
+      msApproxTransformInfo *psATInfo =
+        (msApproxTransformInfo *) pasBands[iBand].pCBData;
+      msFreeProjTransformer( psATInfo->pBaseCBData );
+      msFreeApproxTransformer( psATInfo );
+      msFreeProjection( pasProjCopies + 2 * iBand );
+      msFreeProjection( pasProjCopies + 2 * iBand + 1 );
+    }
+
+    nBands = 1;
+    pasBands[0].nDstYStart = 0;
+    pasBands[0].nDstYEnd = psDstImage->height;
+  }
+
+  if( debug && nBands > 1 )
+    msDebug( "%s: resampling %d row bands with up to %d threads.\n",
+             pszResamplerName, nBands, nThreads );
+
+  /* -------------------------------------------------------------------- */
+  /*      Perform the resampling.                                         */
+  /* -------------------------------------------------------------------- */
+  msThreadRunJobs( msRunBandResampler, papBands, nBands, nThreads );
+
+  /* -------------------------------------------------------------------- */
+  /*      Cleanup and collect statistics.                                 */
+  /* -------------------------------------------------------------------- */
+  for( iBand = 0; iBand < nBands; iBand++ ) {
+    msApproxTransformInfo *psATInfo =
+      (msApproxTransformInfo *) pasBands[iBand].pCBData;
+
+    nFailedPoints += pasBands[iBand].nFailedPoints;
+    nSetPoints += pasBands[iBand].nSetPoints;
+
+    msFreeProjTransformer( psATInfo->pBaseCBData );
+    msFreeApproxTransformer( psATInfo );
+
+    if( iBand > 0 ) {
+      msFreeProjection( pasProjCopies + 2 * iBand );
+      msFreeProjection( pasProjCopies + 2 * iBand + 1 );
+    }
+  }
+
+  free( papBands );
+  free( pasBands );
+  free( pasProjCopies );
+
+  /* -------------------------------------------------------------------- */
+  /*      Some debugging output.                                          */
+  /* -------------------------------------------------------------------- */
+  if( nFailedPoints > 0 && debug ) {
+    msDebug( "%s: %d failed to transform, %d actually set.\n",
+             pszResamplerName, nFailedPoints, nSetPoints );
+  }
+
+  return 0;
+}
+
 #endif /* def USE_PROJ */
 
 #ifdef USE_GDAL
@@ -1178,9 +1617,9 @@ int msResampleGDALToMap( mapObj *map, layerObj *layer, imageObj *image,
   rectObj sSrcExtent, sOrigSrcExtent;
   mapObj  sDummyMap;
   imageObj   *srcImage;
-  void  *pTCBData;
-  void  *pACBData;
-  int         anCMap[256];
+  msBandResampler pfnResampler;
+  const char *pszResamplerName;
+  int         nThreads;
   char       **papszAlteredProcessing = NULL;
   int         nLoadImgXSize, nLoadImgYSize;
   double      dfOversampleRatio;
@@ -1510,47 +1949,29 @@ int msResampleGDALToMap( mapObj *map, layerObj *layer, imageObj *image,
   }
 
   /* -------------------------------------------------------------------- */
-  /*      Setup transformations between our source image, and the         */
-  /*      target map image.                                               */
+  /*      Perform the resampling.  The transformations between our        */
+  /*      source image and the target map image are set up per band.      */
   /* -------------------------------------------------------------------- */
-  pTCBData = msInitProjTransformer( &(layer->projection),
-                                    adfSrcGeoTransform,
-                                    &(map->projection),
-                                    adfDstGeoTransform );
+  nThreads = msThreadParseCount(
+               CSLFetchNameValue( layer->processing, "RESAMPLE_THREADS" ), 1 );
 
-  if( pTCBData == NULL ) {
-    if( layer->debug )
-      msDebug( "msInitProjTransformer() returned NULL.\n" );
-    if( MS_RENDERER_PLUGIN( srcImage->format ) && !srcImage->format->vtable->supports_pixel_buffer)
-      msFreeRasterBuffer(psrc_rb);
-    msFreeImage( srcImage );
-    return MS_PROJERR;
+  if( EQUAL(resampleMode,"AVERAGE") ) {
+    pfnResampler = msAverageRasterResampler;
+    pszResamplerName = "msAverageRasterResampler";
+  } else if( EQUAL(resampleMode,"BILINEAR") ) {
+    pfnResampler = msBilinearRasterResampler;
+    pszResamplerName = "msBilinearRasterResampler";
+  } else {
+    pfnResampler = msNearestRasterResampler;
+    pszResamplerName = "msNearestRasterResampler";
   }
 
-  /* -------------------------------------------------------------------- */
-  /*      It is cheaper to use linear approximations as long as our       */
-  /*      error is modest (less than 0.333 pixels).                       */
-  /* -------------------------------------------------------------------- */
-  pACBData = msInitApproxTransformer( msProjTransformer, pTCBData, 0.333 );
-
-  /* -------------------------------------------------------------------- */
-  /*      Perform the resampling.                                         */
-  /* -------------------------------------------------------------------- */
-  if( EQUAL(resampleMode,"AVERAGE") )
-    result =
-      msAverageRasterResampler( srcImage, psrc_rb, image, rb,
-                                anCMap, msApproxTransformer, pACBData,
-                                layer->debug, mask_rb );
-  else if( EQUAL(resampleMode,"BILINEAR") )
-    result =
-      msBilinearRasterResampler( srcImage, psrc_rb, image, rb,
-                                 anCMap, msApproxTransformer, pACBData,
-                                 layer->debug, mask_rb );
-  else
-    result =
-      msNearestRasterResampler( srcImage, psrc_rb, image, rb,
-                                anCMap, msApproxTransformer, pACBData,
-                                layer->debug, mask_rb );
+  result = msResampleBands( pfnResampler, pszResamplerName,
+                            srcImage, psrc_rb, image, rb,
+                            &(layer->projection), adfSrcGeoTransform,
+                            &(map->projection), adfDstGeoTransform,
+                            nThreads, layer->debug, mask_rb );
+  msFree( mask_rb );
 
   /* -------------------------------------------------------------------- */
   /*      cleanup                                                         */
@@ -1559,9 +1980,6 @@ int msResampleGDALToMap( mapObj *map, layerObj *layer, imageObj *image,
     msFreeRasterBuffer(psrc_rb);
   msFreeImage( srcImage );
 
-  msFreeProjTransformer( pTCBData );
-  msFreeApproxTransformer( pACBData );
-
   return result;
 #endif
 }
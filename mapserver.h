@@ -111,6 +111,7 @@ typedef uint32_t        ms_uint32;
 typedef struct rendererVTableObj rendererVTableObj;
 typedef struct tileCacheObj tileCacheObj;
 typedef struct textPathObj textPathObj;
+typedef struct bandWriterObj bandWriterObj;
 typedef struct textRunObj textRunObj;
 typedef struct glyph_element glyph_element;
 typedef struct face_element face_element;
@@ -492,7 +493,7 @@ extern "C" {
 #define MS_LARGE 13
 #define MS_GIANT 16
   enum MS_QUERYMAP_STYLES {MS_NORMAL, MS_HILITE, MS_SELECTED};
-  enum MS_CONNECTION_TYPE {MS_INLINE, MS_SHAPEFILE, MS_TILED_SHAPEFILE, MS_UNUSED_2, MS_OGR, MS_UNUSED_1, MS_POSTGIS, MS_WMS, MS_ORACLESPATIAL, MS_WFS, MS_GRATICULE, MS_MYSQL, MS_RASTER, MS_PLUGIN, MS_UNION, MS_UVRASTER, MS_CONTOUR, MS_KERNELDENSITY };
+  enum MS_CONNECTION_TYPE {MS_INLINE, MS_SHAPEFILE, MS_TILED_SHAPEFILE, MS_UNUSED_2, MS_OGR, MS_UNUSED_1, MS_POSTGIS, MS_WMS, MS_ORACLESPATIAL, MS_WFS, MS_GRATICULE, MS_MYSQL, MS_RASTER, MS_PLUGIN, MS_UNION, MS_UVRASTER, MS_CONTOUR, MS_KERNELDENSITY, MS_FEATURESTORE, MS_FLATGEOBUF };
 #define IS_THIRDPARTY_LAYER_CONNECTIONTYPE(type) ((type) == MS_UNION || (type) == MS_KERNELDENSITY)
   enum MS_JOIN_CONNECTION_TYPE {MS_DB_XBASE, MS_DB_CSV, MS_DB_MYSQL, MS_DB_ORACLE, MS_DB_POSTGRES};
   enum MS_JOIN_TYPE {MS_JOIN_ONE_TO_ONE, MS_JOIN_ONE_TO_MANY};
@@ -1963,6 +1964,7 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
     char* (*LayerEscapePropertyName)(layerObj *layer, const char* pszString);
     void (*LayerEnablePaging)(layerObj *layer, int value);
     int (*LayerGetPaging)(layerObj *layer);
+    int (*LayerNextShapes)(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes);
   };
 #endif /*SWIG*/
 
@@ -2127,6 +2129,8 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msOGRCleanup(void);
   MS_DLL_EXPORT void msGDALCleanup(void);
   MS_DLL_EXPORT void msGDALInitialize(void);
+  MS_DLL_EXPORT void *msGDALAcquireCachedDataset(const char *pszPath);
+  MS_DLL_EXPORT void msGDALReleaseCachedDataset(void *hDS, int nMaxIdle);
 
   MS_DLL_EXPORT imageObj *msDrawScalebar(mapObj *map); /* in mapscale.c */
   MS_DLL_EXPORT int msCalculateScale(rectObj extent, int units, int width, int height, double resolution, double *scaledenom);
@@ -2338,6 +2342,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT void msTransformShapeToPixelSnapToGrid(shapeObj *shape, rectObj extent, double cellsize, double grid_resolution);
   MS_DLL_EXPORT void msTransformShapeToPixelRound(shapeObj *shape, rectObj extent, double cellsize);
   MS_DLL_EXPORT void msTransformShapeToPixelDoublePrecision(shapeObj *shape, rectObj extent, double cellsize);
+  MS_DLL_EXPORT void msGeneralizeShapePixels(shapeObj *shape, double tolerance, long *vertices_in, long *vertices_out);
+  MS_DLL_EXPORT void msTransformPointArray(pointObj *point, int numpoints, double minx, double maxy, double inv_cs, double snap);
+  MS_DLL_EXPORT void msPointArrayExtendBounds(const pointObj *point, int numpoints, rectObj *bounds);
 
 #ifndef SWIG
 
@@ -2415,6 +2422,25 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msLayerGetItemIndex(layerObj *layer, char *item);
   MS_DLL_EXPORT int msLayerWhichItems(layerObj *layer, int get_all, const char *metadata);
   MS_DLL_EXPORT int msLayerNextShape(layerObj *layer, shapeObj *shape);
+  MS_DLL_EXPORT int msLayerNextShapes(layerObj *layer, shapeObj *shapes, int maxshapes, int *numshapes);
+
+  /* shapes read ahead by msLayerNextShapes(), handed out by msShapeBatchNext() */
+  typedef struct {
+    shapeObj *shapes;
+    int maxshapes, numshapes, current;
+    int status; /* of the last msLayerNextShapes() call */
+    void *pipeline; /* read ahead thread, see msShapeBatchStartPipeline() */
+  } shapeBatchObj;
+
+#define MS_SHAPE_BATCH_DEFAULT_SIZE 16
+
+  MS_DLL_EXPORT void msInitShapeBatch(shapeBatchObj *batch, int maxshapes, int use_arenas);
+  MS_DLL_EXPORT int msShapeBatchStartPipeline(layerObj *layer, shapeBatchObj *batch);
+  MS_DLL_EXPORT int msShapeBatchNext(layerObj *layer, shapeBatchObj *batch, shapeObj *shape);
+  MS_DLL_EXPORT void msFreeShapeBatch(shapeBatchObj *batch);
+  MS_DLL_EXPORT void msShapeBatchGetArenaStats(shapeBatchObj *batch, long *allocations, long *resets);
+  MS_DLL_EXPORT int msLayerGetShapeBatchSize(layerObj *layer);
+
   MS_DLL_EXPORT int msLayerGetItems(layerObj *layer);
   MS_DLL_EXPORT int msLayerSetItems(layerObj *layer, char **items, int numitems);
   MS_DLL_EXPORT int msLayerGetShape(layerObj *layer, shapeObj *shape, resultObj *record);
@@ -2489,12 +2515,16 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msContourLayerInitializeVirtualTable(layerObj *layer);  
   MS_DLL_EXPORT int msPluginLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT int msUnionLayerInitializeVirtualTable(layerObj *layer);
+  MS_DLL_EXPORT int msFeatureStoreLayerInitializeVirtualTable(layerObj *layer);
+  MS_DLL_EXPORT void msFeatureStoreCleanup(void);
+  MS_DLL_EXPORT int msFlatGeobufLayerInitializeVirtualTable(layerObj *layer);
   MS_DLL_EXPORT void msPluginFreeVirtualTableFactory(void);
 
   /* ==================================================================== */
   /*      Prototypes for functions in mapdraw.c                           */
   /* ==================================================================== */
 
+  MS_DLL_EXPORT int msPrepareMapGeometry(mapObj *map, int allow_nonsquare);
   MS_DLL_EXPORT imageObj *msPrepareImage(mapObj *map, int allow_nonsquare);
   MS_DLL_EXPORT imageObj *msDrawMap(mapObj *map, int querymap);
   MS_DLL_EXPORT int msLayerIsVisible(mapObj *map, layerObj *layer);
@@ -2552,6 +2582,54 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   /*      End of Prototypes for functions in mapdraw.c                    */
   /* ==================================================================== */
 
+  /* ==================================================================== */
+  /*      Prototypes for functions in mapbands.c                          */
+  /* ==================================================================== */
+  typedef void (*msBandOutputStartFunc)(void *data);
+  MS_DLL_EXPORT int msMapGetBandHeight(mapObj *map);
+  MS_DLL_EXPORT int msDrawMapInBands(mapObj *map, char *filename, msBandOutputStartFunc start, void *startdata);
+
+  /* ==================================================================== */
+  /*      Prototypes for functions in maprasterpool.c                     */
+  /* ==================================================================== */
+  typedef struct {
+    long hits;           /* acquisitions served from the pool */
+    long misses;         /* acquisitions that had to malloc() */
+    long evictions;      /* pooled buffers freed to stay within the budget */
+    int pooled_buffers;
+    size_t pooled_bytes;
+    size_t peak_bytes;
+  } rasterBufferPoolStatsObj;
+
+  MS_DLL_EXPORT void *msRasterBufferPoolAcquire(size_t size);
+  MS_DLL_EXPORT void msRasterBufferPoolRelease(void *buffer, size_t size);
+  MS_DLL_EXPORT void msRasterBufferPoolSetSize(int megabytes);
+  MS_DLL_EXPORT void msRasterBufferPoolGetStats(rasterBufferPoolStatsObj *stats);
+  MS_DLL_EXPORT void msRasterBufferPoolCleanup(void);
+
+  /* ==================================================================== */
+  /*      Prototypes for functions in mapshapearena.c                     */
+  /* ==================================================================== */
+#ifndef SWIG
+  typedef struct shapeArenaChunkObj shapeArenaChunkObj;
+  typedef struct shapeArenaObj {
+    shapeArenaChunkObj *chunks; /* most recent first */
+    size_t chunksize;
+    long allocations, resets;
+  } shapeArenaObj;
+
+  MS_DLL_EXPORT shapeArenaObj *msShapeArenaCreate(size_t chunksize);
+  MS_DLL_EXPORT void *msShapeArenaAlloc(shapeArenaObj *arena, size_t size);
+  MS_DLL_EXPORT void msShapeArenaShrink(shapeArenaObj *arena, void *ptr, size_t size, size_t newsize);
+  MS_DLL_EXPORT int msShapeArenaOwns(shapeArenaObj *arena, const void *ptr);
+  MS_DLL_EXPORT void msShapeArenaReset(shapeArenaObj *arena);
+  MS_DLL_EXPORT void msShapeArenaDestroy(shapeArenaObj *arena);
+  MS_DLL_EXPORT void *msShapeAllocStorage(shapeObj *shape, size_t size);
+  MS_DLL_EXPORT void msShapeFreeStorage(shapeObj *shape, void *ptr);
+  MS_DLL_EXPORT void msShapeShrinkStorage(shapeObj *shape, void *ptr, size_t size, size_t newsize);
+  MS_DLL_EXPORT void *msShapeReallocStorage(shapeObj *shape, void *ptr, size_t used, size_t size);
+#endif
+
   /* ==================================================================== */
   /*      Prototypes for functions in mapgeomutil.cpp                       */
   /* ==================================================================== */
@@ -2581,12 +2659,17 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   MS_DLL_EXPORT int msJoinPrepare(joinObj *join, shapeObj *shape);
   MS_DLL_EXPORT int msJoinNext(joinObj *join);
   MS_DLL_EXPORT int msJoinClose(joinObj *join);
+  MS_DLL_EXPORT void msJoinCleanup(void);
 
   /*in mapraster.c */
   MS_DLL_EXPORT int msDrawRasterLayerLow(mapObj *map, layerObj *layer, imageObj *image, rasterBufferObj *rb );
   MS_DLL_EXPORT int msGetClass(layerObj *layer, colorObj *color, int colormap_index);
   MS_DLL_EXPORT int msGetClass_FloatRGB(layerObj *layer, float fValue,
                                         int red, int green, int blue );
+  MS_DLL_EXPORT char *msGetRasterClassKey(layerObj *layer, const char *pszPrefix);
+  MS_DLL_EXPORT int msRasterClassLUTFetch(const char *pszKey, unsigned char *pabyRGBA, int nEntries);
+  MS_DLL_EXPORT void msRasterClassLUTStore(const char *pszKey, const unsigned char *pabyRGBA, int nEntries);
+  MS_DLL_EXPORT void msRasterClassLUTCleanup(void);
 
   /* in mapdrawgdal.c */
   MS_DLL_EXPORT int msDrawRasterLayerGDAL(mapObj *map, layerObj *layer, imageObj *image, rasterBufferObj *rb, void *hDSVoid );
@@ -2742,6 +2825,9 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
   /*      prototypes for functions in mapgdal.c                           */
   /* ==================================================================== */
   MS_DLL_EXPORT int msSaveImageGDAL( mapObj *map, imageObj *image, char *filename );
+  int msGDALBandWriterSupported( outputFormatObj *format );
+  bandWriterObj *msGDALCreateBandWriter( mapObj *map, outputFormatObj *format,
+                                         int width, int height, char *filename );
   MS_DLL_EXPORT int msInitDefaultGDALOutputFormat( outputFormatObj *format );
 
   /* ==================================================================== */
@@ -3041,14 +3127,42 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
                              rgbaPixel *forced_palette, int num_forced_palette_entries,
                              unsigned int *palette_scaling_maxval);
   int msClassifyRasterBuffer(rasterBufferObj *rb, rasterBufferObj *qrb);
+  int msQuantizeRasterBufferFast(rasterBufferObj *rb, unsigned int *reqcolors, rgbaPixel *palette);
+  typedef struct inverseColormapObj inverseColormapObj;
+  inverseColormapObj* msCreateInverseColormap(const rgbaPixel *palette, int num_entries);
+  void msFreeInverseColormap(inverseColormapObj *icm);
+  int msClassifyRasterBufferLUT(rasterBufferObj *rb, rasterBufferObj *qrb, inverseColormapObj *icm);
+  void msFillInverseColormap(inverseColormapObj *icm);
+  int msGetSharedPalette(const char *key, rgbaPixel *palette, unsigned int *num_entries, inverseColormapObj **icm);
+  void msReleaseSharedPalette(const char *key, inverseColormapObj *icm);
+  void msQuantizeCleanup(void);
   int msSaveRasterBuffer(mapObj *map, rasterBufferObj *data, FILE *stream, outputFormatObj *format);
   int msSaveRasterBufferToBuffer(rasterBufferObj *data, bufferObj *buffer, outputFormatObj *format);
+
+  /*
+  ** Incremental image writer used by the banded renderer (mapbands.c): the
+  ** rows of the image are appended top to bottom by writeRows(), and the
+  ** output is completed (or discarded on failure) by close(), which also
+  ** frees the writer.
+  */
+  struct bandWriterObj {
+    int width, height;
+    int (*writeRows)(bandWriterObj *writer, rasterBufferObj *rb, int firstrow, int numrows);
+    int (*close)(bandWriterObj *writer, int success);
+    void *data;
+  };
+  int msBandWriterSupported(outputFormatObj *format);
+  bandWriterObj *msCreateBandWriter(mapObj *map, outputFormatObj *format, int width, int height, char *filename);
   int msLoadMSRasterBufferFromFile(char *path, rasterBufferObj *rb);
   
   /* in mapagg.cpp */
-  void msApplyBlurringCompositingFilter(rasterBufferObj *rb, unsigned int radius);
+  void msApplyBlurringCompositingFilter(rasterBufferObj *rb, unsigned int radius, int threads);
+
+  /* in mapblend.c */
+  int msCompositeRGBA(unsigned char *dst, int dst_row_step, const unsigned char *src, int src_row_step,
+                      int width, int height, CompositingOperation comp, unsigned int cover);
   
-  int WARN_UNUSED msApplyCompositingFilter(mapObj *map, rasterBufferObj *rb, CompositingFilter *filter);
+  int WARN_UNUSED msApplyCompositingFilters(mapObj *map, layerObj *layer, rasterBufferObj *rb, CompositingFilter *filter);
 
   void msBufferInit(bufferObj *buffer);
   void msBufferResize(bufferObj *buffer, size_t target_size);
@@ -3068,6 +3182,10 @@ void msPopulateTextSymbolForLabelAndString(textSymbolObj *ts, labelObj *l, char
     enum MS_TRANSFORM_MODE transform_mode;
     double default_approximation_scale;
     double approximation_scale;
+    double generalization_tolerance; /* in pixels, 0 disables screen space generalization */
+    long generalization_vertices_in, generalization_vertices_out;
+    double pixel_clipping_limit; /* largest pixel coordinate the rasterizer can clip itself, 0 if it cannot */
+    int pixel_clipping; /* current layer leaves clipping to the rasterizer, see msDrawShape() */
 
     void *renderer_data;
 
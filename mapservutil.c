@@ -1493,6 +1493,31 @@ int msCGIDispatchQueryRequest(mapservObj *mapserv)
   return MS_SUCCESS;
 }
 
+static void msCGISendImageHeaders(void *data)
+{
+  mapservObj *mapserv = (mapservObj *) data;
+
+  /*
+   ** Set the Cache control headers if the option is set.
+   */
+  if( mapserv->sendheaders && msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age") ) {
+    msIO_setHeader("Cache-Control","max-age=%s", msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age"));
+  }
+
+  if(mapserv->sendheaders)  {
+    const char *attachment = msGetOutputFormatOption(mapserv->map->outputformat, "ATTACHMENT", NULL );
+    if(attachment)
+      msIO_setHeader("Content-disposition","attachment; filename=%s", attachment);
+
+    if(!strcmp(MS_IMAGE_MIME_TYPE(mapserv->map->outputformat), "application/json")) {
+      msIO_setHeader("Content-Type","application/json; charset=utf-8");
+    } else {
+      msIO_setHeader("Content-Type","%s", MS_IMAGE_MIME_TYPE(mapserv->map->outputformat));
+    }
+    msIO_sendHeaders();
+  }
+}
+
 int msCGIDispatchImageRequest(mapservObj *mapserv)
 {
   int status;
@@ -1503,6 +1528,10 @@ int msCGIDispatchImageRequest(mapservObj *mapserv)
         status = msLoadQuery(mapserv->map, mapserv->QueryFile);
         if(status != MS_SUCCESS) return MS_FAILURE;
         img = msDrawMap(mapserv->map, MS_TRUE);
+      } else if(msMapGetBandHeight(mapserv->map) > 0) {
+        /* large images are drawn and streamed out a band of rows at a time,
+           the headers are sent once the first band is drawn */
+        return msDrawMapInBands(mapserv->map, NULL, msCGISendImageHeaders, mapserv);
       } else
         img = msDrawMap(mapserv->map, MS_FALSE);
       break;
@@ -1528,25 +1557,7 @@ int msCGIDispatchImageRequest(mapservObj *mapserv)
 
   if(!img) return MS_FAILURE;
 
-  /*
-   ** Set the Cache control headers if the option is set.
-   */
-  if( mapserv->sendheaders && msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age") ) {
-    msIO_setHeader("Cache-Control","max-age=%s", msLookupHashTable(&(mapserv->map->web.metadata), "http_max_age"));
-  }
-
-  if(mapserv->sendheaders)  {
-    const char *attachment = msGetOutputFormatOption(mapserv->map->outputformat, "ATTACHMENT", NULL );
-    if(attachment)
-      msIO_setHeader("Content-disposition","attachment; filename=%s", attachment);
-
-    if(!strcmp(MS_IMAGE_MIME_TYPE(mapserv->map->outputformat), "application/json")) {
-      msIO_setHeader("Content-Type","application/json; charset=utf-8");
-    } else {
-      msIO_setHeader("Content-Type","%s", MS_IMAGE_MIME_TYPE(mapserv->map->outputformat));
-    }
-    msIO_sendHeaders();
-  }
+  msCGISendImageHeaders(mapserv);
 
   if( mapserv->Mode == MAP || mapserv->Mode == TILE )
     status = msSaveImage(mapserv->map, img, NULL);
@@ -1239,8 +1239,11 @@ int msSHXReadSize( SHPHandle psSHP, int hEntity )
 
 /*
 ** msSHPReadShape() - Reads the vertices for one shape from a shape file.
+** The Arena variant reads polygon and arc vertices into the given shape arena
+** (NULL for malloc()), it is used by the layer readers to keep the arena their
+** caller attached to the shape.
 */
-void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
+static void msSHPReadShapeArena( SHPHandle psSHP, int hEntity, shapeObj *shape, shapeArenaObj *arena )
 {
   int i, j, k;
 #ifdef USE_POINT_Z_M
@@ -1249,6 +1252,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
   int nEntitySize, nRequiredSize;
 
   msInitShape(shape); /* initialize the shape */
+  shape->arena = arena; /* polygon and arc vertices are read into it */
 
   /* -------------------------------------------------------------------- */
   /*      Validate the record/entity number.                              */
@@ -1367,7 +1371,7 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
     /* -------------------------------------------------------------------- */
     /*      Fill the shape structure.                                       */
     /* -------------------------------------------------------------------- */
-    shape->line = (lineObj *)malloc(sizeof(lineObj)*nParts);
+    shape->line = (lineObj *)msShapeAllocStorage(shape, sizeof(lineObj)*nParts);
     MS_CHECK_ALLOC_NO_RET(shape->line, sizeof(lineObj)*nParts);
 
     shape->numlines = nParts;
@@ -1382,18 +1386,18 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
         msSetError(MS_SHPERR, "Corrupted .shp file : shape %d, shape->line[%d].numpoints=%d", "msSHPReadShape()",
                    hEntity, i, shape->line[i].numpoints);
         while(--i >= 0)
-          free(shape->line[i].point);
-        free(shape->line);
+          msShapeFreeStorage(shape, shape->line[i].point);
+        msShapeFreeStorage(shape, shape->line);
         shape->line = NULL;
         shape->numlines = 0;
         shape->type = MS_SHAPE_NULL;
         return;
       }
 
-      if( (shape->line[i].point = (pointObj *)malloc(sizeof(pointObj)*shape->line[i].numpoints)) == NULL ) {
+      if( (shape->line[i].point = (pointObj *)msShapeAllocStorage(shape, sizeof(pointObj)*shape->line[i].numpoints)) == NULL ) {
         while(--i >= 0)
-          free(shape->line[i].point);
-        free(shape->line);
+          msShapeFreeStorage(shape, shape->line[i].point);
+        msShapeFreeStorage(shape, shape->line);
         shape->numlines = 0;
         shape->type = MS_SHAPE_NULL;
         msSetError(MS_MEMERR, "Out of memory", "msSHPReadShape()");
@@ -1621,6 +1625,11 @@ void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
   return;
 }
 
+void msSHPReadShape( SHPHandle psSHP, int hEntity, shapeObj *shape )
+{
+  msSHPReadShapeArena(psSHP, hEntity, shape, NULL);
+}
+
 int msSHPReadBounds( SHPHandle psSHP, int hEntity, rectObj *padBounds)
 {
   /* -------------------------------------------------------------------- */
@@ -2263,7 +2272,7 @@ int msTiledSHPNextShape(layerObj *layer, shapeObj *shape)
 
     tSHP->shpfile->lastshape = i;
 
-    msSHPReadShape(tSHP->shpfile->hSHP, i, shape);
+    msSHPReadShapeArena(tSHP->shpfile->hSHP, i, shape, shape->arena);
     if(shape->type == MS_SHAPE_NULL) {
       msFreeShape(shape);
       continue; /* skip NULL shapes */
@@ -2687,7 +2696,7 @@ int msSHPLayerNextShape(layerObj *layer, shapeObj *shape)
   shpfile->lastshape = i;
   if(i == -1) return(MS_DONE); /* nothing else to read */
 
-  msSHPReadShape(shpfile->hSHP, i, shape);
+  msSHPReadShapeArena(shpfile->hSHP, i, shape, shape->arena);
   if(shape->type == MS_SHAPE_NULL) {
     msFreeShape(shape);
     return msSHPLayerNextShape(layer, shape); /* skip NULL shapes */
@@ -129,6 +129,8 @@ extern "C" {
     int   nCurrentRecord;
     int   bCurrentRecordModified;
     char  *pszCurrentRecord;
+    int   nCurrentRecordStart; /* byte range of pszCurrentRecord read from the file */
+    int   nCurrentRecordEnd;
 
     int   bNoHeader;
     int   bUpdated;
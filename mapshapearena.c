@@ -0,0 +1,222 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Bump allocator for the line storage of shapes.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapserver.h"
+
+/*
+** A shape arena hands out the line and point arrays of one shapeObj from a
+** few large chunks, and takes all of them back at once when the shape is
+** freed.  A shape reused for every feature of a layer (the msDrawVectorLayer()
+** loop) thus stops calling malloc()/free() for its geometry once the arena has
+** grown to the size of the largest feature.
+**
+** Storage of an arena backed shape may be a mix of arena and malloc()ed
+** blocks: msShapeFreeStorage() and msShapeReallocStorage() must be used
+** instead of free()/realloc() on shape->line and shape->line[i].point.
+*/
+
+#define MS_SHAPE_ARENA_DEFAULT_CHUNK_SIZE (64*1024)
+#define MS_SHAPE_ARENA_MAX_RETAINED (16*1024*1024)
+#define MS_SHAPE_ARENA_ALIGN 16
+
+struct shapeArenaChunkObj {
+  struct shapeArenaChunkObj *next;
+  size_t size, used;
+  /* data follows, aligned to MS_SHAPE_ARENA_ALIGN */
+};
+
+#define MS_SHAPE_ARENA_HEADER_SIZE \
+  ((sizeof(shapeArenaChunkObj) + MS_SHAPE_ARENA_ALIGN - 1) & ~(size_t)(MS_SHAPE_ARENA_ALIGN - 1))
+#define MS_SHAPE_ARENA_CHUNK_DATA(chunk) ((unsigned char*)(chunk) + MS_SHAPE_ARENA_HEADER_SIZE)
+
+static shapeArenaChunkObj *msShapeArenaNewChunk(size_t size)
+{
+  shapeArenaChunkObj *chunk = (shapeArenaChunkObj*)malloc(MS_SHAPE_ARENA_HEADER_SIZE + size);
+  if(!chunk)
+    return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+shapeArenaObj *msShapeArenaCreate(size_t chunksize)
+{
+  shapeArenaObj *arena = (shapeArenaObj*)msSmallMalloc(sizeof(shapeArenaObj));
+  arena->chunksize = chunksize > 0 ? chunksize : MS_SHAPE_ARENA_DEFAULT_CHUNK_SIZE;
+  arena->chunks = NULL;
+  arena->allocations = arena->resets = 0;
+  return arena;
+}
+
+/*
+** Return size bytes from the arena, or NULL if out of memory.  The memory
+** stays valid until the next msShapeArenaReset() or msShapeArenaDestroy().
+*/
+void *msShapeArenaAlloc(shapeArenaObj *arena, size_t size)
+{
+  shapeArenaChunkObj *chunk = arena->chunks;
+  void *ptr;
+
+  size = (size + MS_SHAPE_ARENA_ALIGN - 1) & ~(size_t)(MS_SHAPE_ARENA_ALIGN - 1);
+  if(!chunk || chunk->size - chunk->used < size) {
+    chunk = msShapeArenaNewChunk(MS_MAX(arena->chunksize, size));
+    if(!chunk)
+      return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+  ptr = MS_SHAPE_ARENA_CHUNK_DATA(chunk) + chunk->used;
+  chunk->used += size;
+  arena->allocations++;
+  return ptr;
+}
+
+/*
+** Shrink the most recent allocation ptr of size bytes to newsize bytes,
+** handing the tail back to the arena.  Does nothing if ptr is not the last
+** block handed out by the arena.
+*/
+void msShapeArenaShrink(shapeArenaObj *arena, void *ptr, size_t size, size_t newsize)
+{
+  shapeArenaChunkObj *chunk = arena->chunks;
+  unsigned char *data;
+
+  if(!chunk || newsize > size)
+    return;
+  size = (size + MS_SHAPE_ARENA_ALIGN - 1) & ~(size_t)(MS_SHAPE_ARENA_ALIGN - 1);
+  newsize = (newsize + MS_SHAPE_ARENA_ALIGN - 1) & ~(size_t)(MS_SHAPE_ARENA_ALIGN - 1);
+  data = MS_SHAPE_ARENA_CHUNK_DATA(chunk);
+  if((unsigned char*)ptr + size == data + chunk->used)
+    chunk->used -= size - newsize;
+}
+
+int msShapeArenaOwns(shapeArenaObj *arena, const void *ptr)
+{
+  shapeArenaChunkObj *chunk;
+  for(chunk = arena->chunks; chunk; chunk = chunk->next) {
+    const unsigned char *data = MS_SHAPE_ARENA_CHUNK_DATA(chunk);
+    if((const unsigned char*)ptr >= data && (const unsigned char*)ptr < data + chunk->size)
+      return MS_TRUE;
+  }
+  return MS_FALSE;
+}
+
+/*
+** Release everything allocated from the arena.  When the last round needed
+** several chunks they are replaced by a single one large enough for all of
+** them, so that the next shape of similar size is served from one chunk.
+*/
+void msShapeArenaReset(shapeArenaObj *arena)
+{
+  shapeArenaChunkObj *chunk = arena->chunks;
+  size_t total = 0;
+
+  if(!chunk)
+    return;
+  arena->resets++;
+  if(!chunk->next) {
+    chunk->used = 0;
+    return;
+  }
+  while(chunk) {
+    shapeArenaChunkObj *next = chunk->next;
+    total += chunk->size;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  if(total <= MS_SHAPE_ARENA_MAX_RETAINED)
+    arena->chunks = msShapeArenaNewChunk(total);
+}
+
+void msShapeArenaDestroy(shapeArenaObj *arena)
+{
+  shapeArenaChunkObj *chunk;
+  if(!arena)
+    return;
+  chunk = arena->chunks;
+  while(chunk) {
+    shapeArenaChunkObj *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(arena);
+}
+
+/*
+** Allocate line or point storage for shape, from its arena if it has one.
+*/
+void *msShapeAllocStorage(shapeObj *shape, size_t size)
+{
+  void *ptr = NULL;
+  if(shape->arena)
+    ptr = msShapeArenaAlloc(shape->arena, size);
+  if(!ptr)
+    ptr = malloc(size);
+  return ptr;
+}
+
+/*
+** free() line or point storage of shape, unless it belongs to its arena.
+*/
+void msShapeFreeStorage(shapeObj *shape, void *ptr)
+{
+  if(!ptr)
+    return;
+  if(shape->arena && msShapeArenaOwns(shape->arena, ptr))
+    return;
+  free(ptr);
+}
+
+/*
+** Give the unused tail of the last block allocated for shape back to its
+** arena.  A no-op for malloc()ed storage.
+*/
+void msShapeShrinkStorage(shapeObj *shape, void *ptr, size_t size, size_t newsize)
+{
+  if(ptr && shape->arena)
+    msShapeArenaShrink(shape->arena, ptr, size, newsize);
+}
+
+/*
+** realloc() line or point storage of shape.  Arena storage cannot grow in
+** place, it is copied (used bytes only) to a new malloc()ed block instead.
+** The result is always a malloc()ed block, or NULL if out of memory.
+*/
+void *msShapeReallocStorage(shapeObj *shape, void *ptr, size_t used, size_t size)
+{
+  void *newptr;
+  if(!ptr || !shape->arena || !msShapeArenaOwns(shape->arena, ptr))
+    return realloc(ptr, size);
+  newptr = malloc(size);
+  if(newptr)
+    memcpy(newptr, ptr, MS_MIN(used, size));
+  return newptr;
+}
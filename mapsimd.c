@@ -0,0 +1,94 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  CPU feature detection for SIMD code paths.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapserver.h"
+#include "mapsimd.h"
+
+#if defined(MS_HAVE_X86_SIMD) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+/************************************************************************/
+/*                        msSIMDDetectLevel()                           */
+/************************************************************************/
+
+static int msSIMDDetectLevel(void)
+{
+#if defined(MS_HAVE_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports("avx2") )
+    return MS_SIMD_AVX2;
+  if( __builtin_cpu_supports("sse2") )
+    return MS_SIMD_SSE2;
+  return MS_SIMD_NONE;
+#elif defined(MS_HAVE_X86_SIMD) && defined(_MSC_VER)
+  int anRegs[4];
+  int bSSE2, bOSXSave, bAVX;
+
+  __cpuid( anRegs, 1 );
+  bSSE2 = (anRegs[3] & (1 << 26)) != 0;
+  bOSXSave = (anRegs[2] & (1 << 27)) != 0;
+  bAVX = (anRegs[2] & (1 << 28)) != 0;
+
+  /* AVX registers must also be saved by the OS (XCR0 bits 1 and 2) */
+  if( bOSXSave && bAVX && (_xgetbv(0) & 6) == 6 ) {
+    __cpuidex( anRegs, 7, 0 );
+    if( anRegs[1] & (1 << 5) )
+      return MS_SIMD_AVX2;
+  }
+  return bSSE2 ? MS_SIMD_SSE2 : MS_SIMD_NONE;
+#else
+  return MS_SIMD_NONE;
+#endif
+}
+
+/************************************************************************/
+/*                          msSIMDGetLevel()                            */
+/************************************************************************/
+
+int msSIMDGetLevel(void)
+{
+  /* detection is idempotent, so a racy first initialization is harmless */
+  static int nLevel = -1;
+
+  if( nLevel < 0 ) {
+    int nDetected = msSIMDDetectLevel();
+    const char *pszCap = getenv("MS_SIMD");
+
+    if( pszCap != NULL ) {
+      if( strcasecmp(pszCap, "NONE") == 0 )
+        nDetected = MS_SIMD_NONE;
+      else if( strcasecmp(pszCap, "SSE2") == 0 )
+        nDetected = MS_MIN(nDetected, MS_SIMD_SSE2);
+    }
+    nLevel = nDetected;
+  }
+
+  return nLevel;
+}
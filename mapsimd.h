@@ -0,0 +1,70 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  CPU feature detection for SIMD code paths.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef MAPSIMD_H
+#define MAPSIMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /*
+  ** MS_HAVE_X86_SIMD is defined when compiling for an x86 target where the
+  ** SSE2 and AVX2 kernels can be built.  Kernels are compiled with the
+  ** MS_SIMD_TARGET_* attributes so that the rest of the file can still be
+  ** built for the baseline instruction set, and are only called after
+  ** msSIMDGetLevel() confirmed the CPU supports them.
+  */
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define MS_HAVE_X86_SIMD 1
+#  if defined(__GNUC__) || defined(__clang__)
+#    define MS_SIMD_TARGET_SSE2 __attribute__((target("sse2")))
+#    define MS_SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#  else
+#    define MS_SIMD_TARGET_SSE2
+#    define MS_SIMD_TARGET_AVX2
+#  endif
+#endif
+
+#define MS_SIMD_NONE 0
+#define MS_SIMD_SSE2 1
+#define MS_SIMD_AVX2 2
+
+  /*
+  ** Returns the best instruction set usable on this CPU, as one of the
+  ** MS_SIMD_* levels.  The MS_SIMD environment variable (NONE, SSE2 or
+  ** AVX2) can be used to cap the level, e.g. to compare against the
+  ** scalar code paths.
+  */
+  int msSIMDGetLevel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAPSIMD_H */
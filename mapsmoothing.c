@@ -127,9 +127,9 @@ static int processShapePathDistance(shapeObj *shape, int force)
   
   /* Clean our shape object */
   for (i= 0; i < newShape->numlines; i++)
-    free(newShape->line[i].point);
+    msShapeFreeStorage(newShape, newShape->line[i].point);
   newShape->numlines = 0;
-  if (newShape->line) free(newShape->line);
+  msShapeFreeStorage(newShape, newShape->line);
   
   for (i=0;i<shape->numlines;++i) {
     const int windowSize = 5;
@@ -225,10 +225,10 @@ shapeObj* msSmoothShapeSIA(shapeObj *shape, int ss, int si, char *preprocessing)
       
       /* Clean our shape object */
       for (j=0; j < newShape->numlines; ++j)
-        free(newShape->line[j].point);
+        msShapeFreeStorage(newShape, newShape->line[j].point);
       newShape->numlines = 0;
       if (newShape->line) {
-        free(newShape->line);
+        msShapeFreeStorage(newShape, newShape->line);
         newShape->line = NULL;
       }
 
@@ -59,6 +59,33 @@ possible to implement for other thread libraries if needed.
         Releases the indicated mutex.  If the lock id is invalid, or if the
         mutex is not currently held by this thread then results are undefined.
 
+  void msThreadRunJobs(msThreadJobFunc pfnJob, void **papJobData,
+                       int nJobs, int nMaxThreads):
+        Runs pfnJob once for each entry of papJobData, using up to
+        nMaxThreads threads (the calling thread included), and returns once
+        all jobs have completed.  Jobs are handed out in order but may
+        complete in any order, so each job must only write to state of its
+        own.  Without USE_THREAD the jobs are simply run in sequence.
+
+  int msThreadParseCount(const char *pszValue, int nDefault):
+        Parses a thread count setting such as a PROCESSING or FORMATOPTION
+        value.  "ALL_CPUS" maps to msThreadGetCPUCount().  Always returns 1
+        when built without USE_THREAD.
+
+  msThreadHandle *msThreadCreate(msThreadJobFunc pfnJob, void *pJobData):
+  void msThreadJoin(msThreadHandle *psThread):
+        Runs pfnJob in a new background thread, and waits for it to end.
+        msThreadCreate() returns NULL if no thread could be started, which
+        is always the case without USE_THREAD: callers then have to do the
+        work themselves.
+
+  msThreadQueue *msThreadQueueCreate(int nMaxItems):
+        Creates a bounded FIFO of pointers for handing work between threads.
+        msThreadQueuePush() waits while the queue is full, msThreadQueuePop()
+        while it is empty.  msThreadQueueClose() wakes up all waiting
+        threads and makes later pushes and pops fail, msThreadQueueDestroy()
+        frees the queue once no thread uses it anymore.
+
 It is incredibly important to ensure that any mutex that is acquired is
 released as soon as possible.  Any flow of control that could result in a
 mutex not being release is going to be a disaster.
@@ -144,7 +171,8 @@ static int thread_debug = 0;
 
 static char *lock_names[] = {
   NULL, "PARSER", "GDAL", "ERROROBJ", "PROJ", "TTF", "POOL", "SDE",
-  "ORACLE", "OWS", "LAYER_VTABLE", "IOCONTEXT", "TMPFILE", "DEBUGOBJ", "OGR", "TIME", "FRIBIDI", "WXS", "GEOS", NULL
+  "ORACLE", "OWS", "LAYER_VTABLE", "IOCONTEXT", "TMPFILE", "DEBUGOBJ", "OGR", "TIME", "FRIBIDI", "WXS", "GEOS", "RASTERCLASS",
+  "TILEINDEX", "GDALCACHE", "JOIN", "PALETTE", "RASTERPOOL", "FEATURESTORE", "OGR_DSCACHE", NULL
 };
 #endif
 
@@ -316,3 +344,437 @@ void msReleaseLock( int nLockId )
 }
 
 #endif /* defined(USE_THREAD) && defined(_WIN32) */
+
+
+/************************************************************************/
+/* ==================================================================== */
+/*                             JOB RUNNER                               */
+/* ==================================================================== */
+/************************************************************************/
+
+#if defined(_WIN32) && !defined(USE_THREAD)
+#include <windows.h>
+#endif
+
+typedef struct {
+  msThreadJobFunc pfnJob;
+  void **papJobData;
+  int nJobs;
+  int nNextJob;
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_mutex_t hLock;
+#endif
+} msThreadJobQueue;
+
+/************************************************************************/
+/*                         msThreadJobWorker()                          */
+/*                                                                      */
+/*      Pull jobs off the queue until it is exhausted.                  */
+/************************************************************************/
+
+static void msThreadJobWorker( msThreadJobQueue *psQueue )
+
+{
+  for( ;; ) {
+    int iJob;
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+    pthread_mutex_lock( &(psQueue->hLock) );
+    iJob = psQueue->nNextJob++;
+    pthread_mutex_unlock( &(psQueue->hLock) );
+#elif defined(USE_THREAD) && defined(_WIN32)
+    iJob = InterlockedIncrement( (LONG *) &(psQueue->nNextJob) ) - 1;
+#else
+    iJob = psQueue->nNextJob++;
+#endif
+
+    if( iJob >= psQueue->nJobs )
+      break;
+
+    psQueue->pfnJob( psQueue->papJobData[iJob] );
+  }
+}
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+static void *msThreadJobWorkerPosix( void *pData )
+{
+  msThreadJobWorker( (msThreadJobQueue *) pData );
+  return NULL;
+}
+#elif defined(USE_THREAD) && defined(_WIN32)
+static DWORD WINAPI msThreadJobWorkerWin32( LPVOID pData )
+{
+  msThreadJobWorker( (msThreadJobQueue *) pData );
+  return 0;
+}
+#endif
+
+/************************************************************************/
+/*                          msThreadRunJobs()                           */
+/************************************************************************/
+
+void msThreadRunJobs( msThreadJobFunc pfnJob, void **papJobData,
+                      int nJobs, int nMaxThreads )
+
+{
+  msThreadJobQueue sQueue;
+  int nThreads = MS_MIN(nMaxThreads, nJobs);
+
+  sQueue.pfnJob = pfnJob;
+  sQueue.papJobData = papJobData;
+  sQueue.nJobs = nJobs;
+  sQueue.nNextJob = 0;
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+  /* the workers, including the calling thread, always take the lock */
+  pthread_mutex_init( &(sQueue.hLock), NULL );
+
+  if( nThreads > 1 ) {
+    pthread_t *pahThreads;
+    int i, nStarted = 0;
+
+    pahThreads = (pthread_t *) msSmallMalloc(sizeof(pthread_t) * (nThreads-1));
+
+    for( i = 0; i < nThreads-1; i++ ) {
+      if( pthread_create( pahThreads + nStarted, NULL,
+                          msThreadJobWorkerPosix, &sQueue ) == 0 )
+        nStarted++;
+    }
+
+    /* the calling thread takes its share too */
+    msThreadJobWorker( &sQueue );
+
+    for( i = 0; i < nStarted; i++ )
+      pthread_join( pahThreads[i], NULL );
+
+    free( pahThreads );
+    pthread_mutex_destroy( &(sQueue.hLock) );
+    return;
+  }
+#elif defined(USE_THREAD) && defined(_WIN32)
+  if( nThreads > 1 ) {
+    HANDLE *pahThreads;
+    int i, nStarted = 0;
+
+    pahThreads = (HANDLE *) msSmallMalloc(sizeof(HANDLE) * (nThreads-1));
+
+    for( i = 0; i < nThreads-1; i++ ) {
+      pahThreads[nStarted] = CreateThread( NULL, 0, msThreadJobWorkerWin32,
+                                           &sQueue, 0, NULL );
+      if( pahThreads[nStarted] != NULL )
+        nStarted++;
+    }
+
+    msThreadJobWorker( &sQueue );
+
+    if( nStarted > 0 )
+      WaitForMultipleObjects( nStarted, pahThreads, TRUE, INFINITE );
+    for( i = 0; i < nStarted; i++ )
+      CloseHandle( pahThreads[i] );
+
+    free( pahThreads );
+    return;
+  }
+#else
+  (void) nThreads;
+#endif
+
+  msThreadJobWorker( &sQueue );
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_mutex_destroy( &(sQueue.hLock) );
+#endif
+}
+
+/************************************************************************/
+/*                        msThreadGetCPUCount()                         */
+/************************************************************************/
+
+int msThreadGetCPUCount()
+
+{
+#if defined(_WIN32)
+  SYSTEM_INFO sInfo;
+  GetSystemInfo( &sInfo );
+  return MS_MAX(1, (int) sInfo.dwNumberOfProcessors);
+#elif defined(_SC_NPROCESSORS_ONLN)
+  return MS_MAX(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+#else
+  return 1;
+#endif
+}
+
+/************************************************************************/
+/*                         msThreadParseCount()                         */
+/************************************************************************/
+
+int msThreadParseCount( const char *pszValue, int nDefault )
+
+{
+#if defined(USE_THREAD)
+  int nCount;
+
+  if( pszValue == NULL )
+    return MS_MAX(1, nDefault);
+
+  if( strcasecmp(pszValue, "ALL_CPUS") == 0 )
+    return msThreadGetCPUCount();
+
+  nCount = atoi(pszValue);
+  return MS_MAX(1, nCount);
+#else
+  (void) pszValue;
+  (void) nDefault;
+  return 1;
+#endif
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*                       BACKGROUND THREADS                             */
+/* ==================================================================== */
+/************************************************************************/
+
+struct msThreadHandle_t {
+  msThreadJobFunc pfnJob;
+  void *pJobData;
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_t hThread;
+#elif defined(USE_THREAD) && defined(_WIN32)
+  HANDLE hThread;
+#endif
+};
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+static void *msThreadStartPosix( void *pData )
+{
+  msThreadHandle *psThread = (msThreadHandle *) pData;
+  psThread->pfnJob( psThread->pJobData );
+  return NULL;
+}
+#elif defined(USE_THREAD) && defined(_WIN32)
+static DWORD WINAPI msThreadStartWin32( LPVOID pData )
+{
+  msThreadHandle *psThread = (msThreadHandle *) pData;
+  psThread->pfnJob( psThread->pJobData );
+  return 0;
+}
+#endif
+
+/************************************************************************/
+/*                           msThreadCreate()                           */
+/************************************************************************/
+
+msThreadHandle *msThreadCreate( msThreadJobFunc pfnJob, void *pJobData )
+
+{
+#if defined(USE_THREAD)
+  msThreadHandle *psThread;
+
+  psThread = (msThreadHandle *) msSmallMalloc(sizeof(msThreadHandle));
+  psThread->pfnJob = pfnJob;
+  psThread->pJobData = pJobData;
+
+#if !defined(_WIN32)
+  if( pthread_create( &(psThread->hThread), NULL,
+                      msThreadStartPosix, psThread ) != 0 ) {
+    free( psThread );
+    return NULL;
+  }
+#else
+  psThread->hThread = CreateThread( NULL, 0, msThreadStartWin32,
+                                    psThread, 0, NULL );
+  if( psThread->hThread == NULL ) {
+    free( psThread );
+    return NULL;
+  }
+#endif
+  return psThread;
+#else
+  (void) pfnJob;
+  (void) pJobData;
+  return NULL;
+#endif
+}
+
+/************************************************************************/
+/*                            msThreadJoin()                            */
+/************************************************************************/
+
+void msThreadJoin( msThreadHandle *psThread )
+
+{
+  if( psThread == NULL )
+    return;
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_join( psThread->hThread, NULL );
+#elif defined(USE_THREAD) && defined(_WIN32)
+  WaitForSingleObject( psThread->hThread, INFINITE );
+  CloseHandle( psThread->hThread );
+#endif
+  free( psThread );
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*                         BOUNDED QUEUE                                */
+/* ==================================================================== */
+/************************************************************************/
+
+struct msThreadQueue_t {
+  void **papItems;
+  int nMaxItems;
+  int nFirst;
+  int nItems;
+  int bClosed;
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_mutex_t hLock;
+  pthread_cond_t hNotEmpty;
+  pthread_cond_t hNotFull;
+#elif defined(USE_THREAD) && defined(_WIN32)
+  CRITICAL_SECTION hLock;
+  CONDITION_VARIABLE hNotEmpty;
+  CONDITION_VARIABLE hNotFull;
+#endif
+};
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+#define QUEUE_LOCK(q)       pthread_mutex_lock( &((q)->hLock) )
+#define QUEUE_UNLOCK(q)     pthread_mutex_unlock( &((q)->hLock) )
+#define QUEUE_WAIT(q,c)     pthread_cond_wait( &((q)->c), &((q)->hLock) )
+#define QUEUE_SIGNAL(q,c)   pthread_cond_signal( &((q)->c) )
+#define QUEUE_BROADCAST(q,c) pthread_cond_broadcast( &((q)->c) )
+#elif defined(USE_THREAD) && defined(_WIN32)
+#define QUEUE_LOCK(q)       EnterCriticalSection( &((q)->hLock) )
+#define QUEUE_UNLOCK(q)     LeaveCriticalSection( &((q)->hLock) )
+#define QUEUE_WAIT(q,c)     SleepConditionVariableCS( &((q)->c), &((q)->hLock), INFINITE )
+#define QUEUE_SIGNAL(q,c)   WakeConditionVariable( &((q)->c) )
+#define QUEUE_BROADCAST(q,c) WakeAllConditionVariable( &((q)->c) )
+#else
+/* nobody else can change the queue, so never wait */
+#define QUEUE_LOCK(q)
+#define QUEUE_UNLOCK(q)
+#define QUEUE_WAIT(q,c)     break
+#define QUEUE_SIGNAL(q,c)
+#define QUEUE_BROADCAST(q,c)
+#endif
+
+/************************************************************************/
+/*                        msThreadQueueCreate()                         */
+/************************************************************************/
+
+msThreadQueue *msThreadQueueCreate( int nMaxItems )
+
+{
+  msThreadQueue *psQueue;
+
+  psQueue = (msThreadQueue *) msSmallMalloc(sizeof(msThreadQueue));
+  psQueue->nMaxItems = MS_MAX(1, nMaxItems);
+  psQueue->papItems = (void **) msSmallMalloc(sizeof(void*) * psQueue->nMaxItems);
+  psQueue->nFirst = psQueue->nItems = 0;
+  psQueue->bClosed = MS_FALSE;
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_mutex_init( &(psQueue->hLock), NULL );
+  pthread_cond_init( &(psQueue->hNotEmpty), NULL );
+  pthread_cond_init( &(psQueue->hNotFull), NULL );
+#elif defined(USE_THREAD) && defined(_WIN32)
+  InitializeCriticalSection( &(psQueue->hLock) );
+  InitializeConditionVariable( &(psQueue->hNotEmpty) );
+  InitializeConditionVariable( &(psQueue->hNotFull) );
+#endif
+
+  return psQueue;
+}
+
+/************************************************************************/
+/*                         msThreadQueuePush()                          */
+/*                                                                      */
+/*      Appends an item, waiting while the queue is full.  Returns      */
+/*      MS_FALSE if the queue was closed (or is full, without threads). */
+/************************************************************************/
+
+int msThreadQueuePush( msThreadQueue *psQueue, void *pItem )
+
+{
+  int bPushed = MS_FALSE;
+
+  QUEUE_LOCK( psQueue );
+  while( !psQueue->bClosed && psQueue->nItems == psQueue->nMaxItems )
+    QUEUE_WAIT( psQueue, hNotFull );
+  if( !psQueue->bClosed && psQueue->nItems < psQueue->nMaxItems ) {
+    psQueue->papItems[(psQueue->nFirst + psQueue->nItems) % psQueue->nMaxItems] = pItem;
+    psQueue->nItems++;
+    bPushed = MS_TRUE;
+    QUEUE_SIGNAL( psQueue, hNotEmpty );
+  }
+  QUEUE_UNLOCK( psQueue );
+
+  return bPushed;
+}
+
+/************************************************************************/
+/*                          msThreadQueuePop()                          */
+/*                                                                      */
+/*      Removes the oldest item, waiting while the queue is empty.      */
+/*      Returns NULL if the queue was closed (or is empty, without      */
+/*      threads).                                                       */
+/************************************************************************/
+
+void *msThreadQueuePop( msThreadQueue *psQueue )
+
+{
+  void *pItem = NULL;
+
+  QUEUE_LOCK( psQueue );
+  while( !psQueue->bClosed && psQueue->nItems == 0 )
+    QUEUE_WAIT( psQueue, hNotEmpty );
+  if( !psQueue->bClosed && psQueue->nItems > 0 ) {
+    pItem = psQueue->papItems[psQueue->nFirst];
+    psQueue->nFirst = (psQueue->nFirst + 1) % psQueue->nMaxItems;
+    psQueue->nItems--;
+    QUEUE_SIGNAL( psQueue, hNotFull );
+  }
+  QUEUE_UNLOCK( psQueue );
+
+  return pItem;
+}
+
+/************************************************************************/
+/*                         msThreadQueueClose()                         */
+/*                                                                      */
+/*      Wakes up all waiting threads, later push and pop calls fail.    */
+/************************************************************************/
+
+void msThreadQueueClose( msThreadQueue *psQueue )
+
+{
+  QUEUE_LOCK( psQueue );
+  psQueue->bClosed = MS_TRUE;
+  QUEUE_BROADCAST( psQueue, hNotEmpty );
+  QUEUE_BROADCAST( psQueue, hNotFull );
+  QUEUE_UNLOCK( psQueue );
+}
+
+/************************************************************************/
+/*                        msThreadQueueDestroy()                        */
+/************************************************************************/
+
+void msThreadQueueDestroy( msThreadQueue *psQueue )
+
+{
+  if( psQueue == NULL )
+    return;
+
+#if defined(USE_THREAD) && !defined(_WIN32)
+  pthread_mutex_destroy( &(psQueue->hLock) );
+  pthread_cond_destroy( &(psQueue->hNotEmpty) );
+  pthread_cond_destroy( &(psQueue->hNotFull) );
+#elif defined(USE_THREAD) && defined(_WIN32)
+  DeleteCriticalSection( &(psQueue->hLock) );
+#endif
+
+  free( psQueue->papItems );
+  free( psQueue );
+}
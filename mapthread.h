@@ -46,6 +46,32 @@ extern "C" {
 #define msReleaseLock(x)
 #endif
 
+  /*
+  ** Simple fork/join job runner.  Without USE_THREAD the jobs are run
+  ** sequentially in the calling thread.
+  */
+  typedef void (*msThreadJobFunc)( void *pJobData );
+
+  void msThreadRunJobs( msThreadJobFunc pfnJob, void **papJobData,
+                        int nJobs, int nMaxThreads );
+  int msThreadGetCPUCount(void);
+  int msThreadParseCount( const char *pszValue, int nDefault );
+
+  /*
+  ** Background thread and bounded queue for producer/consumer pipelines.
+  ** Without USE_THREAD msThreadCreate() always returns NULL.
+  */
+  typedef struct msThreadHandle_t msThreadHandle;
+  typedef struct msThreadQueue_t msThreadQueue;
+
+  msThreadHandle *msThreadCreate( msThreadJobFunc pfnJob, void *pJobData );
+  void msThreadJoin( msThreadHandle *psThread );
+  msThreadQueue *msThreadQueueCreate( int nMaxItems );
+  int msThreadQueuePush( msThreadQueue *psQueue, void *pItem );
+  void *msThreadQueuePop( msThreadQueue *psQueue );
+  void msThreadQueueClose( msThreadQueue *psQueue );
+  void msThreadQueueDestroy( msThreadQueue *psQueue );
+
   /*
   ** lock ids - note there is a corresponding lock_names[] array in
   ** mapthread.c that needs to be extended when new ids are added.
@@ -69,8 +95,16 @@ extern "C" {
 #define TLOCK_FRIBIDI   16
 #define TLOCK_WxS       17
 #define TLOCK_GEOS       18
-
-#define TLOCK_STATIC_MAX 20
+#define TLOCK_RASTERCLASS 19
+#define TLOCK_TILEINDEX 20
+#define TLOCK_GDALCACHE 21
+#define TLOCK_JOIN      22
+#define TLOCK_PALETTE   23
+#define TLOCK_RASTERPOOL 24
+#define TLOCK_FEATURESTORE 25
+#define TLOCK_OGR_DSCACHE 26
+
+#define TLOCK_STATIC_MAX 27
 #define TLOCK_MAX       100
 
 #ifdef __cplusplus
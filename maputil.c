@@ -1941,6 +1941,11 @@ void msCleanup()
 #ifdef USE_GDAL
   msGDALCleanup();
 #endif
+  msRasterClassLUTCleanup();
+  msJoinCleanup();
+  msQuantizeCleanup();
+  msRasterBufferPoolCleanup();
+  msFeatureStoreCleanup();
 #ifdef USE_PROJ
 #  if PJ_VERSION >= 480
   pj_clear_initcache();
@@ -2211,11 +2216,11 @@ void msFreeRasterBuffer(rasterBufferObj *b)
 {
   switch(b->type) {
     case MS_BUFFER_BYTE_RGBA:
-      msFree(b->data.rgba.pixels);
+      msRasterBufferPoolRelease(b->data.rgba.pixels, (size_t)b->data.rgba.row_step * b->height);
       b->data.rgba.pixels = NULL;
       break;
     case MS_BUFFER_BYTE_PALETTE:
-      msFree(b->data.palette.pixels);
+      msRasterBufferPoolRelease(b->data.palette.pixels, (size_t)b->width * b->height);
       msFree(b->data.palette.palette);
       b->data.palette.pixels = NULL;
       b->data.palette.palette = NULL;
@@ -0,0 +1,303 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  SIMD world to pixel transform and bounds of vertex arrays.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapserver.h"
+#include "mapsimd.h"
+
+#ifdef MS_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Vertex array kernels.                                           */
+/*                                                                      */
+/*      The x and y members of a pointObj are adjacent doubles, so      */
+/*      one SSE2 register holds the (x,y) pair of a vertex.  Without    */
+/*      USE_POINT_Z_M the vertices are packed and an AVX2 register      */
+/*      holds two of them; with z and m the AVX2 level falls back to    */
+/*      the SSE2 kernels.                                               */
+/*                                                                      */
+/*      The transform computes (x-minx)*inv_cs and (-y+maxy)*inv_cs,    */
+/*      the y sign being flipped with a xor, which are exactly the      */
+/*      MS_MAP2IMAGE_X/Y_IC_DBL() values (zeros included).  The         */
+/*      vector rounding matches MS_NINT() only when it is lrint(), so   */
+/*      the rounding modes stay scalar with the generic MS_NINT().      */
+/* ==================================================================== */
+/************************************************************************/
+
+#ifdef USE_POINT_Z_M
+#  define MS_VERTEX_PACKED 0
+#else
+#  define MS_VERTEX_PACKED 1
+#endif
+
+#if defined(HAVE_LRINT) && !defined(USE_GENERIC_MS_NINT)
+#  define MS_VERTEX_SIMD_ROUND 1
+#else
+#  define MS_VERTEX_SIMD_ROUND 0
+#endif
+
+/************************************************************************/
+/*                          Scalar versions.                            */
+/************************************************************************/
+
+static void msTransformPointArrayScalar( pointObj *point, int numpoints,
+                                         double minx, double maxy,
+                                         double inv_cs, double snap )
+
+{
+  int i;
+
+  if( snap > 0 ) {
+    for( i = 0; i < numpoints; i++ ) {
+      point[i].x = MS_MAP2IMAGE_X_IC_SNAP(point[i].x, minx, inv_cs, snap);
+      point[i].y = MS_MAP2IMAGE_Y_IC_SNAP(point[i].y, maxy, inv_cs, snap);
+    }
+  } else {
+    for( i = 0; i < numpoints; i++ ) {
+      point[i].x = MS_MAP2IMAGE_X_IC_DBL(point[i].x, minx, inv_cs);
+      point[i].y = MS_MAP2IMAGE_Y_IC_DBL(point[i].y, maxy, inv_cs);
+    }
+  }
+}
+
+static void msPointArrayBoundsScalar( const pointObj *point, int numpoints,
+                                      rectObj *bounds )
+
+{
+  int i;
+
+  for( i = 0; i < numpoints; i++ ) {
+    bounds->minx = MS_MIN(bounds->minx, point[i].x);
+    bounds->maxx = MS_MAX(bounds->maxx, point[i].x);
+    bounds->miny = MS_MIN(bounds->miny, point[i].y);
+    bounds->maxy = MS_MAX(bounds->maxy, point[i].y);
+  }
+}
+
+#ifdef MS_HAVE_X86_SIMD
+
+/************************************************************************/
+/*                           SSE2 versions.                             */
+/************************************************************************/
+
+/* round to nearest even like lrint(): adding and removing 2^52 rounds */
+/* |v| < 2^52 in the current rounding mode, larger values are already */
+/* integers.  The final +0.0 turns -0.0 into 0.0 as lrint() would. */
+MS_SIMD_TARGET_SSE2
+static __m128d msRoundLanes_SSE2( __m128d v )
+
+{
+  const __m128d sign = _mm_set1_pd( -0.0 );
+  const __m128d magic = _mm_set1_pd( 4503599627370496.0 );
+  __m128d a = _mm_andnot_pd( sign, v );
+  __m128d r = _mm_sub_pd( _mm_add_pd( a, magic ), magic );
+  __m128d big = _mm_cmpge_pd( a, magic );
+
+  r = _mm_or_pd( r, _mm_and_pd( v, sign ) );
+  r = _mm_or_pd( _mm_and_pd( big, v ), _mm_andnot_pd( big, r ) );
+  return _mm_add_pd( r, _mm_setzero_pd() );
+}
+
+MS_SIMD_TARGET_SSE2
+static void msTransformPointArray_SSE2( pointObj *point, int numpoints,
+                                        double minx, double maxy,
+                                        double inv_cs, double snap )
+
+{
+  const __m128d flip = _mm_set_pd( -0.0, 0.0 );
+  const __m128d origin = _mm_set_pd( -maxy, minx );
+  const __m128d scale = _mm_set1_pd( inv_cs );
+  const __m128d res = _mm_set1_pd( snap );
+  int i;
+
+  if( snap > 0 ) {
+    for( i = 0; i < numpoints; i++ ) {
+      __m128d v = _mm_xor_pd( _mm_loadu_pd( &point[i].x ), flip );
+      v = _mm_mul_pd( _mm_sub_pd( v, origin ), scale );
+      v = _mm_div_pd( msRoundLanes_SSE2( _mm_mul_pd( v, res ) ), res );
+      _mm_storeu_pd( &point[i].x, v );
+    }
+  } else {
+    for( i = 0; i < numpoints; i++ ) {
+      __m128d v = _mm_xor_pd( _mm_loadu_pd( &point[i].x ), flip );
+      v = _mm_mul_pd( _mm_sub_pd( v, origin ), scale );
+      _mm_storeu_pd( &point[i].x, v );
+    }
+  }
+}
+
+MS_SIMD_TARGET_SSE2
+static void msPointArrayBounds_SSE2( const pointObj *point, int numpoints,
+                                     rectObj *bounds )
+
+{
+  __m128d vmin = _mm_set_pd( bounds->miny, bounds->minx );
+  __m128d vmax = _mm_set_pd( bounds->maxy, bounds->maxx );
+  int i;
+
+  /* minpd/maxpd return the second operand unless the first one wins, */
+  /* just like MS_MIN(bounds, p) and MS_MAX(bounds, p) */
+  for( i = 0; i < numpoints; i++ ) {
+    __m128d p = _mm_loadu_pd( &point[i].x );
+    vmin = _mm_min_pd( vmin, p );
+    vmax = _mm_max_pd( vmax, p );
+  }
+  bounds->minx = _mm_cvtsd_f64( vmin );
+  bounds->miny = _mm_cvtsd_f64( _mm_unpackhi_pd( vmin, vmin ) );
+  bounds->maxx = _mm_cvtsd_f64( vmax );
+  bounds->maxy = _mm_cvtsd_f64( _mm_unpackhi_pd( vmax, vmax ) );
+}
+
+#if MS_VERTEX_PACKED
+
+/************************************************************************/
+/*                           AVX2 versions.                             */
+/*                                                                      */
+/*      Two packed vertices per register, the odd vertex count tail     */
+/*      is left to the SSE2 kernels.                                    */
+/************************************************************************/
+
+MS_SIMD_TARGET_AVX2
+static int msTransformPointArray_AVX2( pointObj *point, int numpoints,
+                                       double minx, double maxy,
+                                       double inv_cs, double snap )
+
+{
+  const __m256d flip = _mm256_set_pd( -0.0, 0.0, -0.0, 0.0 );
+  const __m256d origin = _mm256_set_pd( -maxy, minx, -maxy, minx );
+  const __m256d scale = _mm256_set1_pd( inv_cs );
+  const __m256d res = _mm256_set1_pd( snap );
+  double *p = &point[0].x;
+  int i;
+
+  if( snap > 0 ) {
+    for( i = 0; i + 2 <= numpoints; i += 2 ) {
+      __m256d v = _mm256_xor_pd( _mm256_loadu_pd( p + 2 * i ), flip );
+      v = _mm256_mul_pd( _mm256_sub_pd( v, origin ), scale );
+      v = _mm256_round_pd( _mm256_mul_pd( v, res ), _MM_FROUND_CUR_DIRECTION );
+      v = _mm256_div_pd( _mm256_add_pd( v, _mm256_setzero_pd() ), res );
+      _mm256_storeu_pd( p + 2 * i, v );
+    }
+  } else {
+    for( i = 0; i + 2 <= numpoints; i += 2 ) {
+      __m256d v = _mm256_xor_pd( _mm256_loadu_pd( p + 2 * i ), flip );
+      v = _mm256_mul_pd( _mm256_sub_pd( v, origin ), scale );
+      _mm256_storeu_pd( p + 2 * i, v );
+    }
+  }
+  return i;
+}
+
+MS_SIMD_TARGET_AVX2
+static int msPointArrayBounds_AVX2( const pointObj *point, int numpoints,
+                                    rectObj *bounds )
+
+{
+  const double *p = &point[0].x;
+  __m256d vmin = _mm256_set_pd( bounds->miny, bounds->minx, bounds->miny, bounds->minx );
+  __m256d vmax = _mm256_set_pd( bounds->maxy, bounds->maxx, bounds->maxy, bounds->maxx );
+  __m128d lo, hi;
+  int i;
+
+  for( i = 0; i + 2 <= numpoints; i += 2 ) {
+    __m256d v = _mm256_loadu_pd( p + 2 * i );
+    vmin = _mm256_min_pd( vmin, v );
+    vmax = _mm256_max_pd( vmax, v );
+  }
+  lo = _mm_min_pd( _mm256_castpd256_pd128( vmin ), _mm256_extractf128_pd( vmin, 1 ) );
+  hi = _mm_max_pd( _mm256_castpd256_pd128( vmax ), _mm256_extractf128_pd( vmax, 1 ) );
+  bounds->minx = _mm_cvtsd_f64( lo );
+  bounds->miny = _mm_cvtsd_f64( _mm_unpackhi_pd( lo, lo ) );
+  bounds->maxx = _mm_cvtsd_f64( hi );
+  bounds->maxy = _mm_cvtsd_f64( _mm_unpackhi_pd( hi, hi ) );
+  return i;
+}
+
+#endif /* MS_VERTEX_PACKED */
+
+#endif /* MS_HAVE_X86_SIMD */
+
+/************************************************************************/
+/*                       msTransformPointArray()                        */
+/*                                                                      */
+/*      Transforms numpoints vertices from map to image coordinates     */
+/*      in place.  With snap > 0 the result is rounded to a 1/snap      */
+/*      pixel grid as MS_MAP2IMAGE_X/Y_IC_SNAP() do (snap = 1 being     */
+/*      MS_MAP2IMAGE_X/Y_IC() rounding), otherwise it is kept in full   */
+/*      precision as MS_MAP2IMAGE_X/Y_IC_DBL() do.                      */
+/************************************************************************/
+
+void msTransformPointArray( pointObj *point, int numpoints,
+                            double minx, double maxy,
+                            double inv_cs, double snap )
+
+{
+#ifdef MS_HAVE_X86_SIMD
+  int level = msSIMDGetLevel();
+
+  if( level != MS_SIMD_NONE && (snap <= 0 || MS_VERTEX_SIMD_ROUND) ) {
+    int i = 0;
+#if MS_VERTEX_PACKED
+    if( level >= MS_SIMD_AVX2 )
+      i = msTransformPointArray_AVX2( point, numpoints, minx, maxy, inv_cs, snap );
+#endif
+    msTransformPointArray_SSE2( point + i, numpoints - i, minx, maxy, inv_cs, snap );
+    return;
+  }
+#endif
+  msTransformPointArrayScalar( point, numpoints, minx, maxy, inv_cs, snap );
+}
+
+/************************************************************************/
+/*                      msPointArrayExtendBounds()                      */
+/*                                                                      */
+/*      Grows the (initialized) bounds to include numpoints vertices.   */
+/************************************************************************/
+
+void msPointArrayExtendBounds( const pointObj *point, int numpoints,
+                               rectObj *bounds )
+
+{
+#ifdef MS_HAVE_X86_SIMD
+  int level = msSIMDGetLevel();
+
+  if( level != MS_SIMD_NONE ) {
+    int i = 0;
+#if MS_VERTEX_PACKED
+    if( level >= MS_SIMD_AVX2 )
+      i = msPointArrayBounds_AVX2( point, numpoints, bounds );
+#endif
+    msPointArrayBounds_SSE2( point + i, numpoints - i, bounds );
+    return;
+  }
+#endif
+  msPointArrayBoundsScalar( point, numpoints, bounds );
+}
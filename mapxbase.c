@@ -134,6 +134,42 @@ static void flushRecord( DBFHandle psDBF )
   }
 }
 
+/************************************************************************/
+/*                             loadRecord()                             */
+/*                                                                      */
+/*      Make sure bytes nStart to nEnd of record hEntity are in         */
+/*      pszCurrentRecord.  Only that byte range is read from the        */
+/*      file, so a caller needing a few fields of a wide record does    */
+/*      not pay for reading the whole of it.                            */
+/************************************************************************/
+static int loadRecord( DBFHandle psDBF, int hEntity, int nStart, int nEnd )
+
+{
+  unsigned int nRecordOffset;
+
+  if( psDBF->nCurrentRecord == hEntity ) {
+    if( nStart >= psDBF->nCurrentRecordStart && nEnd <= psDBF->nCurrentRecordEnd )
+      return MS_TRUE;
+    /* a modified record is always fully loaded, so there is nothing to flush */
+    nStart = MS_MIN(nStart, psDBF->nCurrentRecordStart);
+    nEnd = MS_MAX(nEnd, psDBF->nCurrentRecordEnd);
+  } else
+    flushRecord( psDBF );
+
+  nRecordOffset = psDBF->nRecordLength * hEntity + psDBF->nHeaderLength + nStart;
+
+  safe_fseek( psDBF->fp, nRecordOffset, 0 );
+  if( fread( psDBF->pszCurrentRecord + nStart, nEnd - nStart, 1, psDBF->fp ) != 1 ) {
+    psDBF->nCurrentRecord = -1;
+    return MS_FALSE;
+  }
+
+  psDBF->nCurrentRecord = hEntity;
+  psDBF->nCurrentRecordStart = nStart;
+  psDBF->nCurrentRecordEnd = nEnd;
+  return MS_TRUE;
+}
+
 /************************************************************************/
 /*                              msDBFOpen()                             */
 /*                                                                      */
@@ -191,6 +227,7 @@ DBFHandle msDBFOpen( const char * pszFilename, const char * pszAccess )
   psDBF->bNoHeader = MS_FALSE;
   psDBF->nCurrentRecord = -1;
   psDBF->bCurrentRecordModified = MS_FALSE;
+  psDBF->nCurrentRecordStart = psDBF->nCurrentRecordEnd = 0;
 
   psDBF->pszStringField = NULL;
   psDBF->nStringFieldLen = 0;
@@ -369,6 +406,7 @@ DBFHandle msDBFCreate( const char * pszFilename )
 
   psDBF->nCurrentRecord = -1;
   psDBF->bCurrentRecordModified = MS_FALSE;
+  psDBF->nCurrentRecordStart = psDBF->nCurrentRecordEnd = 0;
   psDBF->pszCurrentRecord = NULL;
 
   psDBF->pszStringField = NULL;
@@ -511,7 +549,6 @@ static const char *msDBFReadAttribute(DBFHandle psDBF, int hEntity, int iField )
 
 {
   int         i;
-  unsigned int nRecordOffset;
   const uchar *pabyRec;
   const char  *pReturnField = NULL;
 
@@ -531,19 +568,13 @@ static const char *msDBFReadAttribute(DBFHandle psDBF, int hEntity, int iField )
   /* -------------------------------------------------------------------- */
   /*  Have we read the record?              */
   /* -------------------------------------------------------------------- */
-  if( psDBF->nCurrentRecord != hEntity ) {
-    flushRecord( psDBF );
-
-    nRecordOffset = psDBF->nRecordLength * hEntity + psDBF->nHeaderLength;
-
-    safe_fseek( psDBF->fp, nRecordOffset, 0 );
-    if( fread( psDBF->pszCurrentRecord, psDBF->nRecordLength, 1, psDBF->fp ) != 1 )
-    {
+  if( psDBF->nCurrentRecord != hEntity
+      || psDBF->panFieldOffset[iField] < psDBF->nCurrentRecordStart
+      || psDBF->panFieldOffset[iField] + psDBF->panFieldSize[iField] > psDBF->nCurrentRecordEnd ) {
+    if( !loadRecord( psDBF, hEntity, 0, psDBF->nRecordLength ) ) {
       msSetError(MS_DBFERR, "Cannot read record %d.", "msDBFReadAttribute()",hEntity );
       return( NULL );
     }
-
-    psDBF->nCurrentRecord = hEntity;
   }
 
   pabyRec = (const uchar *) psDBF->pszCurrentRecord;
@@ -691,7 +722,6 @@ DBFFieldType msDBFGetFieldInfo( DBFHandle psDBF, int iField, char * pszFieldName
 /************************************************************************/
 static int msDBFWriteAttribute(DBFHandle psDBF, int hEntity, int iField, void * pValue )
 {
-  unsigned int          nRecordOffset;
   int  i, j;
   uchar *pabyRec;
   char  szSField[40], szFormat[12];
@@ -716,23 +746,16 @@ static int msDBFWriteAttribute(DBFHandle psDBF, int hEntity, int iField, void *
       psDBF->pszCurrentRecord[i] = ' ';
 
     psDBF->nCurrentRecord = hEntity;
+    psDBF->nCurrentRecordStart = 0;
+    psDBF->nCurrentRecordEnd = psDBF->nRecordLength;
   }
 
   /* -------------------------------------------------------------------- */
   /*      Is this an existing record, but different than the last one     */
   /*      we accessed?                                                    */
   /* -------------------------------------------------------------------- */
-  if( psDBF->nCurrentRecord != hEntity ) {
-    flushRecord( psDBF );
-
-    nRecordOffset = psDBF->nRecordLength * hEntity + psDBF->nHeaderLength;
-
-    safe_fseek( psDBF->fp, nRecordOffset, 0 );
-    if( fread( psDBF->pszCurrentRecord, psDBF->nRecordLength, 1, psDBF->fp ) != 1 )
-      return MS_FALSE;
-
-    psDBF->nCurrentRecord = hEntity;
-  }
+  if( !loadRecord( psDBF, hEntity, 0, psDBF->nRecordLength ) )
+    return MS_FALSE;
 
   pabyRec = (uchar *) psDBF->pszCurrentRecord;
 
@@ -903,10 +926,36 @@ char **msDBFGetValueList(DBFHandle dbffile, int record, int *itemindexes, int nu
 {
   const char *value;
   char **values=NULL;
-  int i;
+  int i, nStart, nEnd;
 
   if(numitems == 0) return(NULL);
 
+  if(record < 0 || record >= dbffile->nRecords) {
+    msSetError(MS_DBFERR, "Invalid record number %d.", "msDBFGetValueList()", record);
+    return(NULL);
+  }
+
+  /* only read the part of the record holding the requested fields */
+  nStart = (int)dbffile->nRecordLength;
+  nEnd = 0;
+  for(i=0; i<numitems; i++) {
+    if(itemindexes[i] < 0 || itemindexes[i] >= dbffile->nFields) {
+      nStart = 0;
+      nEnd = dbffile->nRecordLength;
+      break;
+    }
+    nStart = MS_MIN(nStart, dbffile->panFieldOffset[itemindexes[i]]);
+    nEnd = MS_MAX(nEnd, dbffile->panFieldOffset[itemindexes[i]] + dbffile->panFieldSize[itemindexes[i]]);
+  }
+  if(nEnd <= nStart) {
+    nStart = 0;
+    nEnd = dbffile->nRecordLength;
+  }
+  if(!loadRecord(dbffile, record, nStart, nEnd)) {
+    msSetError(MS_DBFERR, "Cannot read record %d.", "msDBFGetValueList()", record);
+    return(NULL);
+  }
+
   values = (char **)malloc(sizeof(char *)*numitems);
   MS_CHECK_ALLOC(values, sizeof(char *)*numitems, NULL);
 
@@ -293,21 +293,32 @@ int main(int argc, char *argv[])
       }
     }
 
-    image = msDrawMap(map, MS_FALSE);
+    if(msMapGetBandHeight(map) > 0) {
+      /* large images are drawn and written a band of rows at a time */
+      if(msDrawMapInBands(map, outfile, NULL, NULL) != MS_SUCCESS) {
+        msWriteError(stderr);
+
+        msFreeMap(map);
+        msCleanup();
+        exit(1);
+      }
+    } else {
+      image = msDrawMap(map, MS_FALSE);
 
-    if(!image) {
-      msWriteError(stderr);
+      if(!image) {
+        msWriteError(stderr);
 
-      msFreeMap(map);
-      msCleanup();
-      exit(1);
-    }
+        msFreeMap(map);
+        msCleanup();
+        exit(1);
+      }
 
-    if( msSaveImage(map, image, outfile) != MS_SUCCESS ) {
-      msWriteError(stderr);
-    }
+      if( msSaveImage(map, image, outfile) != MS_SUCCESS ) {
+        msWriteError(stderr);
+      }
 
-    msFreeImage(image);
+      msFreeImage(image);
+    }
     msFreeMap(map);
 
     if(msGetGlobalDebugLevel() >= MS_DEBUGLEVEL_TUNING) {
@@ -0,0 +1,297 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Checks the FEATURESTORE layer against the shapefile driver.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** Writes a grid of square polygons as a shapefile into the directory given
+** on the command line, and queries it through a shapefile layer and a
+** FEATURESTORE layer of the same map: rectangle queries with and without an
+** AND filter must return the same features and attribute values.  The
+** shapefile is then rewritten (all files, then only the .dbf) and the
+** FEATURESTORE layer must serve the new data in the same process.
+**
+** Usage: featurestore <work directory>
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../mapserver.h"
+
+static const char *mapfile =
+  "MAP\n"
+  "  EXTENT 0 0 20 20\n"
+  "  SIZE 200 200\n"
+  "  LAYER\n"
+  "    NAME 'shape'\n"
+  "    TYPE POLYGON\n"
+  "    STATUS ON\n"
+  "    DATA 'featurestore'\n"
+  "    TEMPLATE 'ttt'\n"
+  "  END\n"
+  "  LAYER\n"
+  "    NAME 'store'\n"
+  "    TYPE POLYGON\n"
+  "    STATUS ON\n"
+  "    CONNECTIONTYPE FEATURESTORE\n"
+  "    DATA 'featurestore'\n"
+  "    TEMPLATE 'ttt'\n"
+  "  END\n"
+  "END\n";
+
+static int failures = 0;
+
+static void fail(const char *test, const char *message)
+{
+  fprintf(stderr, "%s: %s\n", test, message);
+  failures++;
+}
+
+/* size x size squares, NAME is namewidth wide and cycles through namecount values */
+static int writeShapefile(const char *basename, int size, int namewidth, int namecount, int withshp)
+{
+  char filename[MS_MAXPATHLEN];
+  SHPHandle hSHP = NULL;
+  DBFHandle hDBF;
+  shapeObj shape;
+  lineObj line;
+  pointObj points[5];
+  char name[32];
+  int i, j, n = 0;
+
+  if(withshp && (hSHP = msSHPCreate(basename, SHP_POLYGON)) == NULL)
+    return MS_FAILURE;
+  snprintf(filename, sizeof(filename), "%s.dbf", basename);
+  if((hDBF = msDBFCreate(filename)) == NULL) {
+    if(hSHP) msSHPClose(hSHP);
+    return MS_FAILURE;
+  }
+  msDBFAddField(hDBF, "ID", FTInteger, 10, 0);
+  msDBFAddField(hDBF, "VALUE", FTDouble, 10, 2);
+  msDBFAddField(hDBF, "NAME", FTString, namewidth, 0);
+
+  line.numpoints = 5;
+  line.point = points;
+  for(j=0; j<size; j++) {
+    for(i=0; i<size; i++) {
+      if(hSHP) {
+        msInitShape(&shape);
+        shape.type = MS_SHAPE_POLYGON;
+        points[0].x = points[3].x = points[4].x = i;
+        points[1].x = points[2].x = i + 0.9;
+        points[0].y = points[1].y = points[4].y = j;
+        points[2].y = points[3].y = j + 0.9;
+        msAddLine(&shape, &line);
+        msSHPWriteShape(hSHP, &shape);
+        msFreeShape(&shape);
+      }
+      snprintf(name, sizeof(name), "name%d", (i + j) % namecount);
+      msDBFWriteIntegerAttribute(hDBF, n, 0, n);
+      msDBFWriteDoubleAttribute(hDBF, n, 1, i * 1.5 + j * 0.25);
+      msDBFWriteStringAttribute(hDBF, n, 2, name);
+      n++;
+    }
+  }
+
+  if(hSHP) msSHPClose(hSHP);
+  msDBFClose(hDBF);
+  return MS_SUCCESS;
+}
+
+/* replace the shapefile by rename(), as the FEATURESTORE documentation asks */
+static int replaceShapefile(const char *dir, int size, int namewidth, int namecount, int withshp)
+{
+  char tmpname[MS_MAXPATHLEN], from[MS_MAXPATHLEN], to[MS_MAXPATHLEN];
+  const char *extensions[] = {"shp", "shx", "dbf"};
+  int i;
+
+  snprintf(tmpname, sizeof(tmpname), "%s/featurestore_new", dir);
+  if(writeShapefile(tmpname, size, namewidth, namecount, withshp) != MS_SUCCESS)
+    return MS_FAILURE;
+  for(i=withshp?0:2; i<3; i++) {
+    snprintf(from, sizeof(from), "%s/featurestore_new.%s", dir, extensions[i]);
+    snprintf(to, sizeof(to), "%s/featurestore.%s", dir, extensions[i]);
+    if(rename(from, to) != 0)
+      return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+/* all the attribute values of the query results of layer, one line per feature */
+static char *getResults(layerObj *layer)
+{
+  char *results = msStrdup("");
+  shapeObj shape;
+  int i, j;
+
+  if(!layer->resultcache || layer->resultcache->numresults == 0)
+    return results;
+
+  if(msLayerOpen(layer) != MS_SUCCESS || msLayerGetItems(layer) != MS_SUCCESS) {
+    msLayerClose(layer);
+    return results;
+  }
+  for(i=0; i<layer->resultcache->numresults; i++) {
+    msInitShape(&shape);
+    if(msLayerGetShape(layer, &shape, &(layer->resultcache->results[i])) != MS_SUCCESS) {
+      results = msStringConcatenate(results, "(error)\n");
+      continue;
+    }
+    for(j=0; j<shape.numvalues; j++) {
+      results = msStringConcatenate(results, shape.values[j]);
+      results = msStringConcatenate(results, j+1 < shape.numvalues ? "," : "\n");
+    }
+    msFreeShape(&shape);
+  }
+  msLayerClose(layer);
+
+  return results;
+}
+
+/* rectangle query of both layers, returns the number of features found */
+static int compareQuery(const char *test, mapObj *map, double minx, double miny, double maxx, double maxy, char *filter)
+{
+  layerObj *shape = GET_LAYER(map, 0), *store = GET_LAYER(map, 1);
+  char *shaperesults, *storeresults;
+  int numresults;
+
+  msFreeExpression(&shape->filter);
+  msFreeExpression(&store->filter);
+  if(filter) {
+    msLoadExpressionString(&shape->filter, filter);
+    msLoadExpressionString(&store->filter, filter);
+  }
+
+  msInitQuery(&(map->query));
+  map->query.type = MS_QUERY_BY_RECT;
+  map->query.mode = MS_QUERY_MULTIPLE;
+  map->query.rect.minx = minx;
+  map->query.rect.miny = miny;
+  map->query.rect.maxx = maxx;
+  map->query.rect.maxy = maxy;
+  if(msQueryByRect(map) != MS_SUCCESS) {
+    if(msGetErrorObj()->code != MS_NOTFOUND) {
+      fail(test, "query failed");
+      msWriteError(stderr);
+      msResetErrorList();
+      return -1;
+    }
+    msResetErrorList();
+  }
+
+  shaperesults = getResults(shape);
+  storeresults = getResults(store);
+  numresults = shape->resultcache ? shape->resultcache->numresults : 0;
+  if(strcmp(shaperesults, storeresults) != 0) {
+    fail(test, "FEATURESTORE results differ from the shapefile results");
+    fprintf(stderr, "shapefile:\n%sFEATURESTORE:\n%s", shaperesults, storeresults);
+  }
+  msFree(shaperesults);
+  msFree(storeresults);
+
+  return numresults;
+}
+
+int main(int argc, char *argv[])
+{
+  char basename[MS_MAXPATHLEN], mappath[MS_MAXPATHLEN];
+  mapObj *map;
+  char *results;
+
+  if(argc != 2) {
+    fprintf(stderr, "Usage: %s <work directory>\n", argv[0]);
+    exit(2);
+  }
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  snprintf(basename, sizeof(basename), "%s/featurestore", argv[1]);
+  snprintf(mappath, sizeof(mappath), "%s/", argv[1]);
+  if(writeShapefile(basename, 10, 8, 3, MS_TRUE) != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  map = msLoadMapFromString((char*)mapfile, mappath);
+  if(!map) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  /* rectangle queries: whole file, inside a feature, across features, outside */
+  if(compareQuery("bbox all", map, -1, -1, 11, 11, NULL) != 100)
+    fail("bbox all", "expected 100 features");
+  if(compareQuery("bbox one", map, 2.2, 3.2, 2.4, 3.4, NULL) != 1)
+    fail("bbox one", "expected 1 feature");
+  if(compareQuery("bbox some", map, 2.5, 3.5, 6.5, 5.5, NULL) != 15)
+    fail("bbox some", "expected 15 features");
+  if(compareQuery("bbox gap", map, 2.92, 3.92, 2.98, 3.98, NULL) != 0)
+    fail("bbox gap", "expected no feature");
+  if(compareQuery("bbox outside", map, 12, 12, 13, 13, NULL) != 0)
+    fail("bbox outside", "expected no feature");
+
+  /* filters the FEATURESTORE evaluates on its columns, and one it does not */
+  if(compareQuery("filter and", map, -1, -1, 11, 11, "([VALUE] > 5 AND '[NAME]' = 'name1')") <= 0)
+    fail("filter and", "expected features");
+  if(compareQuery("filter and bbox", map, 2.5, 3.5, 6.5, 5.5, "([ID] >= 30 AND [VALUE] <= 8.5 AND '[NAME]' != 'name2')") <= 0)
+    fail("filter and bbox", "expected features");
+  if(compareQuery("filter or", map, -1, -1, 11, 11, "([ID] < 5 OR '[NAME]' = 'name0')") <= 0)
+    fail("filter or", "expected features");
+
+  /* the same process must see a rewritten .shp and .dbf... */
+  if(replaceShapefile(argv[1], 12, 8, 3, MS_TRUE) != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  if(compareQuery("reload shp", map, -1, -1, 13, 13, NULL) != 144)
+    fail("reload shp", "expected 144 features");
+
+  /* ...and a rewritten .dbf alone */
+  if(replaceShapefile(argv[1], 12, 12, 5, MS_FALSE) != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  if(compareQuery("reload dbf", map, 3.5, 0.5, 3.6, 0.6, NULL) != 1)
+    fail("reload dbf", "expected 1 feature");
+  results = getResults(GET_LAYER(map, 1));
+  if(strcmp(results, "3,4.50,name3\n") != 0)
+    fail("reload dbf", "FEATURESTORE did not reload the .dbf");
+  msFree(results);
+  if(compareQuery("reload dbf filter", map, -1, -1, 13, 13, "('[NAME]' = 'name4')") <= 0)
+    fail("reload dbf filter", "expected features");
+
+  msFreeMap(map);
+  msCleanup();
+
+  if(failures) {
+    fprintf(stderr, "%d FEATURESTORE checks failed\n", failures);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,315 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Checks the FLATGEOBUF layer on the flatgeobuf.fgb fixture.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** flatgeobuf.fgb holds 36 squares, feature n (0 to 35) is the polygon
+** (i, j) - (i+0.9, j+0.9) with i = n%6 and j = n/6.  Features are in
+** Hilbert order and the file has a packed R-tree (node size 16).  There is
+** a column of each FlatGeobuf type, named after it:
+**
+**   byte -n, ubyte 150+n, bool n%2, short -300n, ushort 60000+n, int -100000n,
+**   uint 3000000000+n, long -5000000000-n, ulong 10000000000000000000+n,
+**   float n+0.5, double n*0.1, string "name<n>" (missing when n%10 == 9),
+**   json {"n": <n>}, datetime 2016-01-01T00:00:<n>Z, binary bytes n, 0xAB.
+**
+** The same squares are written as a shapefile into the work directory: the
+** FLATGEOBUF layer must draw the same image as the shapefile, rectangle
+** queries must only read the features the index selects, and every column
+** type must read back formatted as expected.
+**
+** Usage: flatgeobuf <tests directory> <work directory>
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../mapserver.h"
+
+#define NUM_FEATURES 36
+
+static int failures = 0;
+
+static void fail(const char *test, const char *message)
+{
+  fprintf(stderr, "%s: %s\n", test, message);
+  failures++;
+}
+
+static int writeShapefile(const char *basename)
+{
+  char filename[MS_MAXPATHLEN];
+  SHPHandle hSHP;
+  DBFHandle hDBF;
+  shapeObj shape;
+  lineObj line;
+  pointObj points[5];
+  int n;
+
+  if((hSHP = msSHPCreate(basename, SHP_POLYGON)) == NULL)
+    return MS_FAILURE;
+  snprintf(filename, sizeof(filename), "%s.dbf", basename);
+  if((hDBF = msDBFCreate(filename)) == NULL) {
+    msSHPClose(hSHP);
+    return MS_FAILURE;
+  }
+  msDBFAddField(hDBF, "N", FTInteger, 10, 0);
+
+  line.numpoints = 5;
+  line.point = points;
+  for(n=0; n<NUM_FEATURES; n++) {
+    msInitShape(&shape);
+    shape.type = MS_SHAPE_POLYGON;
+    points[0].x = points[3].x = points[4].x = n % 6;
+    points[1].x = points[2].x = n % 6 + 0.9;
+    points[0].y = points[1].y = points[4].y = n / 6;
+    points[2].y = points[3].y = n / 6 + 0.9;
+    msAddLine(&shape, &line);
+    msSHPWriteShape(hSHP, &shape);
+    msFreeShape(&shape);
+    msDBFWriteIntegerAttribute(hDBF, n, 0, n);
+  }
+
+  msSHPClose(hSHP);
+  msDBFClose(hDBF);
+  return MS_SUCCESS;
+}
+
+/* draw the map with only layer on (-1 for none), as a PNG */
+static unsigned char *drawMap(mapObj *map, int layer, int *size)
+{
+  imageObj *image;
+  unsigned char *buffer;
+  int i;
+
+  for(i=0; i<map->numlayers; i++)
+    GET_LAYER(map, i)->status = (i == layer) ? MS_ON : MS_OFF;
+
+  if((image = msDrawMap(map, MS_FALSE)) == NULL)
+    return NULL;
+  buffer = msSaveImageBuffer(image, size, map->outputformat);
+  msFreeImage(image);
+  return buffer;
+}
+
+/* the features read after WhichShapes(rect), as a string of n values */
+static char *readFeatures(layerObj *layer, double minx, double miny, double maxx, double maxy)
+{
+  int found[NUM_FEATURES] = {0};
+  char *features = msStrdup(""), number[16];
+  rectObj rect;
+  shapeObj shape;
+  int status, n;
+
+  rect.minx = minx;
+  rect.miny = miny;
+  rect.maxx = maxx;
+  rect.maxy = maxy;
+
+  if(msLayerOpen(layer) != MS_SUCCESS || msLayerWhichItems(layer, MS_TRUE, NULL) != MS_SUCCESS) {
+    msLayerClose(layer);
+    return features;
+  }
+  status = msLayerWhichShapes(layer, rect, MS_TRUE);
+  msInitShape(&shape);
+  while(status == MS_SUCCESS && (status = msLayerNextShape(layer, &shape)) == MS_SUCCESS) {
+    n = -atoi(shape.values[0]); /* byte */
+    if(n >= 0 && n < NUM_FEATURES)
+      found[n]++;
+    msFreeShape(&shape);
+  }
+  msLayerClose(layer);
+
+  /* in feature order, the file is in Hilbert order */
+  for(n=0; n<NUM_FEATURES; n++) {
+    if(!found[n]) continue;
+    snprintf(number, sizeof(number), "%s%d%s", features[0] ? "," : "", n, found[n] > 1 ? "(again)" : "");
+    features = msStringConcatenate(features, number);
+  }
+  return features;
+}
+
+static void checkFeatures(const char *test, layerObj *layer, double minx, double miny, double maxx, double maxy,
+                          const char *expected)
+{
+  char *features = readFeatures(layer, minx, miny, maxx, maxy);
+
+  if(strcmp(features, expected) != 0) {
+    fail(test, "unexpected features");
+    fprintf(stderr, "expected: %s\nread: %s\n", expected, features);
+  }
+  msFree(features);
+}
+
+/* all the values of the feature of the query of rect, as a comma separated string */
+static char *queryValues(mapObj *map, layerObj *layer, double minx, double miny, double maxx, double maxy)
+{
+  char *values = msStrdup("");
+  shapeObj shape;
+  int j;
+
+  msInitQuery(&(map->query));
+  map->query.type = MS_QUERY_BY_RECT;
+  map->query.mode = MS_QUERY_MULTIPLE;
+  map->query.layer = layer->index;
+  map->query.rect.minx = minx;
+  map->query.rect.miny = miny;
+  map->query.rect.maxx = maxx;
+  map->query.rect.maxy = maxy;
+  layer->status = MS_ON;
+  if(msQueryByRect(map) != MS_SUCCESS || layer->resultcache->numresults != 1) {
+    msResetErrorList();
+    return values;
+  }
+
+  if(msLayerOpen(layer) != MS_SUCCESS || msLayerGetItems(layer) != MS_SUCCESS) {
+    msLayerClose(layer);
+    return values;
+  }
+  msInitShape(&shape);
+  if(msLayerGetShape(layer, &shape, &(layer->resultcache->results[0])) == MS_SUCCESS) {
+    for(j=0; j<shape.numvalues; j++) {
+      values = msStringConcatenate(values, shape.values[j]);
+      if(j+1 < shape.numvalues)
+        values = msStringConcatenate(values, ",");
+    }
+    msFreeShape(&shape);
+  }
+  msLayerClose(layer);
+
+  return values;
+}
+
+static void checkValues(const char *test, mapObj *map, layerObj *layer, double x, double y, const char *expected)
+{
+  char *values = queryValues(map, layer, x, y, x + 0.01, y + 0.01);
+
+  if(strcmp(values, expected) != 0) {
+    fail(test, "unexpected values");
+    fprintf(stderr, "expected: %s\nread: %s\n", expected, values);
+  }
+  msFree(values);
+}
+
+int main(int argc, char *argv[])
+{
+  char basename[MS_MAXPATHLEN], mapfile[4096];
+  unsigned char *fgbimage, *shapeimage, *emptyimage;
+  int fgbsize, shapesize, emptysize;
+  mapObj *map;
+  layerObj *layer;
+
+  if(argc != 3) {
+    fprintf(stderr, "Usage: %s <tests directory> <work directory>\n", argv[0]);
+    exit(2);
+  }
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  snprintf(basename, sizeof(basename), "%s/flatgeobuf", argv[2]);
+  if(writeShapefile(basename) != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  snprintf(mapfile, sizeof(mapfile),
+           "MAP\n"
+           "  EXTENT -0.5 -0.5 6.5 6.5\n"
+           "  SIZE 140 140\n"
+           "  IMAGECOLOR 255 255 255\n"
+           "  OUTPUTFORMAT\n"
+           "    NAME 'png'\n"
+           "    DRIVER AGG/PNG\n"
+           "    IMAGEMODE RGB\n"
+           "  END\n"
+           "  LAYER\n"
+           "    NAME 'fgb'\n"
+           "    TYPE POLYGON\n"
+           "    CONNECTIONTYPE FLATGEOBUF\n"
+           "    DATA 'flatgeobuf.fgb'\n"
+           "    TEMPLATE 'ttt'\n"
+           "    CLASS STYLE COLOR 255 0 0 OUTLINECOLOR 0 0 255 END END\n"
+           "  END\n"
+           "  LAYER\n"
+           "    NAME 'shape'\n"
+           "    TYPE POLYGON\n"
+           "    DATA '%s'\n"
+           "    CLASS STYLE COLOR 255 0 0 OUTLINECOLOR 0 0 255 END END\n"
+           "  END\n"
+           "END\n", basename);
+  map = msLoadMapFromString(mapfile, argv[1]);
+  if(!map) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  layer = GET_LAYER(map, 0);
+
+  /* drawing */
+  fgbimage = drawMap(map, 0, &fgbsize);
+  shapeimage = drawMap(map, 1, &shapesize);
+  emptyimage = drawMap(map, -1, &emptysize);
+  if(!fgbimage || !shapeimage || !emptyimage) {
+    fail("draw", "drawing failed");
+    msWriteError(stderr);
+  } else if(fgbsize == emptysize && memcmp(fgbimage, emptyimage, fgbsize) == 0)
+    fail("draw", "nothing drawn");
+  else if(fgbsize != shapesize || memcmp(fgbimage, shapeimage, fgbsize) != 0)
+    fail("draw", "FLATGEOBUF image differs from the shapefile image");
+  msFree(fgbimage);
+  msFree(shapeimage);
+  msFree(emptyimage);
+
+  /* the index selects the features whose bounds overlap the rectangle */
+  checkFeatures("index all", layer, -1, -1, 7, 7,
+                "0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35");
+  checkFeatures("index some", layer, 2.5, 3.5, 4.5, 4.5, "20,21,22,26,27,28");
+  checkFeatures("index one", layer, 5.2, 0.2, 5.4, 0.4, "5");
+  checkFeatures("index gap", layer, 2.92, 3.92, 2.98, 3.98, "");
+  checkFeatures("index corner", layer, 5.85, 5.85, 6.2, 6.2, "35");
+
+  /* each column type */
+  checkValues("values", map, layer, 3.4, 3.4,
+              "-21,171,1,-6300,60021,-2100000,3000000021,-5000000021,10000000000000000021,"
+              "21.5,2.1,name21,{\"n\": 21},2016-01-01T00:00:21Z,15AB");
+  checkValues("values zero", map, layer, 0.4, 0.4,
+              "0,150,0,0,60000,0,3000000000,-5000000000,10000000000000000000,"
+              "0.5,0,name0,{\"n\": 0},2016-01-01T00:00:00Z,00AB");
+  checkValues("values missing", map, layer, 5.4, 4.4,
+              "-29,179,1,-8700,60029,-2900000,3000000029,-5000000029,10000000000000000029,"
+              "29.5,2.9,,{\"n\": 29},2016-01-01T00:00:29Z,1DAB");
+
+  msFreeMap(map);
+  msCleanup();
+
+  if(failures) {
+    fprintf(stderr, "%d FLATGEOBUF checks failed\n", failures);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,283 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  Checks the OGR datasource cache.
+ * Author:   MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2016 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+** Writes a grid of squares as a shapefile into the directory given on the
+** command line and queries it, in one process, through three OGR layers
+** sharing the file: one with a FILTER, one without and one with an SQL
+** DATA statement.  Each query must return the right features, the file
+** must only be opened once while it does not change (OGROpen() calls are
+** counted in the debug log) and must be reopened after it is replaced.
+**
+** Usage: ogrcache <work directory>
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../mapserver.h"
+
+static const char *mapfile =
+  "MAP\n"
+  "  EXTENT -0.5 -0.5 6.5 6.5\n"
+  "  SIZE 140 140\n"
+  "  LAYER\n"
+  "    NAME 'filter'\n"
+  "    TYPE POLYGON\n"
+  "    STATUS ON\n"
+  "    DEBUG 1\n"
+  "    CONNECTIONTYPE OGR\n"
+  "    CONNECTION 'ogrcache.shp'\n"
+  "    FILTER ([N] < 10)\n"
+  "    TEMPLATE 'ttt'\n"
+  "  END\n"
+  "  LAYER\n"
+  "    NAME 'all'\n"
+  "    TYPE POLYGON\n"
+  "    STATUS ON\n"
+  "    DEBUG 1\n"
+  "    CONNECTIONTYPE OGR\n"
+  "    CONNECTION 'ogrcache.shp'\n"
+  "    TEMPLATE 'ttt'\n"
+  "  END\n"
+  "  LAYER\n"
+  "    NAME 'sql'\n"
+  "    TYPE POLYGON\n"
+  "    STATUS ON\n"
+  "    DEBUG 1\n"
+  "    CONNECTIONTYPE OGR\n"
+  "    CONNECTION 'ogrcache.shp'\n"
+  "    DATA 'SELECT * FROM ogrcache WHERE N >= 30'\n"
+  "    TEMPLATE 'ttt'\n"
+  "  END\n"
+  "END\n";
+
+static int failures = 0;
+
+static void fail(const char *test, const char *message)
+{
+  fprintf(stderr, "%s: %s\n", test, message);
+  failures++;
+}
+
+/* size x size squares, attribute N numbers them */
+static int writeShapefile(const char *basename, int size)
+{
+  char filename[MS_MAXPATHLEN];
+  SHPHandle hSHP;
+  DBFHandle hDBF;
+  shapeObj shape;
+  lineObj line;
+  pointObj points[5];
+  int n;
+
+  if((hSHP = msSHPCreate(basename, SHP_POLYGON)) == NULL)
+    return MS_FAILURE;
+  snprintf(filename, sizeof(filename), "%s.dbf", basename);
+  if((hDBF = msDBFCreate(filename)) == NULL) {
+    msSHPClose(hSHP);
+    return MS_FAILURE;
+  }
+  msDBFAddField(hDBF, "N", FTInteger, 10, 0);
+
+  line.numpoints = 5;
+  line.point = points;
+  for(n=0; n<size*size; n++) {
+    msInitShape(&shape);
+    shape.type = MS_SHAPE_POLYGON;
+    points[0].x = points[3].x = points[4].x = n % size;
+    points[1].x = points[2].x = n % size + 0.9;
+    points[0].y = points[1].y = points[4].y = n / size;
+    points[2].y = points[3].y = n / size + 0.9;
+    msAddLine(&shape, &line);
+    msSHPWriteShape(hSHP, &shape);
+    msFreeShape(&shape);
+    msDBFWriteIntegerAttribute(hDBF, n, 0, n);
+  }
+
+  msSHPClose(hSHP);
+  msDBFClose(hDBF);
+  return MS_SUCCESS;
+}
+
+/* replace the shapefile by rename(), so that open handles keep the old file */
+static int replaceShapefile(const char *dir, int size)
+{
+  char tmpname[MS_MAXPATHLEN], from[MS_MAXPATHLEN], to[MS_MAXPATHLEN];
+  const char *extensions[] = {"shp", "shx", "dbf"};
+  int i;
+
+  snprintf(tmpname, sizeof(tmpname), "%s/ogrcache_new", dir);
+  if(writeShapefile(tmpname, size) != MS_SUCCESS)
+    return MS_FAILURE;
+  for(i=0; i<3; i++) {
+    snprintf(from, sizeof(from), "%s/ogrcache_new.%s", dir, extensions[i]);
+    snprintf(to, sizeof(to), "%s/ogrcache.%s", dir, extensions[i]);
+    if(rename(from, to) != 0)
+      return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+/* number of OGROpen() calls in the debug log, which is closed to flush it */
+static int countOpens(const char *logfile)
+{
+  char buffer[1024];
+  int count = 0;
+  FILE *fp;
+
+  msCloseErrorFile();
+  if((fp = fopen(logfile, "r")) != NULL) {
+    while(fgets(buffer, sizeof(buffer), fp)) {
+      if(strstr(buffer, "OGROPen("))
+        count++;
+    }
+    fclose(fp);
+  }
+  msSetErrorFile(logfile, NULL);
+  return count;
+}
+
+/* rectangle query of every layer, the N values found by each layer are compared to expected */
+static void checkQuery(const char *test, mapObj *map, const char *expected[])
+{
+  char *found, number[16];
+  shapeObj shape;
+  layerObj *layer;
+  int i, l;
+
+  msInitQuery(&(map->query));
+  map->query.type = MS_QUERY_BY_RECT;
+  map->query.mode = MS_QUERY_MULTIPLE;
+  map->query.rect.minx = map->query.rect.miny = -1;
+  map->query.rect.maxx = map->query.rect.maxy = 7;
+  if(msQueryByRect(map) != MS_SUCCESS && msGetErrorObj()->code != MS_NOTFOUND) {
+    fail(test, "query failed");
+    msWriteError(stderr);
+  }
+  msResetErrorList();
+
+  for(l=0; l<map->numlayers; l++) {
+    layer = GET_LAYER(map, l);
+    found = msStrdup("");
+    if(layer->resultcache && layer->resultcache->numresults > 0 &&
+        msLayerOpen(layer) == MS_SUCCESS && msLayerGetItems(layer) == MS_SUCCESS) {
+      for(i=0; i<layer->resultcache->numresults; i++) {
+        msInitShape(&shape);
+        if(msLayerGetShape(layer, &shape, &(layer->resultcache->results[i])) != MS_SUCCESS)
+          continue;
+        snprintf(number, sizeof(number), "%s%s", found[0] ? "," : "", shape.values[0]);
+        found = msStringConcatenate(found, number);
+        msFreeShape(&shape);
+      }
+    }
+    msLayerClose(layer);
+    if(strcmp(found, expected[l]) != 0) {
+      fail(test, "unexpected features");
+      fprintf(stderr, "layer %s expected: %s\nfound: %s\n", layer->name, expected[l], found);
+    }
+    msFree(found);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *grid6[] = {"0,1,2,3,4,5,6,7,8,9",
+                         "0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35",
+                         "30,31,32,33,34,35"
+                        };
+  const char *grid4[] = {"0,1,2,3,4,5,6,7,8,9",
+                         "0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15",
+                         ""
+                        };
+  char basename[MS_MAXPATHLEN], mappath[MS_MAXPATHLEN], logfile[MS_MAXPATHLEN];
+  mapObj *map;
+  int i, opens;
+
+  if(argc != 2) {
+    fprintf(stderr, "Usage: %s <work directory>\n", argv[0]);
+    exit(2);
+  }
+
+  if(msSetup() != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+
+  snprintf(basename, sizeof(basename), "%s/ogrcache", argv[1]);
+  snprintf(mappath, sizeof(mappath), "%s/", argv[1]);
+  snprintf(logfile, sizeof(logfile), "%s/ogrcache.log", argv[1]);
+  if(writeShapefile(basename, 6) != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  remove(logfile);
+  msSetErrorFile(logfile, NULL);
+  map = msLoadMapFromString((char*)mapfile, mappath);
+  if(!map) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  /* the layers share one handle, kept open across queries */
+  for(i=0; i<3; i++)
+    checkQuery("cache", map, grid6);
+  if((opens = countOpens(logfile)) != 1) {
+    fprintf(stderr, "%d opens\n", opens);
+    fail("cache", "expected one OGROpen()");
+  }
+
+  /* a replaced file is reopened */
+  if(replaceShapefile(argv[1], 4) != MS_SUCCESS) {
+    msWriteError(stderr);
+    exit(1);
+  }
+  for(i=0; i<2; i++)
+    checkQuery("reopen", map, grid4);
+  if((opens = countOpens(logfile)) != 2) {
+    fprintf(stderr, "%d opens\n", opens);
+    fail("reopen", "expected a second OGROpen()");
+  }
+
+  /* CLOSE_CONNECTION=ALWAYS layers do not use the cache */
+  msLayerSetProcessingKey(GET_LAYER(map, 1), "CLOSE_CONNECTION", "ALWAYS");
+  for(i=0; i<2; i++)
+    checkQuery("close always", map, grid4);
+  if((opens = countOpens(logfile)) != 4) {
+    fprintf(stderr, "%d opens\n", opens);
+    fail("close always", "expected an OGROpen() per query");
+  }
+
+  msFreeMap(map);
+  msCleanup();
+
+  if(failures) {
+    fprintf(stderr, "%d OGR datasource cache checks failed\n", failures);
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Checks that the SIMD resampling kernels produce the same images as the
+# scalar code: each layer of resample_simd.map is drawn at a downsampling
+# and an upsampling size, into RGBA and FLOAT32 images, with the MS_SIMD
+# cap at NONE, SSE2 and the best level of the CPU, and the outputs must be
+# byte identical.  The scalar output must also differ from the same layer
+# drawn over an extent the raster does not cover, so a raster that fails
+# to draw is not taken for a match.
+#
+# Usage: resample_simd.sh <path to shp2img> [<output directory>]
+#
+
+SHP2IMG=$1
+OUTDIR=${2:-.}
+TESTDIR=`dirname "$0"`
+FAILED=0
+
+if test -z "$SHP2IMG"; then
+  echo "Usage: $0 <path to shp2img> [<output directory>]"
+  exit 2
+fi
+
+for layer in average bilinear; do
+  for format in png24 float32; do
+    for size in "64 64" "400 400"; do
+      name=`echo "$layer-$format-$size" | tr ' ' 'x'`
+      for simd in NONE SSE2 AVX2; do
+        MS_SIMD=$simd "$SHP2IMG" -m "$TESTDIR/resample_simd.map" \
+          -l "$layer" -i "$format" -s $size -o "$OUTDIR/$name-$simd.img" \
+          || exit 1
+        if ! test -s "$OUTDIR/$name-$simd.img"; then
+          echo "$name: MS_SIMD=$simd output is empty"
+          FAILED=1
+        fi
+      done
+      "$SHP2IMG" -m "$TESTDIR/resample_simd.map" -l "$layer" -i "$format" \
+        -s $size -e 10000000 -10000000 10100000 -9900000 \
+        -o "$OUTDIR/$name-EMPTY.img" || exit 1
+      if cmp -s "$OUTDIR/$name-NONE.img" "$OUTDIR/$name-EMPTY.img"; then
+        echo "$name: MS_SIMD=NONE output has no raster drawn"
+        FAILED=1
+      fi
+      for simd in SSE2 AVX2; do
+        if ! cmp -s "$OUTDIR/$name-NONE.img" "$OUTDIR/$name-$simd.img"; then
+          echo "$name: MS_SIMD=$simd output differs from MS_SIMD=NONE"
+          FAILED=1
+        fi
+      done
+      rm -f "$OUTDIR/$name"-*.img
+    done
+  done
+done
+
+exit $FAILED